@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "kvarena.h"
+
+/* Initializes ARENA to allocate blocks of at least BLOCK_SIZE bytes. No
+ * memory is allocated until it is first needed. */
+void kvarena_init(kvarena_t *arena, size_t block_size) {
+  arena->head = NULL;
+  arena->block_size = block_size;
+}
+
+/* Frees the list of blocks starting at BLOCK, returning their total size. */
+static size_t kvarena_free_blocks(struct kvarena_block *block) {
+  struct kvarena_block *next;
+  size_t size = 0;
+  for (; block != NULL; block = next) {
+    next = block->next;
+    size += block->size;
+    free(block);
+  }
+  return size;
+}
+
+/* Adds a block of SIZE bytes to the front of ARENA. Returns the block, or
+ * NULL if there is not enough memory. */
+static struct kvarena_block *kvarena_grow(kvarena_t *arena, size_t size) {
+  struct kvarena_block *block = malloc(sizeof(struct kvarena_block) + size);
+  if (block == NULL)
+    return NULL;
+  block->next = arena->head;
+  block->size = size;
+  block->used = 0;
+  arena->head = block;
+  return block;
+}
+
+/* Frees every allocation made from ARENA at once. If they took more than one
+ * block, the blocks are replaced by a single block as large as all of them
+ * together, so that the same allocations would next time fit in one. No
+ * block larger than KVARENA_MAX_RETAIN times ARENA's block size is kept. */
+void kvarena_reset(kvarena_t *arena) {
+  size_t size, max_size = arena->block_size * KVARENA_MAX_RETAIN;
+  if (arena->head == NULL)
+    return;
+  if (arena->head->next == NULL && arena->head->size <= max_size) {
+    arena->head->used = 0;
+    return;
+  }
+  size = kvarena_free_blocks(arena->head);
+  arena->head = NULL;
+  kvarena_grow(arena, (size < max_size) ? size : max_size);
+}
+
+/* Frees ARENA's blocks, and with them every allocation made from it. ARENA
+ * may be used again afterwards. */
+void kvarena_free(kvarena_t *arena) {
+  kvarena_free_blocks(arena->head);
+  arena->head = NULL;
+}
+
+/* Allocates SIZE bytes from ARENA, or using malloc() if ARENA is NULL.
+ * Returns NULL if there is not enough memory. */
+void *kvarena_alloc(kvarena_t *arena, size_t size) {
+  struct kvarena_block *block;
+  size_t offset;
+
+  if (arena == NULL)
+    return malloc(size);
+  block = arena->head;
+  if (block != NULL) {
+    offset = (block->used + KVARENA_ALIGN - 1) & ~((size_t) KVARENA_ALIGN - 1);
+    if (offset <= block->size && size <= block->size - offset) {
+      block->used = offset + size;
+      return block->data + offset;
+    }
+  }
+  block = kvarena_grow(arena,
+      (size > arena->block_size) ? size : arena->block_size);
+  if (block == NULL)
+    return NULL;
+  block->used = size;
+  return block->data;
+}
+
+/* Allocates zeroed memory for NUM elements of SIZE bytes each from ARENA, or
+ * using calloc() if ARENA is NULL. Returns NULL if there is not enough
+ * memory. */
+void *kvarena_calloc(kvarena_t *arena, size_t num, size_t size) {
+  void *ptr;
+  if (arena == NULL)
+    return calloc(num, size);
+  if (size != 0 && num > SIZE_MAX / size)
+    return NULL;
+  if ((ptr = kvarena_alloc(arena, num * size)) != NULL)
+    memset(ptr, 0, num * size);
+  return ptr;
+}
+
+/* Copies STR into memory allocated from ARENA, or using malloc() if ARENA is
+ * NULL. Returns the copy, or NULL if there is not enough memory. */
+char *kvarena_strdup(kvarena_t *arena, const char *str) {
+  size_t len = strlen(str) + 1;
+  char *copy = kvarena_alloc(arena, len);
+  if (copy != NULL)
+    memcpy(copy, str, len);
+  return copy;
+}
+
+/* Moves STR, which uses malloc()d memory, into ARENA, freeing the original.
+ * If ARENA is NULL, STR is returned as it is. Returns NULL if STR is NULL
+ * or there is not enough memory. */
+char *kvarena_take(kvarena_t *arena, char *str) {
+  char *copy;
+  if (arena == NULL || str == NULL)
+    return str;
+  copy = kvarena_strdup(arena, str);
+  free(str);
+  return copy;
+}
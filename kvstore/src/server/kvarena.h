@@ -0,0 +1,54 @@
+#ifndef __KV_ARENA__
+#define __KV_ARENA__
+
+#include <stddef.h>
+
+/* KVArena is a bump allocator for the short-lived allocations made while a
+ * single request is handled: the request message and its fields, the
+ * response, and the value it carries.
+ *
+ * Each allocation is taken from the end of the arena's current block, and
+ * nothing is freed on its own; kvarena_reset frees everything at once. A
+ * request which outgrows the current block gets a further block, and the
+ * next reset replaces all of the blocks with a single one big enough for
+ * them, so that an arena reused for request after request soon stops
+ * allocating at all. The block kept is capped at KVARENA_MAX_RETAIN block
+ * sizes, so that one unusually large request does not pin its memory in
+ * the arena for good.
+ *
+ * Every function taking an arena also accepts NULL, in which case it falls
+ * back to the malloc() function of the same name, so that code can serve
+ * both callers which have an arena and callers which do not.
+ */
+
+/* The size of an arena's first block. */
+#define KVARENA_BLOCK_SIZE 8192
+/* The most blocks' worth of memory an arena keeps across a reset. */
+#define KVARENA_MAX_RETAIN 4
+/* The alignment of every allocation. */
+#define KVARENA_ALIGN 16
+
+/* A block of memory allocations are taken from. */
+struct kvarena_block {
+  struct kvarena_block *next; /* The block filled before this one. */
+  size_t size;                /* The number of bytes of DATA. */
+  size_t used;                /* The number of bytes of DATA allocated. */
+  char data[] __attribute__((aligned(KVARENA_ALIGN)));
+};
+
+/* A KVArena. */
+typedef struct {
+  struct kvarena_block *head; /* The block allocations are taken from, or NULL. */
+  size_t block_size;          /* The smallest block this arena allocates. */
+} kvarena_t;
+
+void kvarena_init(kvarena_t *, size_t block_size);
+void kvarena_reset(kvarena_t *);
+void kvarena_free(kvarena_t *);
+
+void *kvarena_alloc(kvarena_t *, size_t size);
+void *kvarena_calloc(kvarena_t *, size_t num, size_t size);
+char *kvarena_strdup(kvarena_t *, const char *str);
+char *kvarena_take(kvarena_t *, char *str);
+
+#endif
@@ -36,13 +36,23 @@ kvcacheset_t *get_cache_set(kvcache_t *cache, char *key) {
 
 /* Attempts to retrieve KEY from CACHE. If successful, returns 0 and stores the
  * associated value inside VALUE using malloc()d memory which should be free()d
- * later. Otherwise, returns a negative error code. */
+ * later. Returns KVCACHESET_ABSENT if KEY is known to be absent. Otherwise,
+ * returns a negative error code. */
 int kvcache_get(kvcache_t *cache, char *key, char **value) {
   if (strlen(key) > MAX_KEYLEN)
     return ERRKEYLEN;
   return kvcacheset_get(get_cache_set(cache, key), key, value);
 }
 
+/* Gets KEY from CACHE as kvcache_get does, but copies the value into memory
+ * allocated from ARENA (see kvarena_strdup). */
+int kvcache_get_arena(kvcache_t *cache, char *key, char **value,
+    kvarena_t *arena) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  return kvcacheset_get_arena(get_cache_set(cache, key), key, value, arena);
+}
+
 /* Attempts to place the given KEY, VALUE entry into CACHE. Returns 0 if
  * successful, else a negative error code. */
 int kvcache_put(kvcache_t *cache, char *key, char *value) {
@@ -61,6 +71,117 @@ int kvcache_del(kvcache_t *cache, char *key) {
   return kvcacheset_del(get_cache_set(cache, key), key);
 }
 
+/* Writes the given KEY, VALUE entry into CACHE as committed at VERSION (see
+ * kvcacheset_put_versioned). Returns 0 if successful, 1 if the entry was
+ * stale, else a negative error code. */
+int kvcache_put_versioned(kvcache_t *cache, char *key, char *value,
+    unsigned long version) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (strlen(value) > MAX_VALLEN)
+    return ERRVALLEN;
+  return kvcacheset_put_versioned(get_cache_set(cache, key), key, value,
+      version);
+}
+
+/* Removes KEY from CACHE because of a write committed at VERSION (see
+ * kvcacheset_invalidate). Returns 0 if successful, else a negative error
+ * code. */
+int kvcache_invalidate(kvcache_t *cache, char *key, unsigned long version) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  return kvcacheset_invalidate(get_cache_set(cache, key), key, version);
+}
+
+/* Returns the token with which to fill KEY into CACHE once it has been loaded
+ * (see kvcacheset_fill_token). */
+unsigned long kvcache_fill_token(kvcache_t *cache, char *key) {
+  return kvcacheset_fill_token(get_cache_set(cache, key));
+}
+
+/* Adds the given KEY, VALUE entry, loaded after TOKEN was taken, to CACHE,
+ * or records KEY as absent if VALUE is NULL (see kvcacheset_fill). Returns 0
+ * if successful, 1 if the fill was dropped, else a negative error code. */
+int kvcache_fill(kvcache_t *cache, char *key, char *value,
+    unsigned long token) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (value != NULL && strlen(value) > MAX_VALLEN)
+    return ERRVALLEN;
+  return kvcacheset_fill(get_cache_set(cache, key), key, value, token);
+}
+
+/* Pins or unpins the entry for KEY in CACHE (see kvcacheset_pin). Returns 0
+ * if successful, 1 if the entry could not be pinned, else a negative error
+ * code. */
+int kvcache_pin(kvcache_t *cache, char *key, bool pinned) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  return kvcacheset_pin(get_cache_set(cache, key), key, pinned);
+}
+
+/* Makes the value cached for KEY in CACHE expire TTL_MS milliseconds from now
+ * (see kvcacheset_set_ttl). Returns 0 if successful, else a negative error
+ * code. */
+int kvcache_set_ttl(kvcache_t *cache, char *key, unsigned long ttl_ms) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  return kvcacheset_set_ttl(get_cache_set(cache, key), key, ttl_ms);
+}
+
+/* Returns the milliseconds left before the value cached for KEY in CACHE
+ * expires, or 0 if it never does or is not cached. */
+unsigned long kvcache_ttl(kvcache_t *cache, char *key) {
+  if (strlen(key) > MAX_KEYLEN)
+    return 0;
+  return kvcacheset_ttl(get_cache_set(cache, key), key);
+}
+
+/* Writes the given KEY, VALUE entry into CACHE as a dirty entry, to be
+ * written back later (see kvcacheset_put_dirty). Returns 0 if successful,
+ * else a negative error code. */
+int kvcache_put_dirty(kvcache_t *cache, char *key, char *value) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (strlen(value) > MAX_VALLEN)
+    return ERRVALLEN;
+  return kvcacheset_put_dirty(get_cache_set(cache, key), key, value);
+}
+
+/* Returns 1 if KEY's entry in CACHE is dirty, 0 if it is clean, else a
+ * negative error code. */
+int kvcache_dirty(kvcache_t *cache, char *key) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  return kvcacheset_dirty(get_cache_set(cache, key), key);
+}
+
+/* Sets the function used to write dirty entries of every set of CACHE back
+ * (see kvcacheset_set_flush). */
+void kvcache_set_flush(kvcache_t *cache, kvcacheset_flush_t flush,
+    void *aux) {
+  unsigned int i;
+  for (i = 0; i < cache->num_sets; i++)
+    kvcacheset_set_flush(&cache->sets[i], flush, aux);
+}
+
+/* Writes every dirty entry of CACHE back, one set at a time, holding each
+ * set's write lock while its entries are written. Returns the number of
+ * entries written if successful, else a negative error code. */
+int kvcache_flush(kvcache_t *cache) {
+  unsigned int i;
+  int ret, count = 0;
+  for (i = 0; i < cache->num_sets; i++) {
+    pthread_rwlock_wrlock(&cache->sets[i].lock);
+    ret = kvcacheset_flush(&cache->sets[i]);
+    pthread_rwlock_unlock(&cache->sets[i].lock);
+    if (ret < 0)
+      return ret;
+    count += ret;
+  }
+  return count;
+}
+
 /* Returns the read-write lock associated with a given KEY within CACHE. Each
  * cache set has a separate lock. */
 pthread_rwlock_t *kvcache_getlock(kvcache_t *cache, char *key) {
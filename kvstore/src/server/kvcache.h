@@ -37,8 +37,22 @@ typedef struct {
 int kvcache_init(kvcache_t *, unsigned int num_sets, unsigned int elem_per_set);
 
 int kvcache_get(kvcache_t *, char *key, char **value);
+int kvcache_get_arena(kvcache_t *, char *key, char **value,
+    kvarena_t *arena);
 int kvcache_put(kvcache_t *, char *key, char *value);
 int kvcache_del(kvcache_t *, char *key);
+int kvcache_put_versioned(kvcache_t *, char *key, char *value,
+    unsigned long version);
+int kvcache_invalidate(kvcache_t *, char *key, unsigned long version);
+unsigned long kvcache_fill_token(kvcache_t *, char *key);
+int kvcache_fill(kvcache_t *, char *key, char *value, unsigned long token);
+int kvcache_pin(kvcache_t *, char *key, bool pinned);
+int kvcache_set_ttl(kvcache_t *, char *key, unsigned long ttl_ms);
+unsigned long kvcache_ttl(kvcache_t *, char *key);
+int kvcache_put_dirty(kvcache_t *, char *key, char *value);
+int kvcache_dirty(kvcache_t *, char *key);
+void kvcache_set_flush(kvcache_t *, kvcacheset_flush_t flush, void *aux);
+int kvcache_flush(kvcache_t *);
 
 pthread_rwlock_t *kvcache_getlock(kvcache_t *, char *key);
 
@@ -1,6 +1,7 @@
 #include <pthread.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <time.h>
 #include "uthash.h"
 #include "utlist.h"
 #include "kvconstants.h"
@@ -24,14 +25,36 @@ int kvcacheset_init(kvcacheset_t *cacheset, unsigned int elem_per_set) {
   cacheset->num_entries = 0;
   cacheset->entries = NULL;
   cacheset->hash = NULL;
+  cacheset->version = 0;
+  cacheset->seq = 0;
+  cacheset->num_pinned = 0;
+  cacheset->num_absent = 0;
+  cacheset->num_dirty = 0;
+  cacheset->flush = NULL;
+  cacheset->flush_aux = NULL;
   return 0;
 }
 
 
+/* Returns the current time on a monotonic clock, in milliseconds. */
+static unsigned long kvcacheset_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /* Get the entry corresponding to KEY from CACHESET. Returns 0 if successful,
- * else returns a negative error code. If successful, populates VALUE with a
- * malloced string which should later be freed. */
+ * KVCACHESET_ABSENT if KEY is cached as absent, else returns a negative error
+ * code. If successful, populates VALUE with a malloced string which should
+ * later be freed. */
 int kvcacheset_get(kvcacheset_t *cacheset, char *key, char **value) {
+  return kvcacheset_get_arena(cacheset, key, value, NULL);
+}
+
+/* Gets KEY from CACHESET as kvcacheset_get does, but copies the value into
+ * memory allocated from ARENA (see kvarena_strdup). */
+int kvcacheset_get_arena(kvcacheset_t *cacheset, char *key, char **value,
+    kvarena_t *arena) {
   struct kvcacheentry *elt;
   HASH_FIND_STR(cacheset->hash, key, elt);
 
@@ -39,23 +62,96 @@ int kvcacheset_get(kvcacheset_t *cacheset, char *key, char **value) {
     return ERRNOKEY;
   }
 
+  /* An expired entry is left for the next write or fill to replace, as this
+   * may be called with only a read lock held. */
+  if (elt->value == NULL) {
+    if (kvcacheset_now_ms() >= elt->expires)
+      return ERRNOKEY;
+    elt->refbit = true;
+    return KVCACHESET_ABSENT;
+  }
+
+  if (elt->expires != 0 && kvcacheset_now_ms() >= elt->expires)
+    return ERRNOKEY;
   elt->refbit = true;
-  *value = malloc(strlen(elt->value)+1);
-  strcpy(*value, elt->value);
+  if ((*value = kvarena_strdup(arena, elt->value)) == NULL)
+    return -ENOMEM;
   return 0;
 }
 
-/* Add the given KEY, VALUE pair to CACHESET. Returns 0 if successful, else
- * returns a negative error code. Should evict elements if necessary to not
- * exceed CACHESET->elem_per_set total entries. */
-int kvcacheset_put(kvcacheset_t *cacheset, char *key, char *value) {
-  struct kvcacheentry *selected;
-  struct kvcacheentry *elt, *tmp;
+/* Writes the dirty entry ELT of CACHESET back with CACHESET's flush
+ * function, and marks it clean. Returns 0 if successful, else a negative
+ * error code. */
+static int kvcacheset_flush_entry(kvcacheset_t *cacheset,
+    struct kvcacheentry *elt) {
+  int ret;
+
+  if (cacheset->flush == NULL)
+    return -1;
+  if ((ret = cacheset->flush(elt->key, elt->value, cacheset->flush_aux)) < 0)
+    return ret;
+  elt->dirty = false;
+  cacheset->num_dirty--;
+  return 0;
+}
+
+/* Frees ELT, which has been removed from CACHESET. */
+static void kvcacheset_free_entry(kvcacheset_t *cacheset,
+    struct kvcacheentry *elt) {
+  if (elt->pinned)
+    cacheset->num_pinned--;
+  if (elt->dirty)
+    cacheset->num_dirty--;
+  if (elt->value == NULL)
+    cacheset->num_absent--;
+  free(elt->key);
+  free(elt->value);
+  free(elt);
+}
+
+/* Removes the oldest absent entry from CACHESET if it already holds as many
+ * as it may (see KVCACHESET_ABSENT_SHARE), to make room for another. */
+static void kvcacheset_limit_absent(kvcacheset_t *cacheset) {
+  unsigned int max = cacheset->elem_per_set / KVCACHESET_ABSENT_SHARE;
+  struct kvcacheentry *elt;
+
+  if (cacheset->num_absent < (max > 0 ? max : 1))
+    return;
+  DL_FOREACH(cacheset->entries, elt) {
+    if (elt->value == NULL) {
+      HASH_DEL(cacheset->hash, elt);
+      DL_DELETE(cacheset->entries, elt);
+      kvcacheset_free_entry(cacheset, elt);
+      cacheset->num_entries--;
+      return;
+    }
+  }
+}
+
+/* Add the given KEY, VALUE pair to CACHESET, or record KEY as absent if
+ * VALUE is NULL. Returns 0 if successful, else returns a negative error
+ * code. Should evict elements if necessary to not exceed
+ * CACHESET->elem_per_set total entries. */
+static int kvcacheset_store(kvcacheset_t *cacheset, char *key, char *value) {
+  struct kvcacheentry *selected, *elt;
+  unsigned int i;
+  bool evicted = false;
 
   /* Check if an entry with the key already exists. If it does, set the refbit
    * and replace its value, otherwise allocate a new entry. */
+  cacheset->seq++;
   HASH_FIND_STR(cacheset->hash, key, selected);
+  if (selected && selected->value == NULL && value == NULL) {
+    selected->expires = kvcacheset_now_ms() + KVCACHESET_ABSENT_TTL_MS;
+    return 0;
+  }
+  if (selected == NULL && value == NULL)
+    kvcacheset_limit_absent(cacheset);
   if (selected) {
+    if (selected->value == NULL)
+      cacheset->num_absent--;
+    if (selected->dirty)
+      cacheset->num_dirty--;
     free(selected->value);
     selected->refbit = true;
   } else {
@@ -67,15 +163,25 @@ int kvcacheset_put(kvcacheset_t *cacheset, char *key, char *value) {
 
     strcpy(selected->key, key);
     selected->refbit = false;
+    selected->pinned = false;
   }
+  selected->version = 0;
+  selected->dirty = false;
 
 
   /* Copy the value into the entry field. */
-  selected->value = malloc(strlen(value)+1);
-  if (!selected->value) {
-    return ERRFILCRT;
+  if (value == NULL) {
+    selected->value = NULL;
+    selected->expires = kvcacheset_now_ms() + KVCACHESET_ABSENT_TTL_MS;
+    cacheset->num_absent++;
+  } else {
+    selected->value = malloc(strlen(value)+1);
+    if (!selected->value) {
+      return ERRFILCRT;
+    }
+    strcpy(selected->value, value);
+    selected->expires = 0;
   }
-  strcpy(selected->value, value);
 
 
   /* If adding a new entry, check for evictions. */
@@ -83,20 +189,26 @@ int kvcacheset_put(kvcacheset_t *cacheset, char *key, char *value) {
     if (cacheset->num_entries < cacheset->elem_per_set) {
       cacheset->num_entries++;
     } else {
-      DL_FOREACH_SAFE(cacheset->entries, elt, tmp) {
+      /* Two passes are enough to clear every refbit and reach an entry which
+       * can be evicted, unless every unpinned entry is dirty and fails to
+       * flush, in which case the set holds one entry too many for now. */
+      for (i = 0; i < 2 * cacheset->num_entries && !evicted; i++) {
+        elt = cacheset->entries;
         DL_DELETE(cacheset->entries, elt);
 
-        if (!elt->refbit) {
+        if (!elt->refbit && !elt->pinned &&
+            (!elt->dirty || kvcacheset_flush_entry(cacheset, elt) == 0)) {
           HASH_DEL(cacheset->hash, elt);
-          free(elt->key);
-          free(elt->value);
-          free(elt);
+          kvcacheset_free_entry(cacheset, elt);
+          evicted = true;
           break;
         }
           
         elt->refbit = false;
         DL_APPEND(cacheset->entries, elt);
       }
+      if (!evicted)
+        cacheset->num_entries++;
     }
 
     DL_APPEND(cacheset->entries, selected);
@@ -106,22 +218,149 @@ int kvcacheset_put(kvcacheset_t *cacheset, char *key, char *value) {
   return 0;
 }
 
+/* Add the given KEY, VALUE pair to CACHESET. Returns 0 if successful, else
+ * returns a negative error code. Should evict elements if necessary to not
+ * exceed CACHESET->elem_per_set total entries. */
+int kvcacheset_put(kvcacheset_t *cacheset, char *key, char *value) {
+  return kvcacheset_store(cacheset, key, value);
+}
+
+/* Adds the given KEY, VALUE pair to CACHESET as a dirty entry, which has not
+ * been written back yet (see kvcacheset_flush). Repeated writes of KEY
+ * before it is flushed only leave the last value to be written. Returns 0
+ * if successful, else a negative error code. */
+int kvcacheset_put_dirty(kvcacheset_t *cacheset, char *key, char *value) {
+  struct kvcacheentry *elt;
+  int ret;
+
+  if ((ret = kvcacheset_store(cacheset, key, value)) < 0)
+    return ret;
+  HASH_FIND_STR(cacheset->hash, key, elt);
+  elt->dirty = true;
+  cacheset->num_dirty++;
+  return 0;
+}
+
+/* Sets the function used to write CACHESET's dirty entries back to FLUSH,
+ * which is passed AUX along with each entry's key and value and returns 0
+ * if successful, else a negative error code. */
+void kvcacheset_set_flush(kvcacheset_t *cacheset, kvcacheset_flush_t flush,
+    void *aux) {
+  cacheset->flush = flush;
+  cacheset->flush_aux = aux;
+}
+
+/* Writes every dirty entry of CACHESET back and marks it clean. Returns the
+ * number of entries written if successful, else a negative error code, in
+ * which case the entries not written are left dirty. */
+int kvcacheset_flush(kvcacheset_t *cacheset) {
+  struct kvcacheentry *elt;
+  int ret, count = 0;
+
+  DL_FOREACH(cacheset->entries, elt) {
+    if (!elt->dirty)
+      continue;
+    if ((ret = kvcacheset_flush_entry(cacheset, elt)) < 0)
+      return ret;
+    count++;
+  }
+  return count;
+}
+
+/* Returns 1 if the entry for KEY in CACHESET is dirty, 0 if it is clean, or
+ * -1 if KEY is not cached. */
+int kvcacheset_dirty(kvcacheset_t *cacheset, char *key) {
+  struct kvcacheentry *elt;
+  HASH_FIND_STR(cacheset->hash, key, elt);
+
+  if (!elt)
+    return -1;
+  return elt->dirty;
+}
+
 /* Deletes the entry corresponding to KEY from CACHESET. Returns 0 if
  * successful, else returns a negative error code. */
 int kvcacheset_del(kvcacheset_t *cacheset, char *key) {
   struct kvcacheentry *elt;
 
+  cacheset->seq++;
   HASH_FIND_STR(cacheset->hash, key, elt);
   if (elt) {
     HASH_DEL(cacheset->hash, elt);
     DL_DELETE(cacheset->entries, elt);
-    free(elt);
+    kvcacheset_free_entry(cacheset, elt);
+    cacheset->num_entries--;
     return 0;
   }
 
   return ERRNOKEY;
 }
 
+/* Writes KEY, VALUE to CACHESET as committed at VERSION, unless CACHESET
+ * holds KEY at a later version or, not holding KEY, has already seen a later
+ * version (in which case leaving KEY out is the safe choice). Returns 0 if
+ * the entry was written, 1 if it was stale, else a negative error code. */
+int kvcacheset_put_versioned(kvcacheset_t *cacheset, char *key, char *value,
+    unsigned long version) {
+  struct kvcacheentry *elt;
+  bool stale;
+  int ret;
+
+  HASH_FIND_STR(cacheset->hash, key, elt);
+  stale = (elt != NULL) ? (elt->version > version) :
+      (version < cacheset->version);
+  cacheset->seq++;
+  if (version > cacheset->version)
+    cacheset->version = version;
+  if (stale)
+    return 1;
+  if ((ret = kvcacheset_put(cacheset, key, value)) < 0)
+    return ret;
+  HASH_FIND_STR(cacheset->hash, key, elt);
+  elt->version = version;
+  return 0;
+}
+
+/* Removes KEY from CACHESET because of a write committed at VERSION, unless
+ * CACHESET holds KEY at a later version. Returns 0. */
+int kvcacheset_invalidate(kvcacheset_t *cacheset, char *key,
+    unsigned long version) {
+  struct kvcacheentry *elt;
+
+  HASH_FIND_STR(cacheset->hash, key, elt);
+  cacheset->seq++;
+  if (version > cacheset->version)
+    cacheset->version = version;
+  if (elt != NULL && elt->version <= version)
+    kvcacheset_del(cacheset, key);
+  return 0;
+}
+
+/* Returns a token to be passed to kvcacheset_fill once a key which missed in
+ * CACHESET has been loaded from elsewhere. */
+unsigned long kvcacheset_fill_token(kvcacheset_t *cacheset) {
+  return cacheset->seq;
+}
+
+/* Adds KEY, VALUE, which was loaded after TOKEN was taken from
+ * kvcacheset_fill_token, to CACHESET, or records KEY as absent for
+ * KVCACHESET_ABSENT_TTL_MS if VALUE is NULL. The fill is dropped if a write or
+ * invalidation has reached CACHESET since, as VALUE may predate it.
+ * Returns 0 if KEY is now cached, 1 if the fill was dropped, else a negative
+ * error code. */
+int kvcacheset_fill(kvcacheset_t *cacheset, char *key, char *value,
+    unsigned long token) {
+  struct kvcacheentry *elt;
+
+  if (cacheset->seq != token)
+    return 1;
+  HASH_FIND_STR(cacheset->hash, key, elt);
+  if (elt != NULL && elt->value != NULL &&
+      (elt->expires == 0 || kvcacheset_now_ms() < elt->expires))
+    return 0;
+  return kvcacheset_store(cacheset, key, value);
+}
+
 /* Completely clears this cache set. For testing purposes. */
 void kvcacheset_clear(kvcacheset_t *cacheset) {
   struct kvcacheentry *elt, *tmp;
@@ -129,8 +368,64 @@ void kvcacheset_clear(kvcacheset_t *cacheset) {
   HASH_ITER(hh, cacheset->hash, elt, tmp) {
     HASH_DEL(cacheset->hash, elt);
     DL_DELETE(cacheset->entries, elt);
+    free(elt->key);
+    free(elt->value);
     free(elt);
   }
+  cacheset->num_entries = 0;
+  cacheset->num_pinned = 0;
+  cacheset->num_absent = 0;
+  cacheset->num_dirty = 0;
+  cacheset->seq++;
+}
+
+/* Pins the entry for KEY in CACHESET if PINNED is true, so that it is not
+ * evicted, else unpins it. Returns 0 if successful, 1 if the entry could not
+ * be pinned because every other entry of CACHESET is already pinned, or
+ * ERRNOKEY if KEY is not cached. */
+int kvcacheset_pin(kvcacheset_t *cacheset, char *key, bool pinned) {
+  struct kvcacheentry *elt;
+
+  HASH_FIND_STR(cacheset->hash, key, elt);
+  if (elt == NULL)
+    return ERRNOKEY;
+  if (elt->pinned == pinned)
+    return 0;
+  if (pinned && cacheset->num_pinned + 1 >= cacheset->elem_per_set)
+    return 1;
+  elt->pinned = pinned;
+  if (pinned)
+    cacheset->num_pinned++;
+  else
+    cacheset->num_pinned--;
+  return 0;
+}
+
+/* Makes the value cached for KEY in CACHESET expire TTL_MS milliseconds from
+ * now, or never if TTL_MS is 0. Returns 0 if successful, or ERRNOKEY if no
+ * value is cached for KEY. */
+int kvcacheset_set_ttl(kvcacheset_t *cacheset, char *key,
+    unsigned long ttl_ms) {
+  struct kvcacheentry *elt;
+
+  HASH_FIND_STR(cacheset->hash, key, elt);
+  if (elt == NULL || elt->value == NULL)
+    return ERRNOKEY;
+  elt->expires = (ttl_ms > 0) ? kvcacheset_now_ms() + ttl_ms : 0;
+  return 0;
+}
+
+/* Returns the milliseconds left before the value cached for KEY in CACHESET
+ * expires, or 0 if it never does or no value is cached for KEY. */
+unsigned long kvcacheset_ttl(kvcacheset_t *cacheset, char *key) {
+  struct kvcacheentry *elt;
+  unsigned long now;
+
+  HASH_FIND_STR(cacheset->hash, key, elt);
+  if (elt == NULL || elt->value == NULL || elt->expires == 0)
+    return 0;
+  now = kvcacheset_now_ms();
+  return (elt->expires > now) ? elt->expires - now : 0;
 }
 
 /* Returns refbit of key. For testing purposes. */
@@ -3,6 +3,7 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include "kvarena.h"
 #include "uthash.h"
 
 /* KVCacheSet represents a single distinct set of elements within a KVCache.
@@ -15,17 +16,58 @@
  * A KVCacheSet may not store more than ELEM_PER_SET entries. The eviction
  * policy used is the second-chance algorithm. See kvcache.h for more details
  * on this algorithm.
+ *
+ * A cache which must stay coherent with writes made elsewhere (such as the
+ * TPCMaster's, which caches values stored on its slaves) writes committed
+ * values with kvcacheset_put_versioned and kvcacheset_invalidate, tagging
+ * each with its commit version, and loads missing keys with
+ * kvcacheset_fill_token and kvcacheset_fill. A fill is dropped if any
+ * write or invalidation reached the set while the value was being loaded, so
+ * a value read before a write can never overwrite it.
+ *
+ * An entry can be pinned with kvcacheset_pin, which exempts it from
+ * eviction until it is unpinned or deleted. At least one entry of each set
+ * is always left unpinned, so that new entries can still be added.
+ *
+ * Filling a key with a NULL value records that the key is known to be
+ * absent, so that repeated lookups of a missing key need not go to the
+ * store. kvcacheset_get reports such an entry as KVCACHESET_ABSENT. Absent
+ * entries expire after KVCACHESET_ABSENT_TTL_MS and may take up at most
+ * 1/KVCACHESET_ABSENT_SHARE of a set (but at least one entry), the oldest
+ * making way for a new one; any write of the key replaces its entry.
+ *
+ * A cached value may be given a TTL with kvcacheset_set_ttl, after which
+ * kvcacheset_get no longer returns it; any write of the key clears its TTL.
+ *
+ * A cache used in write-back mode stores writes with kvcacheset_put_dirty
+ * and writes them back later with kvcacheset_flush, through the function
+ * given to kvcacheset_set_flush. A dirty entry chosen for eviction is
+ * written back first, and is kept if that fails.
  */
 
+/* Returned by kvcacheset_get for a key which is known to be absent. */
+#define KVCACHESET_ABSENT 1
+/* How long (in milliseconds) a key is remembered as absent. */
+#define KVCACHESET_ABSENT_TTL_MS 1000
+/* At most 1/KVCACHESET_ABSENT_SHARE of each set records absent keys. */
+#define KVCACHESET_ABSENT_SHARE 4
+
 /* An entry within the KVCacheSet. */
 struct kvcacheentry {
   char *key;                        /* The entry's key. */
-  char *value;                      /* The entry's value. */
+  char *value;                      /* The entry's value, or NULL if KEY is known absent. */
   bool refbit;                      /* Used to determine if this entry has been used. */
+  unsigned long version;            /* The commit version this entry was written at, or 0. */
+  bool pinned;                      /* Set if this entry must not be evicted. */
+  unsigned long expires;            /* When VALUE expires, or KEY stops being known absent, or 0 (ms). */
+  bool dirty;                       /* Set if VALUE has not been written back yet. */
   struct kvcacheentry *prev, *next; /* Used in linked list implementation. */
   UT_hash_handle hh;                /* Make this struct hashable. */
 };
 
+/* A function which writes a dirty entry back. */
+typedef int (*kvcacheset_flush_t)(char *key, char *value, void *aux);
+
 /* A KVCacheSet. */
 typedef struct {
   unsigned int elem_per_set;      /* The max number of elements which can be stored in this set. */
@@ -33,13 +75,36 @@ typedef struct {
   int num_entries;                /* The current number of entries in this set. */
   struct kvcacheentry *entries;   /* Head pointer to entry linked list. */
   struct kvcacheentry *hash;      /* Pointer to hash table. */
+  unsigned long version;          /* The latest commit version written to or invalidated in this set. */
+  unsigned long seq;              /* Incremented by every write and invalidation. */
+  unsigned int num_pinned;        /* The number of pinned entries in this set. */
+  unsigned int num_absent;        /* The number of entries recording an absent key. */
+  unsigned int num_dirty;         /* The number of dirty entries in this set. */
+  kvcacheset_flush_t flush;       /* Writes dirty entries back, or NULL. */
+  void *flush_aux;                /* Passed to FLUSH. */
 } kvcacheset_t;
 
 int kvcacheset_init(kvcacheset_t *, unsigned int elem_per_set);
 
 int kvcacheset_get(kvcacheset_t *, char *key, char **value);
+int kvcacheset_get_arena(kvcacheset_t *, char *key, char **value,
+    kvarena_t *arena);
 int kvcacheset_put(kvcacheset_t *, char *key, char *value);
 int kvcacheset_del(kvcacheset_t *, char *key);
+int kvcacheset_put_versioned(kvcacheset_t *, char *key, char *value,
+    unsigned long version);
+int kvcacheset_invalidate(kvcacheset_t *, char *key, unsigned long version);
+unsigned long kvcacheset_fill_token(kvcacheset_t *);
+int kvcacheset_fill(kvcacheset_t *, char *key, char *value,
+    unsigned long token);
+int kvcacheset_pin(kvcacheset_t *, char *key, bool pinned);
+int kvcacheset_set_ttl(kvcacheset_t *, char *key, unsigned long ttl_ms);
+unsigned long kvcacheset_ttl(kvcacheset_t *, char *key);
+int kvcacheset_put_dirty(kvcacheset_t *, char *key, char *value);
+void kvcacheset_set_flush(kvcacheset_t *, kvcacheset_flush_t flush,
+    void *aux);
+int kvcacheset_flush(kvcacheset_t *);
+int kvcacheset_dirty(kvcacheset_t *, char *key);
 
 void kvcacheset_clear(kvcacheset_t *);
 int kvcacheset_refbit(kvcacheset_t *cacheset, char *key);
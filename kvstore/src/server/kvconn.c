@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "kvconn.h"
+
+/* Initializes CONN to read from and write to the socket SOCKFD, with nothing
+ * yet buffered, reading messages into ARENA (which may be NULL). */
+void kvconn_init(kvconn_t *conn, int sockfd, kvarena_t *arena) {
+  conn->sockfd = sockfd;
+  conn->arena = arena;
+  conn->in = NULL;
+  conn->in_size = 0;
+  conn->in_pos = 0;
+  conn->in_len = 0;
+  conn->num_out = 0;
+}
+
+/* Frees the buffers of CONN, discarding any responses not yet written. Does
+ * not close its socket. */
+void kvconn_free(kvconn_t *conn) {
+  unsigned int i;
+  for (i = 0; i < conn->num_out; i++)
+    free(conn->out[i].iov_base);
+  conn->num_out = 0;
+  free(conn->in);
+  conn->in = NULL;
+  conn->in_size = 0;
+  conn->in_pos = 0;
+  conn->in_len = 0;
+}
+
+/* Returns the size of the frame starting at the first unread byte of CONN,
+ * including its header, or 0 if the header has not yet been read in full. */
+static size_t kvconn_frame_size(kvconn_t *conn) {
+  uint32_t size;
+  if (conn->in_len - conn->in_pos < 4)
+    return 0;
+  memcpy(&size, conn->in + conn->in_pos, 4);
+  return 4 + (size_t) ntohl(size);
+}
+
+/* Returns true if a whole message has been read into CONN and not yet taken
+ * by kvconn_read, so that reading it will not block. */
+bool kvconn_pending(kvconn_t *conn) {
+  size_t frame = kvconn_frame_size(conn);
+  return frame > 0 && conn->in_len - conn->in_pos >= frame;
+}
+
+/* Reads whatever SOCKFD has ready into CONN, making room for a frame of
+ * FRAME bytes (plus one, for kvmessage_decode) if it is larger than the
+ * buffer. Returns the number of bytes read, 0 if the socket has been closed,
+ * or -1 if there is an error. */
+static long kvconn_fill(kvconn_t *conn, size_t frame) {
+  size_t size = (frame + 1 > KVCONN_BUFSIZE) ? frame + 1 : KVCONN_BUFSIZE;
+  ssize_t ret;
+  char *in;
+
+  /* Unread bytes are moved to the front, so the buffer only grows to hold
+   * the largest single frame. */
+  if (conn->in_pos > 0) {
+    memmove(conn->in, conn->in + conn->in_pos, conn->in_len - conn->in_pos);
+    conn->in_len -= conn->in_pos;
+    conn->in_pos = 0;
+  }
+  if (size > conn->in_size) {
+    if ((in = realloc(conn->in, size)) == NULL)
+      return -1;
+    conn->in = in;
+    conn->in_size = size;
+  }
+  do {
+    ret = read(conn->sockfd, conn->in + conn->in_len,
+        conn->in_size - 1 - conn->in_len);
+  } while (ret == -1 && errno == EINTR);
+  if (ret > 0)
+    conn->in_len += ret;
+  return ret;
+}
+
+/* Receives and returns the next message from CONN, reading from its socket
+ * only if the message has not already been read. Returns NULL if the socket
+ * is closed first, the message is larger than KVMESSAGE_MAX_SIZE, or there
+ * is an error. The message is allocated from CONN's arena, or, if it has
+ * none, should be freed using kvmessage_free. */
+kvmessage_t *kvconn_read(kvconn_t *conn) {
+  kvmessage_t *msg;
+  size_t frame;
+
+  while (!kvconn_pending(conn)) {
+    frame = kvconn_frame_size(conn);
+    if (frame > 4 + (size_t) KVMESSAGE_MAX_SIZE || kvconn_fill(conn, frame) <= 0)
+      return NULL;
+  }
+  frame = kvconn_frame_size(conn);
+  if (frame > 4 + (size_t) KVMESSAGE_MAX_SIZE)
+    return NULL;
+  msg = kvmessage_decode(conn->in + conn->in_pos + 4, frame - 4, conn->arena);
+  conn->in_pos += frame;
+  return msg;
+}
+
+/* Reads whatever CONN's socket has ready into CONN without waiting for a
+ * whole message, so that a non-blocking socket can be read as its data
+ * arrives; kvconn_pending tells when a message is complete. Must not be
+ * called while one is. Returns the number of bytes read, 0 if the socket
+ * has been closed, or -1 if there is an error (with errno EAGAIN if a
+ * non-blocking socket has nothing ready). */
+long kvconn_receive(kvconn_t *conn) {
+  size_t frame = kvconn_frame_size(conn);
+  if (frame > 4 + (size_t) KVMESSAGE_MAX_SIZE) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  return kvconn_fill(conn, frame);
+}
+
+/* Waits up to TIMEOUT_MS milliseconds for CONN to have something to read.
+ * Returns true if a message is already pending or the socket has become
+ * readable (which includes having been closed), else false. */
+bool kvconn_wait(kvconn_t *conn, int timeout_ms) {
+  struct pollfd pfd;
+  int ret;
+
+  if (kvconn_pending(conn))
+    return true;
+  pfd.fd = conn->sockfd;
+  pfd.events = POLLIN;
+  do {
+    ret = poll(&pfd, 1, timeout_ms);
+  } while (ret == -1 && errno == EINTR);
+  return ret > 0;
+}
+
+/* Encodes MESSAGE and holds it in CONN to be written by the next
+ * kvconn_flush, which happens at once if KVCONN_MAX_QUEUED responses are
+ * already held. MESSAGE is not referenced afterwards. Returns 0 if
+ * successful, or -1 if there is an error. */
+int kvconn_queue(kvconn_t *conn, kvmessage_t *message) {
+  unsigned int size;
+  char *frame;
+
+  if (conn->num_out == KVCONN_MAX_QUEUED && kvconn_flush(conn) < 0)
+    return -1;
+  if ((frame = kvmessage_encode(message, &size)) == NULL)
+    return -1;
+  conn->out[conn->num_out].iov_base = frame;
+  conn->out[conn->num_out].iov_len = size;
+  conn->num_out++;
+  return 0;
+}
+
+/* Writes every response held in CONN in a single writev, carrying on after
+ * a short write. Returns the number of bytes which were sent, or -1 if there
+ * is an error, in which case the responses are discarded. */
+int kvconn_flush(kvconn_t *conn) {
+  struct iovec iov[KVCONN_MAX_QUEUED];
+  unsigned int i, num_out = conn->num_out;
+  long sent = 0;
+
+  if (num_out == 0)
+    return 0;
+  /* kvmessage_writev advances the vectors it is given, so it gets a copy and
+   * the originals are left to be freed. */
+  memcpy(iov, conn->out, num_out * sizeof(struct iovec));
+  sent = kvmessage_writev(conn->sockfd, iov, num_out);
+  for (i = 0; i < num_out; i++)
+    free(conn->out[i].iov_base);
+  conn->num_out = 0;
+  return sent;
+}
+
+/* Serves the connection SOCKFD, passing each request read from it to
+ * HANDLER along with AUX, then closes it. Requests are read into ARENA,
+ * which is reset after each one is answered, or, if ARENA is NULL, into an
+ * arena of the connection's own. The first request is always
+ * answered, even if it cannot be read. Responses are written once no
+ * further request has already arrived, and the connection is closed once
+ * its client closes it, sends something unreadable, or sends nothing more
+ * for KVCONN_IDLE_MS. */
+void kvconn_serve(int sockfd, kvarena_t *arena, kvconn_handler_t handler,
+    void *aux) {
+  kvarena_t own_arena;
+  kvmessage_t *reqmsg;
+  kvconn_t conn;
+  bool done;
+
+  kvarena_init(&own_arena, KVARENA_BLOCK_SIZE);
+  kvconn_init(&conn, sockfd, (arena != NULL) ? arena : &own_arena);
+  reqmsg = kvconn_read(&conn);
+  for (;;) {
+    done = (reqmsg == NULL);
+    handler(aux, &conn, reqmsg);
+    kvarena_reset(conn.arena);
+    if (done)
+      break;
+    if (!kvconn_pending(&conn) &&
+        (kvconn_flush(&conn) < 0 || !kvconn_wait(&conn, KVCONN_IDLE_MS)))
+      break;
+    if ((reqmsg = kvconn_read(&conn)) == NULL)
+      break;
+  }
+  kvconn_flush(&conn);
+  kvconn_free(&conn);
+  kvarena_free(&own_arena);
+  close(sockfd);
+}
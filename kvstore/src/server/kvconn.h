@@ -0,0 +1,75 @@
+#ifndef __KV_CONN__
+#define __KV_CONN__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include "kvmessage.h"
+
+/* KVConn buffers the messages read from and written to one connection, so
+ * that a client may pipeline several requests on it.
+ *
+ * kvconn_read reads as much as the socket has ready into the connection's
+ * input buffer and takes each message from there, so a message which arrives
+ * whole costs a single read, and the messages which follow it need none.
+ * kvconn_queue encodes a response and holds on to it; kvconn_flush sends
+ * every response held in a single writev. kvconn_serve uses these to answer
+ * the requests already waiting before writing any of the answers, so that
+ * the answers to a pipelined burst of requests leave in one write.
+ *
+ * A connection holds one of the server's worker threads for as long as it is
+ * served, so kvconn_serve waits only KVCONN_IDLE_MS for a further request
+ * once it has answered those which arrived. That is long enough to catch the
+ * rest of a burst still in flight, but a client which waits on each answer
+ * before sending its next request should open a new connection for it.
+ *
+ * A connection may be given an arena (see kvarena.h), in which case the
+ * messages kvconn_read returns are allocated there. kvconn_serve gives each
+ * connection the arena of the worker serving it, or one of its own, and
+ * resets it after each request is answered, so that nothing allocated
+ * while a request is handled in that arena outlives the request.
+ *
+ * The framing is exactly that of kvmessage_send and kvmessage_parse, so a
+ * client sending one request per connection sees no difference.
+ */
+
+/* The size the input buffer of a connection starts at. */
+#define KVCONN_BUFSIZE 4096
+/* The most responses held before they are written. */
+#define KVCONN_MAX_QUEUED 64
+/* How long kvconn_serve waits for a further request before closing. */
+#define KVCONN_IDLE_MS 2
+
+/* A buffered connection. */
+typedef struct {
+  int sockfd;               /* The socket this connection reads and writes. */
+  kvarena_t *arena;         /* The arena messages are read into, or NULL to malloc() them. */
+  char *in;                 /* The input buffer, or NULL until the first read. */
+  size_t in_size;           /* The size of IN. */
+  size_t in_pos;            /* The offset of the first unread byte of IN. */
+  size_t in_len;            /* The offset just after the last byte read into IN. */
+  unsigned int num_out;     /* The number of responses held in OUT. */
+  struct iovec out[KVCONN_MAX_QUEUED]; /* The encoded responses not yet written. */
+} kvconn_t;
+
+/* A function which answers REQMSG (or NULL if it could not be read), read
+ * from CONN, by passing its response to kvconn_queue. REQMSG, and anything
+ * else allocated from CONN's arena, is freed once it returns. */
+typedef void (*kvconn_handler_t)(void *aux, kvconn_t *conn,
+    kvmessage_t *reqmsg);
+
+void kvconn_init(kvconn_t *, int sockfd, kvarena_t *arena);
+void kvconn_free(kvconn_t *);
+
+kvmessage_t *kvconn_read(kvconn_t *);
+long kvconn_receive(kvconn_t *);
+bool kvconn_pending(kvconn_t *);
+bool kvconn_wait(kvconn_t *, int timeout_ms);
+
+int kvconn_queue(kvconn_t *, kvmessage_t *);
+int kvconn_flush(kvconn_t *);
+
+void kvconn_serve(int sockfd, kvarena_t *arena, kvconn_handler_t handler,
+    void *aux);
+
+#endif
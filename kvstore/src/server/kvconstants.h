@@ -19,12 +19,21 @@
 #define ERRMSG_INVALID_REQUEST "ERROR: INVALID REQUEST"
 #define ERRMSG_NOT_IMPLEMENTED "ERROR: NOT IMPLEMENTED"
 #define ERRMSG_GENERIC_ERROR "ERROR: UNABLE TO PROCESS REQUEST"
+#define ERRMSG_KEY_LOCKED "ERROR: KEY LOCKED BY ANOTHER TRANSACTION"
+#define ERRMSG_CAS_MISMATCH "ERROR: VALUE DOES NOT MATCH"
+#define ERRMSG_NOT_INTEGER "ERROR: VALUE IS NOT AN INTEGER"
+#define ERRMSG_OVERLOADED "ERROR: SERVER OVERLOADED"
 
 /* Convert an error code to an error message. */
 #define GETMSG(error) ((error == ERRKEYLEN) ? ERRMSG_KEY_LEN : \
                       ((error == ERRVALLEN) ? ERRMSG_VAL_LEN : \
                       ((error == ERRNOKEY)  ? ERRMSG_NO_KEY  : \
-                                              ERRMSG_GENERIC_ERROR)))
+                      ((error == ERRKEYLOCKED) ? ERRMSG_KEY_LOCKED : \
+                      ((error == ERRCASMISMATCH) ? ERRMSG_CAS_MISMATCH : \
+                      ((error == ERRNOTINTEGER) ? ERRMSG_NOT_INTEGER : \
+                      ((error == ERRNOTIMPL) ? ERRMSG_NOT_IMPLEMENTED : \
+                      ((error == ERROVERLOADED) ? ERRMSG_OVERLOADED : \
+                                              ERRMSG_GENERIC_ERROR))))))))
 
 /* Message types for use by KVMessage. */
 typedef enum {
@@ -39,18 +48,14 @@ typedef enum {
   VOTE_COMMIT,
   VOTE_ABORT,
   REGISTER,
-  INFO
+  INFO,
+  BATCHREQ,
+  SCANREQ,
+  CASREQ,
+  INCRREQ,
+  DECRREQ
 } msgtype_t;
 
-/* Possible TPC states. */
-typedef enum {
-  TPC_INIT,
-  TPC_WAIT,
-  TPC_READY,
-  TPC_ABORT,
-  TPC_COMMIT
-} tpc_state_t;
-
 /* Error types/values */
 /* Error for invalid key length. */
 #define ERRKEYLEN -11
@@ -66,5 +71,17 @@ typedef enum {
 #define ERRFILCRT -16
 /* Error returned if error was encountered accessing a file. */
 #define ERRFILACCESS -17
+/* Error for a key which is locked by another prepared TPC transaction. */
+#define ERRKEYLOCKED -18
+/* Error for a CAS whose expected value does not match the stored one. */
+#define ERRCASMISMATCH -19
+/* Error for an INCR or DECR of a value or by a delta which is not an integer,
+ * or whose result overflows. */
+#define ERRNOTINTEGER -20
+/* Error for a request this server cannot serve in its current mode. */
+#define ERRNOTIMPL -21
+/* Error for a request turned away, unserved, because the server is
+ * overloaded. */
+#define ERROVERLOADED -22
 
 #endif
@@ -0,0 +1,431 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "kvconstants.h"
+#include "kvengine.h"
+#include "kvmemstore.h"
+#include "kvstore.h"
+
+/* The state of a "file" or "mmap" engine. */
+typedef struct {
+  kvstore_t store;          /* The store holding the entries. */
+  bool migrating;           /* Set while MIGRATE_THREAD has to be joined. */
+  bool stopping;            /* Set to stop MIGRATE_THREAD early. */
+  pthread_t migrate_thread; /* Moves STORE out of the flat layout. */
+} kvfile_t;
+
+/* Moves the store of the file engine AUX out of the flat layout, a batch of
+ * hash chains at a time, while it serves requests. */
+static void *kvfile_migrate_loop(void *aux) {
+  kvfile_t *file = aux;
+
+  while (!__atomic_load_n(&file->stopping, __ATOMIC_SEQ_CST) &&
+      kvstore_migrate(&file->store, KVSTORE_MIGRATE_BATCH) > 0)
+    continue;
+  return NULL;
+}
+
+/* Initializes a file engine in DIRNAME. If DIRNAME holds entries in the flat
+ * layout, they are migrated into subdirectories in the background (see
+ * kvstore.h). */
+static int kvfile_init(void **state, char *dirname) {
+  kvfile_t *file = calloc(1, sizeof(kvfile_t));
+  int ret;
+
+  if (file == NULL)
+    return -ENOMEM;
+  if ((ret = kvstore_init(&file->store, dirname)) < 0) {
+    free(file);
+    return ret;
+  }
+  if (kvstore_migrating(&file->store) && pthread_create(
+      &file->migrate_thread, NULL, kvfile_migrate_loop, file) == 0)
+    file->migrating = true;
+  *state = file;
+  return 0;
+}
+
+/* Initializes an mmap engine in DIRNAME. */
+static int kvfile_init_mmap(void **state, char *dirname) {
+  kvfile_t *file = calloc(1, sizeof(kvfile_t));
+  int ret;
+
+  if (file == NULL)
+    return -ENOMEM;
+  if ((ret = kvstore_init_mmap(&file->store, dirname)) < 0) {
+    free(file);
+    return ret;
+  }
+  *state = file;
+  return 0;
+}
+
+static int kvfile_get(void *state, char *key, char **value,
+    unsigned long *expires) {
+  return kvstore_get_expiring(&((kvfile_t *) state)->store, key, value,
+      expires);
+}
+
+static int kvfile_put(void *state, char *key, char *value,
+    unsigned long expires) {
+  return kvstore_put_expiring(&((kvfile_t *) state)->store, key, value,
+      expires);
+}
+
+static int kvfile_put_check(void *state, char *key, char *value) {
+  return kvstore_put_check(&((kvfile_t *) state)->store, key, value);
+}
+
+static int kvfile_del(void *state, char *key) {
+  return kvstore_del(&((kvfile_t *) state)->store, key);
+}
+
+static int kvfile_expire(void *state, char *key) {
+  return kvstore_expire(&((kvfile_t *) state)->store, key);
+}
+
+static int kvfile_del_check(void *state, char *key) {
+  return kvstore_del_check(&((kvfile_t *) state)->store, key);
+}
+
+static bool kvfile_haskey(void *state, char *key) {
+  return kvstore_haskey(&((kvfile_t *) state)->store, key);
+}
+
+static int kvfile_get_versioned(void *state, char *key, char **value,
+    unsigned long *version) {
+  return kvstore_get_versioned(&((kvfile_t *) state)->store, key, value,
+      version);
+}
+
+static int kvfile_put_versioned(void *state, char *key, char *value,
+    unsigned long version) {
+  return kvstore_put_versioned(&((kvfile_t *) state)->store, key, value,
+      version);
+}
+
+static int kvfile_scan(void *state, unsigned long start, unsigned int max,
+    bool expired, kvstore_visit_t visit, void *aux, unsigned long *next) {
+  return kvstore_scan(&((kvfile_t *) state)->store, start, max, expired,
+      visit, aux, next);
+}
+
+/* Applies the writes OPS to a file engine atomically. They are written as
+ * they are, without being copied into the batch. */
+static int kvfile_batch(void *state, kvstore_op_t *ops,
+    unsigned int num_ops) {
+  kvstore_batch_t batch = {ops, num_ops, num_ops};
+  return kvstore_write_batch(&((kvfile_t *) state)->store, &batch);
+}
+
+static int kvfile_update(void *state, char *key, kvstore_update_t update,
+    void *aux, char **value, unsigned long *expires) {
+  return kvstore_update(&((kvfile_t *) state)->store, key, update, aux, value,
+      expires);
+}
+
+static int kvfile_sync(void *state) {
+  return kvstore_sync(&((kvfile_t *) state)->store);
+}
+
+static void kvfile_stats(void *state, unsigned long *num_entries,
+    unsigned long *memory) {
+  kvstore_stats(&((kvfile_t *) state)->store, num_entries, memory);
+}
+
+/* Stops the migration of the file engine FILE, if it is running. */
+static void kvfile_stop(kvfile_t *file) {
+  if (!file->migrating)
+    return;
+  __atomic_store_n(&file->stopping, true, __ATOMIC_SEQ_CST);
+  pthread_join(file->migrate_thread, NULL);
+  file->migrating = false;
+}
+
+static void kvfile_close(void *state) {
+  kvfile_stop(state);
+  kvstore_close(&((kvfile_t *) state)->store);
+  free(state);
+}
+
+static int kvfile_clean(void *state) {
+  kvfile_stop(state);
+  return kvstore_clean(&((kvfile_t *) state)->store);
+}
+
+/* Initializes a memory engine. It keeps nothing in DIRNAME. */
+static int kvmem_init(void **state, char *dirname) {
+  kvmemstore_t *store = malloc(sizeof(kvmemstore_t));
+  int ret;
+
+  if (store == NULL)
+    return -ENOMEM;
+  if ((ret = kvmemstore_init(store)) != 0) {
+    free(store);
+    return -ret;
+  }
+  *state = store;
+  return 0;
+}
+
+/* Reads KEY from a memory engine, treating a tombstone or an expired entry
+ * as absent. */
+static int kvmem_get(void *state, char *key, char **value,
+    unsigned long *expires) {
+  int ret = kvmemstore_get(state, key, value, NULL, expires);
+  return (ret == 1) ? ERRNOKEY : ret;
+}
+
+static int kvmem_put_check(void *state, char *key, char *value) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (strlen(value) > MAX_VALLEN)
+    return ERRVALLEN;
+  return 0;
+}
+
+static int kvmem_put(void *state, char *key, char *value,
+    unsigned long expires) {
+  int ret;
+  if ((ret = kvmem_put_check(state, key, value)) < 0)
+    return ret;
+  return kvmemstore_put(state, key, value, 0, expires, false);
+}
+
+static int kvmem_del(void *state, char *key) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  return kvmemstore_del(state, key);
+}
+
+static int kvmem_expire(void *state, char *key) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  return kvmemstore_expire(state, key);
+}
+
+static bool kvmem_haskey(void *state, char *key) {
+  return kvmem_get(state, key, NULL, NULL) == 0;
+}
+
+static int kvmem_del_check(void *state, char *key) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (!kvmem_haskey(state, key))
+    return ERRNOKEY;
+  return 0;
+}
+
+/* Reads KEY from a memory engine, setting *VALUE to NULL for a tombstone. */
+static int kvmem_get_versioned(void *state, char *key, char **value,
+    unsigned long *version) {
+  int ret = kvmemstore_get(state, key, value, version, NULL);
+  return (ret == 1) ? 0 : ret;
+}
+
+static int kvmem_put_versioned(void *state, char *key, char *value,
+    unsigned long version) {
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (value != NULL && (ret = kvmem_put_check(state, key, value)) < 0)
+    return ret;
+  return kvmemstore_put(state, key, value, version, 0, true);
+}
+
+static int kvmem_scan(void *state, unsigned long start, unsigned int max,
+    bool expired, kvstore_visit_t visit, void *aux, unsigned long *next) {
+  return kvmemstore_scan(state, start, max, expired, visit, aux, next);
+}
+
+/* Applies the writes OPS to a memory engine under a single lock, after
+ * checking every one of them. */
+static int kvmem_batch(void *state, kvstore_op_t *ops, unsigned int num_ops) {
+  unsigned int i;
+  int ret;
+
+  for (i = 0; i < num_ops; i++) {
+    if (strlen(ops[i].key) > MAX_KEYLEN)
+      return ERRKEYLEN;
+    if (ops[i].value != NULL &&
+        (ret = kvmem_put_check(state, ops[i].key, ops[i].value)) < 0)
+      return ret;
+  }
+  return kvmemstore_batch(state, ops, num_ops);
+}
+
+static int kvmem_update(void *state, char *key, kvstore_update_t update,
+    void *aux, char **value, unsigned long *expires) {
+  return kvmemstore_update(state, key, update, aux, value, expires);
+}
+
+/* A memory engine has nothing to make durable. */
+static int kvmem_sync(void *state) {
+  return 0;
+}
+
+static void kvmem_stats(void *state, unsigned long *num_entries,
+    unsigned long *memory) {
+  kvmemstore_stats(state, num_entries, memory);
+}
+
+static void kvmem_close(void *state) {
+  kvmemstore_free(state);
+  pthread_rwlock_destroy(&((kvmemstore_t *) state)->lock);
+  free(state);
+}
+
+static int kvmem_clean(void *state) {
+  kvmemstore_free(state);
+  return 0;
+}
+
+/* The engines which can be chosen by name. */
+static const kvengine_ops_t kvengines[] = {
+  { "file", kvfile_init, kvfile_get, kvfile_put, kvfile_put_check,
+    kvfile_del, kvfile_del_check, kvfile_haskey, kvfile_get_versioned,
+    kvfile_put_versioned, kvfile_scan, kvfile_batch, kvfile_update,
+    kvfile_expire, kvfile_sync, kvfile_stats, kvfile_close, kvfile_clean },
+  { "mmap", kvfile_init_mmap, kvfile_get, kvfile_put, kvfile_put_check,
+    kvfile_del, kvfile_del_check, kvfile_haskey, kvfile_get_versioned,
+    kvfile_put_versioned, kvfile_scan, kvfile_batch, kvfile_update,
+    kvfile_expire, kvfile_sync, kvfile_stats, kvfile_close, kvfile_clean },
+  { "memory", kvmem_init, kvmem_get, kvmem_put, kvmem_put_check,
+    kvmem_del, kvmem_del_check, kvmem_haskey, kvmem_get_versioned,
+    kvmem_put_versioned, kvmem_scan, kvmem_batch, kvmem_update,
+    kvmem_expire, kvmem_sync, kvmem_stats, kvmem_close, kvmem_clean },
+};
+
+/* Initializes ENGINE as the engine called NAME (or KVENGINE_DEFAULT if NAME
+ * is NULL), using DIRNAME as the directory in which to store its entries.
+ * Returns 0 if successful, -1 if there is no engine called NAME, else a
+ * negative error code. */
+int kvengine_init(kvengine_t *engine, const char *name, char *dirname) {
+  unsigned int i;
+
+  if (name == NULL)
+    name = KVENGINE_DEFAULT;
+  if (strlen(dirname) >= MAX_FILENAME)
+    return -1;
+  for (i = 0; i < sizeof(kvengines) / sizeof(kvengines[0]); i++) {
+    if (strcmp(kvengines[i].name, name) == 0) {
+      engine->ops = &kvengines[i];
+      strcpy(engine->dirname, dirname);
+      return engine->ops->init(&engine->state, dirname);
+    }
+  }
+  return -1;
+}
+
+/* Returns the name of ENGINE's engine. */
+const char *kvengine_name(kvengine_t *engine) {
+  return engine->ops->name;
+}
+
+int kvengine_get(kvengine_t *engine, char *key, char **value) {
+  return engine->ops->get(engine->state, key, value, NULL);
+}
+
+/* Reads KEY from ENGINE as kvengine_get does, also setting *EXPIRES to the
+ * time the entry expires at, in seconds since the epoch, or 0 if it never
+ * does. */
+int kvengine_get_expiring(kvengine_t *engine, char *key, char **value,
+    unsigned long *expires) {
+  return engine->ops->get(engine->state, key, value, expires);
+}
+
+int kvengine_put(kvengine_t *engine, char *key, char *value) {
+  return engine->ops->put(engine->state, key, value, 0);
+}
+
+/* Writes KEY with VALUE to ENGINE as kvengine_put does, to expire at EXPIRES,
+ * in seconds since the epoch, or never if EXPIRES is 0. */
+int kvengine_put_expiring(kvengine_t *engine, char *key, char *value,
+    unsigned long expires) {
+  return engine->ops->put(engine->state, key, value, expires);
+}
+
+int kvengine_put_check(kvengine_t *engine, char *key, char *value) {
+  return engine->ops->put_check(engine->state, key, value);
+}
+
+int kvengine_del(kvengine_t *engine, char *key) {
+  return engine->ops->del(engine->state, key);
+}
+
+int kvengine_del_check(kvengine_t *engine, char *key) {
+  return engine->ops->del_check(engine->state, key);
+}
+
+bool kvengine_haskey(kvengine_t *engine, char *key) {
+  return engine->ops->haskey(engine->state, key);
+}
+
+int kvengine_get_versioned(kvengine_t *engine, char *key, char **value,
+    unsigned long *version) {
+  return engine->ops->get_versioned(engine->state, key, value, version);
+}
+
+int kvengine_put_versioned(kvengine_t *engine, char *key, char *value,
+    unsigned long version) {
+  return engine->ops->put_versioned(engine->state, key, value, version);
+}
+
+int kvengine_scan(kvengine_t *engine, unsigned long start, unsigned int max,
+    bool expired, kvstore_visit_t visit, void *aux, unsigned long *next) {
+  return engine->ops->scan(engine->state, start, max, expired, visit, aux,
+      next);
+}
+
+/* Replaces the value of KEY in ENGINE with the one UPDATE computes from its
+ * current value and AUX, as a single atomic read-modify-write (see
+ * kvstore_update). Returns 0 if successful, in which case the new value is
+ * placed into VALUE using malloc()d memory and, unless EXPIRES is NULL, the
+ * time it expires at into EXPIRES, else a negative error code. */
+int kvengine_update(kvengine_t *engine, char *key, kvstore_update_t update,
+    void *aux, char **value, unsigned long *expires) {
+  return engine->ops->update(engine->state, key, update, aux, value,
+      expires);
+}
+
+/* Removes the entry KEY from ENGINE if it has expired (see kvstore_expire).
+ * Returns 0 if it was removed, ERRNOKEY if there was no expired entry to
+ * remove, else a negative error code. */
+int kvengine_expire(kvengine_t *engine, char *key) {
+  return engine->ops->expire(engine->state, key);
+}
+
+/* Applies the NUM_OPS writes OPS to ENGINE in order and atomically. A DEL of
+ * a key which is absent does nothing. Returns 0 if successful, else a
+ * negative error code. */
+int kvengine_batch(kvengine_t *engine, kvstore_op_t *ops,
+    unsigned int num_ops) {
+  return engine->ops->batch(engine->state, ops, num_ops);
+}
+
+/* Makes every write ENGINE has applied durable. Returns 0 if successful,
+ * else a negative error code. */
+int kvengine_sync(kvengine_t *engine) {
+  return engine->ops->sync(engine->state);
+}
+
+/* Sets *NUM_ENTRIES to the number of entries ENGINE holds and *MEMORY to the
+ * bytes of memory it uses to hold or find them. */
+void kvengine_stats(kvengine_t *engine, unsigned long *num_entries,
+    unsigned long *memory) {
+  engine->ops->stats(engine->state, num_entries, memory);
+}
+
+/* Releases ENGINE, leaving whatever it persisted in place. ENGINE must be
+ * initialized again before it is next used. */
+void kvengine_close(kvengine_t *engine) {
+  engine->ops->close(engine->state);
+  engine->state = NULL;
+}
+
+/* Deletes every entry of ENGINE, along with its directory. ENGINE must
+ * still be closed once it is no longer used. */
+int kvengine_clean(kvengine_t *engine) {
+  return engine->ops->clean(engine->state);
+}
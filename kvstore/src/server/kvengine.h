@@ -0,0 +1,98 @@
+#ifndef __KV_ENGINE__
+#define __KV_ENGINE__
+
+#include <stdbool.h>
+#include "kvconstants.h"
+#include "kvstore.h"
+
+/* KVEngine is the storage engine interface through which a KVServer stores
+ * its entries, so that the server need not know how (or whether) they are
+ * persisted.
+ *
+ * An engine is a table of operations, kvengine_ops_t, chosen by name when
+ * the engine is initialized. The engines are:
+ *    "file"    A KVStore keeping each entry in its own file (see kvstore.h).
+ *              This is the default.
+ *    "mmap"    A KVStore keeping every entry in a single memory-mapped file
+ *              (see kvmmap.h).
+ *    "memory"  A KVMemstore keeping every entry in memory and nothing on
+ *              disk (see kvmemstore.h), for cache-tier servers which need no
+ *              persistence. Its entries are lost when the process exits.
+ *
+ * Every engine offers the same semantics as the KVStore functions of the
+ * same names, including versioned writes and tombstones. A batch applies a
+ * sequence of PUTs and DELs (see kvstore_op_t) atomically; the file and mmap
+ * engines also make it crash-atomic (see kvstore_write_batch). An update is
+ * a read-modify-write of one entry which no other write to it can interleave
+ * (see kvstore_update). An entry may be written to expire at a given time,
+ * after which it is treated as absent until kvengine_expire removes it.
+ */
+
+/* The name of the engine used when none is given. */
+#define KVENGINE_DEFAULT "file"
+
+/* The operations of a storage engine, each taking the engine's state. */
+typedef struct kvengine_ops {
+  const char *name;
+  int (*init)(void **state, char *dirname);
+  int (*get)(void *, char *key, char **value, unsigned long *expires);
+  int (*put)(void *, char *key, char *value, unsigned long expires);
+  int (*put_check)(void *, char *key, char *value);
+  int (*del)(void *, char *key);
+  int (*del_check)(void *, char *key);
+  bool (*haskey)(void *, char *key);
+  int (*get_versioned)(void *, char *key, char **value,
+      unsigned long *version);
+  int (*put_versioned)(void *, char *key, char *value, unsigned long version);
+  int (*scan)(void *, unsigned long start, unsigned int max, bool expired,
+      kvstore_visit_t visit, void *aux, unsigned long *next);
+  int (*batch)(void *, kvstore_op_t *ops, unsigned int num_ops);
+  int (*update)(void *, char *key, kvstore_update_t update, void *aux,
+      char **value, unsigned long *expires);
+  int (*expire)(void *, char *key);
+  int (*sync)(void *);
+  void (*stats)(void *, unsigned long *num_entries, unsigned long *memory);
+  void (*close)(void *);
+  int (*clean)(void *);
+} kvengine_ops_t;
+
+/* A storage engine. */
+typedef struct {
+  const kvengine_ops_t *ops;    /* The operations of this engine. */
+  void *state;                  /* The state those operations act on. */
+  char dirname[MAX_FILENAME];   /* The directory this engine was initialized with. */
+} kvengine_t;
+
+int kvengine_init(kvengine_t *, const char *name, char *dirname);
+const char *kvengine_name(kvengine_t *);
+
+int kvengine_get(kvengine_t *, char *key, char **value);
+int kvengine_get_expiring(kvengine_t *, char *key, char **value,
+    unsigned long *expires);
+int kvengine_put(kvengine_t *, char *key, char *value);
+int kvengine_put_expiring(kvengine_t *, char *key, char *value,
+    unsigned long expires);
+int kvengine_put_check(kvengine_t *, char *key, char *value);
+int kvengine_del(kvengine_t *, char *key);
+int kvengine_del_check(kvengine_t *, char *key);
+bool kvengine_haskey(kvengine_t *, char *key);
+
+int kvengine_get_versioned(kvengine_t *, char *key, char **value,
+    unsigned long *version);
+int kvengine_put_versioned(kvengine_t *, char *key, char *value,
+    unsigned long version);
+
+int kvengine_scan(kvengine_t *, unsigned long start, unsigned int max,
+    bool expired, kvstore_visit_t visit, void *aux, unsigned long *next);
+int kvengine_batch(kvengine_t *, kvstore_op_t *ops, unsigned int num_ops);
+int kvengine_update(kvengine_t *, char *key, kvstore_update_t update,
+    void *aux, char **value, unsigned long *expires);
+int kvengine_expire(kvengine_t *, char *key);
+
+int kvengine_sync(kvengine_t *);
+void kvengine_stats(kvengine_t *, unsigned long *num_entries,
+    unsigned long *memory);
+void kvengine_close(kvengine_t *);
+int kvengine_clean(kvengine_t *);
+
+#endif
@@ -0,0 +1,99 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvconstants.h"
+#include "kvflight.h"
+
+/* Initializes FLIGHT. Returns 0 if successful, else a negative error code. */
+int kvflight_init(kvflight_t *flight) {
+  flight->calls = NULL;
+  return pthread_mutex_init(&flight->lock, NULL);
+}
+
+/* Frees CALL, which must have finished and have no waiters left. */
+static void kvflight_free_call(struct kvflightcall *call) {
+  pthread_cond_destroy(&call->cond);
+  free(call->key);
+  free(call->value);
+  free(call);
+}
+
+/* Joins the load of KEY, which missed the cache under fill token TOKEN, in
+ * FLIGHT. If no load of KEY under TOKEN is in progress, the caller becomes
+ * its leader: the new call is returned, and must be passed to
+ * kvflight_finish once KEY has been loaded. Otherwise waits for the leader
+ * and returns NULL, with RET set to the result of the load and, if it is 0,
+ * VALUE set to a copy of the value loaded which should later be free()d and
+ * TTL (unless it is NULL) to the seconds the value has left. If the call
+ * cannot be allocated, returns NULL with RET set to ERRFILCRT. */
+struct kvflightcall *kvflight_join(kvflight_t *flight, char *key,
+    unsigned long token, int *ret, char **value, unsigned long *ttl) {
+  struct kvflightcall *call;
+
+  pthread_mutex_lock(&flight->lock);
+  HASH_FIND_STR(flight->calls, key, call);
+  if (call != NULL && call->token == token) {
+    call->waiters++;
+    while (!call->done)
+      pthread_cond_wait(&call->cond, &flight->lock);
+    *ret = call->ret;
+    if (call->ret == 0) {
+      *value = malloc(strlen(call->value) + 1);
+      if (*value != NULL)
+        strcpy(*value, call->value);
+      else
+        *ret = ERRFILCRT;
+      if (ttl != NULL)
+        *ttl = call->ttl;
+    }
+    if (--call->waiters == 0)
+      kvflight_free_call(call);
+    pthread_mutex_unlock(&flight->lock);
+    return NULL;
+  }
+
+  /* A call under an older token is left to finish for its own waiters. */
+  if (call != NULL)
+    HASH_DEL(flight->calls, call);
+  call = calloc(1, sizeof(struct kvflightcall));
+  if (call == NULL || (call->key = malloc(strlen(key) + 1)) == NULL) {
+    pthread_mutex_unlock(&flight->lock);
+    free(call);
+    *ret = ERRFILCRT;
+    return NULL;
+  }
+  strcpy(call->key, key);
+  call->token = token;
+  pthread_cond_init(&call->cond, NULL);
+  HASH_ADD_KEYPTR(hh, flight->calls, call->key, strlen(call->key), call);
+  pthread_mutex_unlock(&flight->lock);
+  return call;
+}
+
+/* Finishes CALL, which was returned by kvflight_join, with the result RET of
+ * loading its key and, if RET is 0, the VALUE loaded (which is copied) and the
+ * TTL it has left, and wakes any threads waiting for it. */
+void kvflight_finish(kvflight_t *flight, struct kvflightcall *call, int ret,
+    char *value, unsigned long ttl) {
+  struct kvflightcall *curr;
+
+  pthread_mutex_lock(&flight->lock);
+  HASH_FIND_STR(flight->calls, call->key, curr);
+  if (curr == call)
+    HASH_DEL(flight->calls, call);
+  call->ret = ret;
+  call->ttl = ttl;
+  if (ret == 0) {
+    call->value = malloc(strlen(value) + 1);
+    if (call->value != NULL)
+      strcpy(call->value, value);
+    else
+      call->ret = ERRFILCRT;
+  }
+  call->done = true;
+  if (call->waiters == 0)
+    kvflight_free_call(call);
+  else
+    pthread_cond_broadcast(&call->cond);
+  pthread_mutex_unlock(&flight->lock);
+}
@@ -0,0 +1,48 @@
+#ifndef __KV_FLIGHT__
+#define __KV_FLIGHT__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include "uthash.h"
+
+/* KVFlight coalesces concurrent loads of the same key ("single flight").
+ *
+ * A thread which misses its cache on a key joins a flight for that key
+ * before loading it. The first thread to join becomes the flight's leader:
+ * it loads the key and publishes the result with kvflight_finish. Threads
+ * which join while the load is in progress wait for that result instead of
+ * loading the key themselves.
+ *
+ * Each flight is tagged with the cache fill token (see kvcacheset_fill) its
+ * leader missed under. A thread whose token differs, because the key's cache
+ * set has been written to since, starts a new flight rather than waiting for
+ * a result which may predate that write.
+ */
+
+/* A load of a single key, in progress or finished. */
+struct kvflightcall {
+  char *key;                /* The key being loaded. */
+  unsigned long token;      /* The fill token the leader missed under. */
+  int ret;                  /* The result of the load, once DONE. */
+  char *value;              /* The value loaded, if RET is 0. */
+  unsigned long ttl;        /* The seconds VALUE has left before it expires, or 0. */
+  bool done;                /* Set once the leader has finished the load. */
+  unsigned int waiters;     /* The number of threads waiting for the result. */
+  pthread_cond_t cond;      /* Signalled when the load finishes. */
+  UT_hash_handle hh;        /* Make this struct hashable by KEY. */
+};
+
+/* A KVFlight. */
+typedef struct {
+  struct kvflightcall *calls; /* The loads in progress, by key. */
+  pthread_mutex_t lock;       /* A lock used to protect CALLS. */
+} kvflight_t;
+
+int kvflight_init(kvflight_t *);
+
+struct kvflightcall *kvflight_join(kvflight_t *, char *key,
+    unsigned long token, int *ret, char **value, unsigned long *ttl);
+void kvflight_finish(kvflight_t *, struct kvflightcall *call, int ret,
+    char *value, unsigned long ttl);
+
+#endif
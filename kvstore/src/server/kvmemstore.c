@@ -0,0 +1,337 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "kvconstants.h"
+#include "kvmemstore.h"
+
+/* Initializes STORE. Returns 0 if successful, else a negative error code. */
+int kvmemstore_init(kvmemstore_t *store) {
+  store->entries = NULL;
+  store->memory = 0;
+  return pthread_rwlock_init(&store->lock, NULL);
+}
+
+/* Returns the bytes of memory used by ENTRY. */
+static unsigned long kvmemstore_entry_memory(kvmementry_t *entry) {
+  return sizeof(kvmementry_t) + strlen(entry->key) + 1 +
+      ((entry->value != NULL) ? strlen(entry->value) + 1 : 0);
+}
+
+/* Removes ENTRY from STORE and frees it. Must be called with STORE's write
+ * lock held. */
+static void kvmemstore_remove(kvmemstore_t *store, kvmementry_t *entry) {
+  store->memory -= kvmemstore_entry_memory(entry);
+  HASH_DEL(store->entries, entry);
+  free(entry->key);
+  free(entry->value);
+  free(entry);
+}
+
+/* Frees every entry of STORE. */
+void kvmemstore_free(kvmemstore_t *store) {
+  kvmementry_t *entry, *tmp;
+  pthread_rwlock_wrlock(&store->lock);
+  HASH_ITER(hh, store->entries, entry, tmp) {
+    kvmemstore_remove(store, entry);
+  }
+  pthread_rwlock_unlock(&store->lock);
+}
+
+/* Attempts to retrieve the entry denoted by KEY from STORE. Returns 0 if
+ * successful, KVMMAP_TOMBSTONE if KEY was deleted by a versioned delete or
+ * has expired, else a negative error code, as for kvmmap_get. If VALUE is not
+ * NULL, the entry's value is placed into VALUE using malloc()d memory which
+ * should be free()d later, or set to NULL for a tombstone. If VERSION is not
+ * NULL, it is set to the version the entry was written at, and if EXPIRES is
+ * not NULL, to the time it expires at. */
+int kvmemstore_get(kvmemstore_t *store, char *key, char **value,
+    unsigned long *version, unsigned long *expires) {
+  kvmementry_t *entry;
+  int ret = 0;
+
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  pthread_rwlock_rdlock(&store->lock);
+  HASH_FIND_STR(store->entries, key, entry);
+  if (entry == NULL) {
+    ret = ERRNOKEY;
+  } else {
+    if (version != NULL)
+      *version = entry->version;
+    if (expires != NULL)
+      *expires = entry->expires;
+    if (entry->value == NULL || kvstore_expired(entry->expires)) {
+      ret = 1;
+      if (value != NULL)
+        *value = NULL;
+    } else if (value != NULL) {
+      if ((*value = malloc(strlen(entry->value) + 1)) == NULL)
+        ret = -ENOMEM;
+      else
+        strcpy(*value, entry->value);
+    }
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return ret;
+}
+
+/* Replaces the value of ENTRY, which is in STORE, with the malloc()d string
+ * VALUE (or NULL for a tombstone) at VERSION, to expire at EXPIRES. Must be
+ * called with STORE's write lock held. */
+static void kvmemstore_set(kvmemstore_t *store, kvmementry_t *entry,
+    char *value, unsigned long version, unsigned long expires) {
+  store->memory -= kvmemstore_entry_memory(entry);
+  free(entry->value);
+  entry->value = value;
+  entry->version = version;
+  entry->expires = expires;
+  store->memory += kvmemstore_entry_memory(entry);
+}
+
+/* Allocates a copy of STR into *COPY, unless STR is NULL. Returns 0 if
+ * successful, else -ENOMEM. */
+static int kvmemstore_copy(char *str, char **copy) {
+  *copy = NULL;
+  if (str == NULL)
+    return 0;
+  if ((*copy = malloc(strlen(str) + 1)) == NULL)
+    return -ENOMEM;
+  strcpy(*copy, str);
+  return 0;
+}
+
+/* Stores KEY with VALUE (or, if VALUE is NULL, a tombstone) at VERSION in
+ * STORE, to expire at EXPIRES (or never, if it is 0). If VERSIONED is set,
+ * the write is skipped if STORE already holds KEY at VERSION or a later one.
+ * Returns 0 if the write was applied, 1 if it was stale, else a negative
+ * error code. */
+int kvmemstore_put(kvmemstore_t *store, char *key, char *value,
+    unsigned long version, unsigned long expires, bool versioned) {
+  kvmementry_t *entry;
+  char *copy;
+  int ret = 0;
+
+  if (kvmemstore_copy(value, &copy) < 0)
+    return -ENOMEM;
+  pthread_rwlock_wrlock(&store->lock);
+  HASH_FIND_STR(store->entries, key, entry);
+  if (entry != NULL && versioned && entry->version >= version) {
+    free(copy);
+    ret = 1;
+  } else if (entry != NULL) {
+    kvmemstore_set(store, entry, copy, version, expires);
+  } else if ((entry = calloc(1, sizeof(kvmementry_t))) == NULL ||
+      kvmemstore_copy(key, &entry->key) < 0) {
+    free(entry);
+    free(copy);
+    ret = -ENOMEM;
+  } else {
+    entry->value = copy;
+    entry->version = version;
+    entry->expires = expires;
+    HASH_ADD_KEYPTR(hh, store->entries, entry->key, strlen(entry->key),
+        entry);
+    store->memory += kvmemstore_entry_memory(entry);
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return ret;
+}
+
+/* Removes the entry KEY from STORE. Returns 0 if successful, else a negative
+ * error code. An expired entry is removed, but reported as ERRNOKEY. */
+int kvmemstore_del(kvmemstore_t *store, char *key) {
+  kvmementry_t *entry;
+  int ret = 0;
+
+  pthread_rwlock_wrlock(&store->lock);
+  HASH_FIND_STR(store->entries, key, entry);
+  if (entry == NULL || entry->value == NULL) {
+    ret = ERRNOKEY;
+  } else {
+    if (kvstore_expired(entry->expires))
+      ret = ERRNOKEY;
+    kvmemstore_remove(store, entry);
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return ret;
+}
+
+/* Removes the entry KEY from STORE as kvstore_expire does. */
+int kvmemstore_expire(kvmemstore_t *store, char *key) {
+  kvmementry_t *entry;
+  int ret = ERRNOKEY;
+
+  pthread_rwlock_wrlock(&store->lock);
+  HASH_FIND_STR(store->entries, key, entry);
+  if (entry != NULL && entry->value != NULL &&
+      kvstore_expired(entry->expires)) {
+    kvmemstore_remove(store, entry);
+    ret = 0;
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return ret;
+}
+
+/* Applies the NUM_OPS writes OPS to STORE in order, as unversioned PUTs and
+ * DELs, under one lock so that no reader sees part of them. A DEL of a key
+ * which is absent does nothing. Everything the batch needs is allocated
+ * before it is applied, so it is applied either entirely or not at all.
+ * Returns 0 if successful, else a negative error code. */
+int kvmemstore_batch(kvmemstore_t *store, kvstore_op_t *ops,
+    unsigned int num_ops) {
+  kvmementry_t *fresh[num_ops], *entry;
+  char *values[num_ops];
+  unsigned int i;
+  int ret = 0;
+
+  for (i = 0; i < num_ops; i++) {
+    fresh[i] = NULL;
+    values[i] = NULL;
+  }
+  for (i = 0; ret == 0 && i < num_ops; i++) {
+    if (ops[i].value == NULL)
+      continue;
+    if (kvmemstore_copy(ops[i].value, &values[i]) < 0 ||
+        (fresh[i] = calloc(1, sizeof(kvmementry_t))) == NULL ||
+        kvmemstore_copy(ops[i].key, &fresh[i]->key) < 0)
+      ret = -ENOMEM;
+  }
+  if (ret < 0) {
+    for (i = 0; i < num_ops; i++) {
+      free(values[i]);
+      if (fresh[i] != NULL)
+        free(fresh[i]->key);
+      free(fresh[i]);
+    }
+    return ret;
+  }
+
+  pthread_rwlock_wrlock(&store->lock);
+  for (i = 0; i < num_ops; i++) {
+    HASH_FIND_STR(store->entries, ops[i].key, entry);
+    if (ops[i].value == NULL) {
+      if (entry != NULL)
+        kvmemstore_remove(store, entry);
+    } else if (entry != NULL) {
+      kvmemstore_set(store, entry, values[i], 0, ops[i].expires);
+    } else {
+      entry = fresh[i];
+      entry->value = values[i];
+      entry->expires = ops[i].expires;
+      HASH_ADD_KEYPTR(hh, store->entries, entry->key, strlen(entry->key),
+          entry);
+      store->memory += kvmemstore_entry_memory(entry);
+      fresh[i] = NULL;
+    }
+  }
+  pthread_rwlock_unlock(&store->lock);
+  for (i = 0; i < num_ops; i++) {
+    if (fresh[i] != NULL)
+      free(fresh[i]->key);
+    free(fresh[i]);
+  }
+  return 0;
+}
+
+/* Replaces the value of KEY in STORE as kvstore_update does, holding STORE's
+ * write lock for the whole read-modify-write. The entry keeps its own copy of
+ * the new value. */
+int kvmemstore_update(kvmemstore_t *store, char *key, kvstore_update_t update,
+    void *aux, char **value, unsigned long *expires) {
+  kvmementry_t *entry, *fresh = NULL;
+  char *current = NULL, *newvalue = NULL, *copy = NULL;
+  unsigned long keep = 0;
+  int ret;
+
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  pthread_rwlock_wrlock(&store->lock);
+  HASH_FIND_STR(store->entries, key, entry);
+  if (entry != NULL && !kvstore_expired(entry->expires)) {
+    current = entry->value;
+    keep = entry->expires;
+  }
+  ret = update(current, aux, &newvalue);
+  if (ret == 0 && strlen(newvalue) > MAX_VALLEN)
+    ret = ERRVALLEN;
+  else if (ret == 0 && (kvmemstore_copy(newvalue, &copy) < 0 ||
+      (entry == NULL && ((fresh = calloc(1, sizeof(kvmementry_t))) == NULL ||
+      kvmemstore_copy(key, &fresh->key) < 0))))
+    ret = -ENOMEM;
+  if (ret == 0 && entry != NULL) {
+    kvmemstore_set(store, entry, copy, 0, keep);
+  } else if (ret == 0) {
+    fresh->value = copy;
+    HASH_ADD_KEYPTR(hh, store->entries, fresh->key, strlen(fresh->key),
+        fresh);
+    store->memory += kvmemstore_entry_memory(fresh);
+  }
+  pthread_rwlock_unlock(&store->lock);
+  if (ret < 0) {
+    free(copy);
+    if (fresh != NULL)
+      free(fresh->key);
+    free(fresh);
+    free(newvalue);
+    return ret;
+  }
+  *value = newvalue;
+  if (expires != NULL)
+    *expires = keep;
+  return 0;
+}
+
+/* Orders two entries by the hash of their keys, for qsort. */
+static int kvmemstore_compare(const void *a, const void *b) {
+  unsigned long x = hash((*(kvmementry_t * const *) a)->key),
+                y = hash((*(kvmementry_t * const *) b)->key);
+  return (x > y) - (x < y);
+}
+
+/* Visits the entries of STORE as kvstore_scan does for a store, treating the
+ * entries which share a hash as a hash chain. */
+int kvmemstore_scan(kvmemstore_t *store, unsigned long start,
+    unsigned int max, bool expired, kvstore_visit_t visit, void *aux,
+    unsigned long *next) {
+  kvmementry_t **sorted, *entry;
+  unsigned int num = 0, i, visited = 0;
+  unsigned long hashval = 0;
+
+  *next = 0;
+  pthread_rwlock_rdlock(&store->lock);
+  sorted = malloc((HASH_COUNT(store->entries) + 1) * sizeof(kvmementry_t *));
+  if (sorted == NULL) {
+    pthread_rwlock_unlock(&store->lock);
+    return -ENOMEM;
+  }
+  for (entry = store->entries; entry != NULL; entry = entry->hh.next)
+    if (hash(entry->key) >= start)
+      sorted[num++] = entry;
+  qsort(sorted, num, sizeof(kvmementry_t *), kvmemstore_compare);
+  for (i = 0; i < num; i++) {
+    if (visited == 0 || hash(sorted[i]->key) != hashval) {
+      if (visited == max)
+        break;
+      hashval = hash(sorted[i]->key);
+      visited++;
+    }
+    if (sorted[i]->value != NULL &&
+        (expired || !kvstore_expired(sorted[i]->expires)))
+      visit(sorted[i]->key, sorted[i]->value, sorted[i]->expires, aux);
+  }
+  if (visited > 0)
+    *next = hashval + 1;
+  free(sorted);
+  pthread_rwlock_unlock(&store->lock);
+  return visited;
+}
+
+/* Sets *NUM_ENTRIES to the number of entries in STORE, counting tombstones,
+ * and *MEMORY to the bytes of memory they use. */
+void kvmemstore_stats(kvmemstore_t *store, unsigned long *num_entries,
+    unsigned long *memory) {
+  pthread_rwlock_rdlock(&store->lock);
+  *num_entries = HASH_COUNT(store->entries);
+  *memory = store->memory;
+  pthread_rwlock_unlock(&store->lock);
+}
@@ -0,0 +1,54 @@
+#ifndef __KV_MEMSTORE__
+#define __KV_MEMSTORE__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include "kvstore.h"
+#include "uthash.h"
+
+/* KVMemstore is a storage engine which keeps every entry in memory and
+ * nothing on disk, for cache-tier servers which need no persistence. Its
+ * entries are lost when the process exits.
+ *
+ * Like a KVStore, it records the version each entry was written at, and a
+ * versioned delete leaves a tombstone (an entry whose value is NULL) which
+ * is treated as absent by all but the versioned functions, as is an entry
+ * which has expired until it is removed. A batch of
+ * writes is applied under a single lock, so readers see all of it or none.
+ */
+
+/* A single entry of a KVMemstore. */
+typedef struct kvmementry {
+  char *key;                /* The entry's key. */
+  char *value;              /* The entry's value, or NULL for a tombstone. */
+  unsigned long version;    /* The version the entry was written at. */
+  unsigned long expires;    /* The time the entry expires at, or 0. */
+  UT_hash_handle hh;        /* Make this struct hashable by KEY. */
+} kvmementry_t;
+
+/* A KVMemstore. */
+typedef struct {
+  kvmementry_t *entries;    /* The entries, by key. */
+  unsigned long memory;     /* The bytes of memory used by ENTRIES. */
+  pthread_rwlock_t lock;    /* Protects ENTRIES and MEMORY. */
+} kvmemstore_t;
+
+int kvmemstore_init(kvmemstore_t *);
+void kvmemstore_free(kvmemstore_t *);
+
+int kvmemstore_get(kvmemstore_t *, char *key, char **value,
+    unsigned long *version, unsigned long *expires);
+int kvmemstore_put(kvmemstore_t *, char *key, char *value,
+    unsigned long version, unsigned long expires, bool versioned);
+int kvmemstore_del(kvmemstore_t *, char *key);
+int kvmemstore_expire(kvmemstore_t *, char *key);
+int kvmemstore_batch(kvmemstore_t *, kvstore_op_t *ops, unsigned int num_ops);
+int kvmemstore_update(kvmemstore_t *, char *key, kvstore_update_t update,
+    void *aux, char **value, unsigned long *expires);
+
+int kvmemstore_scan(kvmemstore_t *, unsigned long start, unsigned int max,
+    bool expired, kvstore_visit_t visit, void *aux, unsigned long *next);
+void kvmemstore_stats(kvmemstore_t *, unsigned long *num_entries,
+    unsigned long *memory);
+
+#endif
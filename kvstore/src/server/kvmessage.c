@@ -1,63 +1,62 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
 #include <json-c/json.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <string.h>
 #include "kvmessage.h"
 
-/* Receives and returns a message from socket SOCKFD.
- * Returns NULL if there is an error. */
-kvmessage_t *kvmessage_parse(int sockfd) {
-  json_object *new_obj;
-  kvmessage_t *msg = (kvmessage_t *) calloc(1, sizeof(kvmessage_t));
-  int size;
-
-  /* First read the size of the incoming message */
-  if (read(sockfd, &size, 4) < 4) {
+/* Copies the string held by field NAME of JSON into memory allocated from
+ * ARENA (see kvarena_strdup). Returns NULL if JSON has no such field. */
+static char *kvmessage_json_string(json_object *json, const char *name,
+    kvarena_t *arena) {
+  json_object *value_obj;
+  if (!json_object_object_get_ex(json, name, &value_obj))
     return NULL;
-  }
-  /* Then create the buffer and read in the data */
-  size = ntohl(size);
-  char buffer[size];
-  if (read(sockfd, buffer, size) < size) {
-    return NULL;
-  }
+  return kvarena_strdup(arena, json_object_get_string(value_obj));
+}
 
+/* Populates MSG with whichever fields are present in JSON, including any
+ * nested batch operations, allocating them from ARENA. An "ops" field which
+ * is not an array is ignored, leaving MSG without operations. */
+static void kvmessage_from_json(kvmessage_t *msg, json_object *json,
+    kvarena_t *arena) {
   struct json_object *value_obj;
-  new_obj = json_tokener_parse(buffer);
-  if (json_object_object_get_ex(new_obj, "type", &value_obj)) {
+  unsigned int i;
+  msg->arena = arena;
+  if (json_object_object_get_ex(json, "type", &value_obj)) {
     int type = json_object_get_int(value_obj);
     msg->type = type;
   }
-
-  if (json_object_object_get_ex(new_obj, "key", &value_obj)) {
-    const char *key = json_object_get_string(value_obj);
-    char *key_buf = calloc(1, strlen(key) + 1);
-    memcpy(key_buf, key, strlen(key) + 1);
-    msg->key = key_buf;
+  msg->key = kvmessage_json_string(json, "key", arena);
+  msg->value = kvmessage_json_string(json, "value", arena);
+  msg->message = kvmessage_json_string(json, "message", arena);
+  msg->expected = kvmessage_json_string(json, "expected", arena);
+  if (json_object_object_get_ex(json, "txid", &value_obj))
+    msg->txid = json_object_get_int64(value_obj);
+  if (json_object_object_get_ex(json, "version", &value_obj))
+    msg->version = json_object_get_int64(value_obj);
+  if (json_object_object_get_ex(json, "ttl", &value_obj))
+    msg->ttl = json_object_get_int64(value_obj);
+  if (json_object_object_get_ex(json, "ops", &value_obj) &&
+      json_object_is_type(value_obj, json_type_array)) {
+    msg->num_ops = json_object_array_length(value_obj);
+    msg->ops = kvarena_calloc(arena, msg->num_ops, sizeof(kvmessage_t));
+    for (i = 0; i < msg->num_ops; i++)
+      kvmessage_from_json(&msg->ops[i],
+          json_object_array_get_idx(value_obj, i), arena);
   }
-  if (json_object_object_get_ex(new_obj, "value", &value_obj)) {
-    const char *value = json_object_get_string(value_obj);
-    char *value_buf = calloc(1, strlen(value) + 1);
-    memcpy(value_buf, value, strlen(value) + 1);
-    msg->value = value_buf;
-  }
-  if (json_object_object_get_ex(new_obj, "message", &value_obj)) {
-    const char *message = json_object_get_string(value_obj);
-    char *message_buf = calloc(1, strlen(message) + 1);
-    memcpy(message_buf, message, strlen(message) + 1);
-    msg->message = message_buf;
-  }
-  json_object_put(new_obj);
-  return msg;
 }
 
-/* Sends MESSAGE on socket SOCKFD. Includes whichever fields are
- * non-null in the message. Returns the number of bytes which were sent. */
-int kvmessage_send(kvmessage_t *message, int sockfd) {
-  int sent = 0;
-  json_object *json = json_object_new_object();
+/* Builds the JSON representation of MESSAGE, including whichever fields are
+ * non-null and any nested batch operations. */
+static json_object *kvmessage_to_json(kvmessage_t *message) {
+  json_object *ops, *json = json_object_new_object();
+  unsigned int i;
   json_object_object_add(json, "type", json_object_new_int(message->type));
   if (message->key) {
     json_object_object_add(json, "key", json_object_new_string(message->key));
@@ -70,23 +69,197 @@ int kvmessage_send(kvmessage_t *message, int sockfd) {
     json_object_object_add(json, "message",
         json_object_new_string(message->message));
   }
+  if (message->expected) {
+    json_object_object_add(json, "expected",
+        json_object_new_string(message->expected));
+  }
+  if (message->txid) {
+    json_object_object_add(json, "txid",
+        json_object_new_int64(message->txid));
+  }
+  if (message->ttl) {
+    json_object_object_add(json, "ttl",
+        json_object_new_int64(message->ttl));
+  }
+  if (message->version) {
+    json_object_object_add(json, "version",
+        json_object_new_int64(message->version));
+  }
+  if (message->ops) {
+    ops = json_object_new_array();
+    for (i = 0; i < message->num_ops; i++)
+      json_object_array_add(ops, kvmessage_to_json(&message->ops[i]));
+    json_object_object_add(json, "ops", ops);
+  }
+  return json;
+}
+
+/* Reads exactly LEN bytes from SOCKFD into BUF, however many reads they
+ * arrive in. Returns 0 if successful, or -1 if the socket is closed or fails
+ * first. */
+static int kvmessage_read_full(int sockfd, void *buf, size_t len) {
+  size_t received;
+  ssize_t ret;
+  for (received = 0; received < len; received += ret) {
+    ret = read(sockfd, (char *) buf + received, len - received);
+    if (ret == -1 && errno == EINTR) {
+      ret = 0;
+    } else if (ret <= 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Returns the message whose JSON representation is the SIZE bytes of BODY,
+ * allocated from ARENA, or using malloc() if ARENA is NULL (in which case it
+ * should be freed using kvmessage_free). BODY[SIZE] must be writable, as
+ * the JSON is terminated there while it is parsed; its byte is restored
+ * afterwards. Returns NULL if there is not enough memory. */
+kvmessage_t *kvmessage_decode(char *body, unsigned int size,
+    kvarena_t *arena) {
+  kvmessage_t *msg = kvarena_calloc(arena, 1, sizeof(kvmessage_t));
+  json_object *new_obj;
+  char saved = body[size];
+
+  if (msg == NULL)
+    return NULL;
+  body[size] = '\0';
+  new_obj = json_tokener_parse(body);
+  body[size] = saved;
+  kvmessage_from_json(msg, new_obj, arena);
+  json_object_put(new_obj);
+  return msg;
+}
+
+/* Receives and returns a message from socket SOCKFD, reading exactly its
+ * frame and nothing after it. Returns NULL if there is an error. */
+kvmessage_t *kvmessage_parse(int sockfd) {
+  kvmessage_t *msg;
+  uint32_t size;
+  char *body;
+
+  /* First read the size of the incoming message, then the message itself,
+   * either of which may arrive in several pieces. */
+  if (kvmessage_read_full(sockfd, &size, 4) < 0)
+    return NULL;
+  size = ntohl(size);
+  if (size > KVMESSAGE_MAX_SIZE || (body = malloc(size + 1)) == NULL)
+    return NULL;
+  if (kvmessage_read_full(sockfd, body, size) < 0) {
+    free(body);
+    return NULL;
+  }
+  msg = kvmessage_decode(body, size, NULL);
+  free(body);
+  return msg;
+}
+
+/* Writes the IOVCNT buffers of IOV to SOCKFD, resuming after any short write
+ * until every byte has been sent. IOV is advanced past what was sent, so its
+ * contents are undefined afterwards. Returns the number of bytes which were
+ * sent, or -1 if the socket fails first. */
+long kvmessage_writev(int sockfd, struct iovec *iov, int iovcnt) {
+  struct msghdr msghdr;
+  long sent = 0;
+  ssize_t ret;
+
+  memset(&msghdr, 0, sizeof(msghdr));
+  while (iovcnt > 0) {
+    if (iov->iov_len == 0) {
+      iov++;
+      iovcnt--;
+      continue;
+    }
+    msghdr.msg_iov = iov;
+    msghdr.msg_iovlen = iovcnt;
+    /* MSG_NOSIGNAL: a peer which has gone away must not raise SIGPIPE. */
+    ret = sendmsg(sockfd, &msghdr, MSG_NOSIGNAL);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return -1;
+    sent += ret;
+    while (iovcnt > 0 && (size_t) ret >= iov->iov_len) {
+      ret -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+  return sent;
+}
+
+/* Returns the frame of MESSAGE, its size followed by its JSON representation
+ * as kvmessage_send sends it, placing its length into *SIZE. The frame uses
+ * malloc()d memory which should be free()d later. Returns NULL if there is
+ * not enough memory. */
+char *kvmessage_encode(kvmessage_t *message, unsigned int *size) {
+  json_object *json = kvmessage_to_json(message);
+  const char *json_string = json_object_to_json_string(json);
+  uint32_t len = strlen(json_string), header = htonl(len);
+  char *frame = malloc(4 + len);
+
+  if (frame != NULL) {
+    memcpy(frame, &header, 4);
+    memcpy(frame + 4, json_string, len);
+    *size = 4 + len;
+  }
+  json_object_put(json);
+  return frame;
+}
+
+/* Sends MESSAGE on socket SOCKFD. Includes whichever fields are
+ * non-null in the message. The size and the JSON go out in a single write,
+ * so that a small message is never split across packets. Returns the number
+ * of bytes which were sent, or -1 if there is an error. */
+int kvmessage_send(kvmessage_t *message, int sockfd) {
+  json_object *json = kvmessage_to_json(message);
   const char *json_string = json_object_to_json_string(json);
-  int size = htonl(strlen(json_string));
-  sent += write(sockfd, &size, 4);
-  sent += write(sockfd, json_string, strlen(json_string));
+  uint32_t len = strlen(json_string), header = htonl(len);
+  struct iovec iov[2];
+  long sent;
+
+  iov[0].iov_base = &header;
+  iov[0].iov_len = 4;
+  iov[1].iov_base = (char *) json_string;
+  iov[1].iov_len = len;
+  sent = kvmessage_writev(sockfd, iov, 2);
   json_object_put(json);
   return sent;
 }
 
-/* Frees the memory for MESSAGE. Assumes that the message itself and all
- * fields were allocated using malloc/calloc (which will be the case for a
- * message created using kvmessage_parse). */
-void kvmessage_free(kvmessage_t *message) {
+/* Frees the fields of MESSAGE (but not MESSAGE itself), including any nested
+ * batch operations. Does nothing if MESSAGE was allocated in an arena. */
+void kvmessage_free_fields(kvmessage_t *message) {
+  unsigned int i;
+  if (message->arena != NULL)
+    return;
   if (message->key)
     free(message->key);
   if (message->value)
     free(message->value);
   if (message->message)
     free(message->message);
+  if (message->expected)
+    free(message->expected);
+  if (message->ops) {
+    for (i = 0; i < message->num_ops; i++)
+      kvmessage_free_fields(&message->ops[i]);
+    free(message->ops);
+  }
+}
+
+/* Frees the memory for MESSAGE. Assumes that the message itself and all
+ * fields were allocated using malloc/calloc (which will be the case for a
+ * message created using kvmessage_parse), or all in an arena, in which case
+ * nothing is freed. */
+void kvmessage_free(kvmessage_t *message) {
+  if (message->arena != NULL)
+    return;
+  kvmessage_free_fields(message);
   free(message);
 }
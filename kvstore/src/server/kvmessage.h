@@ -1,6 +1,8 @@
 #ifndef __KV_MESSAGE__
 #define __KV_MESSAGE__
 
+#include <sys/uio.h>
+#include "kvarena.h"
 #include "kvconstants.h"
 
 /* KVMessage is used to send messages across sockets.
@@ -12,19 +14,75 @@
  * kvmessage_parse reads the first four bytes of the message, uses this to determine
  * the size of the remainder of the message, then parses the remainder of the message
  * as JSON and populates whichever fields of the message are present in the incoming JSON.
+ *
+ * Both carry on across short reads and writes, and kvmessage_send writes the
+ * size and the JSON together in one writev. A message larger than
+ * KVMESSAGE_MAX_SIZE is refused. To read several messages from a connection
+ * or batch several responses into one write, use a KVConn (see kvconn.h).
+ *
+ * A message decoded into an arena (see kvarena.h) has it and all of its
+ * fields allocated there, and is freed along with the arena;
+ * kvmessage_free does nothing for it.
+ *
+ * A BATCHREQ message carries several PUTREQ and DELREQ operations, which are
+ * sent as a JSON array "ops" of nested messages.
+ *
+ * TPC messages between a master and its slaves carry the id of the
+ * transaction they belong to, so that a slave can have several transactions
+ * prepared at once. The id is only sent when it is nonzero; id 0 is the
+ * default transaction used by requests which do not carry one.
+ *
+ * A master running in quorum mode (see tpcmaster.h) stamps the PUTREQs and
+ * DELREQs it sends to slaves with the version they write, and sets a nonzero
+ * version on its GETREQs to ask for the version of the stored value, which
+ * the slave returns in the same field. The version is only sent when it is
+ * nonzero.
+ *
+ * A SCANREQ asks a slave for the entries of its store whose keys hash to at
+ * least VERSION, taking the hash chains of at most VALUE (a decimal string)
+ * hashes. The slave answers with the entries as PUTREQs in OPS and sets
+ * VERSION to the hash from which to continue, or to 0 once its whole store
+ * has been scanned.
+ *
+ * A CASREQ stores VALUE under KEY only if the value stored there is
+ * EXPECTED, or, if EXPECTED is absent, only if KEY is absent. An INCRREQ or
+ * DECRREQ adds to or subtracts from the decimal integer stored under KEY
+ * (taken to be 0 if KEY is absent) the decimal delta in VALUE, or 1 if VALUE
+ * is absent, and is answered with a GETRESP holding the new value.
+ *
+ * A PUTREQ (alone or within a BATCHREQ) may carry a TTL, the number of
+ * seconds after which the key expires and is removed. A GETRESP for a key
+ * which expires carries the seconds it has left, rounded up, in the same
+ * field. The TTL is only sent when it is nonzero.
  */
 
-typedef struct {
+/* The largest JSON representation of a message which will be read. */
+#define KVMESSAGE_MAX_SIZE (64 << 20)
+
+typedef struct kvmessage {
   msgtype_t type;    /* The type of this message. */
   char *key;         /* The key this message stores. May be NULL, depending on type. */
   char *value;       /* The value this message stores. May be NULL, depending on type. */
   char *message;     /* The message this message stores. May be NULL, depending on type. */
+  char *expected;    /* The value a CASREQ expects to replace, or NULL if it expects no value. */
+  unsigned long txid;     /* The TPC transaction this message belongs to, or 0. */
+  unsigned long version;  /* The version of the value written or read (quorum mode), or 0. */
+  unsigned long ttl;      /* The seconds until the value written or read expires, or 0 if never. */
+  unsigned int num_ops;   /* The number of operations in OPS (BATCHREQ and SCANREQ responses only). */
+  struct kvmessage *ops;  /* An array of the operations in this batch (BATCHREQ and SCANREQ responses only). */
+  kvarena_t *arena;       /* The arena this message and its fields are allocated in, or NULL if they are malloc()d. */
 } kvmessage_t;
 
 kvmessage_t *kvmessage_parse(int sockfd);
 
 int kvmessage_send(kvmessage_t *, int sockfd);
 
+kvmessage_t *kvmessage_decode(char *body, unsigned int size,
+    kvarena_t *arena);
+char *kvmessage_encode(kvmessage_t *, unsigned int *size);
+long kvmessage_writev(int sockfd, struct iovec *iov, int iovcnt);
+
 void kvmessage_free(kvmessage_t *);
+void kvmessage_free_fields(kvmessage_t *);
 
 #endif
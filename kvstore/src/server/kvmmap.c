@@ -0,0 +1,544 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kvmmap.h"
+
+#define KVMMAP_MAGIC 0x6b766d6d61703032UL
+
+/* Returns the size of a file holding NUM_SLOTS slots and OVERFLOW_SIZE bytes
+ * of overflow. */
+static size_t kvmmap_file_size(unsigned long num_slots,
+    unsigned long overflow_size) {
+  return sizeof(kvmmap_header_t) + num_slots * sizeof(kvmmap_slot_t) +
+      overflow_size;
+}
+
+/* Maps the file FILENAME into MAP, creating it with NUM_SLOTS slots and
+ * OVERFLOW_SIZE bytes of overflow if it does not exist. Returns 0 if
+ * successful, else a negative error code. */
+static int kvmmap_open(kvmmap_t *map, char *filename, unsigned long num_slots,
+    unsigned long overflow_size) {
+  struct stat st;
+  bool created;
+  char *addr;
+  int fd;
+
+  if ((fd = open(filename, O_RDWR | O_CREAT, 0600)) < 0)
+    return ERRFILACCESS;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return ERRFILACCESS;
+  }
+  created = (st.st_size == 0);
+  if (created) {
+    st.st_size = kvmmap_file_size(num_slots, overflow_size);
+    if (ftruncate(fd, st.st_size) == -1) {
+      close(fd);
+      return ERRFILACCESS;
+    }
+  } else if (st.st_size < (off_t) sizeof(kvmmap_header_t)) {
+    close(fd);
+    return ERRFILACCESS;
+  }
+  addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return ERRFILACCESS;
+  map->map = addr;
+  map->size = st.st_size;
+  map->header = (kvmmap_header_t *) addr;
+  if (created) {
+    /* A new file reads as zeroes, so every slot starts out KVMMAP_EMPTY. */
+    map->header->magic = KVMMAP_MAGIC;
+    map->header->num_slots = num_slots;
+    map->header->overflow_size = overflow_size;
+  } else if (map->header->magic != KVMMAP_MAGIC || map->size !=
+      kvmmap_file_size(map->header->num_slots, map->header->overflow_size)) {
+    munmap(addr, st.st_size);
+    return ERRFILACCESS;
+  }
+  map->slots = (kvmmap_slot_t *) (addr + sizeof(kvmmap_header_t));
+  map->overflow = (char *) (map->slots + map->header->num_slots);
+  return 0;
+}
+
+/* Initializes MAP, mapping the file FILENAME and creating it if necessary.
+ * Returns 0 if successful, else a negative error code. */
+int kvmmap_init(kvmmap_t *map, char *filename) {
+  strcpy(map->filename, filename);
+  map->map = NULL;
+  pthread_rwlock_init(&map->lock, NULL);
+  return kvmmap_open(map, filename, KVMMAP_SLOTS, KVMMAP_OVERFLOW);
+}
+
+/* Unmaps MAP's file, leaving it on disk. */
+void kvmmap_close(kvmmap_t *map) {
+  if (map->map != NULL)
+    munmap(map->map, map->size);
+  map->map = NULL;
+}
+
+/* Writes MAP's file through to the disk. Returns 0 if successful, else a
+ * negative error code. */
+int kvmmap_sync(kvmmap_t *map) {
+  int ret = 0;
+  pthread_rwlock_rdlock(&map->lock);
+  if (map->map == NULL || msync(map->map, map->size, MS_SYNC) == -1)
+    ret = ERRFILACCESS;
+  pthread_rwlock_unlock(&map->lock);
+  return ret;
+}
+
+/* Sets *NUM_ENTRIES to the number of entries in MAP, counting tombstones,
+ * and *MEMORY to the size of its mapping. */
+void kvmmap_stats(kvmmap_t *map, unsigned long *num_entries,
+    unsigned long *memory) {
+  pthread_rwlock_rdlock(&map->lock);
+  *num_entries = (map->map != NULL) ? map->header->num_used : 0;
+  *memory = (map->map != NULL) ? map->size : 0;
+  pthread_rwlock_unlock(&map->lock);
+}
+
+/* Returns the slot at which the probe sequence of HASHVAL starts in MAP.
+ * djb2 is weak in its low bits, so the hash is mixed first. */
+static unsigned long kvmmap_home(kvmmap_t *map, unsigned long hashval) {
+  hashval ^= hashval >> 31;
+  hashval *= 0x9e3779b97f4a7c15UL;
+  return (hashval ^ (hashval >> 29)) & (map->header->num_slots - 1);
+}
+
+/* Returns the data of SLOT in MAP. */
+static char *kvmmap_data(kvmmap_t *map, kvmmap_slot_t *slot) {
+  if (slot->length <= KVMMAP_INLINE)
+    return slot->data;
+  return map->overflow + slot->overflow;
+}
+
+/* Returns the slot of MAP holding KEY, whose hash is HASHVAL, or NULL if
+ * there is none. If HOLE is not NULL, it is set to the first slot at which
+ * KEY could be inserted. Must be called with MAP's lock held. */
+static kvmmap_slot_t *kvmmap_find(kvmmap_t *map, char *key,
+    unsigned long hashval, kvmmap_slot_t **hole) {
+  unsigned long mask = map->header->num_slots - 1, i, n;
+  kvmmap_slot_t *slot;
+
+  if (hole != NULL)
+    *hole = NULL;
+  for (i = kvmmap_home(map, hashval), n = 0; n <= mask;
+      i = (i + 1) & mask, n++) {
+    slot = &map->slots[i];
+    if (slot->state == KVMMAP_EMPTY) {
+      if (hole != NULL && *hole == NULL)
+        *hole = slot;
+      return NULL;
+    }
+    if (slot->state == KVMMAP_DELETED) {
+      if (hole != NULL && *hole == NULL)
+        *hole = slot;
+    } else if (slot->hashval == hashval &&
+        strcmp(kvmmap_data(map, slot), key) == 0) {
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+/* Copies the entry KEY, VALUE (or a tombstone if VALUE is NULL), whose hash
+ * is HASHVAL, into SLOT of MAP at VERSION, to expire at EXPIRES, reusing the
+ * overflow data of the entry SLOT holds if it is long enough. Returns 0 if
+ * successful, or 1 if the overflow area lacks room for it. */
+static int kvmmap_fill(kvmmap_t *map, kvmmap_slot_t *slot,
+    unsigned long hashval, char *key, char *value, unsigned long version,
+    unsigned long expires) {
+  size_t keylen = strlen(key) + 1, vallen = (value != NULL) ?
+      strlen(value) + 1 : 0;
+  kvmmap_header_t *header = map->header;
+  char *data = slot->data;
+
+  /* An entry's old overflow data, which nothing else refers to, is
+   * overwritten if the new data fits within it. */
+  if (keylen + vallen > KVMMAP_INLINE && slot->length >= keylen + vallen &&
+      (slot->state == KVMMAP_FULL || slot->state == KVMMAP_DEAD)) {
+    data = map->overflow + slot->overflow;
+  } else if (keylen + vallen > KVMMAP_INLINE) {
+    if (header->overflow_used + keylen + vallen > header->overflow_size)
+      return 1;
+    slot->overflow = header->overflow_used;
+    header->overflow_used += keylen + vallen;
+    data = map->overflow + slot->overflow;
+  }
+  memcpy(data, key, keylen);
+  if (value != NULL)
+    memcpy(data + keylen, value, vallen);
+  slot->hashval = hashval;
+  slot->version = version;
+  slot->expires = expires;
+  slot->length = keylen + vallen;
+  slot->state = (value != NULL) ? KVMMAP_FULL : KVMMAP_DEAD;
+  return 0;
+}
+
+/* Rebuilds MAP's file with NUM_SLOTS slots and OVERFLOW_SIZE bytes of
+ * overflow, copying over its entries and dropping the space of deleted ones,
+ * then renames it over the old file. Must be called with MAP's write lock
+ * held. Returns 0 if successful, else a negative error code, in which case
+ * MAP is unchanged. */
+static int kvmmap_rebuild(kvmmap_t *map, unsigned long num_slots,
+    unsigned long overflow_size) {
+  char tmpname[MAX_FILENAME];
+  kvmmap_slot_t *slot, *hole;
+  kvmmap_t grown;
+  unsigned long i;
+  char *data;
+  int ret;
+
+  sprintf(tmpname, "%s.tmp", map->filename);
+  remove(tmpname);
+  if ((ret = kvmmap_open(&grown, tmpname, num_slots, overflow_size)) < 0)
+    return ret;
+  for (i = 0; i < map->header->num_slots; i++) {
+    slot = &map->slots[i];
+    if (slot->state != KVMMAP_FULL && slot->state != KVMMAP_DEAD)
+      continue;
+    data = kvmmap_data(map, slot);
+    kvmmap_find(&grown, data, slot->hashval, &hole);
+    kvmmap_fill(&grown, hole, slot->hashval, data,
+        (slot->state == KVMMAP_FULL) ? data + strlen(data) + 1 : NULL,
+        slot->version, slot->expires);
+    grown.header->num_used++;
+  }
+  if (msync(grown.map, grown.size, MS_SYNC) == -1 ||
+      rename(tmpname, map->filename) == -1) {
+    kvmmap_close(&grown);
+    remove(tmpname);
+    return ERRFILACCESS;
+  }
+  kvmmap_close(map);
+  map->map = grown.map;
+  map->size = grown.size;
+  map->header = grown.header;
+  map->slots = grown.slots;
+  map->overflow = grown.overflow;
+  return 0;
+}
+
+/* Attempts to retrieve the entry denoted by KEY from MAP. Returns 0 if
+ * successful, KVMMAP_TOMBSTONE if KEY was deleted by a versioned delete or
+ * has expired, else a negative error code. If VALUE is not NULL, the entry's
+ * value will be placed into VALUE using malloc()d memory which should be
+ * free()d later, or set to NULL for a tombstone. If VERSION is not NULL, it
+ * is set to the version the entry was written at, and if EXPIRES is not NULL,
+ * to the time it expires at. */
+int kvmmap_get(kvmmap_t *map, char *key, char **value,
+    unsigned long *version, unsigned long *expires) {
+  kvmmap_slot_t *slot;
+  char *data;
+  int ret = 0;
+
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  pthread_rwlock_rdlock(&map->lock);
+  if (map->map == NULL) {
+    pthread_rwlock_unlock(&map->lock);
+    return ERRFILACCESS;
+  }
+  slot = kvmmap_find(map, key, hash(key), NULL);
+  if (slot == NULL) {
+    ret = ERRNOKEY;
+  } else {
+    if (version != NULL)
+      *version = slot->version;
+    if (expires != NULL)
+      *expires = slot->expires;
+    if (slot->state == KVMMAP_DEAD || kvstore_expired(slot->expires)) {
+      ret = KVMMAP_TOMBSTONE;
+      if (value != NULL)
+        *value = NULL;
+    } else if (value != NULL) {
+      data = kvmmap_data(map, slot);
+      data += strlen(data) + 1;
+      if ((*value = malloc(strlen(data) + 1)) == NULL)
+        ret = ENOMEM;
+      else
+        strcpy(*value, data);
+    }
+  }
+  pthread_rwlock_unlock(&map->lock);
+  return ret;
+}
+
+/* Returns the number of bytes of MAP's overflow area which its entries and
+ * tombstones refer to, which is all a rebuild keeps of it. */
+static unsigned long kvmmap_live_overflow(kvmmap_t *map) {
+  unsigned long live = 0, i;
+  kvmmap_slot_t *slot;
+  for (i = 0; i < map->header->num_slots; i++) {
+    slot = &map->slots[i];
+    if ((slot->state == KVMMAP_FULL || slot->state == KVMMAP_DEAD) &&
+        slot->length > KVMMAP_INLINE)
+      live += slot->length;
+  }
+  return live;
+}
+
+/* Makes room in MAP for NUM_SLOTS more slots and OVERFLOW more bytes of
+ * overflow data, rebuilding it if need be. The overflow area is rebuilt at
+ * the same size if compacting it leaves at least half of it free, else at
+ * the smallest doubling of that size which does. Must be called with MAP's
+ * write lock held. Returns 0 if there was room, 1 if MAP was rebuilt, else a
+ * negative error code. */
+static int kvmmap_reserve(kvmmap_t *map, unsigned long num_slots,
+    size_t overflow) {
+  kvmmap_header_t *header = map->header;
+  unsigned long slots = header->num_slots, overflow_size, live;
+  int ret, rebuilt = 0;
+
+  if (num_slots > 0 && (header->num_used + header->num_deleted + num_slots) *
+      100 > header->num_slots * KVMMAP_LOAD_PERCENT) {
+    /* Grow the table, unless it is mostly deleted slots, which a rebuild
+     * at the same size reclaims. */
+    while ((header->num_used + num_slots) * 200 > slots * KVMMAP_LOAD_PERCENT)
+      slots *= 2;
+    if ((ret = kvmmap_rebuild(map, slots, header->overflow_size)) < 0)
+      return ret;
+    rebuilt = 1;
+  }
+  header = map->header;
+  if (overflow > 0 &&
+      header->overflow_used + overflow > header->overflow_size) {
+    live = kvmmap_live_overflow(map) + overflow;
+    overflow_size = header->overflow_size;
+    while (overflow_size < 2 * live)
+      overflow_size *= 2;
+    if ((ret = kvmmap_rebuild(map, header->num_slots, overflow_size)) < 0)
+      return ret;
+    rebuilt = 1;
+  }
+  return rebuilt;
+}
+
+/* Stores KEY as kvmmap_put does. Must be called with MAP's write lock
+ * held. */
+static int kvmmap_put_locked(kvmmap_t *map, char *key, char *value,
+    unsigned long version, unsigned long expires, bool versioned) {
+  unsigned long hashval = hash(key);
+  size_t length = strlen(key) + 1 + ((value != NULL) ? strlen(value) + 1 : 0);
+  kvmmap_header_t *header;
+  kvmmap_slot_t *slot, *hole;
+  int ret;
+
+  if (map->map == NULL)
+    return ERRFILACCESS;
+  slot = kvmmap_find(map, key, hashval, &hole);
+  if (slot != NULL && versioned && slot->version >= version)
+    return 1;
+  /* No overflow is needed if the new data fits in place of the old (see
+   * kvmmap_fill). */
+  ret = kvmmap_reserve(map, (slot == NULL) ? 1 : 0,
+      (length > KVMMAP_INLINE &&
+       (slot == NULL || slot->length < length)) ? length : 0);
+  if (ret < 0)
+    return ret;
+  if (ret == 1)
+    slot = kvmmap_find(map, key, hashval, &hole);
+  header = map->header;
+  if (slot == NULL) {
+    slot = hole;
+    if (slot->state == KVMMAP_DELETED)
+      header->num_deleted--;
+    header->num_used++;
+  }
+  kvmmap_fill(map, slot, hashval, key, value, version, expires);
+  return 0;
+}
+
+/* Stores KEY with VALUE (or, if VALUE is NULL, a tombstone) at VERSION in
+ * MAP, to expire at EXPIRES (or never, if it is 0), growing its file as
+ * needed. If VERSIONED is set, the write is skipped if MAP already holds KEY
+ * at VERSION or a later one. Returns 0 if the write was applied, 1 if it was
+ * stale, else a negative error code. */
+int kvmmap_put(kvmmap_t *map, char *key, char *value, unsigned long version,
+    unsigned long expires, bool versioned) {
+  int ret;
+  pthread_rwlock_wrlock(&map->lock);
+  ret = kvmmap_put_locked(map, key, value, version, expires, versioned);
+  pthread_rwlock_unlock(&map->lock);
+  return ret;
+}
+
+/* Removes the entry KEY from MAP. Must be called with MAP's write lock held.
+ * Returns 0 if successful, else a negative error code. An expired entry is
+ * removed, but reported as ERRNOKEY; if EXPIRED is set, only an expired entry
+ * is removed, and 0 is returned for it. */
+static int kvmmap_del_locked(kvmmap_t *map, char *key, bool expired) {
+  kvmmap_slot_t *slot;
+  bool stale;
+
+  if (map->map == NULL)
+    return ERRFILACCESS;
+  slot = kvmmap_find(map, key, hash(key), NULL);
+  if (slot == NULL || slot->state == KVMMAP_DEAD)
+    return ERRNOKEY;
+  stale = kvstore_expired(slot->expires);
+  if (expired && !stale)
+    return ERRNOKEY;
+  slot->state = KVMMAP_DELETED;
+  map->header->num_used--;
+  map->header->num_deleted++;
+  return (stale && !expired) ? ERRNOKEY : 0;
+}
+
+/* Removes the entry KEY from MAP. Returns 0 if successful, else a negative
+ * error code. */
+int kvmmap_del(kvmmap_t *map, char *key) {
+  int ret;
+  pthread_rwlock_wrlock(&map->lock);
+  ret = kvmmap_del_locked(map, key, false);
+  pthread_rwlock_unlock(&map->lock);
+  return ret;
+}
+
+/* Removes the entry KEY from MAP as kvstore_expire does. */
+int kvmmap_expire(kvmmap_t *map, char *key) {
+  int ret;
+  pthread_rwlock_wrlock(&map->lock);
+  ret = kvmmap_del_locked(map, key, true);
+  pthread_rwlock_unlock(&map->lock);
+  return ret;
+}
+
+/* Replaces the value of KEY in MAP as kvstore_update does, holding MAP's
+ * write lock for the whole read-modify-write. */
+int kvmmap_update(kvmmap_t *map, char *key, kvstore_update_t update,
+    void *aux, char **value, unsigned long *expires) {
+  kvmmap_slot_t *slot;
+  char *current = NULL, *newvalue = NULL;
+  unsigned long keep = 0;
+  int ret;
+
+  pthread_rwlock_wrlock(&map->lock);
+  if (map->map == NULL) {
+    pthread_rwlock_unlock(&map->lock);
+    return ERRFILACCESS;
+  }
+  slot = kvmmap_find(map, key, hash(key), NULL);
+  if (slot != NULL && slot->state == KVMMAP_FULL &&
+      !kvstore_expired(slot->expires)) {
+    current = kvmmap_data(map, slot);
+    current += strlen(current) + 1;
+    keep = slot->expires;
+  }
+  /* UPDATE runs before the put, which may move CURRENT by rebuilding. */
+  if ((ret = update(current, aux, &newvalue)) == 0) {
+    if (strlen(newvalue) > MAX_VALLEN)
+      ret = ERRVALLEN;
+    else if ((ret = kvmmap_put_locked(map, key, newvalue, 0, keep,
+        false)) > 0)
+      ret = 0;
+  }
+  pthread_rwlock_unlock(&map->lock);
+  if (ret < 0) {
+    free(newvalue);
+    return ret;
+  }
+  *value = newvalue;
+  if (expires != NULL)
+    *expires = keep;
+  return 0;
+}
+
+/* Applies the NUM_OPS writes OPS to MAP in order, as unversioned PUTs and
+ * DELs, under one lock so that no reader sees part of them. A DEL of a key
+ * which is absent does nothing. Room for every PUT is made before any is
+ * applied, so the batch can only fail part way if the file cannot be
+ * written at all. Returns 0 if successful, else a negative error code. */
+int kvmmap_batch(kvmmap_t *map, kvstore_op_t *ops, unsigned int num_ops) {
+  unsigned long num_slots = 0;
+  size_t overflow = 0, length;
+  unsigned int i;
+  int ret = 0;
+
+  for (i = 0; i < num_ops; i++) {
+    if (ops[i].value == NULL)
+      continue;
+    length = strlen(ops[i].key) + strlen(ops[i].value) + 2;
+    num_slots++;
+    if (length > KVMMAP_INLINE)
+      overflow += length;
+  }
+  pthread_rwlock_wrlock(&map->lock);
+  if (map->map == NULL)
+    ret = ERRFILACCESS;
+  else if ((ret = kvmmap_reserve(map, num_slots, overflow)) > 0)
+    ret = 0;
+  for (i = 0; ret == 0 && i < num_ops; i++) {
+    if (ops[i].value != NULL)
+      ret = kvmmap_put_locked(map, ops[i].key, ops[i].value, 0,
+          ops[i].expires, false);
+    else if ((ret = kvmmap_del_locked(map, ops[i].key, false)) == ERRNOKEY)
+      ret = 0;
+  }
+  pthread_rwlock_unlock(&map->lock);
+  return ret;
+}
+
+/* Orders two hashes, for qsort. */
+static int kvmmap_compare_hashes(const void *a, const void *b) {
+  unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+  return (x > y) - (x < y);
+}
+
+/* Visits the entries of MAP as kvstore_scan does for a store, treating the
+ * entries which share a hash as a hash chain. */
+int kvmmap_scan(kvmmap_t *map, unsigned long start, unsigned int max,
+    bool expired, kvstore_visit_t visit, void *aux, unsigned long *next) {
+  unsigned long *hashes, mask, i, j, num = 0;
+  kvmmap_slot_t *slot;
+  char *data;
+
+  *next = 0;
+  pthread_rwlock_rdlock(&map->lock);
+  if (map->map == NULL) {
+    pthread_rwlock_unlock(&map->lock);
+    return ERRFILACCESS;
+  }
+  hashes = malloc((map->header->num_used + 1) * sizeof(unsigned long));
+  if (hashes == NULL) {
+    pthread_rwlock_unlock(&map->lock);
+    return -ENOMEM;
+  }
+  for (i = 0; i < map->header->num_slots; i++) {
+    slot = &map->slots[i];
+    if ((slot->state == KVMMAP_FULL || slot->state == KVMMAP_DEAD) &&
+        slot->hashval >= start)
+      hashes[num++] = slot->hashval;
+  }
+  qsort(hashes, num, sizeof(unsigned long), kvmmap_compare_hashes);
+  for (i = 0, j = 0; i < num && j < max; i++)
+    if (j == 0 || hashes[j - 1] != hashes[i])
+      hashes[j++] = hashes[i];
+  num = j;
+  mask = map->header->num_slots - 1;
+  for (i = 0; i < num; i++) {
+    /* Every entry with this hash lies along its probe sequence. */
+    for (j = kvmmap_home(map, hashes[i]);
+        map->slots[j].state != KVMMAP_EMPTY; j = (j + 1) & mask) {
+      slot = &map->slots[j];
+      if (slot->state == KVMMAP_FULL && slot->hashval == hashes[i] &&
+          (expired || !kvstore_expired(slot->expires))) {
+        data = kvmmap_data(map, slot);
+        visit(data, data + strlen(data) + 1, slot->expires, aux);
+      }
+    }
+  }
+  if (num > 0)
+    *next = hashes[num - 1] + 1;
+  free(hashes);
+  pthread_rwlock_unlock(&map->lock);
+  return num;
+}
@@ -0,0 +1,104 @@
+#ifndef __KV_MMAP__
+#define __KV_MMAP__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "kvconstants.h"
+#include "kvstore.h"
+
+/* KVMmap is a storage engine for KVStore which keeps every entry in a single
+ * memory-mapped file, suited to read-heavy sets of small values.
+ *
+ * The file holds a header, an open-addressing hash table of fixed-size slots
+ * probed linearly from the djb2 hash of each key, and an overflow area. An
+ * entry's data (key_string \0 value_string \0, as in kventry_t) is kept
+ * within its slot if it fits in KVMMAP_INLINE bytes, else it is kept in the
+ * overflow area: in place of the entry's old data if that was at least as
+ * long, else appended. A GET is thus a probe of the mapped slots plus a copy
+ * of the value, which costs no system calls once the file is in the page
+ * cache.
+ *
+ * When the table becomes KVMMAP_LOAD_PERCENT full or the overflow area runs
+ * out, the file is rebuilt beside the old one, which also compacts the
+ * overflow area, and renamed over it. The table doubles; the overflow area
+ * only doubles while the data of live entries and tombstones would fill more
+ * than half of it, so that overwriting the same keys reclaims the space of
+ * their old data instead of growing the file. Writers (and readers) wait for
+ * the rebuild, but the store stays online.
+ *
+ * Deleted entries leave a marker in their slot so that probing continues
+ * past them; a versioned delete leaves a tombstone carrying its version,
+ * which is treated as absent by all but the versioned functions. An entry
+ * which has expired is treated as a tombstone until it is removed.
+ */
+
+/* The number of bytes of data an entry can hold within its slot. */
+#define KVMMAP_INLINE 96
+/* The number of slots and overflow bytes of a new file. */
+#define KVMMAP_SLOTS 1024
+#define KVMMAP_OVERFLOW (64 * 1024)
+/* The share of slots in use, in percent, at which the table is grown. */
+#define KVMMAP_LOAD_PERCENT 75
+
+/* Returned by kvmmap_get for a tombstone. */
+#define KVMMAP_TOMBSTONE 1
+
+/* The states of a slot. */
+#define KVMMAP_EMPTY 0
+#define KVMMAP_FULL 1
+#define KVMMAP_DEAD 2       /* A tombstone left by a versioned delete. */
+#define KVMMAP_DELETED 3    /* Free, but not the end of a probe sequence. */
+
+/* The header at the start of a KVMmap file. */
+typedef struct {
+  unsigned long magic;          /* KVMMAP_MAGIC. */
+  unsigned long num_slots;      /* The number of slots, a power of two. */
+  unsigned long num_used;       /* The number of slots FULL or DEAD. */
+  unsigned long num_deleted;    /* The number of slots DELETED. */
+  unsigned long overflow_size;  /* The size of the overflow area in bytes. */
+  unsigned long overflow_used;  /* The number of those bytes handed out. */
+} kvmmap_header_t;
+
+/* A slot of a KVMmap file. */
+typedef struct {
+  unsigned long hashval;        /* The hash of the entry's key. */
+  unsigned long version;        /* The version the entry was written at. */
+  unsigned long expires;        /* The time the entry expires at, or 0. */
+  unsigned long overflow;       /* The offset of the data in the overflow area. */
+  unsigned int state;           /* One of the KVMMAP states above. */
+  unsigned int length;          /* The length of the data. */
+  char data[KVMMAP_INLINE];     /* The data, if LENGTH is at most KVMMAP_INLINE. */
+} kvmmap_slot_t;
+
+/* A KVMmap. */
+typedef struct kvmmap {
+  char filename[MAX_FILENAME];  /* The name of the mapped file. */
+  char *map;                    /* The mapping of the file. */
+  size_t size;                  /* The size of MAP. */
+  kvmmap_header_t *header;      /* The header within MAP. */
+  kvmmap_slot_t *slots;         /* The slots within MAP. */
+  char *overflow;               /* The overflow area within MAP. */
+  pthread_rwlock_t lock;        /* Held for writing while MAP is modified. */
+} kvmmap_t;
+
+int kvmmap_init(kvmmap_t *, char *filename);
+int kvmmap_sync(kvmmap_t *);
+void kvmmap_stats(kvmmap_t *, unsigned long *num_entries,
+    unsigned long *memory);
+void kvmmap_close(kvmmap_t *);
+
+int kvmmap_get(kvmmap_t *, char *key, char **value, unsigned long *version,
+    unsigned long *expires);
+int kvmmap_put(kvmmap_t *, char *key, char *value, unsigned long version,
+    unsigned long expires, bool versioned);
+int kvmmap_del(kvmmap_t *, char *key);
+int kvmmap_expire(kvmmap_t *, char *key);
+int kvmmap_batch(kvmmap_t *, kvstore_op_t *ops, unsigned int num_ops);
+int kvmmap_update(kvmmap_t *, char *key, kvstore_update_t update, void *aux,
+    char **value, unsigned long *expires);
+
+int kvmmap_scan(kvmmap_t *, unsigned long start, unsigned int max,
+    bool expired, kvstore_visit_t visit, void *aux, unsigned long *next);
+
+#endif
@@ -0,0 +1,65 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include "kvring.h"
+
+#define KVRING_MASK (KVRING_SIZE - 1)
+
+/* Initializes RING to be empty. Returns 0 if successful, else a negative
+ * error code. */
+int kvring_init(kvring_t *ring) {
+  unsigned long i;
+  for (i = 0; i < KVRING_SIZE; i++) {
+    ring->cells[i].seq = i;
+    ring->cells[i].item = NULL;
+  }
+  ring->head = ring->tail = 0;
+  return (sem_init(&ring->items, 0, 0) == -1) ? -errno : 0;
+}
+
+/* Pushes ITEM onto RING, which may be done by any number of threads at once.
+ * Returns 0 if successful, else -1 if RING is full. */
+int kvring_push(kvring_t *ring, void *item) {
+  unsigned long pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  struct kvring_cell *cell;
+  long diff;
+
+  for (;;) {
+    cell = &ring->cells[pos & KVRING_MASK];
+    diff = (long) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      /* The cell is free: claim it, unless another producer did first, in
+       * which case POS is reloaded. */
+      if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      /* The cell still holds the item pushed a lap ago. */
+      return -1;
+    } else {
+      pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+  }
+  cell->item = item;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  sem_post(&ring->items);
+  return 0;
+}
+
+/* Pops the oldest item of RING, waiting for one if RING is empty. Must only
+ * be called by RING's one consumer. */
+void *kvring_pop(kvring_t *ring) {
+  struct kvring_cell *cell = &ring->cells[ring->tail & KVRING_MASK];
+  void *item;
+
+  while (sem_wait(&ring->items) == -1 && errno == EINTR)
+    ;
+  /* The item counted may be a later one than this cell's, if its producer
+   * claimed the cell first but has yet to publish it; it is about to. */
+  while (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != ring->tail + 1)
+    sched_yield();
+  item = cell->item;
+  __atomic_store_n(&cell->seq, ring->tail + KVRING_SIZE, __ATOMIC_RELEASE);
+  ring->tail++;
+  return item;
+}
@@ -0,0 +1,45 @@
+#ifndef __KV_RING__
+#define __KV_RING__
+
+#include <semaphore.h>
+
+/* KVRing is a bounded queue which any number of threads push items onto and
+ * a single thread pops them from, without taking a lock.
+ *
+ * The ring has KVRING_SIZE cells, each with a sequence number telling whose
+ * turn it is: a producer claims the cell at HEAD by advancing HEAD with a
+ * compare-and-swap once the cell's sequence says it is free, stores its item
+ * and then publishes the cell by advancing its sequence, and the consumer
+ * takes the cell at TAIL once it has been published, handing it back to the
+ * producers a lap later. A push onto a full ring fails rather than waiting,
+ * so that a producer can shed load instead.
+ *
+ * A semaphore counts the items pushed, so that the consumer sleeps while the
+ * ring is empty instead of spinning. Posting to and waiting on it only enter
+ * the kernel when the consumer is asleep or about to be.
+ */
+
+/* The number of cells of a ring, a power of two. */
+#define KVRING_SIZE 1024
+
+/* A cell of a ring. */
+struct kvring_cell {
+  unsigned long seq;        /* The position the cell is free to be pushed at, or that plus 1 once published. */
+  void *item;               /* The item stored in the cell, once published. */
+};
+
+/* A KVRing. HEAD and TAIL are padded apart onto separate cache lines, so
+ * that producers and the consumer do not contend for them. */
+typedef struct {
+  struct kvring_cell cells[KVRING_SIZE];
+  unsigned long head;       /* The next position to push at. */
+  char pad[64];
+  unsigned long tail;       /* The next position to pop from. */
+  sem_t items;              /* Counts the items pushed but not yet popped. */
+} kvring_t;
+
+int kvring_init(kvring_t *);
+int kvring_push(kvring_t *, void *item);
+void *kvring_pop(kvring_t *);
+
+#endif
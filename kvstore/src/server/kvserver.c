@@ -1,10 +1,15 @@
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include "kvconstants.h"
 #include "kvcache.h"
-#include "kvstore.h"
+#include "kvengine.h"
+#include "kvconn.h"
 #include "kvmessage.h"
 #include "kvserver.h"
 #include "tpclog.h"
@@ -15,14 +20,19 @@
  * for this server.  The server's cache will have NUM_SETS cache sets, each
  * with ELEM_PER_SET elements.  HOSTNAME and PORT indicate where SERVER will be
  * made available for requests.  USE_TPC indicates whether this server should
- * use TPC logic (for PUTs and DELs) or not. */
+ * use TPC logic (for PUTs and DELs) or not. ENGINE names the storage engine
+ * to keep entries in (see kvengine.h), or is NULL for the default. */
 int kvserver_init(kvserver_t *server, char *dirname, unsigned int num_sets,
     unsigned int elem_per_set, unsigned int max_threads, const char *hostname,
-    int port, bool use_tpc) {
+    int port, bool use_tpc, const char *engine) {
   int ret;
   ret = kvcache_init(&server->cache, num_sets, elem_per_set);
   if (ret < 0) return ret;
-  ret = kvstore_init(&server->store, dirname);
+  ret = kvengine_init(&server->store, engine, dirname);
+  if (ret < 0) return ret;
+  ret = kvflight_init(&server->flights);
+  if (ret < 0) return ret;
+  ret = kvwheel_init(&server->expiry, time(NULL));
   if (ret < 0) return ret;
   if (use_tpc) {
       ret = tpclog_init(&server->log, dirname);
@@ -34,6 +44,12 @@ int kvserver_init(kvserver_t *server, char *dirname, unsigned int num_sets,
   strcpy(server->hostname, hostname);
   server->port = port;
   server->use_tpc = use_tpc;
+  server->txns = NULL;
+  server->keylocks = NULL;
+  server->write_back = false;
+  server->flusher_running = false;
+  server->reaper_running = false;
+  pthread_mutex_init(&server->tpc_lock, NULL);
   server->max_threads = max_threads;
   server->handle = kvserver_handle;
   return 0;
@@ -80,13 +96,53 @@ int kvserver_register_master(kvserver_t *server, int sockfd) {
   return error;
 }
 
+/* Returns the milliseconds left before EXPIRES, a time in seconds since the
+ * epoch, or 1 if it has passed, so that a value which is about to expire is
+ * never mistaken for one which does not. */
+static unsigned long kvserver_ms_left(unsigned long expires) {
+  struct timespec now;
+  unsigned long ms;
+  clock_gettime(CLOCK_REALTIME, &now);
+  ms = now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+  return (expires * 1000 > ms) ? expires * 1000 - ms : 1;
+}
+
+/* Returns the TTL in seconds, rounded up, of a value with MS milliseconds
+ * left, or 0 if it never expires. */
+static unsigned long kvserver_ttl_seconds(unsigned long ms) {
+  return (ms + 999) / 1000;
+}
+
+/* Adds a timer for KEY, which expires at EXPIRES, to SERVER's timing wheel
+ * if its reaper is running. A timer which cannot be added only leaves KEY to
+ * be replaced or deleted later, as it already reads as absent once it has
+ * expired. */
+static void kvserver_add_timer(kvserver_t *server, char *key,
+    unsigned long expires) {
+  if (expires != 0 &&
+      __atomic_load_n(&server->reaper_running, __ATOMIC_SEQ_CST))
+    kvwheel_add(&server->expiry, key, expires);
+}
+
 /* Attempts to get KEY from SERVER. Returns 0 if successful, else a negative
  * error code.  If successful, VALUE will point to a string which should later
  * be free()d.  If the KEY is in cache, take the value from there. Otherwise,
- * go to the store and update the value in the cache. */
+ * go to the store and update the value in the cache, or record that KEY is
+ * absent so that repeated GETs of a missing key do not search the store. */
 int kvserver_get(kvserver_t *server, char *key, char **value) {
+  return kvserver_get_ttl(server, key, value, NULL);
+}
+
+/* Gets KEY from SERVER as kvserver_get_ttl does, but places the value into
+ * memory allocated from ARENA (see kvarena.h). A value found in the cache is
+ * copied straight into ARENA; one loaded from the store is moved there once
+ * the cache has been filled with it. */
+static int kvserver_get_arena(kvserver_t *server, char *key, char **value,
+    unsigned long *ttl, kvarena_t *arena) {
   int success;
   pthread_rwlock_t *lock;
+  struct kvflightcall *call;
+  unsigned long token, expires = 0, left = 0;
 
   if (strlen(key) > MAX_KEYLEN)
     return ERRKEYLEN;
@@ -94,41 +150,102 @@ int kvserver_get(kvserver_t *server, char *key, char **value) {
   lock = kvcache_getlock(&server->cache, key);
 
   pthread_rwlock_rdlock(lock);
-  success = kvcache_get(&server->cache, key, value);
+  success = kvcache_get_arena(&server->cache, key, value, arena);
+  if (success == 0 && ttl != NULL)
+    left = kvserver_ttl_seconds(kvcache_ttl(&server->cache, key));
+  token = kvcache_fill_token(&server->cache, key);
   pthread_rwlock_unlock(lock);
-  
-  /* If the key is not in the cache, go to the store. */
-  if (success < 0) {
-    success = kvstore_get(&server->store, key, value);
-    
-    if (success == 0) {
-      pthread_rwlock_wrlock(lock);
-      kvcache_put(&server->cache, key, *value);
-      pthread_rwlock_unlock(lock);
-    }
+  if (success == 0) {
+    if (ttl != NULL)
+      *ttl = left;
+    return 0;
   }
+  if (success == KVCACHESET_ABSENT)
+    return ERRNOKEY;
 
+  /* If the key is not in the cache, go to the store, unless another thread
+   * is already doing so, in which case share its result. */
+  call = kvflight_join(&server->flights, key, token, &success, value, &left);
+  if (call == NULL) {
+    if (success == 0 && (*value = kvarena_take(arena, *value)) == NULL)
+      return -ENOMEM;
+    if (success == 0 && ttl != NULL)
+      *ttl = left;
+    return success;
+  }
+  success = kvengine_get_expiring(&server->store, key, value, &expires);
+  if (success == 0 || success == ERRNOKEY) {
+    pthread_rwlock_wrlock(lock);
+    /* The TTL is only set if the fill was kept, as otherwise the cache may
+     * hold a later write of KEY. */
+    if (kvcache_fill(&server->cache, key, success == 0 ? *value : NULL,
+        token) == 0 && success == 0 && expires != 0)
+      kvcache_set_ttl(&server->cache, key, kvserver_ms_left(expires));
+    pthread_rwlock_unlock(lock);
+  }
+  left = (expires != 0) ? kvserver_ttl_seconds(kvserver_ms_left(expires)) : 0;
+  kvflight_finish(&server->flights, call, success,
+      success == 0 ? *value : NULL, left);
+  if (success == 0 && (*value = kvarena_take(arena, *value)) == NULL)
+    return -ENOMEM;
+  if (success == 0 && ttl != NULL)
+    *ttl = left;
   return success;
 }
 
+/* Gets KEY from SERVER as kvserver_get does and, if successful and TTL is not
+ * NULL, places the seconds its value has left before it expires (rounded up,
+ * or 0 if it never does) into TTL. */
+int kvserver_get_ttl(kvserver_t *server, char *key, char **value,
+    unsigned long *ttl) {
+  return kvserver_get_arena(server, key, value, ttl, NULL);
+}
+
 /* Checks if the given KEY, VALUE pair can be inserted into this server's
  * store. Returns 0 if it can, else a negative error code. */
 int kvserver_put_check(kvserver_t *server, char *key, char *value) {
-  return kvstore_put_check(&server->store, key, value);
+  return kvengine_put_check(&server->store, key, value);
 }
 
 /* Inserts the given KEY, VALUE pair into this server's store and cache. Access
  * to the cache should be concurrent if the keys are in different cache sets.
  * Returns 0 if successful, else a negative error code. */
 int kvserver_put(kvserver_t *server, char *key, char *value) {
+  return kvserver_put_ttl(server, key, value, 0);
+}
+
+/* Inserts KEY, VALUE into SERVER as kvserver_put does, to expire TTL seconds
+ * from now (to the second), or never if TTL is 0. Returns 0 if successful,
+ * else a negative error code; a TTL is refused with ERRNOTIMPL in write-back
+ * mode. */
+int kvserver_put_ttl(kvserver_t *server, char *key, char *value,
+    unsigned long ttl) {
   int err;
   pthread_rwlock_t *lock;
+  unsigned long expires = (ttl != 0) ? time(NULL) + ttl : 0, logged;
 
   err = kvserver_put_check(server, key, value);
   if (err < 0)
     return err;
 
-  err = kvstore_put(&server->store, key, value);
+  if (server->write_back) {
+    if (ttl != 0)
+      return ERRNOTIMPL;
+    lock = kvcache_getlock(&server->cache, key);
+    pthread_rwlock_rdlock(&server->wal_lock);
+    pthread_rwlock_wrlock(lock);
+    err = kvwal_append(&server->wal, key, value, &logged);
+    if (err == 0)
+      err = kvcache_put_dirty(&server->cache, key, value);
+    pthread_rwlock_unlock(lock);
+    pthread_rwlock_unlock(&server->wal_lock);
+    /* The PUT is only acknowledged once its log record is durable. */
+    if (err == 0)
+      err = kvwal_sync(&server->wal, logged);
+    return err;
+  }
+
+  err = kvengine_put_expiring(&server->store, key, value, expires);
   if (err < 0)
     return err;
 
@@ -136,34 +253,256 @@ int kvserver_put(kvserver_t *server, char *key, char *value) {
 
   pthread_rwlock_wrlock(lock);
   err = kvcache_put(&server->cache, key, value);
+  if (err == 0 && expires != 0)
+    kvcache_set_ttl(&server->cache, key, kvserver_ms_left(expires));
   pthread_rwlock_unlock(lock);
 
+  kvserver_add_timer(server, key, expires);
   return err;
 }
 
 /* Checks if the given KEY can be deleted from this server's store.
  * Returns 0 if it can, else a negative error code. */
 int kvserver_del_check(kvserver_t *server, char *key) {
-  return kvstore_del_check(&server->store, key);
+  return kvengine_del_check(&server->store, key);
 }
 
 /* Removes the given KEY from this server's store and cache. Access to the
  * cache should be concurrent if the keys are in different cache sets. Returns
  * 0 if successful, else a negative error code. */
 int kvserver_del(kvserver_t *server, char *key) {
-  int success;
+  int success, dirty, ret;
+  unsigned long logged;
   pthread_rwlock_t *lock;
 
+  if (server->write_back) {
+    /* KEY may only exist as a dirty cache entry, not yet in the store. */
+    lock = kvcache_getlock(&server->cache, key);
+    pthread_rwlock_rdlock(&server->wal_lock);
+    pthread_rwlock_wrlock(lock);
+    ret = success = kvwal_append(&server->wal, key, NULL, &logged);
+    if (success == 0) {
+      dirty = kvcache_dirty(&server->cache, key);
+      kvcache_del(&server->cache, key);
+      success = kvengine_del(&server->store, key);
+      if (success == ERRNOKEY && dirty == 1)
+        success = 0;
+    }
+    pthread_rwlock_unlock(lock);
+    pthread_rwlock_unlock(&server->wal_lock);
+    if (ret == 0 && (ret = kvwal_sync(&server->wal, logged)) < 0)
+      success = ret;
+    return success;
+  }
+
+  /* The store is written first, so that a GET which reads the old value
+   * before the delete has its cache fill dropped (see kvcache_fill). */
+  success = kvengine_del(&server->store, key);
+
   lock = kvcache_getlock(&server->cache, key);
 
   pthread_rwlock_wrlock(lock);
-  success = kvcache_del(&server->cache, key);
+  kvcache_del(&server->cache, key);
   pthread_rwlock_unlock(lock);
 
-  success = kvstore_del(&server->store, key);
   return success;
 }
 
+/* Returns true if TYPE is a read-modify-write request: a CASREQ, INCRREQ or
+ * DECRREQ. */
+static bool kvserver_is_update(msgtype_t type) {
+  return type == CASREQ || type == INCRREQ || type == DECRREQ;
+}
+
+/* Parses the decimal integer STR into *NUM. Returns 0 if successful, else
+ * ERRNOTINTEGER. */
+static int kvserver_parse_integer(char *str, long long *num) {
+  char *end;
+  errno = 0;
+  *num = strtoll(str, &end, 10);
+  if (errno != 0 || end == str || *end != '\0')
+    return ERRNOTINTEGER;
+  return 0;
+}
+
+/* Computes the value the CASREQ, INCRREQ or DECRREQ AUX writes in place of
+ * the current VALUE (NULL if there is none), as described in kvmessage.h, and
+ * places it into NEWVALUE using malloc()d memory. Returns 0 if successful,
+ * else a negative error code; a CAS whose expected value does not match fails
+ * with ERRCASMISMATCH. */
+static int kvserver_update_value(char *value, void *aux, char **newvalue) {
+  kvmessage_t *op = aux;
+  long long num = 0, delta = 1;
+  char buf[32];
+
+  if (op->type == CASREQ) {
+    if ((op->expected == NULL) != (value == NULL) ||
+        (value != NULL && strcmp(value, op->expected) != 0))
+      return ERRCASMISMATCH;
+    *newvalue = strdup(op->value);
+    return (*newvalue == NULL) ? -ENOMEM : 0;
+  }
+  if ((value != NULL && kvserver_parse_integer(value, &num) < 0) ||
+      (op->value != NULL && kvserver_parse_integer(op->value, &delta) < 0))
+    return ERRNOTINTEGER;
+  if ((op->type == INCRREQ) ? __builtin_add_overflow(num, delta, &num) :
+      __builtin_sub_overflow(num, delta, &num))
+    return ERRNOTINTEGER;
+  sprintf(buf, "%lld", num);
+  *newvalue = strdup(buf);
+  return (*newvalue == NULL) ? -ENOMEM : 0;
+}
+
+/* Applies the CASREQ, INCRREQ or DECRREQ OP to SERVER as one atomic
+ * read-modify-write of OP->key, holding the key's cache set lock throughout
+ * so that no other write to the key through SERVER comes between the read and
+ * the write. Returns 0 if successful, in which case the new value is placed
+ * into VALUE using malloc()d memory which should be free()d later, else a
+ * negative error code. */
+int kvserver_update(kvserver_t *server, kvmessage_t *op, char **value) {
+  char *current = NULL;
+  pthread_rwlock_t *lock;
+  unsigned long expires = 0, logged;
+  int ret;
+
+  if (op->key == NULL || !kvserver_is_update(op->type) ||
+      (op->type == CASREQ && op->value == NULL))
+    return ERRINVLDMSG;
+  if (strlen(op->key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  lock = kvcache_getlock(&server->cache, op->key);
+
+  if (server->write_back) {
+    /* The current value may only exist as a dirty cache entry. */
+    pthread_rwlock_rdlock(&server->wal_lock);
+    pthread_rwlock_wrlock(lock);
+    if (kvcache_dirty(&server->cache, op->key) == 1)
+      ret = kvcache_get(&server->cache, op->key, &current);
+    else if ((ret = kvengine_get(&server->store, op->key, &current)) ==
+        ERRNOKEY)
+      ret = 0;
+    if (ret == 0 && (ret = kvserver_update_value(current, op, value)) == 0) {
+      if ((ret = kvserver_put_check(server, op->key, *value)) == 0 &&
+          (ret = kvwal_append(&server->wal, op->key, *value, &logged)) == 0)
+        ret = kvcache_put_dirty(&server->cache, op->key, *value);
+      if (ret < 0)
+        free(*value);
+    }
+    pthread_rwlock_unlock(lock);
+    pthread_rwlock_unlock(&server->wal_lock);
+    free(current);
+    if (ret == 0 && (ret = kvwal_sync(&server->wal, logged)) < 0)
+      free(*value);
+    return ret;
+  }
+
+  pthread_rwlock_wrlock(lock);
+  ret = kvengine_update(&server->store, op->key, kvserver_update_value, op,
+      value, &expires);
+  /* The new value keeps the expiry of the one it replaced. */
+  if (ret == 0 && kvcache_put(&server->cache, op->key, *value) == 0 &&
+      expires != 0)
+    kvcache_set_ttl(&server->cache, op->key, kvserver_ms_left(expires));
+  pthread_rwlock_unlock(lock);
+  return ret;
+}
+
+/* Removes KEY from SERVER's store and cache if its value has expired, as the
+ * reaper does for each key whose timer comes due. A key which has since been
+ * written again or deleted is left alone. Returns 0 if KEY was removed,
+ * ERRNOKEY if there was no expired value to remove, else a negative error
+ * code. */
+int kvserver_expire(kvserver_t *server, char *key) {
+  pthread_rwlock_t *lock;
+  int ret;
+
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  lock = kvcache_getlock(&server->cache, key);
+  pthread_rwlock_wrlock(lock);
+  ret = kvengine_expire(&server->store, key);
+  if (ret == 0)
+    kvcache_del(&server->cache, key);
+  pthread_rwlock_unlock(lock);
+  return ret;
+}
+
+/* Attempts to get KEY from SERVER's store along with the version it was
+ * written at, for a master in quorum mode. Returns 0 if successful, else a
+ * negative error code. If successful, VALUE will point to a string which
+ * should later be free()d, or be NULL if KEY was deleted at VERSION. The
+ * cache does not hold versions, so it is not used. */
+int kvserver_get_versioned(kvserver_t *server, char *key, char **value,
+    unsigned long *version) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  return kvengine_get_versioned(&server->store, key, value, version);
+}
+
+/* Writes KEY with VALUE, or deletes KEY if VALUE is NULL, at version VERSION
+ * on behalf of a master in quorum mode. The write only takes effect if
+ * SERVER does not already hold a later version of KEY, so replicas converge
+ * on the last write whatever order writes arrive in; a stale write still
+ * succeeds. Returns 0 if successful, else a negative error code. */
+int kvserver_put_versioned(kvserver_t *server, char *key, char *value,
+    unsigned long version) {
+  pthread_rwlock_t *lock;
+  int ret;
+
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  lock = kvcache_getlock(&server->cache, key);
+  pthread_rwlock_wrlock(lock);
+  ret = kvengine_put_versioned(&server->store, key, value, version);
+  if (ret == 0) {
+    if (value != NULL)
+      kvcache_put(&server->cache, key, value);
+    else
+      kvcache_del(&server->cache, key);
+  }
+  pthread_rwlock_unlock(lock);
+  return (ret < 0) ? ret : 0;
+}
+
+/* Handles a quorum-mode request REQMSG (one carrying a version) on SERVER and
+ * populates RESPMSG: a GETREQ is answered with the stored version, and a
+ * PUTREQ or DELREQ is applied immediately by kvserver_put_versioned. */
+static void kvserver_handle_versioned(kvserver_t *server, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  char *value = NULL;
+  int error;
+
+  if (reqmsg->type == GETREQ) {
+    error = kvserver_get_versioned(server, reqmsg->key, &value,
+        &respmsg->version);
+    if (!error && value != NULL &&
+        (value = kvarena_take(reqmsg->arena, value)) == NULL)
+      error = -ENOMEM;
+    if (!error && value != NULL) {
+      respmsg->type = GETRESP;
+      respmsg->key = reqmsg->key;
+      respmsg->value = value;
+      respmsg->message = MSG_SUCCESS;
+    } else {
+      /* A tombstone is reported as a missing key, along with its version. */
+      respmsg->message = error ? GETMSG(error) : ERRMSG_NO_KEY;
+    }
+    return;
+  }
+  if (reqmsg->type == PUTREQ && reqmsg->value == NULL) {
+    respmsg->message = ERRMSG_INVALID_REQUEST;
+    return;
+  }
+  if (reqmsg->ttl != 0) {
+    /* A version does not say when a replica's copy should expire. */
+    respmsg->message = ERRMSG_NOT_IMPLEMENTED;
+    return;
+  }
+  error = kvserver_put_versioned(server, reqmsg->key,
+      (reqmsg->type == PUTREQ) ? reqmsg->value : NULL, reqmsg->version);
+  respmsg->message = error ? GETMSG(error) : MSG_SUCCESS;
+}
+
 /* Returns an info string about SERVER including its hostname and port. */
 char *kvserver_get_info_message(kvserver_t *server) {
   char info[1024], buf[256];
@@ -176,18 +515,411 @@ char *kvserver_get_info_message(kvserver_t *server) {
   return msg;
 }
 
+/* Returns the prepared transaction TXID of SERVER, or NULL if there is none.
+ * Must be called with SERVER->tpc_lock held. */
+static kvtxn_t *kvserver_find_txn(kvserver_t *server, unsigned long txid) {
+  kvtxn_t *txn;
+  HASH_FIND(hh, server->txns, &txid, sizeof(unsigned long), txn);
+  return txn;
+}
+
+/* Releases every key lock held by transaction TXN of SERVER. Must be called
+ * with SERVER->tpc_lock held. */
+static void kvserver_release_keys(kvserver_t *server, kvtxn_t *txn) {
+  kvkeylock_t *keylock;
+  unsigned int i;
+  for (i = 0; i < txn->num_ops; i++) {
+    HASH_FIND_STR(server->keylocks, txn->ops[i].key, keylock);
+    if (keylock != NULL && keylock->txn == txn) {
+      HASH_DEL(server->keylocks, keylock);
+      free(keylock);
+    }
+  }
+}
+
+/* Frees transaction TXN, which must no longer be in its server's table or
+ * hold any key locks. */
+static void kvserver_free_txn(kvtxn_t *txn) {
+  unsigned int i;
+  for (i = 0; i < txn->num_ops; i++)
+    kvmessage_free_fields(&txn->ops[i]);
+  free(txn->ops);
+  free(txn);
+}
+
+/* Prepares transaction TXID on SERVER with copies of the NUM_OPS operations
+ * in OPS, locking each key they write, and stores it in *TXNP. Returns 0 if
+ * successful, ERRKEYLOCKED if another prepared transaction holds one of the
+ * keys, or another nonzero error code. Must be called with SERVER->tpc_lock
+ * held. */
+static int kvserver_add_txn(kvserver_t *server, unsigned long txid,
+    kvmessage_t *ops, unsigned int num_ops, kvtxn_t **txnp) {
+  kvkeylock_t *keylock;
+  kvtxn_t *txn;
+  unsigned int i;
+
+  for (i = 0; i < num_ops; i++) {
+    HASH_FIND_STR(server->keylocks, ops[i].key, keylock);
+    if (keylock != NULL)
+      return ERRKEYLOCKED;
+  }
+  txn = calloc(1, sizeof(kvtxn_t));
+  if (txn == NULL)
+    return ENOMEM;
+  txn->ops = calloc(num_ops, sizeof(kvmessage_t));
+  if (txn->ops == NULL) {
+    free(txn);
+    return ENOMEM;
+  }
+  txn->txid = txid;
+  txn->num_ops = num_ops;
+  for (i = 0; i < num_ops; i++) {
+    txn->ops[i].type = ops[i].type;
+    txn->ops[i].ttl = ops[i].ttl;
+    txn->ops[i].key = strdup(ops[i].key);
+    if (ops[i].value != NULL)
+      txn->ops[i].value = strdup(ops[i].value);
+    if (ops[i].expected != NULL)
+      txn->ops[i].expected = strdup(ops[i].expected);
+  }
+  for (i = 0; i < num_ops; i++) {
+    HASH_FIND_STR(server->keylocks, txn->ops[i].key, keylock);
+    if (keylock != NULL)
+      continue;  /* A batch which writes the same key twice. */
+    keylock = malloc(sizeof(kvkeylock_t));
+    if (keylock == NULL) {
+      kvserver_release_keys(server, txn);
+      kvserver_free_txn(txn);
+      return ENOMEM;
+    }
+    keylock->key = txn->ops[i].key;
+    keylock->txn = txn;
+    HASH_ADD_KEYPTR(hh, server->keylocks, keylock->key, strlen(keylock->key),
+        keylock);
+  }
+  HASH_ADD(hh, server->txns, txid, sizeof(unsigned long), txn);
+  *txnp = txn;
+  return 0;
+}
+
+/* Removes transaction TXN from SERVER, releasing its key locks, and frees it.
+ * Must be called with SERVER->tpc_lock held. */
+static void kvserver_drop_txn(kvserver_t *server, kvtxn_t *txn) {
+  HASH_DEL(server->txns, txn);
+  kvserver_release_keys(server, txn);
+  kvserver_free_txn(txn);
+}
+
+/* Applies every operation of transaction TXN to SERVER's store and cache.
+ * The operations of a batch are written to the store as one atomic batch,
+ * then to the cache; if the batch fails, its keys are dropped from the cache
+ * instead, so that they are next read from the store. A PUT's TTL counts
+ * from when it is applied. */
+static void kvserver_apply_txn(kvserver_t *server, kvtxn_t *txn) {
+  kvstore_op_t ops[txn->num_ops];
+  pthread_rwlock_t *lock;
+  unsigned long now = time(NULL);
+  unsigned int i;
+  int ret;
+
+  if (txn->num_ops == 1) {
+    if (txn->ops[0].type == PUTREQ)
+      kvserver_put_ttl(server, txn->ops[0].key, txn->ops[0].value,
+          txn->ops[0].ttl);
+    else
+      kvserver_del(server, txn->ops[0].key);
+    return;
+  }
+  for (i = 0; i < txn->num_ops; i++) {
+    ops[i].key = txn->ops[i].key;
+    ops[i].value = (txn->ops[i].type == PUTREQ) ? txn->ops[i].value : NULL;
+    ops[i].expires = (ops[i].value != NULL && txn->ops[i].ttl != 0) ?
+        now + txn->ops[i].ttl : 0;
+  }
+  ret = kvengine_batch(&server->store, ops, txn->num_ops);
+  for (i = 0; i < txn->num_ops; i++) {
+    lock = kvcache_getlock(&server->cache, ops[i].key);
+    pthread_rwlock_wrlock(lock);
+    if (ret == 0 && ops[i].value != NULL &&
+        kvcache_put(&server->cache, ops[i].key, ops[i].value) == 0) {
+      if (ops[i].expires != 0)
+        kvcache_set_ttl(&server->cache, ops[i].key,
+            kvserver_ms_left(ops[i].expires));
+    } else {
+      kvcache_del(&server->cache, ops[i].key);
+    }
+    pthread_rwlock_unlock(lock);
+    if (ret == 0)
+      kvserver_add_timer(server, ops[i].key, ops[i].expires);
+  }
+}
+
+/* Checks whether the PUTREQ or DELREQ operation OP could be applied to
+ * SERVER. Returns 0 if it could, else a negative error code. */
+static int kvserver_check_op(kvserver_t *server, kvmessage_t *op) {
+  if (op->key == NULL)
+    return ERRINVLDMSG;
+  if (op->type == PUTREQ)
+    return (op->value == NULL) ? ERRINVLDMSG :
+        kvserver_put_check(server, op->key, op->value);
+  if (op->type == DELREQ)
+    return kvserver_del_check(server, op->key);
+  return ERRINVLDMSG;
+}
+
+/* Prepares OP, an operation of a transaction whose keys SERVER has locked,
+ * turning a CASREQ, INCRREQ or DECRREQ into the PUTREQ of the value it
+ * computes from the value currently stored, then checks it as
+ * kvserver_check_op does. An update thus reads the value stored before its
+ * transaction, even if an earlier operation of a batch writes the same key,
+ * and the PUTREQ keeps the TTL that value has left. Returns 0 if OP could be
+ * applied, else a negative error code. */
+static int kvserver_prepare_op(kvserver_t *server, kvmessage_t *op) {
+  char *current = NULL, *value;
+  unsigned long ttl = 0;
+  int ret;
+
+  if (op->key != NULL && kvserver_is_update(op->type)) {
+    if (op->type == CASREQ && op->value == NULL)
+      return ERRINVLDMSG;
+    if ((ret = kvserver_get_ttl(server, op->key, &current, &ttl)) ==
+        ERRNOKEY)
+      current = NULL;
+    else if (ret < 0)
+      return ret;
+    ret = kvserver_update_value(current, op, &value);
+    free(current);
+    if (ret < 0)
+      return ret;
+    free(op->value);
+    free(op->expected);
+    op->type = PUTREQ;
+    op->value = value;
+    op->expected = NULL;
+    op->ttl = ttl;
+  }
+  return kvserver_check_op(server, op);
+}
+
+/* Handles the first phase of TPC transaction REQMSG (a PUTREQ, DELREQ,
+ * BATCHREQ, CASREQ, INCRREQ or DECRREQ), populating RESPMSG with SERVER's
+ * vote. The transaction's keys are locked before its operations are checked
+ * and logged, so only the lock table update is serialized with other
+ * transactions. An update is logged as the PUTREQ it amounts to, and a vote
+ * to commit a single update carries the value it would write and the TTL it
+ * keeps, so that a master can check that its replicas agree and cache it. */
+static void kvserver_tpc_prepare(kvserver_t *server, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  kvmessage_t *ops = reqmsg;
+  unsigned int num_ops = 1, i;
+  kvtxn_t *txn;
+  int error = 0;
+
+  if (reqmsg->type == BATCHREQ) {
+    ops = reqmsg->ops;
+    num_ops = reqmsg->num_ops;
+    if (num_ops == 0)
+      error = ERRINVLDMSG;
+  }
+  for (i = 0; i < num_ops && !error; i++) {
+    if (ops[i].key == NULL)
+      error = ERRINVLDMSG;
+  }
+
+  pthread_mutex_lock(&server->tpc_lock);
+  if (kvserver_find_txn(server, reqmsg->txid) != NULL) {
+    /* This transaction is already prepared. */
+    pthread_mutex_unlock(&server->tpc_lock);
+    respmsg->message = ERRMSG_INVALID_REQUEST;
+    return;
+  }
+  if (!error && server->keylocks == NULL) {
+    /* No transaction is in flight, so every logged transaction has been
+     * applied and its entries are no longer needed to rebuild. */
+    tpclog_clear_log(&server->log);
+  }
+  if (!error)
+    error = kvserver_add_txn(server, reqmsg->txid, ops, num_ops, &txn);
+  pthread_mutex_unlock(&server->tpc_lock);
+
+  if (!error) {
+    /* The keys are locked now, so no other transaction can change whether
+     * these operations apply, or the values the updates among them read. */
+    for (i = 0; i < num_ops && !error; i++)
+      error = kvserver_prepare_op(server, &txn->ops[i]);
+    if (!error)
+      error = (reqmsg->type == BATCHREQ) ?
+          tpclog_log_batch(&server->log, reqmsg->txid, txn->ops, num_ops) :
+          tpclog_log_txn(&server->log, reqmsg->txid, txn->ops[0].type,
+              txn->ops[0].key, txn->ops[0].value, txn->ops[0].ttl);
+    if (!error && kvserver_is_update(reqmsg->type)) {
+      respmsg->ttl = txn->ops[0].ttl;
+      respmsg->value = kvarena_strdup(reqmsg->arena, txn->ops[0].value);
+      if (respmsg->value == NULL)
+        error = -ENOMEM;
+    }
+    if (error) {
+      pthread_mutex_lock(&server->tpc_lock);
+      kvserver_drop_txn(server, txn);
+      pthread_mutex_unlock(&server->tpc_lock);
+    }
+  }
+  if (error) {
+    respmsg->type = VOTE_ABORT;
+    respmsg->message = GETMSG(error);
+    return;
+  }
+  respmsg->type = VOTE_COMMIT;
+}
+
+/* Handles the second phase (a COMMIT or ABORT in REQMSG) of a TPC transaction
+ * on SERVER. A decision for a transaction which is not prepared, e.g. one
+ * which was already finished, is ignored. The decision is logged before the
+ * transaction is applied, and its keys stay locked until it has been. */
+static void kvserver_tpc_finish(kvserver_t *server, kvmessage_t *reqmsg) {
+  kvtxn_t *txn;
+  pthread_mutex_lock(&server->tpc_lock);
+  txn = kvserver_find_txn(server, reqmsg->txid);
+  if (txn != NULL)
+    HASH_DEL(server->txns, txn);
+  pthread_mutex_unlock(&server->tpc_lock);
+  if (txn == NULL)
+    return;
+
+  tpclog_log_txn(&server->log, txn->txid, reqmsg->type, NULL, NULL, 0);
+  if (reqmsg->type == COMMIT)
+    kvserver_apply_txn(server, txn);
+
+  pthread_mutex_lock(&server->tpc_lock);
+  kvserver_release_keys(server, txn);
+  pthread_mutex_unlock(&server->tpc_lock);
+  kvserver_free_txn(txn);
+}
+
+/* Adds KEY and VALUE, visited by kvserver_handle_scan, to the response AUX
+ * as a PUTREQ carrying the TTL left before EXPIRES. On failure, the
+ * response's message is set to an error. */
+static void kvserver_scan_visit(char *key, char *value, unsigned long expires,
+    void *aux) {
+  kvmessage_t *respmsg = aux, *ops, *op;
+  if (respmsg->message != NULL)
+    return;
+  ops = realloc(respmsg->ops, (respmsg->num_ops + 1) * sizeof(kvmessage_t));
+  if (ops == NULL) {
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+  respmsg->ops = ops;
+  op = &ops[respmsg->num_ops];
+  memset(op, 0, sizeof(kvmessage_t));
+  op->type = PUTREQ;
+  op->key = strdup(key);
+  op->value = strdup(value);
+  if (expires != 0)
+    op->ttl = kvserver_ttl_seconds(kvserver_ms_left(expires));
+  respmsg->num_ops++;
+  if (op->key == NULL || op->value == NULL)
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+}
+
+/* Answers the SCANREQ REQMSG with a batch of the entries in SERVER's store,
+ * as described in kvmessage.h. */
+static void kvserver_handle_scan(kvserver_t *server, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  int max = (reqmsg->value != NULL) ? atoi(reqmsg->value) : 0;
+  unsigned int i;
+  if (max <= 0) {
+    respmsg->message = ERRMSG_INVALID_REQUEST;
+    return;
+  }
+  if (kvengine_scan(&server->store, reqmsg->version, max, false,
+        kvserver_scan_visit, respmsg, &respmsg->version) < 0 && respmsg->message == NULL)
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+  if (respmsg->message != NULL) {
+    for (i = 0; i < respmsg->num_ops; i++)
+      kvmessage_free_fields(&respmsg->ops[i]);
+    free(respmsg->ops);
+    respmsg->ops = NULL;
+    respmsg->num_ops = 0;
+    respmsg->version = 0;
+    return;
+  }
+  respmsg->message = MSG_SUCCESS;
+}
+
 /* Handles an incoming kvmessage REQMSG, and populates the appropriate fields
  * of RESPMSG as a response. RESPMSG and REQMSG both must point to valid
  * kvmessage_t structs. Assumes that the request should be handled as a TPC
  * message. This should also log enough information in the server's TPC log to
  * be able to recreate the current state of the server upon recovering from
- * failure.  See the spec for details on logic and error messages.
+ * failure.  See the spec for details on logic and error messages. An INFO
+ * request is the master's heartbeat and is simply answered with success, and
+ * a SCANREQ lists part of SERVER's store so that a master can move keys to a
+ * newly registered slave.
+ *
+ * A BATCHREQ is voted on as a whole: SERVER votes to commit only if every one
+ * of its operations could be applied, and logs the batch with one entry.
+ * A CASREQ, INCRREQ or DECRREQ is prepared as the PUTREQ it amounts to (see
+ * kvserver_tpc_prepare).
+ * Requests are matched to their transaction by REQMSG->txid, and any number
+ * of transactions on disjoint keys may be prepared at once.
  *
  * Checkpoint 2 only. */
 void kvserver_handle_tpc(kvserver_t *server, kvmessage_t *reqmsg,
     kvmessage_t *respmsg) {
+  int error;
+  char *value;
+
   respmsg->type = RESP;
-  respmsg->message = ERRMSG_NOT_IMPLEMENTED;
+  respmsg->message = NULL;
+
+  if (reqmsg->version != 0 && reqmsg->key != NULL &&
+      (reqmsg->type == GETREQ || reqmsg->type == PUTREQ ||
+       reqmsg->type == DELREQ)) {
+    kvserver_handle_versioned(server, reqmsg, respmsg);
+    return;
+  }
+
+  switch (reqmsg->type) {
+    case GETREQ:
+      if (reqmsg->key == NULL) {
+        respmsg->message = ERRMSG_INVALID_REQUEST;
+        break;
+      }
+      error = kvserver_get_arena(server, reqmsg->key, &value, &respmsg->ttl,
+          reqmsg->arena);
+      if (!error) {
+        respmsg->type = GETRESP;
+        respmsg->key = reqmsg->key;
+        respmsg->value = value;
+        respmsg->message = MSG_SUCCESS;
+      } else {
+        respmsg->message = GETMSG(error);
+      }
+      break;
+    case PUTREQ:
+    case DELREQ:
+    case BATCHREQ:
+    case CASREQ:
+    case INCRREQ:
+    case DECRREQ:
+      kvserver_tpc_prepare(server, reqmsg, respmsg);
+      break;
+    case COMMIT:
+    case ABORT:
+      kvserver_tpc_finish(server, reqmsg);
+      respmsg->type = ACK;
+      break;
+    case INFO:
+      respmsg->message = MSG_SUCCESS;
+      break;
+    case SCANREQ:
+      kvserver_handle_scan(server, reqmsg, respmsg);
+      break;
+    default:
+      respmsg->message = ERRMSG_INVALID_REQUEST;
+      break;
+  }
 }
 
 /* Handles an incoming kvmessage REQMSG, and populates the appropriate fields
@@ -198,22 +930,38 @@ void kvserver_handle_no_tpc(kvserver_t *server, kvmessage_t *reqmsg,
     kvmessage_t *respmsg) {
 
   int error;
-  char **value = malloc(sizeof(char **));
+  char *value;
 
   /* Set default response type. */
   respmsg->type = RESP;
 
   if (reqmsg->type == GETREQ) {
-    error = kvserver_get(server, reqmsg->key, value);
+    error = kvserver_get_arena(server, reqmsg->key, &value, &respmsg->ttl,
+        reqmsg->arena);
     if (!error) {
       respmsg->type = GETRESP;
       respmsg->key = reqmsg->key;
-      respmsg->value = *value;
+      respmsg->value = value;
     }
   } else if (reqmsg->type == PUTREQ) {
-    error = kvserver_put(server, reqmsg->key, reqmsg->value);
+    error = kvserver_put_ttl(server, reqmsg->key, reqmsg->value,
+        reqmsg->ttl);
   } else if (reqmsg->type == DELREQ) {
     error = kvserver_del(server, reqmsg->key);
+  } else if (kvserver_is_update(reqmsg->type)) {
+    error = kvserver_update(server, reqmsg, &value);
+    if (!error && reqmsg->type == CASREQ) {
+      free(value);
+    } else if (!error &&
+        (value = kvarena_take(reqmsg->arena, value)) == NULL) {
+      error = -ENOMEM;
+    } else if (!error) {
+      respmsg->type = GETRESP;
+      respmsg->key = reqmsg->key;
+      respmsg->value = value;
+    }
+  } else {
+    error = ERRINVLDMSG;
   }
 
   if (!error) {
@@ -224,47 +972,369 @@ void kvserver_handle_no_tpc(kvserver_t *server, kvmessage_t *reqmsg,
   
 }
 
-/* Generic entrypoint for this SERVER. Takes in a socket on SOCKFD, which
- * should already be connected to an incoming request. Processes the request
- * and sends back a response message.  This should call out to the appropriate
- * internal handler. */
-void kvserver_handle(kvserver_t *server, int sockfd, void *extra) {
-  kvmessage_t *reqmsg, *respmsg;
-  respmsg = calloc(1, sizeof(kvmessage_t));
-  reqmsg = kvmessage_parse(sockfd);
+/* Handles REQMSG, a request read from CONN (or NULL if it could not be
+ * parsed), queueing the response on CONN. Takes ownership of REQMSG, which
+ * must be allocated in CONN's arena, or malloc()d if CONN has none. Serves
+ * as the kvconn_handler_t of the KVServer _SERVER. */
+static void kvserver_answer(void *_server, kvconn_t *conn,
+    kvmessage_t *reqmsg) {
+  kvserver_t *server = (kvserver_t *) _server;
+  kvmessage_t respmsg;
+  unsigned int i;
   void (*server_handler)(kvserver_t *server, kvmessage_t *reqmsg,
       kvmessage_t *respmsg);
   server_handler = server->use_tpc ?
     kvserver_handle_tpc : kvserver_handle_no_tpc;
+  memset(&respmsg, 0, sizeof(kvmessage_t));
   if (reqmsg == NULL) {
-    respmsg->type = RESP;
-    respmsg->message = ERRMSG_INVALID_REQUEST;
+    respmsg.type = RESP;
+    respmsg.message = ERRMSG_INVALID_REQUEST;
   } else {
-    server_handler(server, reqmsg, respmsg);
+    server_handler(server, reqmsg, &respmsg);
+  }
+  kvconn_queue(conn, &respmsg);
+  /* A response's value, if any, is always allocated for it, in the
+   * request's arena if it has one. Its operations are always malloc()d. */
+  if (reqmsg == NULL || reqmsg->arena == NULL)
+    free(respmsg.value);
+  if (respmsg.ops != NULL) {
+    for (i = 0; i < respmsg.num_ops; i++)
+      kvmessage_free_fields(&respmsg.ops[i]);
+    free(respmsg.ops);
   }
-  kvmessage_send(respmsg, sockfd);
   if (reqmsg != NULL)
     kvmessage_free(reqmsg);
 }
 
+/* Generic entrypoint for this SERVER. Takes in a socket on SOCKFD, which
+ * should already be connected to an incoming request. Processes the request
+ * and sends back a response message.  This should call out to the appropriate
+ * internal handler. Any further requests the client pipelines on SOCKFD are
+ * served the same way, and SOCKFD is closed afterwards (see kvconn_serve).
+ * EXTRA is the arena of the worker calling, or NULL if it has none. */
+void kvserver_handle(kvserver_t *server, int sockfd, void *extra) {
+  kvconn_serve(sockfd, (kvarena_t *) extra, kvserver_answer, server);
+}
+
+/* Handles REQMSG, a request which has already been read from the socket
+ * SOCKFD (or NULL if it could not be parsed), and sends back a response on
+ * SOCKFD, as kvserver_handle does. Takes ownership of REQMSG. */
+void kvserver_handle_message(kvserver_t *server, int sockfd,
+    kvmessage_t *reqmsg) {
+  kvconn_t conn;
+  kvconn_init(&conn, sockfd, NULL);
+  kvserver_answer(server, &conn, reqmsg);
+  kvconn_flush(&conn);
+  kvconn_free(&conn);
+}
+
+/* Fills OP with the PUTREQ or DELREQ operation stored in log entry ENTRY.
+ * OP's fields point into ENTRY. */
+static void kvserver_op_from_log(kvmessage_t *op, logentry_t *entry) {
+  memset(op, 0, sizeof(kvmessage_t));
+  op->type = entry->type;
+  op->ttl = entry->ttl;
+  op->key = entry->data;
+  if (entry->type == PUTREQ)
+    op->value = entry->data + strlen(entry->data) + 1;
+}
+
+/* Prepares the transaction logged in the PUTREQ, DELREQ or BATCHREQ log
+ * entry ENTRY on SERVER, replacing any transaction with the same id. Must be
+ * called with SERVER->tpc_lock held. */
+static void kvserver_prepare_from_log(kvserver_t *server, logentry_t *entry) {
+  logentry_t *op = NULL;
+  unsigned int num_ops = 0, i = 0;
+  kvtxn_t *txn = kvserver_find_txn(server, entry->txid);
+  if (txn != NULL)
+    kvserver_drop_txn(server, txn);
+  if (entry->type != BATCHREQ) {
+    kvmessage_t single;
+    kvserver_op_from_log(&single, entry);
+    kvserver_add_txn(server, entry->txid, &single, 1, &txn);
+    return;
+  }
+  while ((op = tpclog_batch_next(entry, op)) != NULL)
+    num_ops++;
+  kvmessage_t ops[num_ops];
+  while ((op = tpclog_batch_next(entry, op)) != NULL)
+    kvserver_op_from_log(&ops[i++], op);
+  kvserver_add_txn(server, entry->txid, ops, num_ops, &txn);
+}
+
 /* Restore SERVER back to the state it should be in, according to the
- * associated LOG.  Must be called on an initialized  SERVER. Only restores the
- * state of the most recent TPC transaction, assuming that all previous actions
- * have been written to persistent storage. Should restore SERVER to its exact
- * state; e.g. if SERVER had written into its log that it received a PUTREQ but
- * no corresponding COMMIT/ABORT, after calling this function SERVER should
- * again be waiting for a COMMIT/ABORT.  This should also ensure that as soon
- * as a server logs a COMMIT, even if it crashes immediately after (before the
- * KVStore has a chance to write to disk), the COMMIT will be finished upon
- * rebuild. The cache need not be the same as before rebuilding.
+ * associated LOG.  Must be called on an initialized  SERVER. Restores every
+ * TPC transaction which was prepared but not yet committed or aborted, along
+ * with its key locks, assuming that all earlier actions have been written to
+ * persistent storage. Should restore SERVER to its exact state; e.g. if SERVER
+ * had written into its log that it received a PUTREQ but no corresponding
+ * COMMIT/ABORT, after calling this function SERVER should again be waiting
+ * for a COMMIT/ABORT.  This should also ensure that as soon as a server logs
+ * a COMMIT, even if it crashes immediately after (before the KVStore has a
+ * chance to write to disk), the COMMIT will be finished upon rebuild. The
+ * cache need not be the same as before rebuilding.
  *
  * Checkpoint 2 only. */
 int kvserver_rebuild_state(kvserver_t *server) {
-  return -1;
+  logentry_t *entry;
+  kvtxn_t *txn, *tmp;
+  if (!server->use_tpc)
+    return -1;
+  pthread_mutex_lock(&server->tpc_lock);
+  HASH_ITER(hh, server->txns, txn, tmp) {
+    kvserver_drop_txn(server, txn);
+  }
+  tpclog_iterate_begin(&server->log);
+  while ((entry = tpclog_iterate_next(&server->log)) != NULL) {
+    switch (entry->type) {
+      case PUTREQ:
+      case DELREQ:
+      case BATCHREQ:
+        kvserver_prepare_from_log(server, entry);
+        break;
+      case COMMIT:
+      case ABORT:
+        txn = kvserver_find_txn(server, entry->txid);
+        if (txn == NULL)
+          break;
+        /* Applying a committed transaction again is harmless, and finishes
+         * it if the server crashed before it reached the store. Transactions
+         * writing the same key never overlap, so replaying commits in log
+         * order leaves each key with its last committed value. */
+        if (entry->type == COMMIT)
+          kvserver_apply_txn(server, txn);
+        kvserver_drop_txn(server, txn);
+        break;
+      default:
+        break;
+    }
+    free(entry);
+  }
+  pthread_mutex_unlock(&server->tpc_lock);
+  return 0;
+}
+
+/* Writes a dirty cache entry KEY, VALUE of the server AUX back to its
+ * store. */
+static int kvserver_flush_entry(char *key, char *value, void *aux) {
+  kvserver_t *server = aux;
+  return kvengine_put(&server->store, key, value);
+}
+
+/* Writes every dirty entry in SERVER's cache back to its store, syncs the
+ * store and then empties its write-ahead log. Most entries are written
+ * before writes are paused, so that the pause only covers the ones written
+ * in the meantime. A round in which nothing was logged syncs nothing.
+ * Returns 0 if successful, else a negative error code, in which case the log
+ * is kept. */
+static int kvserver_flush(kvserver_t *server) {
+  int ret;
+
+  if ((ret = kvcache_flush(&server->cache)) < 0)
+    return ret;
+  pthread_rwlock_wrlock(&server->wal_lock);
+  ret = kvcache_flush(&server->cache);
+  /* No records are appended while WAL_LOCK is held for writing. */
+  if (ret >= 0 && server->wal.size != 0 &&
+      (ret = kvengine_sync(&server->store)) == 0)
+    ret = kvwal_truncate(&server->wal);
+  pthread_rwlock_unlock(&server->wal_lock);
+  return ret < 0 ? ret : 0;
+}
+
+/* Runs SERVER's flusher, which writes dirty cache entries back every
+ * KVSERVER_FLUSH_MS until kvserver_stop_write_back is called. */
+static void *kvserver_flusher_loop(void *aux) {
+  kvserver_t *server = aux;
+
+  while (__atomic_load_n(&server->flusher_running, __ATOMIC_SEQ_CST)) {
+    usleep(KVSERVER_FLUSH_MS * 1000);
+    kvserver_flush(server);
+  }
+  return NULL;
+}
+
+/* Replays a write KEY, VALUE (NULL for a DEL) from the write-ahead log of the
+ * server AUX into its store. */
+static int kvserver_replay_entry(char *key, char *value, void *aux) {
+  kvserver_t *server = aux;
+
+  /* A DEL of a key which was never written back finds nothing to delete,
+   * which is fine. */
+  if (value == NULL) {
+    kvengine_del(&server->store, key);
+    return 0;
+  }
+  return kvengine_put(&server->store, key, value);
+}
+
+/* Switches the non-TPC server SERVER to write-back mode. Any writes left in
+ * its write-ahead log by an earlier run are first replayed into the store.
+ * Returns 0 if successful, else a negative error code. */
+int kvserver_start_write_back(kvserver_t *server) {
+  int ret;
+
+  if (server->use_tpc || server->write_back)
+    return -1;
+  if ((ret = kvwal_init(&server->wal, server->store.dirname)) < 0)
+    return ret;
+  if ((ret = kvwal_replay(&server->wal, kvserver_replay_entry, server)) < 0 ||
+      (ret = kvwal_truncate(&server->wal)) < 0) {
+    kvwal_close(&server->wal);
+    return ret;
+  }
+
+  pthread_rwlock_init(&server->wal_lock, NULL);
+  kvcache_set_flush(&server->cache, kvserver_flush_entry, server);
+  server->write_back = true;
+  server->flusher_running = true;
+  if (pthread_create(&server->flusher_thread, NULL, kvserver_flusher_loop,
+      server) != 0) {
+    server->write_back = server->flusher_running = false;
+    kvwal_close(&server->wal);
+    return -1;
+  }
+  return 0;
+}
+
+/* Stops SERVER's flusher and writes its remaining dirty entries back,
+ * switching it back to write-through. Must not be called while SERVER is
+ * handling requests. Returns 0 if successful, else a negative error code. */
+int kvserver_stop_write_back(kvserver_t *server) {
+  if (!server->write_back)
+    return 0;
+  __atomic_store_n(&server->flusher_running, false, __ATOMIC_SEQ_CST);
+  pthread_join(server->flusher_thread, NULL);
+  if (kvserver_flush(server) < 0)
+    return -1;
+  kvwal_close(&server->wal);
+  server->write_back = false;
+  kvcache_set_flush(&server->cache, NULL, NULL);
+  return 0;
+}
+
+/* Removes every key of SERVER whose timer has come due, taking at most
+ * KVSERVER_EXPIRE_BATCH of them from the timing wheel at once so that the
+ * wheel is not held while they are removed. */
+static void kvserver_reap(kvserver_t *server) {
+  char *keys[KVSERVER_EXPIRE_BATCH];
+  unsigned int num, i;
+
+  do {
+    num = kvwheel_expire(&server->expiry, time(NULL), KVSERVER_EXPIRE_BATCH,
+        keys);
+    for (i = 0; i < num; i++) {
+      kvserver_expire(server, keys[i]);
+      free(keys[i]);
+    }
+  } while (num == KVSERVER_EXPIRE_BATCH &&
+      __atomic_load_n(&server->reaper_running, __ATOMIC_SEQ_CST));
+}
+
+/* Runs SERVER's reaper, which removes expired keys every KVSERVER_EXPIRE_MS
+ * until kvserver_stop_expiry is called. */
+static void *kvserver_reaper_loop(void *aux) {
+  kvserver_t *server = aux;
+
+  while (__atomic_load_n(&server->reaper_running, __ATOMIC_SEQ_CST)) {
+    usleep(KVSERVER_EXPIRE_MS * 1000);
+    kvserver_reap(server);
+  }
+  return NULL;
+}
+
+/* The state of kvserver_start_expiry's scan of a server's store. */
+typedef struct {
+  kvserver_t *server;
+  char **expired;             /* The keys found expired in this batch. */
+  unsigned int num_expired;   /* The number of keys in EXPIRED. */
+  unsigned int capacity;      /* The number of keys EXPIRED has room for. */
+  int error;                  /* Set if a key could not be kept. */
+} kvserver_expiry_scan_t;
+
+/* Adds a timer for the entry KEY, which expires at EXPIRES, to the timing
+ * wheel of the server of the scan AUX, or, if it has already expired, keeps
+ * KEY to be removed once the scan lets go of its chain. */
+static void kvserver_expiry_visit(char *key, char *value,
+    unsigned long expires, void *aux) {
+  kvserver_expiry_scan_t *scan = aux;
+  char **expired, *copy;
+
+  if (!kvstore_expired(expires)) {
+    kvserver_add_timer(scan->server, key, expires);
+    return;
+  }
+  if (scan->num_expired == scan->capacity) {
+    expired = realloc(scan->expired,
+        (scan->capacity * 2 + 1) * sizeof(char *));
+    if (expired == NULL) {
+      scan->error = -ENOMEM;
+      return;
+    }
+    scan->expired = expired;
+    scan->capacity = scan->capacity * 2 + 1;
+  }
+  if ((copy = malloc(strlen(key) + 1)) == NULL) {
+    scan->error = -ENOMEM;
+    return;
+  }
+  strcpy(copy, key);
+  scan->expired[scan->num_expired++] = copy;
+}
+
+/* Starts SERVER's reaper, first adding a timer for every entry of its store
+ * which is yet to expire and removing every entry which expired while no
+ * reaper was running, such as across a restart. Returns 0 if successful,
+ * else a negative error code. */
+int kvserver_start_expiry(kvserver_t *server) {
+  kvserver_expiry_scan_t scan = {server, NULL, 0, 0, 0};
+  unsigned long start = 0, next = 0;
+  unsigned int i;
+  int ret, err;
+
+  if (server->reaper_running)
+    return -1;
+  /* Timers are added from here on, so that no write during the scan is
+   * missed; a key written twice simply has two timers. */
+  __atomic_store_n(&server->reaper_running, true, __ATOMIC_SEQ_CST);
+  do {
+    ret = kvengine_scan(&server->store, start, KVSERVER_EXPIRE_BATCH, true,
+        kvserver_expiry_visit, &scan, &next);
+    /* The scan has let go of each chain by now, so the keys it found
+     * expired can be removed; one written again since is left alone. */
+    for (i = 0; i < scan.num_expired; i++) {
+      err = kvserver_expire(server, scan.expired[i]);
+      if (err < 0 && err != ERRNOKEY && scan.error == 0)
+        scan.error = err;
+      free(scan.expired[i]);
+    }
+    scan.num_expired = 0;
+    if (ret >= 0 && scan.error < 0)
+      ret = scan.error;
+    start = next;
+  } while (ret >= 0 && next != 0);
+  free(scan.expired);
+  if (ret < 0 || pthread_create(&server->reaper_thread, NULL,
+      kvserver_reaper_loop, server) != 0) {
+    __atomic_store_n(&server->reaper_running, false, __ATOMIC_SEQ_CST);
+    kvwheel_free(&server->expiry);
+    return -1;
+  }
+  return 0;
+}
+
+/* Stops SERVER's reaper and drops its pending timers. Keys which expire
+ * afterwards still read as absent, but are left to be replaced or deleted. */
+void kvserver_stop_expiry(kvserver_t *server) {
+  if (!server->reaper_running)
+    return;
+  __atomic_store_n(&server->reaper_running, false, __ATOMIC_SEQ_CST);
+  pthread_join(server->reaper_thread, NULL);
+  kvwheel_free(&server->expiry);
 }
 
 /* Deletes all current entries in SERVER's store and removes the store
  * directory.  Also cleans the associated log. */
 int kvserver_clean(kvserver_t *server) {
-  return kvstore_clean(&server->store);
+  return kvengine_clean(&server->store);
 }
@@ -3,9 +3,13 @@
 
 #include <stdbool.h>
 #include "kvcache.h"
-#include "kvstore.h"
+#include "kvflight.h"
+#include "kvengine.h"
 #include "kvmessage.h"
+#include "kvwheel.h"
 #include "tpclog.h"
+#include "kvwal.h"
+#include "uthash.h"
 
 /* KVServer defines a server which will be used to store <key, value> pairs.
  *
@@ -22,7 +26,13 @@
  * to get an entry from cache before accessing its store to eliminate the need
  * to access disk when possible. The cache should write-through; that is, when
  * a new entry is stored, it should be written to both the cache and the store
- * immediately.
+ * immediately. Concurrent GETs which miss the cache on the same key are
+ * coalesced: one of them reads the key from the store while the others wait
+ * for its result (see kvflight.h).
+ *
+ * The store is reached through a storage engine (see kvengine.h), chosen by
+ * name when the server is initialized, so that a cache-tier server can keep
+ * its entries in memory only.
  *
  * A KVServer can operate in two modes; TPC or non-TPC. In non-TPC mode, all
  * PUT and DEL requests go immediately to the cache/store. In TPC mode, 2-Phase
@@ -31,12 +41,89 @@
  * Because the KVStore stores all data in persistent file storage, a non-TPC
  * KVServer can be reinitialized using a DIRNAME which contains a previous
  * KVServer and all old entries will be available, enabling easy crash
- * recovery.
+ * recovery. This does not hold for the memory engine.
  *
  * A TPC KVServer maintains state beyond the current KVStore entries, so a
  * TPCLog is used to log incoming requests and can be used to recreate the
  * state of the server upon crash recovery.
+ *
+ * A TPC transaction is either a single PUTREQ or DELREQ, or a BATCHREQ holding
+ * several of them, which is voted on, logged and committed as a unit.
+ *
+ * CASREQs, INCRREQs and DECRREQs (see kvmessage.h) are read-modify-writes of
+ * a single key. In non-TPC mode one is applied under its key's cache set
+ * lock and, through kvengine_update, its store lock, so no other write
+ * through SERVER can come between its read and its write. In TPC mode it is
+ * evaluated once its transaction holds the key's lock and is then prepared,
+ * logged and committed as the PUTREQ of the value it computed.
+ *
+ * Many TPC transactions may be prepared at once, each identified by the
+ * transaction id its messages carry. Preparing a transaction locks each of
+ * its keys in a per-key lock table until it is committed or aborted; a
+ * transaction which needs a key that is already locked votes to abort rather
+ * than wait, so transactions on unrelated keys proceed independently and no
+ * two prepared transactions can write the same key.
+ *
+ * A non-TPC KVServer can be switched to write-back mode with
+ * kvserver_start_write_back. A PUT is then appended to a write-ahead log (a
+ * single append-only file in the store's directory, see kvwal.h) and stored
+ * in the cache as a dirty entry, without touching the store. The PUT is
+ * acknowledged once its record is durable; writes arriving together share
+ * one fdatasync of the log (see kvwal_sync). A flusher thread writes dirty
+ * entries back to the store every KVSERVER_FLUSH_MS, so repeated writes of a
+ * key between flushes reach the store once, syncs the store and only then
+ * empties the log. A dirty entry which is evicted is written back first. On
+ * the next start, whatever the log still holds is replayed into the store.
+ * DELs go to the store at once, but are logged as well so that replaying the
+ * log cannot bring back a deleted key.
+ *
+ * A master in quorum mode bypasses 2PC: its writes carry a version and are
+ * applied directly if they are newer than what SERVER holds (see
+ * kvserver_put_versioned), and its reads ask for the stored version.
+ *
+ * A PUT may give its value a TTL in seconds (see kvmessage.h). The store
+ * entry records the second it expires at, after which it reads as absent,
+ * and the cache entry the milliseconds it has left; a GET answers with the
+ * seconds left. Expired keys are removed from the store by a reaper thread,
+ * started with kvserver_start_expiry, which every KVSERVER_EXPIRE_MS takes
+ * the keys which have come due from a timing wheel (see kvwheel.h) and
+ * expires up to KVSERVER_EXPIRE_BATCH of them at a time, each under its
+ * cache set lock, so the cost of reclaiming them does not grow with the
+ * number of keys stored. The wheel is kept in memory, so starting the reaper
+ * first adds a timer for every expiring entry in the store, and removes those
+ * which expired while no reaper was running. A server in
+ * write-back mode rejects TTLs, and its writes clear the TTL a key had.
+ *
+ * A request read by kvserver_handle is allocated in the arena of the worker
+ * handling it (see kvarena.h), and the value of its response is allocated
+ * there too, so that all of them are freed in one step once the response
+ * has been sent. A request without an arena gets a malloc()d value.
  */
+
+/* The interval (in milliseconds) at which a server in write-back mode writes
+ * its dirty cache entries back to its store. */
+#define KVSERVER_FLUSH_MS 100
+
+/* The interval (in milliseconds) at which the reaper expires keys, and the
+ * most keys it takes from the timing wheel at once. */
+#define KVSERVER_EXPIRE_MS 250
+#define KVSERVER_EXPIRE_BATCH 64
+
+/* A prepared TPC transaction, waiting for its COMMIT or ABORT. */
+typedef struct kvtxn {
+  unsigned long txid;       /* The id of this transaction. */
+  unsigned int num_ops;     /* The number of operations in OPS. */
+  kvmessage_t *ops;         /* The PUTREQ and DELREQ operations of this transaction. */
+  UT_hash_handle hh;        /* Make this struct hashable by TXID. */
+} kvtxn_t;
+
+/* An entry of the key lock table: KEY is written by prepared transaction TXN. */
+typedef struct kvkeylock {
+  char *key;                /* The locked key (owned by TXN). */
+  kvtxn_t *txn;             /* The transaction holding the lock. */
+  UT_hash_handle hh;        /* Make this struct hashable by KEY. */
+} kvkeylock_t;
+
 struct kvserver;
 typedef void (*kvhandle_t)(struct kvserver *, int sockfd, void *extra);
 
@@ -44,9 +131,21 @@ typedef void (*kvhandle_t)(struct kvserver *, int sockfd, void *extra);
  * not this is a TPC-enabled server. */
 typedef struct kvserver {
   kvcache_t cache;          /* The cache this server will use. */
-  kvstore_t store;          /* The store this server will use. */
+  kvengine_t store;         /* The storage engine this server will use. */
+  kvflight_t flights;       /* Coalesces concurrent loads of keys missing from CACHE. */
   tpclog_t log;             /* The log this server will use (checkpoint 2 only). */
+  kvtxn_t *txns;            /* The prepared TPC transactions, by id (checkpoint 2 only). */
+  kvkeylock_t *keylocks;    /* The keys locked by prepared transactions (checkpoint 2 only). */
+  pthread_mutex_t tpc_lock; /* Protects TXNS, KEYLOCKS and the log (checkpoint 2 only). */
   bool use_tpc;             /* 1 if this server should expect TPC operations, else 0. */
+  bool write_back;          /* Set if writes go to the cache and are written back later. */
+  kvwal_t wal;              /* The write-ahead log of writes not yet written back. */
+  pthread_rwlock_t wal_lock;/* Held for writing while the write-ahead log is emptied. */
+  bool flusher_running;     /* True while the flusher thread should keep running. */
+  pthread_t flusher_thread; /* The thread writing dirty cache entries back. */
+  kvwheel_t expiry;         /* The timers of the keys which expire. */
+  bool reaper_running;      /* True while the reaper thread should keep running. */
+  pthread_t reaper_thread;  /* The thread removing expired keys. */
   int max_threads;          /* The max threads this server will run on. */
   kvhandle_t handle;        /* The function this server will use to handle requests. */
   int listening;            /* 1 if this server is currently listening for requests, else 0. */
@@ -57,11 +156,12 @@ typedef struct kvserver {
 
 int kvserver_init(kvserver_t *, char *dirname, unsigned int num_sets,
     unsigned int elem_per_set, unsigned int max_threads, const char *hostname,
-    int port, bool use_tpc);
+    int port, bool use_tpc, const char *engine);
 
 int kvserver_register_master(kvserver_t *, int sockfd);
 
 void kvserver_handle(kvserver_t *, int sockfd, void *extra);
+void kvserver_handle_message(kvserver_t *, int sockfd, kvmessage_t *reqmsg);
 
 void kvserver_handle_tpc(kvserver_t *, kvmessage_t *reqmsg,
     kvmessage_t *respmsg);
@@ -69,11 +169,27 @@ void kvserver_handle_no_tpc(kvserver_t *, kvmessage_t *reqmsg,
     kvmessage_t *respmsg);
 
 int kvserver_get(kvserver_t *, char *key, char **value);
+int kvserver_get_ttl(kvserver_t *, char *key, char **value,
+    unsigned long *ttl);
 int kvserver_put(kvserver_t *, char *key, char *value);
+int kvserver_put_ttl(kvserver_t *, char *key, char *value, unsigned long ttl);
 int kvserver_del(kvserver_t *, char *key);
+int kvserver_update(kvserver_t *, kvmessage_t *op, char **value);
+int kvserver_expire(kvserver_t *, char *key);
+
+int kvserver_get_versioned(kvserver_t *, char *key, char **value,
+    unsigned long *version);
+int kvserver_put_versioned(kvserver_t *, char *key, char *value,
+    unsigned long version);
 
 int kvserver_rebuild_state(kvserver_t *);
 
+int kvserver_start_write_back(kvserver_t *);
+int kvserver_stop_write_back(kvserver_t *);
+
+int kvserver_start_expiry(kvserver_t *);
+void kvserver_stop_expiry(kvserver_t *);
+
 int kvserver_clean(kvserver_t *);
 
 #endif
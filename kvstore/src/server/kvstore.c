@@ -1,11 +1,17 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
 #include "kvstore.h"
+#include "kvmmap.h"
 
 /* The djb2 string hash algorithm
  * Do NOT change this function. 
@@ -18,90 +24,705 @@ unsigned long hash(char *str) {
   return hash;
 }
 
+/* Parses NAME as the filename of an entry, storing its hash and position
+ * within its hash chain into *HASHVAL and *CHAINPOS. Returns true if NAME is
+ * the filename of an entry, else false. */
+static bool parse_entry_name(char *name, unsigned long *hashval,
+    unsigned int *chainpos) {
+  int end = 0;
+  sscanf(name, "%lu-%u" KVSTORE_FILETYPE "%n", hashval, chainpos, &end);
+  return end > 0 && name[end] == '\0';
+}
+
+/* Returns true if NAME is that of a subdirectory level of a KVStore. */
+static bool is_fanout_dir(char *name) {
+  return strlen(name) == 2 && isxdigit(name[0]) && isxdigit(name[1]);
+}
+
+/* Returns true if DIRNAME holds the entry of any flat hash chain. */
+static bool has_flat_chains(char *dirname) {
+  unsigned long hashval;
+  unsigned int chainpos;
+  struct dirent *dent;
+  bool found = false;
+  DIR *dir = opendir(dirname);
+  if (dir == NULL)
+    return false;
+  while (!found && (dent = readdir(dir)) != NULL)
+    found = parse_entry_name(dent->d_name, &hashval, &chainpos);
+  closedir(dir);
+  return found;
+}
+
+/* Returns true if an entry which expires at EXPIRES, in seconds since the
+ * epoch (or never, if it is 0), has expired. */
+bool kvstore_expired(unsigned long expires) {
+  return expires != 0 && expires <= (unsigned long) time(NULL);
+}
+
+static int batch_recover(kvstore_t *store);
+
+/* Initializes kvstore STORE to keep its entries in a single memory-mapped
+ * file within DIRNAME, creating the directory and file if necessary.
+ * Returns 0 if successful, else a negative error code. */
+int kvstore_init_mmap(kvstore_t *store, char *dirname) {
+  char filename[MAX_FILENAME];
+  struct stat st;
+  int ret, i;
+  if (stat(dirname, &st) == -1) {
+    if (mkdir(dirname, 0700) == -1)
+      return errno;
+  }
+  strcpy(store->dirname, dirname);
+  for (i = 0; i < KVSTORE_LOCK_STRIPES; i++)
+    pthread_rwlock_init(&store->locks[i], NULL);
+  store->fanout = 0;
+  store->migrating = false;
+  store->chains = NULL;
+  pthread_mutex_init(&store->index_lock, NULL);
+  store->tailfd = -1;
+  store->tail_records = 0;
+  store->snapshotting = false;
+  pthread_mutex_init(&store->batch_lock, NULL);
+  if ((store->mmap = malloc(sizeof(kvmmap_t))) == NULL)
+    return -ENOMEM;
+  sprintf(filename, "%s/%s", dirname, KVSTORE_MMAP_FILE);
+  if ((ret = kvmmap_init(store->mmap, filename)) < 0) {
+    free(store->mmap);
+    store->mmap = NULL;
+    return ret;
+  }
+  return batch_recover(store);
+}
+
+/* Returns true if STORE may still hold hash chains in the flat layout. */
+bool kvstore_migrating(kvstore_t *store) {
+  return __atomic_load_n(&store->migrating, __ATOMIC_SEQ_CST);
+}
+
+/* Returns the lock guarding the hash chain of HASHVAL within STORE. Keys
+ * which collide share a chain and so always share a lock. */
+static pthread_rwlock_t *chain_lock(kvstore_t *store, unsigned long hashval) {
+  return &store->locks[hashval % KVSTORE_LOCK_STRIPES];
+}
+
+/* Writes into DIR the name of the directory holding the hash chain of HASHVAL
+ * within STORE. */
+static void chain_dir(kvstore_t *store, unsigned long hashval, char *dir) {
+  int len = sprintf(dir, "%s", store->dirname);
+  unsigned int i;
+  for (i = 0; i < store->fanout; i++)
+    len += sprintf(dir + len, "/%02lx", (hashval >> (8 * i)) & 0xff);
+}
+
+/* Syncs the file or directory PATH to disk. Returns 0 if successful, else
+ * ERRFILACCESS. */
+static int sync_path(char *path) {
+  int fd, ret;
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return ERRFILACCESS;
+  ret = (fsync(fd) == -1) ? ERRFILACCESS : 0;
+  close(fd);
+  return ret;
+}
+
+/* Creates the directory holding the hash chain of HASHVAL within STORE, along
+ * with any missing parents. The parent of each directory created is synced,
+ * so that syncing a chain's own directory is enough to make its entries
+ * durable. Returns 0 if successful, else a negative error code. */
+static int make_chain_dir(kvstore_t *store, unsigned long hashval) {
+  char dir[MAX_FILENAME];
+  int len = sprintf(dir, "%s", store->dirname), parent;
+  unsigned int i;
+  for (i = 0; i < store->fanout; i++) {
+    parent = len;
+    len += sprintf(dir + len, "/%02lx", (hashval >> (8 * i)) & 0xff);
+    if (mkdir(dir, 0700) == 0) {
+      dir[parent] = '\0';
+      if (sync_path(dir) < 0)
+        return ERRFILACCESS;
+      dir[parent] = '/';
+    } else if (errno != EEXIST) {
+      return ERRFILACCESS;
+    }
+  }
+  return 0;
+}
+
+/* Returns the number of entries in the hash chain of HASHVAL within the
+ * directory DIR. */
+static unsigned int chain_length(char *dir, unsigned long hashval) {
+  char filename[MAX_FILENAME];
+  unsigned int counter = 0;
+  struct stat st;
+  sprintf(filename, "%s/%lu-%u%s", dir, hashval, counter, KVSTORE_FILETYPE);
+  while (stat(filename, &st) != -1)
+    sprintf(filename, "%s/%lu-%u%s", dir, hashval, ++counter,
+        KVSTORE_FILETYPE);
+  return counter;
+}
+
+/* Called by walk_entries with the hash and chain position of an entry found
+ * DEPTH levels below the top of a store, and AUX. */
+typedef void (*walk_visit_t)(unsigned long hashval, unsigned int chainpos,
+    unsigned int depth, void *aux);
+
+/* Calls VISIT for each entry in the directory PATH, which is DEPTH levels
+ * below the top of a store with FANOUT levels, or in any of its subdirectory
+ * levels. Returns 0 if successful, else a negative error code. */
+static int walk_entries(char *path, unsigned int depth, unsigned int fanout,
+    walk_visit_t visit, void *aux) {
+  char subdir[MAX_FILENAME];
+  unsigned long hashval;
+  unsigned int chainpos;
+  struct dirent *dent;
+  int ret = 0;
+  DIR *dir;
+
+  if ((dir = opendir(path)) == NULL)
+    return (depth == 0) ? ERRFILACCESS : 0;
+  while (ret == 0 && (dent = readdir(dir)) != NULL) {
+    if (depth < fanout && is_fanout_dir(dent->d_name)) {
+      sprintf(subdir, "%s/%s", path, dent->d_name);
+      ret = walk_entries(subdir, depth + 1, fanout, visit, aux);
+    } else if (parse_entry_name(dent->d_name, &hashval, &chainpos)) {
+      visit(hashval, chainpos, depth, aux);
+    }
+  }
+  closedir(dir);
+  return ret;
+}
+
+/* Returns the length of the chain of HASHVAL recorded in STORE's index. */
+static unsigned int index_length(kvstore_t *store, unsigned long hashval) {
+  kvchain_t *chain;
+  unsigned int length;
+  pthread_mutex_lock(&store->index_lock);
+  HASH_FIND(hh, store->chains, &hashval, sizeof(unsigned long), chain);
+  length = (chain != NULL) ? chain->length : 0;
+  pthread_mutex_unlock(&store->index_lock);
+  return length;
+}
+
+/* Records LENGTH as the length of the chain of HASHVAL in STORE's index.
+ * Returns 0 if successful, else a negative error code. */
+static int index_set(kvstore_t *store, unsigned long hashval,
+    unsigned int length) {
+  kvchain_t *chain;
+  int ret = 0;
+  pthread_mutex_lock(&store->index_lock);
+  HASH_FIND(hh, store->chains, &hashval, sizeof(unsigned long), chain);
+  if (length == 0 && chain != NULL) {
+    HASH_DEL(store->chains, chain);
+    free(chain);
+  } else if (length > 0 && chain == NULL) {
+    if ((chain = malloc(sizeof(kvchain_t))) == NULL) {
+      ret = -ENOMEM;
+    } else {
+      chain->hashval = hashval;
+      chain->length = length;
+      HASH_ADD(hh, store->chains, hashval, sizeof(unsigned long), chain);
+    }
+  } else if (length > 0) {
+    chain->length = length;
+  }
+  pthread_mutex_unlock(&store->index_lock);
+  return ret;
+}
+
+/* Frees STORE's index. */
+static void index_free(kvstore_t *store) {
+  kvchain_t *chain, *tmp;
+  HASH_ITER(hh, store->chains, chain, tmp) {
+    HASH_DEL(store->chains, chain);
+    free(chain);
+  }
+}
+
+/* A record of the tail file, naming a chain which may have changed length
+ * since the snapshot. CHECK is the complement of HASHVAL, so that a record
+ * torn by a crash is recognized. */
+typedef struct {
+  unsigned long hashval;
+  unsigned long check;
+} tailrecord_t;
+
+/* Appends a record of the chain of HASHVAL to STORE's tail file and syncs
+ * it, so that the chain is re-read at startup even after a crash. Must be
+ * called with the write lock on the chain held, before its length changes,
+ * which it must not if this fails. Returns 0 if successful, else
+ * ERRFILACCESS. */
+static int index_note(kvstore_t *store, unsigned long hashval) {
+  tailrecord_t record = {hashval, ~hashval};
+  if (store->tailfd < 0)
+    return 0;
+  if (write(store->tailfd, &record, sizeof(tailrecord_t)) !=
+      sizeof(tailrecord_t) || fdatasync(store->tailfd) == -1)
+    return ERRFILACCESS;
+  __atomic_add_fetch(&store->tail_records, 1, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+/* The header of an index snapshot, which is followed by NUM_CHAINS records
+ * of the hash and length of a chain. */
+typedef struct {
+  unsigned long magic;         /* KVSTORE_SNAPSHOT_MAGIC. */
+  unsigned long fanout;        /* The fanout of the store. */
+  unsigned long num_chains;    /* The number of records which follow. */
+  unsigned long checksum;      /* The checksum of the records. */
+} snapheader_t;
+
+#define KVSTORE_SNAPSHOT_MAGIC 0x6b76736e61703031UL
+
+/* Returns CHECKSUM extended over the LEN bytes at BUF (FNV-1a). */
+static unsigned long snapshot_checksum(unsigned long checksum, void *buf,
+    size_t len) {
+  unsigned char *bytes = buf;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    checksum ^= bytes[i];
+    checksum *= 0x100000001b3UL;
+  }
+  return checksum;
+}
+
+/* Writes STORE's index to its snapshot file and empties its tail. Writers are
+ * held off meanwhile so that the snapshot matches the disk. The snapshot is
+ * synced before it replaces the old one, and the rename is synced before the
+ * tail is emptied, so that a crash leaves either snapshot with the tail it
+ * needs. A memory-mapped store has no index, so there is nothing to do for
+ * one. Returns 0 if successful, else a negative error code. */
+int kvstore_snapshot(kvstore_t *store) {
+  char filename[MAX_FILENAME], tmpname[MAX_FILENAME];
+  unsigned long record[2];
+  snapheader_t header;
+  kvchain_t *chain;
+  FILE *file;
+  int ret = 0, i;
+
+  if (store->mmap != NULL)
+    return 0;
+  for (i = 0; i < KVSTORE_LOCK_STRIPES; i++)
+    pthread_rwlock_rdlock(&store->locks[i]);
+  pthread_mutex_lock(&store->index_lock);
+  header.magic = KVSTORE_SNAPSHOT_MAGIC;
+  header.fanout = store->fanout;
+  header.num_chains = HASH_COUNT(store->chains);
+  header.checksum = 0xcbf29ce484222325UL;
+  for (chain = store->chains; chain != NULL; chain = chain->hh.next) {
+    record[0] = chain->hashval;
+    record[1] = chain->length;
+    header.checksum = snapshot_checksum(header.checksum, record,
+        sizeof(record));
+  }
+  sprintf(filename, "%s/%s", store->dirname, KVSTORE_SNAPSHOT);
+  sprintf(tmpname, "%s.tmp", filename);
+  if ((file = fopen(tmpname, "w")) == NULL) {
+    ret = ERRFILACCESS;
+  } else {
+    fwrite(&header, sizeof(snapheader_t), 1, file);
+    for (chain = store->chains; chain != NULL; chain = chain->hh.next) {
+      record[0] = chain->hashval;
+      record[1] = chain->length;
+      fwrite(record, sizeof(record), 1, file);
+    }
+    if (fflush(file) != 0 || fsync(fileno(file)) == -1)
+      ret = ERRFILACCESS;
+    if (fclose(file) != 0 || ret < 0 || rename(tmpname, filename) == -1) {
+      remove(tmpname);
+      ret = ERRFILACCESS;
+    } else if (sync_path(store->dirname) < 0) {
+      ret = ERRFILACCESS;
+    }
+  }
+  if (ret == 0 && store->tailfd >= 0 && ftruncate(store->tailfd, 0) == 0)
+    store->tail_records = 0;
+  pthread_mutex_unlock(&store->index_lock);
+  for (i = 0; i < KVSTORE_LOCK_STRIPES; i++)
+    pthread_rwlock_unlock(&store->locks[i]);
+  return ret;
+}
+
+/* Writes a new snapshot of STORE's index if its tail has grown long enough
+ * and no other thread is writing one. Must be called without any lock on a
+ * chain held. */
+static void index_maybe_snapshot(kvstore_t *store) {
+  unsigned long limit;
+  bool idle = false;
+  pthread_mutex_lock(&store->index_lock);
+  limit = HASH_COUNT(store->chains) / 8;
+  pthread_mutex_unlock(&store->index_lock);
+  if (limit < KVSTORE_SNAPSHOT_RECORDS)
+    limit = KVSTORE_SNAPSHOT_RECORDS;
+  if (__atomic_load_n(&store->tail_records, __ATOMIC_SEQ_CST) < limit ||
+      !__atomic_compare_exchange_n(&store->snapshotting, &idle, true, false,
+          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    return;
+  kvstore_snapshot(store);
+  __atomic_store_n(&store->snapshotting, false, __ATOMIC_SEQ_CST);
+}
+
+/* Loads STORE's index from its snapshot file, then re-reads the length of
+ * each chain named in its tail file from the disk. Returns 0 if successful,
+ * else a negative error code if there is no valid snapshot, in which case
+ * the index is left empty. */
+static int index_load(kvstore_t *store) {
+  char filename[MAX_FILENAME], dir[MAX_FILENAME];
+  unsigned long record[2], checksum = 0xcbf29ce484222325UL, i;
+  tailrecord_t tail;
+  snapheader_t header;
+  FILE *file;
+  int ret = 0;
+
+  sprintf(filename, "%s/%s", store->dirname, KVSTORE_SNAPSHOT);
+  if ((file = fopen(filename, "r")) == NULL)
+    return ERRNOKEY;
+  if (fread(&header, sizeof(snapheader_t), 1, file) != 1 ||
+      header.magic != KVSTORE_SNAPSHOT_MAGIC || header.fanout != store->fanout)
+    ret = -1;
+  for (i = 0; ret == 0 && i < header.num_chains; i++) {
+    if (fread(record, sizeof(record), 1, file) != 1) {
+      ret = -1;
+    } else {
+      checksum = snapshot_checksum(checksum, record, sizeof(record));
+      ret = index_set(store, record[0], record[1]);
+    }
+  }
+  fclose(file);
+  if (ret == 0 && checksum != header.checksum)
+    ret = -1;
+  if (ret < 0) {
+    index_free(store);
+    return ret;
+  }
+
+  sprintf(filename, "%s/%s", store->dirname, KVSTORE_TAIL);
+  if ((file = fopen(filename, "r")) == NULL)
+    return 0;
+  while (ret == 0 && fread(&tail, sizeof(tailrecord_t), 1, file) == 1 &&
+      tail.check == ~tail.hashval) {
+    chain_dir(store, tail.hashval, dir);
+    ret = index_set(store, tail.hashval, chain_length(dir, tail.hashval));
+    store->tail_records++;
+  }
+  fclose(file);
+  if (ret < 0)
+    index_free(store);
+  return ret;
+}
+
+/* Counts the entry at CHAINPOS of the chain of HASHVAL into the index of the
+ * store AUX, if it lies in the subdirectory layout. */
+static void index_visit(unsigned long hashval, unsigned int chainpos,
+    unsigned int depth, void *aux) {
+  kvstore_t *store = aux;
+  if (depth == store->fanout && index_length(store, hashval) < chainpos + 1)
+    index_set(store, hashval, chainpos + 1);
+}
+
+/* Rebuilds STORE's index by walking its directory, then snapshots it.
+ * Returns 0 if successful, else a negative error code. */
+static int index_rebuild(kvstore_t *store) {
+  int ret = walk_entries(store->dirname, 0, store->fanout, index_visit, store);
+  if (ret < 0)
+    return ret;
+  return kvstore_snapshot(store);
+}
+
+/* Initializes kvstore STORE with the default number of subdirectory levels,
+ * as for kvstore_init_fanout. */
+int kvstore_init(kvstore_t *store, char *dirname) {
+  return kvstore_init_fanout(store, dirname, KVSTORE_FANOUT);
+}
+
 /* Initializes kvstore STORE. Uses DIRNAME as the directory in which to store
- * the entries of this store, creating the directory if necessary. Returns 0 if
+ * the entries of this store, creating the directory if necessary, with
+ * FANOUT levels of subdirectories beneath it (see kvstore.h). If DIRNAME
+ * holds entries in the flat layout, STORE starts migrating them. The index
+ * is loaded from its snapshot, or rebuilt if there is no valid snapshot. A
+ * batch left in its log by a crash is then applied. Returns 0 if
  * successful, else a negative error code. */
-int kvstore_init(kvstore_t *store, char *dirname) {
+int kvstore_init_fanout(kvstore_t *store, char *dirname, unsigned int fanout) {
+  char filename[MAX_FILENAME];
   struct stat st;
+  int i, ret;
+  if (fanout > KVSTORE_MAX_FANOUT)
+    return -1;
   if (stat(dirname, &st) == -1) {
     if (mkdir(dirname, 0700) == -1)
       return errno;
   }
   strcpy(store->dirname, dirname);
-  pthread_rwlock_init(&store->lock, NULL);
+  for (i = 0; i < KVSTORE_LOCK_STRIPES; i++)
+    pthread_rwlock_init(&store->locks[i], NULL);
+  store->fanout = fanout;
+  store->migrating = fanout > 0 && has_flat_chains(dirname);
+  store->chains = NULL;
+  pthread_mutex_init(&store->index_lock, NULL);
+  store->tail_records = 0;
+  store->snapshotting = false;
+  store->mmap = NULL;
+  pthread_mutex_init(&store->batch_lock, NULL);
+  sprintf(filename, "%s/%s", dirname, KVSTORE_TAIL);
+  if ((store->tailfd = open(filename, O_WRONLY | O_APPEND | O_CREAT,
+      0600)) < 0)
+    return ERRFILACCESS;
+  if (index_load(store) < 0 && (ret = index_rebuild(store)) < 0)
+    return ret;
+  return batch_recover(store);
+}
+
+static int read_entry(char *filename, kventry_t **entryp, bool *legacy);
+static int write_entry_file(char *filename, kventry_t *entry);
+
+/* Rewrites the entry file FILENAME in the current format if it was written
+ * in the older one (see kvstore.h). The new file replaces the old one
+ * atomically, so that a crash leaves one or the other. Returns 0 if
+ * successful, else a negative error code. */
+static int upgrade_entry_file(char *filename) {
+  char tmpname[MAX_FILENAME];
+  kventry_t *entry;
+  bool legacy;
+  int ret;
+  if ((ret = read_entry(filename, &entry, &legacy)) != 0)
+    return (ret > 0) ? -ret : ret;
+  if (legacy) {
+    snprintf(tmpname, MAX_FILENAME, "%s.tmp", filename);
+    ret = write_entry_file(tmpname, entry);
+    if (ret == 0 && rename(tmpname, filename) == -1)
+      ret = ERRFILACCESS;
+  }
+  free(entry);
+  return ret;
+}
+
+/* Moves the flat hash chain of HASHVAL within STORE, if there is one, onto
+ * the end of its chain in the subdirectory layout, rewriting entries of the
+ * older format as it goes. Entries are moved last first, so that both chains
+ * stay complete if this is interrupted. Must be called with the write lock
+ * on the chain held. Returns 0 if successful, else a negative error code. */
+static int migrate_chain_locked(kvstore_t *store, unsigned long hashval) {
+  char dir[MAX_FILENAME], from[MAX_FILENAME], to[MAX_FILENAME];
+  unsigned int flatlen, fanlen;
+  int ret;
+  if (!kvstore_migrating(store) ||
+      (flatlen = chain_length(store->dirname, hashval)) == 0)
+    return 0;
+  if ((ret = make_chain_dir(store, hashval)) < 0)
+    return ret;
+  chain_dir(store, hashval, dir);
+  fanlen = index_length(store, hashval);
+  if ((ret = index_note(store, hashval)) < 0)
+    return ret;
+  while (flatlen > 0) {
+    sprintf(from, "%s/%lu-%u%s", store->dirname, hashval, --flatlen,
+        KVSTORE_FILETYPE);
+    sprintf(to, "%s/%lu-%u%s", dir, hashval, fanlen, KVSTORE_FILETYPE);
+    if ((ret = upgrade_entry_file(from)) < 0)
+      break;
+    if (rename(from, to) == -1) {
+      ret = ERRFILACCESS;
+      break;
+    }
+    fanlen++;
+  }
+  if (index_set(store, hashval, fanlen) < 0)
+    ret = -ENOMEM;
+  return ret;
+}
+
+/* The header of an entry file written before entries carried a version and
+ * an expiry time (see kvstore.h). */
+typedef struct {
+  int length;
+  char data[0];
+} kventry_legacy_t;
+
+/* Reads the entry stored in the file FILENAME, in either format (see
+ * kvstore.h), into *ENTRYP, using malloced memory which should be freed
+ * later. An entry of the older format is read as unversioned and never
+ * expiring, and *LEGACY (if LEGACY is not NULL) is set if it was. Returns 0
+ * if successful, ERRNOKEY if there is no such file, else an error code. */
+static int read_entry(char *filename, kventry_t **entryp, bool *legacy) {
+  FILE *file;
+  kventry_t *entry, header;
+  struct stat st;
+  size_t offset;
+  if ((file = fopen(filename, "r")) == NULL)
+    return (errno == ENOENT) ? ERRNOKEY : ERRFILACCESS;
+  memset(&header, 0, sizeof(kventry_t));
+  if (fstat(fileno(file), &st) == -1 ||
+      fread(&header, 1, sizeof(kventry_t), file) < sizeof(int) ||
+      header.length < 0) {
+    fclose(file);
+    return ERRFILACCESS;
+  }
+  /* An older entry's key may happen to start with the marker, but its file
+   * is always shorter than a current one of the same length. */
+  if (header.magic == KVSTORE_ENTRY_MAGIC &&
+      st.st_size == (off_t) (sizeof(kventry_t) + header.length)) {
+    offset = sizeof(kventry_t);
+  } else if (st.st_size == (off_t) (sizeof(kventry_legacy_t) + header.length)) {
+    offset = sizeof(kventry_legacy_t);
+    header.magic = KVSTORE_ENTRY_MAGIC;
+    header.version = 0;
+    header.expires = 0;
+  } else {
+    fclose(file);
+    return ERRFILACCESS;
+  }
+  entry = malloc(sizeof(kventry_t) + header.length);
+  if (entry == NULL) {
+    fclose(file);
+    return ENOMEM;
+  }
+  *entry = header;
+  fseek(file, offset, SEEK_SET);
+  if (fread(entry->data, 1, header.length, file) < (size_t) header.length) {
+    fclose(file);
+    free(entry);
+    return ERRFILACCESS;
+  }
+  fclose(file);
+  if (legacy != NULL)
+    *legacy = (offset == sizeof(kventry_legacy_t));
+  *entryp = entry;
   return 0;
 }
 
-/* Attempts to find an entry matching KEY within the store.
+/* Attempts to find an entry matching KEY, whose hash is HASHVAL, within the
+ * first LENGTH entries of the hash chain held in the directory DIR. Returns
+ * the position of the entry within the chain, else a negative error code;
+ * see find_entry_locked. */
+static int find_in_chain(char *dir, unsigned long hashval, char *key,
+    unsigned int length, kventry_t **entryp) {
+  unsigned int counter = 0;
+  char currfile[MAX_FILENAME];
+  kventry_t *entry;
+  int ret;
+  sprintf(currfile, "%s/%lu-%u%s", dir, hashval, counter++,
+      KVSTORE_FILETYPE);
+  while (counter <= length &&
+      (ret = read_entry(currfile, &entry, NULL)) == 0) {
+    if (strcmp(key, entry->data) == 0) {
+      if (entryp != NULL)
+        *entryp = entry;
+      else
+        free(entry);
+      return counter - 1;
+    }
+    free(entry);
+    sprintf(currfile, "%s/%lu-%u%s", dir, hashval, counter++,
+        KVSTORE_FILETYPE);
+  }
+  return (counter > length) ? ERRNOKEY : ret;
+}
+
+/* Attempts to find an entry matching KEY within the store. Must be called
+ * with the lock on KEY's hash chain held.
  *
  * Returns a nonnegative integer representing the location of the entry within
  * its hash chain (so, the entry's filename is "hash(key)-returnval.entry").
+ * Tombstones are found like any other entry. While STORE is migrating, an
+ * entry may be found in its flat chain instead; callers which go on to
+ * modify the chain must first move it with migrate_chain_locked.
  *
  * Returns a negative error code if the entry is not found or an error
  * occurred.
  *
- * If VALUE is not NULL, the value of the entry will be placed into VALUE using
- * malloced memory which should be freed later. */
-int find_entry(kvstore_t *store, char *key, char **value) {
+ * If ENTRYP is not NULL, the entry will be placed into ENTRYP using malloced
+ * memory which should be freed later. */
+static int find_entry_locked(kvstore_t *store, char *key, kventry_t **entryp) {
   unsigned long hashval;
-  unsigned int counter = 0;
-  char currfile[MAX_FILENAME];
-  size_t keylen = strlen(key);
+  char dir[MAX_FILENAME];
   struct stat st;
-  FILE *file;
-  kventry_t *entry, header;
-  if (keylen > MAX_KEYLEN)
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
     return ERRKEYLEN;
   if (stat(store->dirname, &st) == -1)
     return ERRFILACCESS;
   hashval = hash(key);
-  pthread_rwlock_rdlock(&store->lock);
-  sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, counter++,
-      KVSTORE_FILETYPE);
-  while (stat(currfile, &st) != -1) {
-    if ((file = fopen(currfile, "r")) == NULL) {
-      pthread_rwlock_unlock(&store->lock);
-      return ERRFILACCESS;
-    }
-    fread(&header, sizeof(kventry_t), 1, file);
-    fseek(file, 0L, SEEK_SET);
-    entry = malloc(sizeof(kventry_t) + header.length);
-    if (entry == NULL) {
-      pthread_rwlock_unlock(&store->lock);
+  chain_dir(store, hashval, dir);
+  /* The index spares a lookup of a key in no chain from the disk. */
+  ret = find_in_chain(dir, hashval, key, index_length(store, hashval),
+      entryp);
+  if (ret == ERRNOKEY && kvstore_migrating(store))
+    ret = find_in_chain(store->dirname, hashval, key, UINT_MAX, entryp);
+  return ret;
+}
+
+/* Returns true if ENTRY is a tombstone left by a versioned delete. */
+static bool entry_is_tombstone(kventry_t *entry) {
+  return entry->length == strlen(entry->data) + 1;
+}
+
+/* Returns true if ENTRY holds a value which has not expired. */
+static bool entry_is_live(kventry_t *entry) {
+  return !entry_is_tombstone(entry) && !kvstore_expired(entry->expires);
+}
+
+/* Attempts to find an entry matching KEY within the store, treating a
+ * tombstone or an expired entry as absent.
+ *
+ * Returns a nonnegative integer representing the location of the entry within
+ * its hash chain (so, the entry's filename is "hash(key)-returnval.entry").
+ *
+ * Returns a negative error code if the entry is not found or an error
+ * occurred.
+ *
+ * If VALUE is not NULL, the value of the entry will be placed into VALUE using
+ * malloced memory which should be freed later. If EXPIRES is not NULL, it is
+ * set to the time the entry expires at. */
+int find_entry(kvstore_t *store, char *key, char **value,
+    unsigned long *expires) {
+  pthread_rwlock_t *lock = chain_lock(store, hash(key));
+  kventry_t *entry;
+  int ret;
+  if (store->mmap != NULL) {
+    ret = kvmmap_get(store->mmap, key, value, NULL, expires);
+    return (ret == KVMMAP_TOMBSTONE) ? ERRNOKEY : ret;
+  }
+  pthread_rwlock_rdlock(lock);
+  ret = find_entry_locked(store, key, &entry);
+  pthread_rwlock_unlock(lock);
+  if (ret < 0)
+    return ret;
+  if (!entry_is_live(entry)) {
+    free(entry);
+    return ERRNOKEY;
+  }
+  if (expires != NULL)
+    *expires = entry->expires;
+  if (value != NULL) {
+    *value = malloc(entry->length - strlen(entry->data) - 1);
+    if (*value == NULL) {
+      free(entry);
       return ENOMEM;
     }
-    fread(entry, sizeof(kventry_t) + header.length, 1, file);
-    fclose(file);
-    if (strcmp(key, entry->data) == 0) {
-      if (value != NULL) {
-        *value = malloc(entry->length - strlen(entry->data) - 1);
-        if (*value == NULL) {
-          pthread_rwlock_unlock(&store->lock);
-          return ENOMEM;
-        }
-        strcpy(*value, entry->data + strlen(entry->data) + 1);
-        free(entry);
-      }
-      pthread_rwlock_unlock(&store->lock);
-      return counter - 1;
-    }
-    sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, counter++,
-        KVSTORE_FILETYPE);
+    strcpy(*value, entry->data + strlen(entry->data) + 1);
   }
-  pthread_rwlock_unlock(&store->lock);
-  return ERRNOKEY;
+  free(entry);
+  return ret;
 }
 
 /* Returns true if STORE contains KEY, else false. */
 bool kvstore_haskey(kvstore_t *store, char *key) {
-  return find_entry(store, key, NULL) >= 0;
+  return find_entry(store, key, NULL, NULL) >= 0;
 }
 
 /* Attempts to retrieve the entry denoted by KEY from STORE.
  * Returns 0 if successful, else a negative error code. The entry's value will
  * be placed into VALUE using malloc()d memory which should be free()d later. */
 int kvstore_get(kvstore_t *store, char *key, char **value) {
-  int ret = find_entry(store, key, value);
+  return kvstore_get_expiring(store, key, value, NULL);
+}
+
+/* Attempts to retrieve the entry denoted by KEY from STORE as kvstore_get
+ * does, also setting *EXPIRES (if EXPIRES is not NULL) to the time the entry
+ * expires at, or 0 if it never does. */
+int kvstore_get_expiring(kvstore_t *store, char *key, char **value,
+    unsigned long *expires) {
+  int ret = find_entry(store, key, value, expires);
   if (ret < 0)
     return ret;
   else
@@ -121,50 +742,371 @@ int kvstore_put_check(kvstore_t *store, char *key, char *value) {
   return 0;
 }
 
+/* Writes ENTRY to the file FILENAME, replacing it if it exists. Returns 0 if
+ * successful, ERRNOKEY if FILENAME's directory does not exist, else
+ * ERRFILACCESS. */
+static int write_entry_file(char *filename, kventry_t *entry) {
+  FILE *file = fopen(filename, "w");
+  size_t size = sizeof(kventry_t) + entry->length;
+  bool written;
+  if (file == NULL)
+    return (errno == ENOENT) ? ERRNOKEY : ERRFILACCESS;
+  written = (fwrite(entry, 1, size, file) == size);
+  if (fclose(file) == EOF || !written)
+    return ERRFILACCESS;
+  return 0;
+}
+
+/* Writes the entry for KEY to STORE, holding VALUE (or a tombstone if VALUE
+ * is NULL), VERSION and EXPIRES. CHAINPOS is the position of KEY's existing entry
+ * within its hash chain, or negative if it has none. Must be called with
+ * the write lock on KEY's hash chain held, after migrate_chain_locked.
+ * Returns 0 if successful, else a negative error code. */
+static int write_entry(kvstore_t *store, char *key, char *value,
+    unsigned long version, unsigned long expires, int chainpos) {
+  unsigned long hashval = hash(key);
+  int counter = chainpos;
+  size_t keylen = strlen(key), vallen = (value != NULL) ? strlen(value) + 1 : 0;
+  char dir[MAX_FILENAME], filename[MAX_FILENAME];
+  kventry_t *entry;
+  int ret;
+  chain_dir(store, hashval, dir);
+  if (counter < 0) {
+    /* Insert at the end of the hash chain, which is about to grow. */
+    counter = index_length(store, hashval);
+    if ((ret = index_note(store, hashval)) < 0)
+      return ret;
+  }
+  sprintf(filename, "%s/%lu-%u%s", dir, hashval, counter, KVSTORE_FILETYPE);
+  entry = malloc(sizeof(kventry_t) + keylen + 1 + vallen);
+  if (entry == NULL)
+    return ENOMEM;
+  entry->length = keylen + 1 + vallen;
+  entry->magic = KVSTORE_ENTRY_MAGIC;
+  entry->version = version;
+  entry->expires = expires;
+  strcpy(entry->data, key);
+  if (value != NULL)
+    strcpy(entry->data + keylen + 1, value);
+  ret = write_entry_file(filename, entry);
+  /* The first entry of a chain may also need its directory created. */
+  if (ret == ERRNOKEY && make_chain_dir(store, hashval) == 0)
+    ret = write_entry_file(filename, entry);
+  free(entry);
+  if (ret != 0)
+    return (ret == ERRNOKEY) ? ERRFILACCESS : ret;
+  if (chainpos < 0)
+    return index_set(store, hashval, counter + 1);
+  return 0;
+}
+
+/* Adds the given KEY, VALUE entry expiring at EXPIRES to STORE, as an
+ * unversioned PUT. Must be called with the write lock on KEY's hash chain
+ * held. Returns 0 if successful, else a negative error code. */
+static int put_entry_locked(kvstore_t *store, char *key, char *value,
+    unsigned long expires) {
+  int ret;
+  if ((ret = migrate_chain_locked(store, hash(key))) < 0)
+    return ret;
+  return write_entry(store, key, value, 0, expires,
+      find_entry_locked(store, key, NULL));
+}
+
 /* Adds the given KEY, VALUE entry to STORE. Returns 0 if successful, else a
  * negative error code. See kvserver.h for a complete description of how
  * entries are stored. */
 int kvstore_put(kvstore_t *store, char *key, char *value) {
-  unsigned long hashval;
-  int counter, check;
-  size_t keylen = strlen(key), vallen = strlen(value);
-  char filename[MAX_FILENAME];
-  struct stat st;
-  FILE *file;
-  kventry_t *entry;
+  return kvstore_put_expiring(store, key, value, 0);
+}
+
+/* Adds the given KEY, VALUE entry to STORE as kvstore_put does, to expire at
+ * EXPIRES, in seconds since the epoch, or never if EXPIRES is 0. Returns 0 if
+ * successful, else a negative error code. */
+int kvstore_put_expiring(kvstore_t *store, char *key, char *value,
+    unsigned long expires) {
+  pthread_rwlock_t *lock;
+  int check;
   if ((check = kvstore_put_check(store, key, value)) < 0)
     return check;
-  hashval = hash(key);
-  counter = find_entry(store, key, NULL);
-  pthread_rwlock_wrlock(&store->lock);
-  if (counter >= 0) {
-    /* Entry already exists, just update it. */
-    sprintf(filename, "%s/%lu-%u%s", store->dirname, hashval, counter,
-        KVSTORE_FILETYPE);
-  } else {
-    /* Search for the end of the hash chain to insert. */
-    counter = 0;
-    sprintf(filename, "%s/%lu-%u%s", store->dirname, hashval, counter++,
-        KVSTORE_FILETYPE);
-    while (stat(filename, &st) != -1)
-      sprintf(filename, "%s/%lu-%u%s", store->dirname, hashval, counter++,
-          KVSTORE_FILETYPE);
+  if (store->mmap != NULL)
+    return kvmmap_put(store->mmap, key, value, 0, expires, false);
+  lock = chain_lock(store, hash(key));
+  pthread_rwlock_wrlock(lock);
+  check = put_entry_locked(store, key, value, expires);
+  pthread_rwlock_unlock(lock);
+  index_maybe_snapshot(store);
+  return check;
+}
+
+/* Replaces the value of KEY in STORE with the one UPDATE computes from its
+ * current value and AUX, holding KEY's hash chain for the whole
+ * read-modify-write so that no other write to KEY comes between them. A
+ * tombstone or an expired entry counts as no value; otherwise the entry keeps
+ * the time it expires at. Returns 0 if successful, in which case the new
+ * value is placed into VALUE using malloc()d memory which should be free()d
+ * later and, unless EXPIRES is NULL, the time it expires at (0 if never) into
+ * EXPIRES, else a negative error code, which may be UPDATE's. */
+int kvstore_update(kvstore_t *store, char *key, kvstore_update_t update,
+    void *aux, char **value, unsigned long *expires) {
+  pthread_rwlock_t *lock;
+  kventry_t *entry = NULL;
+  char *current = NULL, *newvalue = NULL;
+  unsigned long keep = 0;
+  int chainpos, ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (store->mmap != NULL)
+    return kvmmap_update(store->mmap, key, update, aux, value, expires);
+  lock = chain_lock(store, hash(key));
+  pthread_rwlock_wrlock(lock);
+  if ((ret = migrate_chain_locked(store, hash(key))) < 0) {
+    pthread_rwlock_unlock(lock);
+    return ret;
   }
-  if ((file = fopen(filename, "w")) == NULL) {
-    pthread_rwlock_unlock(&store->lock);
-    return ERRFILACCESS;
+  chainpos = find_entry_locked(store, key, &entry);
+  if (chainpos >= 0 && entry_is_live(entry)) {
+    current = entry->data + strlen(entry->data) + 1;
+    keep = entry->expires;
+  }
+  if (chainpos < 0 && chainpos != ERRNOKEY)
+    ret = chainpos;
+  else if ((ret = update(current, aux, &newvalue)) == 0 &&
+      (ret = kvstore_put_check(store, key, newvalue)) == 0)
+    ret = write_entry(store, key, newvalue, 0, keep, chainpos);
+  pthread_rwlock_unlock(lock);
+  if (chainpos >= 0)
+    free(entry);
+  if (ret < 0) {
+    free(newvalue);
+    return ret;
+  }
+  index_maybe_snapshot(store);
+  *value = newvalue;
+  if (expires != NULL)
+    *expires = keep;
+  return 0;
+}
+
+/* Stores KEY with VALUE (or, if VALUE is NULL, a tombstone recording that KEY
+ * was deleted) at version VERSION, unless STORE already holds KEY at VERSION
+ * or a later one, in which case the write is stale and STORE is left as it
+ * is. Returns 0 if the write was applied, 1 if it was stale, else a negative
+ * error code. */
+int kvstore_put_versioned(kvstore_t *store, char *key, char *value,
+    unsigned long version) {
+  pthread_rwlock_t *lock;
+  kventry_t *entry;
+  int chainpos, ret;
+  if (value != NULL && (ret = kvstore_put_check(store, key, value)) < 0)
+    return ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (store->mmap != NULL)
+    return kvmmap_put(store->mmap, key, value, version, 0, true);
+  lock = chain_lock(store, hash(key));
+  pthread_rwlock_wrlock(lock);
+  if ((ret = migrate_chain_locked(store, hash(key))) < 0) {
+    pthread_rwlock_unlock(lock);
+    return ret;
+  }
+  chainpos = find_entry_locked(store, key, &entry);
+  if (chainpos >= 0) {
+    ret = (entry->version >= version);
+    free(entry);
+    if (ret) {
+      pthread_rwlock_unlock(lock);
+      return 1;
+    }
+  }
+  ret = write_entry(store, key, value, version, 0, chainpos);
+  pthread_rwlock_unlock(lock);
+  index_maybe_snapshot(store);
+  return ret;
+}
+
+/* Attempts to retrieve the entry denoted by KEY from STORE along with the
+ * version it was written at. Returns 0 if successful, else a negative error
+ * code. The entry's value will be placed into VALUE using malloc()d memory
+ * which should be free()d later, or VALUE will be set to NULL if the entry is
+ * a tombstone or has expired. */
+int kvstore_get_versioned(kvstore_t *store, char *key, char **value,
+    unsigned long *version) {
+  pthread_rwlock_t *lock = chain_lock(store, hash(key));
+  kventry_t *entry;
+  int ret;
+  if (store->mmap != NULL) {
+    ret = kvmmap_get(store->mmap, key, value, version, NULL);
+    return (ret == KVMMAP_TOMBSTONE) ? 0 : ret;
+  }
+  pthread_rwlock_rdlock(lock);
+  ret = find_entry_locked(store, key, &entry);
+  pthread_rwlock_unlock(lock);
+  if (ret < 0)
+    return ret;
+  *version = entry->version;
+  *value = NULL;
+  if (entry_is_live(entry)) {
+    *value = malloc(entry->length - strlen(entry->data) - 1);
+    if (*value == NULL) {
+      free(entry);
+      return ENOMEM;
+    }
+    strcpy(*value, entry->data + strlen(entry->data) + 1);
   }
-  entry = malloc(sizeof(kventry_t) + keylen + vallen + 2);
-  entry->length = keylen + vallen + 2;
-  strcpy(entry->data, key);
-  strcpy(entry->data + keylen + 1, value);
-  fwrite(entry, sizeof(kventry_t) + entry->length, 1, file);
-  fclose(file);
-  pthread_rwlock_unlock(&store->lock);
   free(entry);
   return 0;
 }
 
+/* Orders two hashes, for qsort. */
+static int compare_hashes(const void *a, const void *b) {
+  unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+  return (x > y) - (x < y);
+}
+
+/* The hashes of the chains found by a scan. */
+typedef struct {
+  unsigned long *hashes;
+  unsigned int num;
+  unsigned int size;
+  unsigned long start;         /* The least hash to be found. */
+  int error;                   /* Set to -ENOMEM if HASHES could not grow. */
+} hashlist_t;
+
+/* Adds HASHVAL to LIST if it is at least the start of LIST. */
+static void hashlist_add(hashlist_t *list, unsigned long hashval) {
+  unsigned long *grown;
+  if (hashval < list->start || list->error < 0)
+    return;
+  if (list->num == list->size) {
+    list->size = (list->size == 0) ? 64 : 2 * list->size;
+    grown = realloc(list->hashes, list->size * sizeof(unsigned long));
+    if (grown == NULL) {
+      list->error = -ENOMEM;
+      return;
+    }
+    list->hashes = grown;
+  }
+  list->hashes[list->num++] = hashval;
+}
+
+/* Adds the hash of each flat chain found by walk_entries to the hashlist_t
+ * AUX. */
+static void scan_flat_visit(unsigned long hashval, unsigned int chainpos,
+    unsigned int depth, void *aux) {
+  if (chainpos == 0)
+    hashlist_add(aux, hashval);
+}
+
+/* Calls VISIT for each live entry in the hash chain of HASHVAL held in the
+ * directory DIR, and each expired one too if EXPIRED is set, as for
+ * kvstore_scan. */
+static void visit_chain(char *dir, unsigned long hashval, bool expired,
+    kvstore_visit_t visit, void *aux) {
+  char filename[MAX_FILENAME];
+  unsigned int chainpos = 0;
+  kventry_t *entry;
+  sprintf(filename, "%s/%lu-%u%s", dir, hashval, chainpos++,
+      KVSTORE_FILETYPE);
+  while (read_entry(filename, &entry, NULL) == 0) {
+    if (entry_is_live(entry) || (expired && !entry_is_tombstone(entry)))
+      visit(entry->data, entry->data + strlen(entry->data) + 1,
+          entry->expires, aux);
+    free(entry);
+    sprintf(filename, "%s/%lu-%u%s", dir, hashval, chainpos++,
+        KVSTORE_FILETYPE);
+  }
+}
+
+/* Calls VISIT(KEY, VALUE, EXPIRES, AUX) for each entry of STORE whose key
+ * hashes to at least START, a whole hash chain at a time and in increasing
+ * order of hash, until the chains of MAX hashes have been visited. Tombstones
+ * are skipped, as are expired entries unless EXPIRED is set, and KEY and
+ * VALUE are only valid during the call. Each chain is read under its own
+ * lock, so VISIT must not call back into STORE. Sets
+ * *NEXT to the START with which to continue the scan, or to 0 if it is
+ * complete. Returns the number of hashes visited, else a negative error
+ * code. */
+int kvstore_scan(kvstore_t *store, unsigned long start, unsigned int max,
+    bool expired, kvstore_visit_t visit, void *aux, unsigned long *next) {
+  hashlist_t list = {NULL, 0, 0, start, 0};
+  char dir[MAX_FILENAME];
+  unsigned int num = 0, i;
+  kvchain_t *chain;
+  struct stat st;
+
+  if (store->mmap != NULL)
+    return kvmmap_scan(store->mmap, start, max, expired, visit, aux, next);
+  *next = 0;
+  if (stat(store->dirname, &st) == -1)
+    return ERRFILACCESS;
+  pthread_mutex_lock(&store->index_lock);
+  for (chain = store->chains; chain != NULL; chain = chain->hh.next)
+    hashlist_add(&list, chain->hashval);
+  pthread_mutex_unlock(&store->index_lock);
+  if (kvstore_migrating(store))
+    walk_entries(store->dirname, 0, 0, scan_flat_visit, &list);
+  if (list.error < 0) {
+    free(list.hashes);
+    return list.error;
+  }
+  qsort(list.hashes, list.num, sizeof(unsigned long), compare_hashes);
+  /* A chain being migrated may be found in both layouts. */
+  for (i = 0; i < list.num && num < max; i++) {
+    if (num > 0 && list.hashes[num - 1] == list.hashes[i])
+      continue;
+    list.hashes[num++] = list.hashes[i];
+  }
+  for (i = 0; i < num; i++) {
+    pthread_rwlock_rdlock(chain_lock(store, list.hashes[i]));
+    chain_dir(store, list.hashes[i], dir);
+    visit_chain(dir, list.hashes[i], expired, visit, aux);
+    if (kvstore_migrating(store))
+      visit_chain(store->dirname, list.hashes[i], expired, visit, aux);
+    pthread_rwlock_unlock(chain_lock(store, list.hashes[i]));
+  }
+  if (num > 0)
+    *next = list.hashes[num - 1] + 1;
+  free(list.hashes);
+  return num;
+}
+
+/* Moves up to MAX hash chains of STORE from the flat layout into its
+ * subdirectories, so that a store opened over a flat directory can be
+ * migrated in the background while it serves requests. Returns the number of
+ * chains moved, 0 once none are left (after which STORE is no longer
+ * migrating), else a negative error code. */
+int kvstore_migrate(kvstore_t *store, unsigned int max) {
+  unsigned long hashval;
+  unsigned int chainpos, moved = 0;
+  struct dirent *dent;
+  pthread_rwlock_t *lock;
+  int ret = 0;
+  DIR *dir;
+
+  if (!kvstore_migrating(store))
+    return 0;
+  if ((dir = opendir(store->dirname)) == NULL)
+    return ERRFILACCESS;
+  while (ret == 0 && moved < max && (dent = readdir(dir)) != NULL) {
+    if (!parse_entry_name(dent->d_name, &hashval, &chainpos) ||
+        chainpos != 0)
+      continue;
+    lock = chain_lock(store, hashval);
+    pthread_rwlock_wrlock(lock);
+    ret = migrate_chain_locked(store, hashval);
+    pthread_rwlock_unlock(lock);
+    moved++;
+  }
+  closedir(dir);
+  if (ret < 0)
+    return ret;
+  /* Writes since initialization have all gone to subdirectories, so a pass
+   * which finds nothing left means that the migration is complete. */
+  if (moved == 0)
+    __atomic_store_n(&store->migrating, false, __ATOMIC_SEQ_CST);
+  return moved;
+}
+
 /* Checks if STORE can successfully remove the given KEY.
  * Returns 0 if it can, else a negative error code indicating why it cannot. */
 int kvstore_del_check(kvstore_t *store, char *key) {
@@ -178,60 +1120,536 @@ int kvstore_del_check(kvstore_t *store, char *key) {
   return 0;
 }
 
-/* Removes the given KEY entry from STORE. Returns 0 if successful, else a
- * negative error code. Any hash chains which are disrupted by the deletion of
- * KEY will be reconnected within this function. */
-int kvstore_del(kvstore_t *store, char *key) {
+/* Removes the given KEY entry from STORE. Must be called with the write lock
+ * on KEY's hash chain held. Returns 0 if successful, else a negative error
+ * code. Any hash chains which are disrupted by the deletion of KEY will be
+ * reconnected within this function. An expired entry is removed, but reported
+ * as ERRNOKEY; if EXPIRED is set, only an expired entry is removed, and 0 is
+ * returned for it. */
+static int del_entry_locked(kvstore_t *store, char *key, bool expired) {
   char delfile[MAX_FILENAME];
   int chainpos;
-  unsigned long hashval;
+  unsigned long hashval = hash(key);
   unsigned int counter;
-  char currfile[MAX_FILENAME];
-  struct stat st;
-  chainpos = find_entry(store, key, NULL);
+  char currfile[MAX_FILENAME], dir[MAX_FILENAME];
+  kventry_t *entry;
+  int ret = 0;
+  if ((chainpos = migrate_chain_locked(store, hashval)) == 0)
+    chainpos = find_entry_locked(store, key, &entry);
+  if (chainpos >= 0) {
+    if (entry_is_tombstone(entry) ||
+        (expired && !kvstore_expired(entry->expires)))
+      chainpos = ERRNOKEY;
+    else if (!expired && kvstore_expired(entry->expires))
+      ret = ERRNOKEY;
+    free(entry);
+  }
   if (chainpos < 0)
     return chainpos;
-  counter = chainpos;
-  hashval = hash(key);
-  pthread_rwlock_wrlock(&store->lock);
-  sprintf(delfile, "%s/%lu-%u%s", store->dirname, hashval, chainpos, KVSTORE_FILETYPE);
-  sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, ++counter, KVSTORE_FILETYPE);
-  while (stat(currfile, &st) != -1) {
-    sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, ++counter, KVSTORE_FILETYPE);
-  }
+  counter = index_length(store, hashval);
+  chain_dir(store, hashval, dir);
+  sprintf(delfile, "%s/%lu-%u%s", dir, hashval, chainpos, KVSTORE_FILETYPE);
+  if (index_note(store, hashval) < 0)
+    return ERRFILACCESS;
   if (counter == chainpos + 1) {
     /* There were no elements in the chain after the element to be deleted. */
-    if (remove(delfile) == -1) {
-      pthread_rwlock_unlock(&store->lock);
+    if (remove(delfile) == -1)
       return errno;
-    }
   } else {
     /* There were elements in the chain after the element to be deleted.
        Take the last element in the chain and swap it into the deletion
        location. */
-    sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, counter - 1,
+    sprintf(currfile, "%s/%lu-%u%s", dir, hashval, counter - 1,
         KVSTORE_FILETYPE);
-    if (rename(currfile, delfile) == -1) {
-      pthread_rwlock_unlock(&store->lock);
+    if (rename(currfile, delfile) == -1)
       return errno;
-    }
   }
-  pthread_rwlock_unlock(&store->lock);
+  index_set(store, hashval, counter - 1);
+  return ret;
+}
+
+/* Removes the given KEY entry from STORE. Returns 0 if successful, else a
+ * negative error code. */
+int kvstore_del(kvstore_t *store, char *key) {
+  pthread_rwlock_t *lock = chain_lock(store, hash(key));
+  int ret;
+  if (store->mmap != NULL)
+    return kvmmap_del(store->mmap, key);
+  pthread_rwlock_wrlock(lock);
+  ret = del_entry_locked(store, key, false);
+  pthread_rwlock_unlock(lock);
+  if (ret == 0)
+    index_maybe_snapshot(store);
+  return ret;
+}
+
+/* Removes the entry KEY from STORE if it has expired, leaving it be if it has
+ * since been written with a later (or no) expiry. Returns 0 if it was
+ * removed, ERRNOKEY if there was no expired entry to remove, else a negative
+ * error code. */
+int kvstore_expire(kvstore_t *store, char *key) {
+  pthread_rwlock_t *lock = chain_lock(store, hash(key));
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (store->mmap != NULL)
+    return kvmmap_expire(store->mmap, key);
+  pthread_rwlock_wrlock(lock);
+  ret = del_entry_locked(store, key, true);
+  pthread_rwlock_unlock(lock);
+  if (ret == 0)
+    index_maybe_snapshot(store);
+  return ret;
+}
+
+/* Initializes BATCH to hold no writes. */
+void kvstore_batch_init(kvstore_batch_t *batch) {
+  batch->ops = NULL;
+  batch->num_ops = 0;
+  batch->capacity = 0;
+}
+
+/* Appends to BATCH a write of KEY with VALUE expiring at EXPIRES, or a DEL of
+ * KEY if VALUE is NULL, copying both. Returns 0 if successful, else a negative
+ * error code. */
+static int batch_add(kvstore_batch_t *batch, char *key, char *value,
+    unsigned long expires) {
+  kvstore_op_t *ops, *op;
+  unsigned int capacity;
+  if (batch->num_ops == batch->capacity) {
+    capacity = (batch->capacity > 0) ? 2 * batch->capacity : 8;
+    if ((ops = realloc(batch->ops, capacity * sizeof(kvstore_op_t))) == NULL)
+      return -ENOMEM;
+    batch->ops = ops;
+    batch->capacity = capacity;
+  }
+  op = &batch->ops[batch->num_ops];
+  op->key = malloc(strlen(key) + 1);
+  op->value = (value != NULL) ? malloc(strlen(value) + 1) : NULL;
+  if (op->key == NULL || (value != NULL && op->value == NULL)) {
+    free(op->key);
+    free(op->value);
+    return -ENOMEM;
+  }
+  strcpy(op->key, key);
+  if (value != NULL)
+    strcpy(op->value, value);
+  op->expires = expires;
+  batch->num_ops++;
   return 0;
 }
 
-/* Deletes all current entries in STORE and removes the store directory. */
-int kvstore_clean(kvstore_t *store) {
+/* Stages a PUT of KEY with VALUE in BATCH. Returns 0 if successful, else a
+ * negative error code. */
+int kvstore_batch_put(kvstore_batch_t *batch, char *key, char *value) {
+  return batch_add(batch, key, value, 0);
+}
+
+/* Stages a DEL of KEY in BATCH. A DEL of a key which is absent when the
+ * batch is written does nothing. Returns 0 if successful, else a negative
+ * error code. */
+int kvstore_batch_del(kvstore_batch_t *batch, char *key) {
+  return batch_add(batch, key, NULL, 0);
+}
+
+/* Frees the writes staged in BATCH, leaving it empty. */
+void kvstore_batch_free(kvstore_batch_t *batch) {
+  unsigned int i;
+  for (i = 0; i < batch->num_ops; i++) {
+    free(batch->ops[i].key);
+    free(batch->ops[i].value);
+  }
+  free(batch->ops);
+  kvstore_batch_init(batch);
+}
+
+/* The header of a batch log, which is followed by LENGTH bytes holding its
+ * writes, each a batchrecord_t followed by its key and value without
+ * terminators. */
+typedef struct {
+  unsigned long magic;         /* KVSTORE_BATCH_MAGIC. */
+  unsigned long num_ops;       /* The number of writes which follow. */
+  unsigned long length;        /* The number of bytes which follow. */
+  unsigned long checksum;      /* The checksum of those bytes. */
+} batchheader_t;
+
+/* A write within a batch log. */
+typedef struct {
+  unsigned int keylen;         /* The length of the key. */
+  unsigned int vallen;         /* The length of the value, or BATCH_DEL. */
+  unsigned long expires;       /* The time the value expires at, or 0. */
+} batchrecord_t;
+
+#define KVSTORE_BATCH_MAGIC 0x6b7662617463680bUL
+#define BATCH_DEL UINT_MAX
+
+/* Writes into FILENAME the name of the log of the batch numbered SEQ within
+ * STORE. */
+static void batch_log_name(kvstore_t *store, unsigned long seq,
+    char *filename) {
+  sprintf(filename, "%s/%s.%lu", store->dirname, KVSTORE_BATCH_LOG, seq);
+}
+
+/* Writes the NUM_OPS writes OPS to the log of the batch numbered SEQ within
+ * STORE and syncs it to disk. Must be called with STORE's batch lock held.
+ * Returns 0 if successful, else a negative error code. */
+static int batch_log(kvstore_t *store, unsigned long seq, kvstore_op_t *ops,
+    unsigned int num_ops) {
+  char filename[MAX_FILENAME], *buf, *pos;
+  batchheader_t *header;
+  batchrecord_t record;
+  size_t length = 0;
+  unsigned int i;
+  int fd, ret = 0;
+
+  for (i = 0; i < num_ops; i++)
+    length += sizeof(batchrecord_t) + strlen(ops[i].key) +
+        ((ops[i].value != NULL) ? strlen(ops[i].value) : 0);
+  if ((buf = malloc(sizeof(batchheader_t) + length)) == NULL)
+    return -ENOMEM;
+  pos = buf + sizeof(batchheader_t);
+  for (i = 0; i < num_ops; i++) {
+    record.keylen = strlen(ops[i].key);
+    record.vallen = (ops[i].value != NULL) ? strlen(ops[i].value) : BATCH_DEL;
+    record.expires = ops[i].expires;
+    memcpy(pos, &record, sizeof(batchrecord_t));
+    pos += sizeof(batchrecord_t);
+    memcpy(pos, ops[i].key, record.keylen);
+    pos += record.keylen;
+    if (ops[i].value != NULL) {
+      memcpy(pos, ops[i].value, record.vallen);
+      pos += record.vallen;
+    }
+  }
+  header = (batchheader_t *) buf;
+  header->magic = KVSTORE_BATCH_MAGIC;
+  header->num_ops = num_ops;
+  header->length = length;
+  header->checksum = snapshot_checksum(0xcbf29ce484222325UL,
+      buf + sizeof(batchheader_t), length);
+
+  batch_log_name(store, seq, filename);
+  if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+    free(buf);
+    return ERRFILACCESS;
+  }
+  if (write(fd, buf, sizeof(batchheader_t) + length) !=
+      sizeof(batchheader_t) + length || fdatasync(fd) == -1)
+    ret = ERRFILACCESS;
+  close(fd);
+  free(buf);
+  return ret;
+}
+
+/* Applies the NUM_OPS writes OPS to STORE, stopping at the first which
+ * fails. Must be called with the write locks on all of their hash chains
+ * held, or before STORE is shared. Returns 0 if successful, else a negative
+ * error code. */
+static int batch_apply(kvstore_t *store, kvstore_op_t *ops,
+    unsigned int num_ops) {
+  unsigned int i;
+  int ret = 0;
+  if (store->mmap != NULL)
+    return kvmmap_batch(store->mmap, ops, num_ops);
+  for (i = 0; ret == 0 && i < num_ops; i++) {
+    if (ops[i].value != NULL)
+      ret = put_entry_locked(store, ops[i].key, ops[i].value,
+          ops[i].expires);
+    else if ((ret = del_entry_locked(store, ops[i].key, false)) == ERRNOKEY)
+      ret = 0;
+  }
+  return ret;
+}
+
+/* Writes the entries of STORE through to the disk: the filesystem holding
+ * its directory, or its memory-mapped file. Returns 0 if successful, else a
+ * negative error code. */
+static int sync_entries(kvstore_t *store) {
+  int fd, ret;
+  if (store->mmap != NULL)
+    return kvmmap_sync(store->mmap);
+  if ((fd = open(store->dirname, O_RDONLY)) < 0)
+    return ERRFILACCESS;
+  ret = (syncfs(fd) == -1) ? ERRFILACCESS : 0;
+  close(fd);
+  return ret;
+}
+
+/* Writes the entries of STORE which the NUM_OPS writes OPS may have touched
+ * through to the disk: the entry files of their hash chains and the
+ * directories holding them, along with the tail file, or STORE's
+ * memory-mapped file. Each chain is held for reading while it is synced, so
+ * that a concurrent write cannot move one of its entries out from under the
+ * sync, while readers go on. Returns 0 if successful, else a negative error
+ * code. */
+static int sync_batch(kvstore_t *store, kvstore_op_t *ops,
+    unsigned int num_ops) {
+  char dir[MAX_FILENAME], filename[MAX_FILENAME];
+  unsigned long *hashvals;
+  unsigned int i, j, length, pos;
+  pthread_rwlock_t *lock;
+  int ret = 0;
+
+  if (store->mmap != NULL)
+    return kvmmap_sync(store->mmap);
+  if (store->tailfd >= 0 && fdatasync(store->tailfd) == -1)
+    return ERRFILACCESS;
+  /* Entries moved out of the flat layout leave the top directory changed. */
+  if (kvstore_migrating(store) && sync_path(store->dirname) < 0)
+    return ERRFILACCESS;
+  if ((hashvals = malloc(num_ops * sizeof(unsigned long))) == NULL)
+    return -ENOMEM;
+  for (i = 0; ret == 0 && i < num_ops; i++) {
+    hashvals[i] = hash(ops[i].key);
+    for (j = 0; j < i && hashvals[j] != hashvals[i]; j++)
+      ;
+    if (j < i)
+      continue;
+    lock = chain_lock(store, hashvals[i]);
+    pthread_rwlock_rdlock(lock);
+    chain_dir(store, hashvals[i], dir);
+    length = index_length(store, hashvals[i]);
+    for (pos = 0; ret == 0 && pos < length; pos++) {
+      sprintf(filename, "%s/%lu-%u%s", dir, hashvals[i], pos,
+          KVSTORE_FILETYPE);
+      ret = sync_path(filename);
+    }
+    /* A chain which is now empty may never have had a directory. */
+    if (ret == 0 && sync_path(dir) < 0 && length > 0)
+      ret = ERRFILACCESS;
+    pthread_rwlock_unlock(lock);
+  }
+  free(hashvals);
+  return ret;
+}
+
+/* Applies the batch in the log FILENAME within STORE, left by a crash, if it
+ * is complete, then syncs its entries and removes the log. Returns 0 if
+ * successful, else a negative error code. */
+static int batch_recover_log(kvstore_t *store, char *filename) {
+  char *buf = NULL, *pos, *key, *value;
+  kvstore_batch_t batch;
+  batchheader_t header;
+  batchrecord_t record;
+  unsigned long i;
+  FILE *file;
+  int ret = -1;
+
+  if ((file = fopen(filename, "r")) == NULL)
+    return 0;
+  kvstore_batch_init(&batch);
+  if (fread(&header, sizeof(batchheader_t), 1, file) == 1 &&
+      header.magic == KVSTORE_BATCH_MAGIC &&
+      (buf = malloc(header.length + 1)) != NULL &&
+      fread(buf, 1, header.length, file) == header.length &&
+      snapshot_checksum(0xcbf29ce484222325UL, buf, header.length) ==
+      header.checksum)
+    ret = 0;
+  fclose(file);
+  pos = buf;
+  for (i = 0; ret == 0 && i < header.num_ops; i++) {
+    memcpy(&record, pos, sizeof(batchrecord_t));
+    pos += sizeof(batchrecord_t);
+    key = strndup(pos, record.keylen);
+    pos += record.keylen;
+    value = NULL;
+    if (record.vallen != BATCH_DEL) {
+      value = strndup(pos, record.vallen);
+      pos += record.vallen;
+    }
+    if (key == NULL || (record.vallen != BATCH_DEL && value == NULL))
+      ret = -ENOMEM;
+    else
+      ret = batch_add(&batch, key, value, record.expires);
+    free(key);
+    free(value);
+  }
+  free(buf);
+  /* A log which is incomplete was never committed, so it is dropped. */
+  if (ret == 0) {
+    if ((ret = batch_apply(store, batch.ops, batch.num_ops)) == 0)
+      ret = sync_batch(store, batch.ops, batch.num_ops);
+  } else if (ret == -1) {
+    ret = 0;
+  }
+  kvstore_batch_free(&batch);
+  if (ret == 0)
+    remove(filename);
+  return ret;
+}
+
+/* Orders batch numbers for qsort. */
+static int batch_seq_cmp(const void *a, const void *b) {
+  unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+  return (x > y) - (x < y);
+}
+
+/* Applies the batches left in STORE's batch logs by a crash, in the order
+ * they were logged, as batch_recover_log does, and numbers later batches
+ * after them. Returns 0 if successful, else a negative error code. */
+static int batch_recover(kvstore_t *store) {
+  char filename[MAX_FILENAME], *end;
+  size_t prefix = strlen(KVSTORE_BATCH_LOG);
+  unsigned long *seqs = NULL, *grown, seq;
+  unsigned int num = 0, capacity = 0, i;
   struct dirent *dent;
+  int ret = 0;
+  DIR *dir;
+
+  store->batch_seq = 0;
+  if ((dir = opendir(store->dirname)) == NULL)
+    return ERRFILACCESS;
+  while (ret == 0 && (dent = readdir(dir)) != NULL) {
+    if (strncmp(dent->d_name, KVSTORE_BATCH_LOG, prefix) != 0 ||
+        dent->d_name[prefix] != '.' || !isdigit(dent->d_name[prefix + 1]))
+      continue;
+    seq = strtoul(dent->d_name + prefix + 1, &end, 10);
+    if (*end != '\0')
+      continue;
+    if (num == capacity) {
+      capacity = (capacity > 0) ? 2 * capacity : 8;
+      if ((grown = realloc(seqs, capacity * sizeof(unsigned long))) == NULL) {
+        ret = -ENOMEM;
+        break;
+      }
+      seqs = grown;
+    }
+    seqs[num++] = seq;
+  }
+  closedir(dir);
+  qsort(seqs, num, sizeof(unsigned long), batch_seq_cmp);
+  for (i = 0; ret == 0 && i < num; i++) {
+    batch_log_name(store, seqs[i], filename);
+    ret = batch_recover_log(store, filename);
+    store->batch_seq = seqs[i];
+  }
+  free(seqs);
+  return ret;
+}
+
+/* Applies the writes staged in BATCH to STORE atomically, as described in
+ * kvstore.h: no reader sees only some of them, and a crash leaves either
+ * none of them or (once STORE is next initialized) all of them applied.
+ * Batches are logged and applied one at a time, each to a log of its own,
+ * which is synced. The entry files and directories of the chains the batch
+ * wrote must then be on disk before the log that would redo them is removed;
+ * they are synced once the batch lock and the chains' write locks are
+ * released, so that neither the next batch nor readers wait for it. A DEL of
+ * an absent key does nothing. Every write is checked before any is made; if
+ * one fails anyway, the log is kept so that the batch is completed when
+ * STORE is next initialized. Returns 0 if successful, else a negative error
+ * code. */
+int kvstore_write_batch(kvstore_t *store, kvstore_batch_t *batch) {
+  bool held[KVSTORE_LOCK_STRIPES] = {false};
   char filename[MAX_FILENAME];
-  DIR *kvstoredir = opendir(store->dirname);
-  if (kvstoredir == NULL)
+  struct stat st;
+  unsigned int i;
+  int ret;
+
+  for (i = 0; i < batch->num_ops; i++) {
+    if (strlen(batch->ops[i].key) > MAX_KEYLEN)
+      return ERRKEYLEN;
+    if (batch->ops[i].value != NULL &&
+        strlen(batch->ops[i].value) > MAX_VALLEN)
+      return ERRVALLEN;
+    held[hash(batch->ops[i].key) % KVSTORE_LOCK_STRIPES] = true;
+  }
+  if (stat(store->dirname, &st) == -1)
+    return ERRFILACCESS;
+  if (batch->num_ops == 0)
     return 0;
-  while ((dent = readdir(kvstoredir)) != NULL) {
-    sprintf(filename, "%s/%s", store->dirname, dent->d_name);
+
+  pthread_mutex_lock(&store->batch_lock);
+  batch_log_name(store, ++store->batch_seq, filename);
+  if ((ret = batch_log(store, store->batch_seq, batch->ops,
+          batch->num_ops)) == 0) {
+    /* Chains are locked in the same order as kvstore_snapshot locks them. */
+    for (i = 0; store->mmap == NULL && i < KVSTORE_LOCK_STRIPES; i++)
+      if (held[i])
+        pthread_rwlock_wrlock(&store->locks[i]);
+    ret = batch_apply(store, batch->ops, batch->num_ops);
+    for (i = 0; store->mmap == NULL && i < KVSTORE_LOCK_STRIPES; i++)
+      if (held[i])
+        pthread_rwlock_unlock(&store->locks[i]);
+  }
+  pthread_mutex_unlock(&store->batch_lock);
+  if (ret == 0)
+    ret = sync_batch(store, batch->ops, batch->num_ops);
+  if (ret == 0)
     remove(filename);
+  index_maybe_snapshot(store);
+  return ret;
+}
+
+/* Removes the files in the directory PATH, which is DEPTH levels below the
+ * top of a store with FANOUT levels, along with its subdirectory levels and
+ * then PATH itself. */
+static void clean_dir(char *path, unsigned int depth, unsigned int fanout) {
+  struct dirent *dent;
+  char filename[MAX_FILENAME];
+  DIR *kvstoredir = opendir(path);
+  if (kvstoredir == NULL)
+    return;
+  while ((dent = readdir(kvstoredir)) != NULL) {
+    sprintf(filename, "%s/%s", path, dent->d_name);
+    if (depth < fanout && is_fanout_dir(dent->d_name))
+      clean_dir(filename, depth + 1, fanout);
+    else
+      remove(filename);
   }
   closedir(kvstoredir);
-  remove(store->dirname);
+  remove(path);
+}
+
+/* Writes everything STORE holds through to the disk: its index snapshot and
+ * entry files, or its memory-mapped file. Returns 0 if successful, else a
+ * negative error code. */
+int kvstore_sync(kvstore_t *store) {
+  int ret;
+  if (store->mmap == NULL && (ret = kvstore_snapshot(store)) < 0)
+    return ret;
+  return sync_entries(store);
+}
+
+/* Sets *NUM_ENTRIES to the number of entries in STORE, counting tombstones
+ * (and, while STORE is migrating, only entries already in subdirectories),
+ * and *MEMORY to the bytes of memory STORE uses to find them. */
+void kvstore_stats(kvstore_t *store, unsigned long *num_entries,
+    unsigned long *memory) {
+  kvchain_t *chain;
+  *num_entries = *memory = 0;
+  if (store->mmap != NULL) {
+    kvmmap_stats(store->mmap, num_entries, memory);
+    return;
+  }
+  pthread_mutex_lock(&store->index_lock);
+  for (chain = store->chains; chain != NULL; chain = chain->hh.next) {
+    *num_entries += chain->length;
+    *memory += sizeof(kvchain_t);
+  }
+  pthread_mutex_unlock(&store->index_lock);
+}
+
+/* Releases the memory and files STORE holds open, leaving its entries on
+ * disk. STORE must be initialized again before it is next used. */
+void kvstore_close(kvstore_t *store) {
+  if (store->mmap != NULL) {
+    kvmmap_close(store->mmap);
+    free(store->mmap);
+    store->mmap = NULL;
+  }
+  if (store->tailfd >= 0)
+    close(store->tailfd);
+  store->tailfd = -1;
+  pthread_mutex_lock(&store->index_lock);
+  index_free(store);
+  pthread_mutex_unlock(&store->index_lock);
+}
+
+/* Deletes all current entries in STORE and removes the store directory,
+ * along with its index. */
+int kvstore_clean(kvstore_t *store) {
+  kvstore_close(store);
+  clean_dir(store->dirname, 0, store->fanout);
   return 0;
 }
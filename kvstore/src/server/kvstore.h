@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include "kvconstants.h"
+#include "uthash.h"
 
 /* KVStore defines the persistent storage used by a server to store <key, value> entries.
  *
@@ -31,6 +32,69 @@
  * that is, you may never have a chain which has entries with a chainpos of 0
  * and 2 but not 1.
  *
+ * Each entry also records a version, used by masters running in quorum mode
+ * (see tpcmaster.h) to order concurrent writes: kvstore_put_versioned only
+ * replaces an entry with one of a later version, and a versioned delete
+ * leaves a tombstone carrying its version so that an older write cannot
+ * bring the key back.
+ *
+ * An entry may also record the time at which it expires, in seconds since
+ * the epoch (see kvstore_put_expiring). Once that time has passed, the entry
+ * is treated as absent by every function but kvstore_expire, which removes
+ * it; the store does not remove expired entries by itself.
+ *
+ * Entry files written before entries carried a version and an expiry time
+ * hold only the LENGTH and DATA of kventry_t. Current entry files are marked
+ * by KVSTORE_ENTRY_MAGIC, and an entry file is read in whichever format its
+ * marker and size match; an older entry is read as unversioned and never
+ * expiring. Older entries are rewritten in the current format when they are
+ * migrated (see below) or next written.
+ *
+ * To keep directories small, each hash chain is stored in a subdirectory
+ * picked by the low bytes of its hash, one level per byte, so that with the
+ * default two levels an entry whose hash is 0x...cdab lives in
+ *    dirname/ab/cd/hash(key)-chainpos.entry
+ * A store with no levels keeps every entry directly in its directory (the
+ * flat layout). A store opened with levels over a flat directory migrates
+ * online: flat chains stay readable, a chain is moved into its subdirectory
+ * the first time it is written, and kvstore_migrate moves the rest in
+ * batches. The number of levels must otherwise stay the same across runs.
+ *
+ * The length of every hash chain in the subdirectory layout is kept in an
+ * in-memory index, which spares lookups of absent keys and appends to a chain
+ * from probing the disk. So that startup need not walk every entry file to
+ * rebuild it, the index is written to a checksummed snapshot file, and the
+ * hash of each chain about to change length is appended to a tail file, and
+ * synced, before it changes; a write whose record cannot be made durable
+ * fails without changing anything. A snapshot is synced, and then its
+ * directory once it has been renamed into place, before the tail it replaces
+ * is emptied. Startup loads the snapshot and re-reads only the chains
+ * named in the tail; a new snapshot replaces the tail once it has grown to
+ * KVSTORE_SNAPSHOT_RECORDS records or an eighth of the number of chains,
+ * whichever is more. A store without a valid snapshot is indexed by walking
+ * its directory, as it would be by an older version.
+ *
+ * A KVStore initialized with kvstore_init_mmap instead keeps all of its
+ * entries in the single memory-mapped file KVSTORE_MMAP_FILE within its
+ * directory (see kvmmap.h), behind the same functions. Such a store has no
+ * hash chain files, index or subdirectories.
+ *
+ * Several PUTs and DELs can be staged in a kvstore_batch_t and applied
+ * together by kvstore_write_batch. The batch is first written to a batch
+ * log of its own within the store's directory, named after
+ * KVSTORE_BATCH_LOG and the batch's number, and synced to disk, which
+ * commits it: the batches whose logs survive a crash are applied again, in
+ * order, when the store is next initialized, and one whose log is
+ * incomplete was never applied at all. The batch is then applied while
+ * holding the locks of all the hash chains it writes, so no reader sees part
+ * of it, and its log is removed once the entry files and directories of
+ * those chains have been synced to disk, which the next batch does not wait
+ * for.
+ *
+ * Access to each hash chain is serialized by one of KVSTORE_LOCK_STRIPES
+ * locks, chosen by the chain's hash, so that operations on unrelated chains
+ * (and in particular disk writes to them) can proceed in parallel.
+ *
  * All state is stored in persistent file storage, so it is valid to initialize
  * a KVStore using a directory name which was previously used for a KVStore,
  * and the new store will be an exact clone of the old store.
@@ -39,35 +103,146 @@
 /* The filetype to append to the filenames of entries within the log. */
 #define KVSTORE_FILETYPE ".entry"
 
+/* The number of locks over which a KVStore's hash chains are striped. */
+#define KVSTORE_LOCK_STRIPES 64
+
+/* The name of the file within a KVStore's directory holding its index
+ * snapshot, and of the file recording the chains changed since. */
+#define KVSTORE_SNAPSHOT "index.snap"
+#define KVSTORE_TAIL "index.tail"
+/* The name of the file within the directory of a memory-mapped KVStore
+ * which holds its entries. */
+#define KVSTORE_MMAP_FILE "store.mmap"
+/* The prefix of the files within a KVStore's directory holding the batches
+ * being written, if any, each followed by a dot and the batch's number. */
+#define KVSTORE_BATCH_LOG "batch.log"
+
+/* Marks an entry file written in the current format (see kventry_t). */
+#define KVSTORE_ENTRY_MAGIC 0x3145564bU
+
+/* The fewest tail records which prompt a new index snapshot. */
+#define KVSTORE_SNAPSHOT_RECORDS 4096
+
+/* The default number of subdirectory levels of a KVStore. */
+#define KVSTORE_FANOUT 2
+/* The most subdirectory levels a KVStore can have. */
+#define KVSTORE_MAX_FANOUT 4
+/* The number of flat chains a background migration moves per call. */
+#define KVSTORE_MIGRATE_BATCH 1024
+
+/* The in-memory index entry of one hash chain of a KVStore. */
+typedef struct kvchain {
+  unsigned long hashval;       /* The hash of the keys in this chain. */
+  unsigned int length;         /* The number of entries in this chain. */
+  UT_hash_handle hh;           /* Make this struct hashable by HASHVAL. */
+} kvchain_t;
+
+struct kvmmap;
+
 /* A KVStore. */
 typedef struct {
   char dirname[MAX_FILENAME];  /* The name of the directory used to store its entries. */
-  pthread_rwlock_t lock;       /* The lock used to make KVStore's functions thread-safe. */
+  pthread_rwlock_t locks[KVSTORE_LOCK_STRIPES]; /* Locks on the hash chains, by hash. */
+  unsigned int fanout;         /* The number of subdirectory levels. */
+  bool migrating;              /* Set while flat chains may remain in DIRNAME. */
+  kvchain_t *chains;           /* The non-empty chains in subdirectories, by hash. */
+  pthread_mutex_t index_lock;  /* Protects CHAINS. */
+  int tailfd;                  /* The tail file, or -1 if it is not open. */
+  unsigned long tail_records;  /* The number of records in the tail file. */
+  bool snapshotting;           /* Set while an index snapshot is being written. */
+  struct kvmmap *mmap;         /* The memory-mapped file holding all entries, or NULL. */
+  pthread_mutex_t batch_lock;  /* Held while a batch is logged and applied. */
+  unsigned long batch_seq;     /* The number of the last batch logged, protected by BATCH_LOCK. */
 } kvstore_t;
 
 /* A single kvstore entry.
  * data stores both the key and the value, in the form:
  *   key_string \0 value_string \0
- * (that is, two concatenated and null terminated strings) */
+ * (that is, two concatenated and null terminated strings)
+ * An entry written by kvstore_put_versioned to record a delete is a tombstone,
+ * whose data holds only key_string \0; tombstones are treated as absent by
+ * all but the versioned functions. */
 typedef struct {
   int length;                   /* Stores the total length of data, including null terminators. */
+  unsigned int magic;           /* KVSTORE_ENTRY_MAGIC, which older entry files lack. */
+  unsigned long version;        /* The version this entry was written at (0 if unversioned). */
+  unsigned long expires;        /* The time this entry expires at (0 if never). */
   char data[0];                 /* Described above. */
 } kventry_t;
 
+/* A write within a batch: a PUT of KEY with VALUE, or a DEL of KEY if VALUE
+ * is NULL. A PUT expires at EXPIRES, or never if it is 0. */
+typedef struct {
+  char *key;
+  char *value;
+  unsigned long expires;
+} kvstore_op_t;
+
+/* A batch of writes to be applied to a KVStore together. */
+typedef struct {
+  kvstore_op_t *ops;           /* The writes, in the order they are applied. */
+  unsigned int num_ops;        /* The number of writes in OPS. */
+  unsigned int capacity;       /* The number of writes OPS has room for. */
+} kvstore_batch_t;
+
+/* A function called with each entry visited by kvstore_scan, along with the
+ * time it expires at (0 if never). */
+typedef void (*kvstore_visit_t)(char *key, char *value,
+    unsigned long expires, void *aux);
+
+/* A function computing the new value of an entry for kvstore_update from its
+ * current VALUE (NULL if it has none) and AUX. It places the new value into
+ * NEWVALUE using malloc()d memory and returns 0, or returns a negative error
+ * code to leave the entry as it is. */
+typedef int (*kvstore_update_t)(char *value, void *aux, char **newvalue);
+
 unsigned long hash(char *str);
+bool kvstore_expired(unsigned long expires);
 
 int kvstore_init(kvstore_t *, char *dirname);
+int kvstore_init_fanout(kvstore_t *, char *dirname, unsigned int fanout);
+int kvstore_init_mmap(kvstore_t *, char *dirname);
 
 int kvstore_get(kvstore_t *, char *key, char **value);
+int kvstore_get_expiring(kvstore_t *, char *key, char **value,
+    unsigned long *expires);
 
 int kvstore_put(kvstore_t *, char *key, char *value);
+int kvstore_put_expiring(kvstore_t *, char *key, char *value,
+    unsigned long expires);
 int kvstore_put_check(kvstore_t *, char *key, char *value);
 
+int kvstore_get_versioned(kvstore_t *, char *key, char **value,
+    unsigned long *version);
+int kvstore_put_versioned(kvstore_t *, char *key, char *value,
+    unsigned long version);
+
 int kvstore_del(kvstore_t *, char *key);
+int kvstore_update(kvstore_t *, char *key, kvstore_update_t update, void *aux,
+    char **value, unsigned long *expires);
+int kvstore_expire(kvstore_t *, char *key);
 int kvstore_del_check(kvstore_t *, char *key);
 
 bool kvstore_haskey(kvstore_t *, char *key);
 
+void kvstore_batch_init(kvstore_batch_t *);
+int kvstore_batch_put(kvstore_batch_t *, char *key, char *value);
+int kvstore_batch_del(kvstore_batch_t *, char *key);
+void kvstore_batch_free(kvstore_batch_t *);
+int kvstore_write_batch(kvstore_t *, kvstore_batch_t *);
+
+int kvstore_scan(kvstore_t *, unsigned long start, unsigned int max,
+    bool expired, kvstore_visit_t visit, void *aux, unsigned long *next);
+
+int kvstore_snapshot(kvstore_t *);
+
+bool kvstore_migrating(kvstore_t *);
+int kvstore_migrate(kvstore_t *, unsigned int max);
+
+int kvstore_sync(kvstore_t *);
+void kvstore_stats(kvstore_t *, unsigned long *num_entries,
+    unsigned long *memory);
+void kvstore_close(kvstore_t *);
 int kvstore_clean(kvstore_t *);
 
 #endif
@@ -0,0 +1,209 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "kvwal.h"
+
+/* Folds the LENGTH bytes at BUF into the FNV-1a CHECKSUM. */
+static unsigned long kvwal_checksum(unsigned long checksum, const void *buf,
+    unsigned long length) {
+  const unsigned char *bytes = buf;
+  unsigned long i;
+  for (i = 0; i < length; i++) {
+    checksum ^= bytes[i];
+    checksum *= 0x100000001b3UL;
+  }
+  return checksum;
+}
+
+/* Returns the checksum of a record with the lengths of HEADER, KEY and VALUE
+ * (of HEADER's VALLEN bytes, or none for a DEL). */
+static unsigned long kvwal_record_checksum(kvwal_record_t *header, char *key,
+    char *value) {
+  unsigned long checksum = 0xcbf29ce484222325UL;
+  checksum = kvwal_checksum(checksum, &header->keylen, sizeof(header->keylen));
+  checksum = kvwal_checksum(checksum, &header->vallen, sizeof(header->vallen));
+  checksum = kvwal_checksum(checksum, key, header->keylen);
+  if (header->vallen != KVWAL_DEL)
+    checksum = kvwal_checksum(checksum, value, header->vallen);
+  return checksum;
+}
+
+/* Initializes WAL to append to the log file in DIRNAME, which is created if
+ * it does not exist yet. Records left in it by an earlier run are kept for
+ * kvwal_replay. Returns 0 if successful, else a negative error code. */
+int kvwal_init(kvwal_t *wal, char *dirname) {
+  char filename[MAX_FILENAME];
+  struct stat st;
+
+  if (stat(dirname, &st) == -1 && mkdir(dirname, 0700) == -1)
+    return ERRFILCRT;
+  snprintf(filename, sizeof(filename), "%s/%s", dirname, KVWAL_FILENAME);
+  wal->fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0600);
+  if (wal->fd == -1)
+    return ERRFILCRT;
+  if (fstat(wal->fd, &st) == -1) {
+    close(wal->fd);
+    return ERRFILACCESS;
+  }
+  wal->size = wal->appended = wal->durable = st.st_size;
+  wal->syncing = false;
+  pthread_cond_init(&wal->synced, NULL);
+  return -pthread_mutex_init(&wal->lock, NULL);
+}
+
+/* Closes the log file of WAL, without syncing it. */
+void kvwal_close(kvwal_t *wal) {
+  close(wal->fd);
+  pthread_cond_destroy(&wal->synced);
+  pthread_mutex_destroy(&wal->lock);
+}
+
+/* Appends a record to WAL which PUTs VALUE under KEY, or DELs KEY if VALUE is
+ * NULL, and sets *END (unless END is NULL) to the position it ends at. The
+ * record is not durable until kvwal_sync reaches that position. Returns 0 if
+ * successful, else a negative error code. */
+int kvwal_append(kvwal_t *wal, char *key, char *value, unsigned long *end) {
+  kvwal_record_t header;
+  unsigned long length;
+  ssize_t written;
+  char *record;
+
+  header.keylen = strlen(key);
+  header.vallen = (value == NULL) ? KVWAL_DEL : strlen(value);
+  header.checksum = kvwal_record_checksum(&header, key, value);
+  length = sizeof(header) + header.keylen +
+      ((value == NULL) ? 0 : header.vallen);
+  record = malloc(length);
+  if (record == NULL)
+    return -ENOMEM;
+  memcpy(record, &header, sizeof(header));
+  memcpy(record + sizeof(header), key, header.keylen);
+  if (value != NULL)
+    memcpy(record + sizeof(header) + header.keylen, value, header.vallen);
+
+  pthread_mutex_lock(&wal->lock);
+  written = write(wal->fd, record, length);
+  if (written == (ssize_t) length) {
+    wal->size += length;
+    wal->appended += length;
+    if (end != NULL)
+      *end = wal->appended;
+  } else if (written > 0) {
+    /* Cut off the partial record, so that later ones are not lost behind
+     * it on replay. */
+    if (ftruncate(wal->fd, wal->size) == -1) {
+      wal->size += written;
+      wal->appended += written;
+    }
+  }
+  pthread_mutex_unlock(&wal->lock);
+  free(record);
+  return (written == (ssize_t) length) ? 0 : ERRFILACCESS;
+}
+
+/* Waits until every record of WAL up to position END (as set by
+ * kvwal_append) is durable. If no sync is in progress, the caller syncs
+ * every record appended so far itself, else it waits for the sync under way
+ * and, if that one stopped short of END, for the next. Records may still be
+ * appended while the file is synced. Returns 0 if successful, else a
+ * negative error code. */
+int kvwal_sync(kvwal_t *wal, unsigned long end) {
+  unsigned long appended;
+  int ret = 0;
+
+  pthread_mutex_lock(&wal->lock);
+  while (ret == 0 && wal->durable < end) {
+    if (wal->syncing) {
+      pthread_cond_wait(&wal->synced, &wal->lock);
+      continue;
+    }
+    wal->syncing = true;
+    appended = wal->appended;
+    pthread_mutex_unlock(&wal->lock);
+    if (fdatasync(wal->fd) == -1)
+      ret = ERRFILACCESS;
+    pthread_mutex_lock(&wal->lock);
+    wal->syncing = false;
+    if (ret == 0 && appended > wal->durable)
+      wal->durable = appended;
+    pthread_cond_broadcast(&wal->synced);
+  }
+  pthread_mutex_unlock(&wal->lock);
+  return ret;
+}
+
+/* Calls VISIT with each record of WAL, in the order they were appended, and
+ * AUX. Replay ends early at a record which is incomplete or fails its
+ * checksum, as the last one may after a crash. Must not be called while
+ * records are appended. Returns 0 if successful, else the error code VISIT
+ * returned or a negative error code. */
+int kvwal_replay(kvwal_t *wal, kvwal_visit_t visit, void *aux) {
+  kvwal_record_t header;
+  unsigned long offset = 0;
+  char *key, *value;
+  bool del, valid = true;
+  int ret = 0;
+
+  while (ret == 0 && valid && offset + sizeof(header) <= wal->size) {
+    if (pread(wal->fd, &header, sizeof(header), offset) != sizeof(header))
+      return ERRFILACCESS;
+    del = (header.vallen == KVWAL_DEL);
+    if (header.keylen > MAX_KEYLEN || (!del && header.vallen > MAX_VALLEN) ||
+        offset + sizeof(header) + header.keylen + (del ? 0 : header.vallen) >
+        wal->size)
+      break;
+    key = malloc(header.keylen + 1);
+    value = del ? NULL : malloc(header.vallen + 1);
+    if (key == NULL || (!del && value == NULL)) {
+      free(key);
+      free(value);
+      return -ENOMEM;
+    }
+    offset += sizeof(header);
+    if (pread(wal->fd, key, header.keylen, offset) != header.keylen ||
+        (!del && pread(wal->fd, value, header.vallen, offset + header.keylen)
+        != header.vallen)) {
+      free(key);
+      free(value);
+      return ERRFILACCESS;
+    }
+    key[header.keylen] = '\0';
+    if (!del)
+      value[header.vallen] = '\0';
+    offset += header.keylen + (del ? 0 : header.vallen);
+    valid = (kvwal_record_checksum(&header, key, value) == header.checksum);
+    if (valid)
+      ret = visit(key, value, aux);
+    free(key);
+    free(value);
+  }
+  return ret;
+}
+
+/* Empties WAL, once every record it holds has been applied elsewhere and
+ * made durable there, which makes those records count as durable for
+ * kvwal_sync. The truncation is synced, so that a crash cannot bring the
+ * records back. Must not be called while records are appended. Returns 0 if
+ * successful, else a negative error code, in which case WAL keeps its
+ * records. */
+int kvwal_truncate(kvwal_t *wal) {
+  int ret = 0;
+
+  pthread_mutex_lock(&wal->lock);
+  if (wal->size != 0) {
+    if (ftruncate(wal->fd, 0) == -1 || fdatasync(wal->fd) == -1) {
+      ret = ERRFILACCESS;
+    } else {
+      wal->size = 0;
+      wal->durable = wal->appended;
+      pthread_cond_broadcast(&wal->synced);
+    }
+  }
+  pthread_mutex_unlock(&wal->lock);
+  return ret;
+}
@@ -0,0 +1,64 @@
+#ifndef __KV_WAL__
+#define __KV_WAL__
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "kvconstants.h"
+
+/* KVWal is an append-only write-ahead log kept in a single file, which a
+ * KVServer in write-back mode logs its writes to (see kvserver.h).
+ *
+ * Each record is a PUT of a key and value, or a DEL of a key, appended to the
+ * end of the file with one write. Appending does not sync the file, but
+ * returns the position the record ends at, and kvwal_sync waits until the
+ * log is durable up to such a position. Syncs are grouped: the first caller
+ * to find no sync in progress syncs every record appended so far with one
+ * fdatasync, while the others wait for it, so that writers arriving
+ * together share one sync rather than paying for one each. Once everything
+ * the log holds has been applied elsewhere and made durable there,
+ * kvwal_truncate empties it.
+ *
+ * A record is framed by the lengths of its key and value and carries a
+ * checksum of both, so that a record torn by a crash ends kvwal_replay at
+ * the last complete one.
+ */
+
+/* The name of the log file, within the directory it is kept in. */
+#define KVWAL_FILENAME "write-back.wal"
+
+/* The value length of a record which deletes its key. */
+#define KVWAL_DEL 0xffffffffU
+
+/* The header of a record, which is followed by its key and then its value,
+ * neither of them nul-terminated. */
+typedef struct {
+  unsigned int keylen;      /* The length of the key. */
+  unsigned int vallen;      /* The length of the value, or KVWAL_DEL. */
+  unsigned long checksum;   /* The checksum of the lengths, key and value. */
+} kvwal_record_t;
+
+/* A KVWal. */
+typedef struct {
+  int fd;                   /* The log file, opened for appending. */
+  unsigned long size;       /* The bytes the file holds. */
+  unsigned long appended;   /* The bytes ever appended, which truncating does not reset. */
+  unsigned long durable;    /* The bytes of APPENDED known to be durable. */
+  bool syncing;             /* Set while a caller of kvwal_sync is syncing the file. */
+  pthread_mutex_t lock;     /* Protects the above, and orders appends. */
+  pthread_cond_t synced;    /* Signalled when DURABLE advances or a sync ends. */
+} kvwal_t;
+
+/* Called by kvwal_replay with each record's KEY and VALUE, which is NULL for
+ * a DEL, and the AUX it was given. Returns 0 to go on, or a negative error
+ * code to stop. */
+typedef int (*kvwal_visit_t)(char *key, char *value, void *aux);
+
+int kvwal_init(kvwal_t *, char *dirname);
+void kvwal_close(kvwal_t *);
+
+int kvwal_append(kvwal_t *, char *key, char *value, unsigned long *end);
+int kvwal_sync(kvwal_t *, unsigned long end);
+int kvwal_replay(kvwal_t *, kvwal_visit_t visit, void *aux);
+int kvwal_truncate(kvwal_t *);
+
+#endif
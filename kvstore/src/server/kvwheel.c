@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "kvwheel.h"
+#include "utlist.h"
+
+#define KVWHEEL_MASK (KVWHEEL_SLOTS - 1)
+
+/* Initializes WHEEL to hold no timers, with NOW as its next tick. Returns 0
+ * if successful, else a negative error code. */
+int kvwheel_init(kvwheel_t *wheel, unsigned long now) {
+  memset(wheel->slots, 0, sizeof(wheel->slots));
+  wheel->now = now;
+  wheel->num_timers = 0;
+  wheel->overflow = NULL;
+  wheel->due = NULL;
+  return -pthread_mutex_init(&wheel->lock, NULL);
+}
+
+/* Frees every timer of the list HEAD. */
+static void kvwheel_free_list(struct kvtimer *head) {
+  struct kvtimer *timer, *tmp;
+  LL_FOREACH_SAFE(head, timer, tmp) {
+    free(timer->key);
+    free(timer);
+  }
+}
+
+/* Frees every timer of WHEEL, leaving it empty. */
+void kvwheel_free(kvwheel_t *wheel) {
+  unsigned int level, slot;
+  pthread_mutex_lock(&wheel->lock);
+  for (level = 0; level < KVWHEEL_LEVELS; level++) {
+    for (slot = 0; slot < KVWHEEL_SLOTS; slot++) {
+      kvwheel_free_list(wheel->slots[level][slot]);
+      wheel->slots[level][slot] = NULL;
+    }
+  }
+  kvwheel_free_list(wheel->overflow);
+  kvwheel_free_list(wheel->due);
+  wheel->overflow = NULL;
+  wheel->due = NULL;
+  wheel->num_timers = 0;
+  pthread_mutex_unlock(&wheel->lock);
+}
+
+/* Places TIMER in the slot of WHEEL which will be reached at or (for a
+ * coarser level) before its tick, or among the due timers if that tick has
+ * passed. Must be called with WHEEL's lock held. */
+static void kvwheel_place(kvwheel_t *wheel, struct kvtimer *timer) {
+  unsigned long delta;
+  unsigned int level, shift;
+
+  if (timer->expires < wheel->now) {
+    LL_PREPEND(wheel->due, timer);
+    return;
+  }
+  delta = timer->expires - wheel->now;
+  for (level = 0; level < KVWHEEL_LEVELS; level++) {
+    shift = KVWHEEL_BITS * level;
+    if (delta < 1UL << (shift + KVWHEEL_BITS)) {
+      LL_PREPEND(wheel->slots[level][(timer->expires >> shift) & KVWHEEL_MASK],
+          timer);
+      return;
+    }
+  }
+  LL_PREPEND(wheel->overflow, timer);
+}
+
+/* Empties the list *HEAD, placing each of its timers again from WHEEL's
+ * current tick. Must be called with WHEEL's lock held. */
+static void kvwheel_cascade(kvwheel_t *wheel, struct kvtimer **head) {
+  struct kvtimer *timer, *tmp, *list = *head;
+  *head = NULL;
+  LL_FOREACH_SAFE(list, timer, tmp)
+    kvwheel_place(wheel, timer);
+}
+
+/* Advances WHEEL by a single tick, cascading the slots of each coarser level
+ * whose span begins at that tick and making the timers of its slot of level
+ * 0 due. Must be called with WHEEL's lock held. */
+static void kvwheel_tick(kvwheel_t *wheel) {
+  unsigned long tick = wheel->now;
+  struct kvtimer **slot;
+  unsigned int level, shift;
+
+  /* Coarser levels are cascaded first, as a timer they hold may fall into a
+   * finer slot which is due at this very tick. */
+  for (level = 1; level <= KVWHEEL_LEVELS; level++) {
+    shift = KVWHEEL_BITS * level;
+    if ((tick & ((1UL << shift) - 1)) != 0)
+      break;
+    if (level == KVWHEEL_LEVELS)
+      kvwheel_cascade(wheel, &wheel->overflow);
+    else
+      kvwheel_cascade(wheel,
+          &wheel->slots[level][(tick >> shift) & KVWHEEL_MASK]);
+  }
+  slot = &wheel->slots[0][tick & KVWHEEL_MASK];
+  LL_CONCAT(*slot, wheel->due);
+  wheel->due = *slot;
+  *slot = NULL;
+  wheel->now++;
+}
+
+/* Adds a timer for KEY, which is copied, to WHEEL, to expire at the tick
+ * EXPIRES. Returns 0 if successful, else a negative error code. */
+int kvwheel_add(kvwheel_t *wheel, char *key, unsigned long expires) {
+  struct kvtimer *timer = malloc(sizeof(struct kvtimer));
+  if (timer == NULL || (timer->key = malloc(strlen(key) + 1)) == NULL) {
+    free(timer);
+    return -ENOMEM;
+  }
+  strcpy(timer->key, key);
+  timer->expires = expires;
+  pthread_mutex_lock(&wheel->lock);
+  kvwheel_place(wheel, timer);
+  wheel->num_timers++;
+  pthread_mutex_unlock(&wheel->lock);
+  return 0;
+}
+
+/* Advances WHEEL through the tick NOW, then removes up to MAX of the timers
+ * which are due, placing their keys into KEYS. Each key uses malloc()d
+ * memory which should be free()d later. Timers left due are returned by the
+ * next call. Returns the number of keys placed into KEYS. */
+unsigned int kvwheel_expire(kvwheel_t *wheel, unsigned long now,
+    unsigned int max, char **keys) {
+  struct kvtimer *timer;
+  unsigned int num = 0;
+
+  pthread_mutex_lock(&wheel->lock);
+  /* An empty wheel need not be stepped through the ticks it has missed. */
+  if (wheel->num_timers == 0 && wheel->now <= now)
+    wheel->now = now + 1;
+  while (wheel->now <= now)
+    kvwheel_tick(wheel);
+  while (num < max && wheel->due != NULL) {
+    timer = wheel->due;
+    wheel->due = timer->next;
+    keys[num++] = timer->key;
+    free(timer);
+    wheel->num_timers--;
+  }
+  pthread_mutex_unlock(&wheel->lock);
+  return num;
+}
+
+/* Returns the number of timers in WHEEL, pending or due. */
+unsigned long kvwheel_count(kvwheel_t *wheel) {
+  unsigned long count;
+  pthread_mutex_lock(&wheel->lock);
+  count = wheel->num_timers;
+  pthread_mutex_unlock(&wheel->lock);
+  return count;
+}
@@ -0,0 +1,57 @@
+#ifndef __KV_WHEEL__
+#define __KV_WHEEL__
+
+#include <pthread.h>
+
+/* KVWheel tracks when keys expire in a hierarchical timing wheel, so that
+ * expired keys can be found without scanning every key.
+ *
+ * Time advances in ticks of one second. The wheel has KVWHEEL_LEVELS levels
+ * of KVWHEEL_SLOTS slots each; a timer due within KVWHEEL_SLOTS ticks sits
+ * in the slot of level 0 for its tick, and one due later sits in a slot of
+ * the first level whose span covers it, KVWHEEL_SLOTS times coarser than the
+ * last. As time reaches a slot of a coarser level, its timers are cascaded
+ * down into finer ones. Timers beyond the span of the top level wait in an
+ * overflow list until the top level wraps around. Adding a timer and
+ * expiring one each take constant time, however many are pending.
+ *
+ * The wheel holds a copy of each timer's key and nothing else, so a key
+ * written again, deleted or given a later expiry leaves its old timer in
+ * place. Whoever expires a key must therefore check that it has in fact
+ * expired (see kvstore_expire).
+ */
+
+/* The number of bits of a tick which index each level. */
+#define KVWHEEL_BITS 6
+/* The number of slots of each level. */
+#define KVWHEEL_SLOTS (1 << KVWHEEL_BITS)
+/* The number of levels, which together span KVWHEEL_SLOTS ^ KVWHEEL_LEVELS
+ * ticks (about 194 days). */
+#define KVWHEEL_LEVELS 4
+
+/* A pending timer. */
+struct kvtimer {
+  char *key;                /* The key which expires. */
+  unsigned long expires;    /* The tick KEY expires at. */
+  struct kvtimer *next;     /* The next timer in the same slot. */
+};
+
+/* A KVWheel. */
+typedef struct {
+  unsigned long now;        /* The next tick to be reached. */
+  unsigned long num_timers; /* The number of timers pending or due. */
+  struct kvtimer *slots[KVWHEEL_LEVELS][KVWHEEL_SLOTS];
+  struct kvtimer *overflow; /* Timers beyond the span of every level. */
+  struct kvtimer *due;      /* Timers reached but not yet returned. */
+  pthread_mutex_t lock;     /* Protects all of the above. */
+} kvwheel_t;
+
+int kvwheel_init(kvwheel_t *, unsigned long now);
+void kvwheel_free(kvwheel_t *);
+
+int kvwheel_add(kvwheel_t *, char *key, unsigned long expires);
+unsigned int kvwheel_expire(kvwheel_t *, unsigned long now, unsigned int max,
+    char **keys);
+unsigned long kvwheel_count(kvwheel_t *);
+
+#endif
@@ -0,0 +1,114 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include "kvengine.h"
+
+const char *USAGE = "Usage: kvbench "
+    "[-n puts_per_thread (default=2000)] "
+    "[-t max_threads (default=8)] "
+    "[-e engine (file, mmap or memory; default=file)] "
+    "[dirname (default=kvbench-store)]";
+
+/* The work given to a single benchmark thread. */
+typedef struct {
+  kvengine_t *store;
+  unsigned int id;
+  unsigned int puts;
+  int errors;
+} benchjob_t;
+
+/* Performs JOB's PUTs of keys private to its thread. */
+static void *bench_thread(void *aux) {
+  benchjob_t *job = aux;
+  char key[MAX_KEYLEN + 1];
+  unsigned int i;
+  for (i = 0; i < job->puts; i++) {
+    sprintf(key, "bench-%u-%u", job->id, i);
+    if (kvengine_put(job->store, key, "benchmark-value") < 0)
+      job->errors++;
+  }
+  return NULL;
+}
+
+/* Returns the current time in seconds. */
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Measures the PUT throughput of a fresh storage engine in DIRNAME with 1, 2, 4, ...
+ * up to MAX_THREADS threads, each writing PUTS distinct keys. */
+int main(int argc, char **argv) {
+  unsigned int puts = 2000, max_threads = 8, threads, i;
+  char *dirname = "kvbench-store", *engine = NULL;
+  pthread_t *handles;
+  benchjob_t *jobs;
+  kvengine_t store;
+  double start, elapsed, base = 0;
+  int errors, c;
+
+  while ((c = getopt(argc, argv, "n:t:e:")) != -1) {
+    switch (c) {
+      case 'n':
+        puts = atoi(optarg);
+        break;
+      case 't':
+        max_threads = atoi(optarg);
+        break;
+      case 'e':
+        engine = optarg;
+        break;
+      default:
+        printf("%s\n", USAGE);
+        return 1;
+    }
+  }
+  if (optind < argc)
+    dirname = argv[optind];
+  if (puts == 0 || max_threads == 0) {
+    printf("%s\n", USAGE);
+    return 1;
+  }
+  handles = malloc(max_threads * sizeof(pthread_t));
+  jobs = malloc(max_threads * sizeof(benchjob_t));
+  if (handles == NULL || jobs == NULL)
+    return 1;
+
+  printf("%8s %12s %10s\n", "threads", "puts/sec", "speedup");
+  for (threads = 1; threads <= max_threads; threads *= 2) {
+    if (kvengine_init(&store, engine, dirname) != 0) {
+      printf("Could not start the storage engine in %s\n", dirname);
+      return 1;
+    }
+    start = bench_now();
+    for (i = 0; i < threads; i++) {
+      jobs[i].store = &store;
+      jobs[i].id = i;
+      jobs[i].puts = puts;
+      jobs[i].errors = 0;
+      pthread_create(&handles[i], NULL, bench_thread, &jobs[i]);
+    }
+    errors = 0;
+    for (i = 0; i < threads; i++) {
+      pthread_join(handles[i], NULL);
+      errors += jobs[i].errors;
+    }
+    elapsed = bench_now() - start;
+    kvengine_clean(&store);
+    kvengine_close(&store);
+    if (threads == 1)
+      base = puts / elapsed;
+    printf("%8u %12.0f %9.2fx", threads, threads * puts / elapsed,
+        threads * puts / elapsed / base);
+    if (errors > 0)
+      printf(" (%d errors)", errors);
+    printf("\n");
+  }
+  free(handles);
+  free(jobs);
+  return 0;
+}
@@ -1,25 +1,62 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <getopt.h>
 #include "socket_server.h"
 #include "kvserver.h"
 
-const char *USAGE = "Usage: kvmaster [port (default=8888)]";
+const char *USAGE = "Usage: kvmaster "
+    "[-w write_quorum -r read_quorum] "
+    "[-q max_queue (default=1024, 0 for no bound)] "
+    "[port (default=8888)]";
 
 int main(int argc, char** argv) {
   int port = 8888;
+  unsigned int write_quorum = 0, read_quorum = 0;
+  int max_queue = SERVER_MAX_QUEUE;
   server_t server;
+  int c;
 
-  if (argc > 1) {
-    if (argc > 2) {
+  while ((c = getopt(argc, argv, "w:r:q:")) != -1) {
+    switch (c) {
+      case 'w':
+        write_quorum = atoi(optarg);
+        break;
+      case 'r':
+        read_quorum = atoi(optarg);
+        break;
+      case 'q':
+        max_queue = atoi(optarg);
+        if (max_queue >= 0)
+          break;
+        /* Fall through. */
+      default:
+        printf("%s\n", USAGE);
+        return 1;
+    }
+  }
+  if (optind < argc) {
+    if (optind + 1 < argc) {
       printf("%s\n", USAGE);
       return 1;
     }
-    port = atoi(argv[1]);
+    port = atoi(argv[optind]);
   }
   server.master = 1;
   server.max_threads = 3;
+  server.max_queue = max_queue;
+  server.queue_deadline_ms = SERVER_QUEUE_DEADLINE_MS;
   tpcmaster_init(&server.tpcmaster, 2, 2, 4, 4);
+  if (tpcmaster_set_quorum(&server.tpcmaster, write_quorum, read_quorum) < 0) {
+    printf("Quorums must be between 1 and %u\n",
+        server.tpcmaster.redundancy);
+    return 1;
+  }
+  if (tpcmaster_start_heartbeat(&server.tpcmaster) < 0 ||
+      tpcmaster_start_rebalancer(&server.tpcmaster) < 0) {
+    printf("Could not start background threads\n");
+    return 1;
+  }
   printf("TPC Master server started listening on port %d...\n", port);
   server_run("localhost", port, &server, NULL);
 }
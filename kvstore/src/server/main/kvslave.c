@@ -6,34 +6,56 @@
 #include "kvserver.h"
 
 const char *USAGE = "Usage: kvslave "
-    "[-t] [--tpc] "
+    "[-t] [--tpc] [-b] [-s shards] [-e engine (file, mmap or memory)] "
+    "[-q max_queue (default=1024, 0 for no bound)] "
     "[slave_port (default=9000)] "
     "[master_port (default=8888)]";
 
 int main(int argc, char **argv) {
   int tpc_mode = 0,
+      write_back = 0,
+      num_shards = 0,
+      max_queue = SERVER_MAX_QUEUE,
       slave_port = 9000,
       master_port = 8888;
-  char *mode = "";
+  char *mode = "", *engine = NULL;
   char *slave_hostname = "localhost", *master_hostname = "localhost";
   int index = 0;
   int opt_ind;
   int c;
   struct option long_options[] = {{"tpc", no_argument, &tpc_mode, 1},
       {0,0,0,0}};
-  if ((c = getopt_long (argc, argv, "t", long_options, &opt_ind)) != -1) {
+  while ((c = getopt_long (argc, argv, "tbs:e:q:", long_options, &opt_ind)) != -1) {
     switch (c) {
       case 0:
         break;
       case 't':
         tpc_mode = 1;
         mode = "(tpc)";
-        index += 1;
+        break;
+      case 'b':
+        write_back = 1;
+        break;
+      case 's':
+        num_shards = atoi(optarg);
+        if (num_shards <= 0)
+          goto usage;
+        break;
+      case 'e':
+        engine = optarg;
+        break;
+      case 'q':
+        max_queue = atoi(optarg);
+        if (max_queue < 0)
+          goto usage;
         break;
       default:
         goto usage;
     }
   }
+  if (tpc_mode && num_shards > 0)
+    goto usage;
+  index = optind - 1;
   if (index < argc) {
     switch (argc - index - 1) {
       case 1:
@@ -72,12 +94,22 @@ int main(int argc, char **argv) {
   server_t server;
   server.master = 0;
   server.max_threads = 3;
+  server.num_shards = 0;
+  server.max_queue = max_queue;
+  server.queue_deadline_ms = SERVER_QUEUE_DEADLINE_MS;
 
   char slave_name[20];
   sprintf(slave_name, "slave-port%d", slave_port);
 
-  kvserver_init(&slave, slave_name, 4, 4, 2, slave_hostname, slave_port,
-      tpc_mode);
+  /* A sharded slave keeps its entries only in its shards' subdirectories of
+   * SLAVE_NAME, so it opens no store or log of its own beside them. */
+  memset(&slave, 0, sizeof(kvserver_t));
+  if (num_shards == 0 && kvserver_init(&slave, slave_name, 4, 4, 2,
+      slave_hostname, slave_port, tpc_mode, engine) < 0) {
+    printf("Could not start the %s storage engine\n",
+        (engine != NULL) ? engine : "default");
+    return 1;
+  }
   if (tpc_mode) {
     /* Need to send registration to the master.*/
     int ret, sockfd = connect_to(master_hostname, master_port, 0);
@@ -96,6 +128,25 @@ int main(int argc, char **argv) {
     close(sockfd);
   }
   server.kvserver = slave;
+  if (num_shards > 0 && server_init_shards(&server, num_shards, slave_name,
+      4, 4, slave_hostname, slave_port, engine) < 0) {
+    printf("Could not create shards\n");
+    return 1;
+  }
+  for (int i = 0; write_back && i < (num_shards > 0 ? num_shards : 1); i++) {
+    if (kvserver_start_write_back(num_shards > 0 ?
+        &server.shards[i].kvserver : &server.kvserver) < 0) {
+      printf("Write-back mode is only available without TPC\n");
+      return 1;
+    }
+  }
+  for (int i = 0; i < (num_shards > 0 ? num_shards : 1); i++) {
+    if (kvserver_start_expiry(num_shards > 0 ?
+        &server.shards[i].kvserver : &server.kvserver) < 0) {
+      printf("Could not start expiring keys\n");
+      return 1;
+    }
+  }
   server_run(slave_hostname, slave_port, &server, NULL);
   return 0;
 
@@ -1,10 +1,13 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,70 +23,230 @@
 
 #define TIMEOUT 100
 
-/* Handles requests under the assumption that SERVER is a TPC Master. */
-void handle_master(server_t *server) {
-  int sockfd;
+/* Turns off Nagle's algorithm on SOCKFD. Every message is written whole in a
+ * single writev (see kvmessage_send and kvconn_flush), so there is nothing
+ * for the algorithm to coalesce; it would only hold a small response back
+ * until the peer's delayed ACK for the previous one arrived. */
+static void set_nodelay(int sockfd) {
+  int option = 1;
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+}
+
+/* Turns away the connection SOCKFD unserved, answering it with
+ * ERRMSG_OVERLOADED, and closes it. Whatever part of the request has already
+ * arrived is read first, as closing a socket with unread data resets the
+ * connection, which could discard the answer before the client reads it. */
+static void server_reject(int sockfd) {
+  kvmessage_t respmsg;
+  char buf[256];
+
+  while (recv(sockfd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+    ;
+  memset(&respmsg, 0, sizeof(kvmessage_t));
+  respmsg.type = RESP;
+  respmsg.message = ERRMSG_OVERLOADED;
+  kvmessage_send(&respmsg, sockfd);
+  close(sockfd);
+}
+
+/* Handles the connection SOCKFD under the assumption that SERVER is a TPC
+ * Master. */
+void handle_master(server_t *server, int sockfd) {
   tpcmaster_t *tpcmaster = &server->tpcmaster;
-  sockfd = (intptr_t) wq_pop(&server->wq);
   tpcmaster->handle(tpcmaster, sockfd, NULL);
 }
 
-/* Handles requests under the assumption that SERVER is a kvserver slave. */
-void handle_slave(server_t *server) {
-  int sockfd;
+/* A request read by a connection thread, waiting for its shard. */
+typedef struct {
+  int sockfd;               /* The socket the request arrived on. */
+  kvmessage_t *reqmsg;      /* The request, or NULL if it could not be parsed. */
+} shardjob_t;
+
+/* Reads a request from SOCKFD under the assumption that SERVER is a sharded
+ * slave, and passes it to the shard which owns its key. A request which
+ * cannot be queued, because memory ran out or the shard's ring is full, is
+ * turned away. */
+void handle_sharded(server_t *server, int sockfd) {
+  shardjob_t *job;
+  unsigned int shard = 0;
+
+  job = malloc(sizeof(shardjob_t));
+  if (job == NULL) {
+    server_reject(sockfd);
+    return;
+  }
+  job->sockfd = sockfd;
+  job->reqmsg = kvmessage_parse(job->sockfd);
+  if (job->reqmsg != NULL && job->reqmsg->key != NULL)
+    shard = (uint64_t) hash_64_bit(job->reqmsg->key) % server->num_shards;
+  if (kvring_push(&server->shards[shard].ring, job) < 0) {
+    if (job->reqmsg != NULL)
+      kvmessage_free(job->reqmsg);
+    free(job);
+    server_reject(sockfd);
+  }
+}
+
+/* Handles the connection SOCKFD under the assumption that SERVER is a
+ * kvserver slave, allocating each request in ARENA. */
+void handle_slave(server_t *server, int sockfd, kvarena_t *arena) {
   kvserver_t *kvserver = &server->kvserver;
-  sockfd = (intptr_t) wq_pop(&server->wq);
-  kvserver->handle(kvserver, sockfd, NULL);
+  if (server->num_shards > 0) {
+    handle_sharded(server, sockfd);
+    return;
+  }
+  kvserver->handle(kvserver, sockfd, arena);
 }
 
-/* Handles requests for _SERVER. */
-void *handle(void *_server) {
-  server_t *server = (server_t *) _server;
-  if (server->master) {
-    handle_master(server);
+/* Handles the next connection in the work queue of SERVER, unless it has
+ * waited there past the server's deadline, in which case it is turned
+ * away. ARENA is the calling worker's arena, which is left reset. */
+void handle(server_t *server, kvarena_t *arena) {
+  unsigned long waited_ms;
+  int sockfd = (intptr_t) wq_pop_aged(&server->wq, &waited_ms);
+  if (server->queue_deadline_ms > 0 && waited_ms > server->queue_deadline_ms) {
+    server_reject(sockfd);
+  } else if (server->master) {
+    handle_master(server, sockfd);
   } else {
-    handle_slave(server);
+    handle_slave(server, sockfd, arena);
   }
-  return NULL;
+}
+
+/* Fills ADDR with the address of the host given at HOST:PORT. Returns 0 if
+ * successful, else -1 if HOST cannot be resolved. */
+static int resolve(const char *host, int port, struct sockaddr_in *addr) {
+  struct hostent *ent = gethostbyname(host);
+  if (ent == NULL)
+    return -1;
+  bzero((char *) addr, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  bcopy((char *)ent->h_addr, (char *)&addr->sin_addr.s_addr, ent->h_length);
+  addr->sin_port = htons(port);
+  return 0;
 }
 
 /* Connects to the host given at HOST:PORT using a TIMEOUT second timeout.
  * Returns a socket fd which should be closed, else -1 if unsuccessful. */
 int connect_to(const char *host, int port, int timeout) {
   struct sockaddr_in addr;
-  struct hostent *ent;
   int sockfd;
 
   sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  ent = gethostbyname(host);
-  if (ent == NULL) {
+  if (sockfd < 0)
+    return -1;
+  if (resolve(host, port, &addr) < 0) {
+    close(sockfd);
     return -1;
   }
-  bzero((char *) &addr, sizeof(addr));
-  addr.sin_family = AF_INET;
-  bcopy((char *)ent->h_addr, (char *)&addr.sin_addr.s_addr, ent->h_length);
-  addr.sin_port = htons(port);
   if (timeout > 0) {
     struct timeval t;
     t.tv_sec = timeout;
     t.tv_usec = 0;
     setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *) &t, sizeof(t));
+    /* Also bounds connect() itself, so an unreachable host cannot block the
+     * caller indefinitely. */
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *) &t, sizeof(t));
   }
   if (connect(sockfd,(struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(sockfd);
     return -1;
   }
+  set_nodelay(sockfd);
   return sockfd;
 }
 
-/* Handles a request in a new thread. */
+/* Starts connecting to the host given at HOST:PORT without waiting for the
+ * connection to be made, so that the caller can wait on several at once.
+ * Returns a non-blocking socket fd, which becomes writable once the
+ * connection has been made or has failed (see SO_ERROR) and should be
+ * closed, else -1 if unsuccessful. */
+int connect_start(const char *host, int port) {
+  struct sockaddr_in addr;
+  int sockfd;
+
+  if (resolve(host, port, &addr) < 0)
+    return -1;
+  sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (sockfd < 0)
+    return -1;
+  if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 &&
+      errno != EINPROGRESS) {
+    close(sockfd);
+    return -1;
+  }
+  set_nodelay(sockfd);
+  return sockfd;
+}
+
+/* Handles a request in a new thread. Each thread keeps one arena, which
+ * every request it handles reuses (see kvarena.h). */
 void *request_handler(void* aux) {
   server_t *server = (server_t *) aux;
+  kvarena_t arena;
 
+  kvarena_init(&arena, KVARENA_BLOCK_SIZE);
   for(;;) {
-    handle(server);
+    handle(server, &arena);
   }
 }
 
+/* Handles the requests passed to the shard AUX, on the shard's own core. */
+void *shard_handler(void *aux) {
+  kvshard_t *shard = (kvshard_t *) aux;
+  shardjob_t *job;
+  cpu_set_t cpus;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(shard->core, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  for (;;) {
+    job = kvring_pop(&shard->ring);
+    kvserver_handle_message(&shard->kvserver, job->sockfd, job->reqmsg);
+    close(job->sockfd);
+    free(job);
+  }
+  return NULL;
+}
+
+/* Splits the non-TPC slave SERVER into NUM_SHARDS shards, which store their
+ * entries in subdirectories "shard-0", "shard-1", ... of DIRNAME, each with
+ * a cache of NUM_SETS sets of ELEM_PER_SET elements. HOSTNAME and PORT are
+ * as for kvserver_init. Shard I runs on core I modulo the number of online
+ * cores. ENGINE names the shards' storage engine, as for kvserver_init. The
+ * kvserver of SERVER itself is not used once it is sharded, and should not
+ * be initialized on DIRNAME. Must be called before server_run. Returns 0 if
+ * successful, else a negative error code. */
+int server_init_shards(server_t *server, unsigned int num_shards,
+    char *dirname, unsigned int num_sets, unsigned int elem_per_set,
+    const char *hostname, int port, const char *engine) {
+  char shard_dir[MAX_FILENAME];
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  struct stat st;
+  unsigned int i;
+  int ret;
+
+  if (num_shards == 0 || strlen(dirname) + 16 > MAX_FILENAME)
+    return -1;
+  if (stat(dirname, &st) == -1 && mkdir(dirname, 0700) == -1)
+    return -errno;
+  server->shards = calloc(num_shards, sizeof(kvshard_t));
+  if (server->shards == NULL)
+    return -1;
+  for (i = 0; i < num_shards; i++) {
+    sprintf(shard_dir, "%s/shard-%u", dirname, i);
+    ret = kvserver_init(&server->shards[i].kvserver, shard_dir, num_sets,
+        elem_per_set, 1, hostname, port, false, engine);
+    if (ret < 0)
+      return ret;
+    if ((ret = kvring_init(&server->shards[i].ring)) < 0)
+      return ret;
+    server->shards[i].core = (cores > 0) ? i % cores : 0;
+  }
+  server->num_shards = num_shards;
+  return 0;
+}
+
 /* Runs SERVER such that it indefinitely (until server_stop is called) listens
  * for incoming requests at HOSTNAME:PORT. If CALLBACK is not NULL, makes a
  * call to CALLBACK with NULL as its parameter once SERVER is actively
@@ -91,13 +254,15 @@ void *request_handler(void* aux) {
  *
  * As given, this function will synchronously handle only a single request
  * at a time. It is your task to modify it such that it can handle up to
- * SERVER->max_threads jobs at a time asynchronously. */
+ * SERVER->max_threads jobs at a time asynchronously. At most
+ * SERVER->max_queue connections wait for a thread; any accepted beyond that
+ * are turned away at once (see socket_server.h). */
 int server_run(const char *hostname, int port, server_t *server,
     callback_t callback) {
   int sock_fd, client_sock, socket_option;
   struct sockaddr_in client_address;
   size_t client_address_length = sizeof(client_address);
-  wq_init(&server->wq);
+  wq_init_bounded(&server->wq, server->max_queue);
   server->listening = 1;
   server->port = port;
   server->hostname = (char *) malloc(strlen(hostname) + 1);
@@ -144,13 +309,19 @@ int server_run(const char *hostname, int port, server_t *server,
   for (int i=0; i < server->max_threads; i++) {
     pthread_create(&handler_thread, NULL, request_handler, (void *) server);
   }
+  for (unsigned int i = 0; !server->master && i < server->num_shards; i++) {
+    pthread_create(&handler_thread, NULL, shard_handler,
+        (void *) &server->shards[i]);
+  }
 
   while (server->listening) {
     client_sock = accept(sock_fd, (struct sockaddr *) &client_address,
         (socklen_t *) &client_address_length);
-    if (client_sock > 0) {
-      wq_push(&server->wq, (void *) (intptr_t) client_sock);
-    }
+    if (client_sock <= 0)
+      continue;
+    set_nodelay(client_sock);
+    if (wq_try_push(&server->wq, (void *) (intptr_t) client_sock) < 0)
+      server_reject(client_sock);
   }
   shutdown(sock_fd, SHUT_RDWR);
   close(sock_fd);
@@ -158,9 +329,11 @@ int server_run(const char *hostname, int port, server_t *server,
 }
 
 
-/* Stops SERVER from continuing to listen for incoming requests. */
+/* Stops SERVER from continuing to listen for incoming requests. The socket
+ * is only shut down here, which wakes up the accept() in server_run; it is
+ * closed there, since closing it from another thread could close a file
+ * descriptor that has already been reused. */
 void server_stop(server_t *server) {
   server->listening = 0;
   shutdown(server->sockfd, SHUT_RDWR);
-  close(server->sockfd);
 }
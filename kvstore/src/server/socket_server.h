@@ -4,6 +4,7 @@
 #include "kvserver.h"
 #include "tpcmaster.h"
 #include "wq.h"
+#include "kvring.h"
 
 /* Socket Server defines helper functions for communicating over sockets.
  *
@@ -15,9 +16,42 @@
  *
  * The server struct stores extra information on top of the stored TPCMaster or
  * KVServer.
+ *
+ * A non-TPC slave can instead be split into shards with server_init_shards.
+ * Each shard is a complete KVServer, with its own cache, store subdirectory
+ * and log, served by a single thread bound to its own core, so shards share
+ * no locks. The server's MAX_THREADS connection threads only read each
+ * request and push it onto the ring of the shard owning its key (by
+ * hash_64_bit), which handles it and sends the response. The ring is
+ * lock-free (see kvring.h), so connection threads handing off requests do
+ * not serialize on a queue lock, and a request whose shard has a full ring
+ * is answered with ERRMSG_OVERLOADED. Requests without a key go to shard 0.
+ * A sharded slave answers a single request per connection, as requests
+ * pipelined on one connection could otherwise be answered out of order by
+ * different shards.
+ *
+ * Accepted connections wait in the server's work queue for a thread, which
+ * holds at most MAX_QUEUE of them. A connection accepted while the queue is
+ * full is answered at once with ERRMSG_OVERLOADED instead, so that overload
+ * turns clients away rather than making every request wait longer. A
+ * connection which has waited in the queue for longer than
+ * QUEUE_DEADLINE_MS is answered the same way without being served, as its
+ * client has most likely given up on it. Either setting may be 0 for no
+ * limit.
  */
 
-void *handle(void *_kvserver);
+/* The defaults for a server's MAX_QUEUE and QUEUE_DEADLINE_MS: the length of
+ * the listen backlog, and the timeout after which a master gives up on a
+ * slave. */
+#define SERVER_MAX_QUEUE 1024
+#define SERVER_QUEUE_DEADLINE_MS (TPCMASTER_TIMEOUT * 1000)
+
+/* One shard of a sharded slave. */
+typedef struct {
+  kvserver_t kvserver;      /* The KVServer holding this shard's keys. */
+  kvring_t ring;            /* The requests waiting for this shard. */
+  unsigned int core;        /* The core this shard's thread runs on. */
+} kvshard_t;
 
 typedef struct server {
   int master;               /* 1 if this server represents a TPC Master, else 0. */
@@ -27,15 +61,26 @@ typedef struct server {
   int port;                 /* The port this server will listen on. */
   char *hostname;           /* The hostname this server will listen on. */
   wq_t wq;                  /* The work queue this server will use to process jobs. */
+  unsigned int max_queue;   /* The most connections WQ holds before turning more away, or 0. */
+  unsigned int queue_deadline_ms; /* How long a connection may wait in WQ to be served, or 0. */
   union {                   /* The kvserver OR tpcmaster this server represents. */
     kvserver_t kvserver;
     tpcmaster_t tpcmaster;
   };
+  unsigned int num_shards;  /* The number of shards in SHARDS, or 0 if this server is not sharded. */
+  kvshard_t *shards;        /* The shards of a sharded slave, used instead of KVSERVER. */
 } server_t;
 
+void handle(server_t *server, kvarena_t *arena);
+
 int connect_to(const char *host, int port, int timeout);
+int connect_start(const char *host, int port);
 int server_run(const char *hostname, int port, server_t *server,
     callback_t callback);
 void server_stop(server_t *server);
 
+int server_init_shards(server_t *server, unsigned int num_shards,
+    char *dirname, unsigned int num_sets, unsigned int elem_per_set,
+    const char *hostname, int port, const char *engine);
+
 #endif
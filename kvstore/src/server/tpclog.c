@@ -36,17 +36,41 @@ int tpclog_init(tpclog_t *log, char *dirname) {
   return 0;
 }
 
-/* Add a log entry to LOG which will store the message type TYPE and, as
- * applicable, the associated KEY and VALUE (which should be NULL if they are
- * not applicable). See tpclog.h for a complete description of how log entries
- * should be stored in the file system. */
-int tpclog_log(tpclog_t *log, msgtype_t type, char *key, char *value) {
+/* Returns the size of a log entry storing message type TYPE along with the
+ * KEY and VALUE that apply to it. */
+static size_t tpclog_entry_size(msgtype_t type, char *key, char *value) {
+  size_t size = sizeof(logentry_t);
+  if (type == PUTREQ || type == DELREQ)
+    size += strlen(key) + 1;
+  if (type == PUTREQ)
+    size += strlen(value) + 1;
+  return size;
+}
+
+/* Fills ENTRY, which must be tpclog_entry_size(TYPE, KEY, VALUE) bytes long,
+ * with message type TYPE of transaction TXID and the KEY, VALUE and TTL that
+ * apply to it. */
+static void tpclog_fill_entry(logentry_t *entry, unsigned long txid,
+    msgtype_t type, char *key, char *value, unsigned long ttl) {
+  int keylen = (type == PUTREQ || type == DELREQ) ? (strlen(key) + 1) : 0;
+  int vallen = (type == PUTREQ) ? (strlen(value) + 1) : 0;
+  memset(entry, 0, sizeof(logentry_t));
+  entry->type = type;
+  entry->magic = TPCLOG_ENTRY_MAGIC;
+  entry->txid = txid;
+  entry->ttl = (type == PUTREQ) ? ttl : 0;
+  entry->length = keylen + vallen;
+  if (type == PUTREQ || type == DELREQ)
+    strcpy(entry->data, key);
+  if (type == PUTREQ)
+    strcpy(entry->data + keylen, value);
+}
+
+/* Writes ENTRY to LOG as its next entry. */
+static int tpclog_write_entry(tpclog_t *log, logentry_t *entry) {
   char filename[MAX_FILENAME];
-  int fd, keylen, vallen;
-  size_t size;
-  logentry_t *entry;
-  if (type != PUTREQ && type != DELREQ && type != ABORT && type != COMMIT)
-    return ERRINVLDMSG;
+  size_t size = sizeof(logentry_t) + entry->length;
+  int fd;
   pthread_rwlock_wrlock(&log->lock);
   sprintf(filename, "%s/%lu%s", log->dirname, log->nextid, TPCLOG_FILETYPE);
   if ((fd = open(filename, O_WRONLY | O_CREAT, S_IRUSR)) < 0) {
@@ -54,51 +78,143 @@ int tpclog_log(tpclog_t *log, msgtype_t type, char *key, char *value) {
     return ERRFILACCESS;
   }
   log->nextid++;
-
-  keylen = (type == PUTREQ || type == DELREQ) ? (strlen(key) + 1) : 0;
-  vallen = (type == PUTREQ) ? (strlen(value) + 1) : 0;
-  size = sizeof(logentry_t) + keylen + vallen;
-  entry = malloc(size);
-  if (entry == NULL) {
-    pthread_rwlock_unlock(&log->lock);
-    return ENOMEM;
-  }
-  entry->type = type;
-  entry->length = keylen + vallen;
-  if (type == PUTREQ || type == DELREQ)
-    strcpy(entry->data, key);
-  if (type == PUTREQ)
-    strcpy(entry->data + keylen, value);
   errno = 0;
   if (write(fd, entry, size) < size) {
+    close(fd);
     pthread_rwlock_unlock(&log->lock);
     return ERRFILACCESS;
   }
   close(fd);
   pthread_rwlock_unlock(&log->lock);
-  free(entry);
   return 0;
 }
 
-/* Load the logentry located at FILENAME into ENTRY, which will be set to
- * malloc()d memory which should be later free()d. Returns 0 if successful,
- * else a negative error code (and ENTRY will be NULL). */
+/* Add a log entry to LOG which will store the message type TYPE and, as
+ * applicable, the associated KEY and VALUE (which should be NULL if they are
+ * not applicable). See tpclog.h for a complete description of how log entries
+ * should be stored in the file system. The entry belongs to the default
+ * transaction, 0. */
+int tpclog_log(tpclog_t *log, msgtype_t type, char *key, char *value) {
+  return tpclog_log_txn(log, 0, type, key, value, 0);
+}
+
+/* Like tpclog_log, but tags the entry with transaction id TXID and, for a
+ * PUTREQ, the TTL its value was written with. */
+int tpclog_log_txn(tpclog_t *log, unsigned long txid, msgtype_t type,
+    char *key, char *value, unsigned long ttl) {
+  size_t size;
+  logentry_t *entry;
+  int ret;
+  if (type != PUTREQ && type != DELREQ && type != ABORT && type != COMMIT)
+    return ERRINVLDMSG;
+  size = tpclog_entry_size(type, key, value);
+  entry = malloc(size);
+  if (entry == NULL)
+    return ENOMEM;
+  tpclog_fill_entry(entry, txid, type, key, value, ttl);
+  ret = tpclog_write_entry(log, entry);
+  free(entry);
+  return ret;
+}
+
+/* Add a single BATCHREQ log entry for transaction TXID to LOG which stores
+ * each of the NUM_OPS PUTREQ and DELREQ operations in OPS, in order. See
+ * tpclog.h for a complete description of how batch entries are stored. */
+int tpclog_log_batch(tpclog_t *log, unsigned long txid, kvmessage_t *ops,
+    unsigned int num_ops) {
+  size_t size = sizeof(logentry_t), offset = sizeof(logentry_t);
+  logentry_t *entry;
+  unsigned int i;
+  int ret;
+  for (i = 0; i < num_ops; i++) {
+    if (ops[i].type != PUTREQ && ops[i].type != DELREQ)
+      return ERRINVLDMSG;
+    size += tpclog_entry_size(ops[i].type, ops[i].key, ops[i].value);
+  }
+  entry = malloc(size);
+  if (entry == NULL)
+    return ENOMEM;
+  memset(entry, 0, sizeof(logentry_t));
+  entry->type = BATCHREQ;
+  entry->magic = TPCLOG_ENTRY_MAGIC;
+  entry->txid = txid;
+  entry->ttl = 0;
+  entry->length = size - sizeof(logentry_t);
+  for (i = 0; i < num_ops; i++) {
+    tpclog_fill_entry((logentry_t *) ((char *) entry + offset), txid,
+        ops[i].type, ops[i].key, ops[i].value, ops[i].ttl);
+    offset += tpclog_entry_size(ops[i].type, ops[i].key, ops[i].value);
+  }
+  ret = tpclog_write_entry(log, entry);
+  free(entry);
+  return ret;
+}
+
+/* Returns the operation following PREV within the BATCHREQ entry BATCH, or
+ * the first operation if PREV is NULL. Returns NULL once every operation has
+ * been returned. The returned entry points into BATCH and must not be freed. */
+logentry_t *tpclog_batch_next(logentry_t *batch, logentry_t *prev) {
+  char *next = (prev == NULL) ? batch->data :
+      prev->data + prev->length;
+  if (next >= batch->data + batch->length)
+    return NULL;
+  return (logentry_t *) next;
+}
+
+/* The header of a log entry written before entries carried a transaction id
+ * and a TTL (see tpclog.h). */
+typedef struct {
+  msgtype_t type;
+  int length;
+  char data[0];
+} logentry_legacy_t;
+
+/* Load the logentry located at FILENAME, in either format (see tpclog.h),
+ * into ENTRY, which will be set to malloc()d memory which should be later
+ * free()d. An entry of the older format belongs to the default transaction
+ * and has no TTL. Returns 0 if successful, else a negative error code (and
+ * ENTRY will be NULL). */
 int tpclog_load_entry(logentry_t **entry, char *filename) {
   logentry_t tmp;
+  struct stat st;
+  size_t offset;
+  ssize_t got;
   int fd;
-  size_t size;
 
+  *entry = NULL;
   if ((fd = open(filename, O_RDONLY)) < 0)
     return ERRFILACCESS;
-  if (read(fd, &tmp, sizeof(logentry_t)) < sizeof(logentry_t))
+  memset(&tmp, 0, sizeof(logentry_t));
+  got = read(fd, &tmp, sizeof(logentry_t));
+  if (fstat(fd, &st) == -1 || got < (ssize_t) sizeof(logentry_legacy_t) ||
+      tmp.length < 0) {
+    close(fd);
     return ERRFILACCESS;
-  lseek(fd, SEEK_SET, 0);
-  size = tmp.length + sizeof(logentry_t);
-  *entry = malloc(size);
-  if (*entry == NULL)
+  }
+  /* An older entry's data may happen to start with the marker, but its file
+   * is always shorter than a current one of the same length. */
+  if (tmp.magic == TPCLOG_ENTRY_MAGIC &&
+      st.st_size == (off_t) (sizeof(logentry_t) + tmp.length)) {
+    offset = sizeof(logentry_t);
+  } else if (st.st_size == (off_t) (sizeof(logentry_legacy_t) + tmp.length)) {
+    offset = sizeof(logentry_legacy_t);
+    tmp.magic = TPCLOG_ENTRY_MAGIC;
+    tmp.txid = 0;
+    tmp.ttl = 0;
+  } else {
+    close(fd);
+    return ERRFILACCESS;
+  }
+  *entry = malloc(sizeof(logentry_t) + tmp.length);
+  if (*entry == NULL) {
+    close(fd);
     return ENOMEM;
-  if (read(fd, *entry, size) < size) {
+  }
+  **entry = tmp;
+  if (pread(fd, (*entry)->data, tmp.length, offset) < tmp.length) {
+    close(fd);
     free(*entry);
+    *entry = NULL;
     return ERRFILACCESS;
   }
   close(fd);
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include "kvconstants.h"
+#include "kvmessage.h"
 
 /* TPCLog defines a log which will log the TPC actions for a server such that
  * it can recreate its state after a crash.
@@ -20,11 +21,25 @@
  * tpclog_clear_log periodically to clear the log. This will erase all entries
  * in the log, so it should only be called when the server is confident that it
  * will not need any existing entry to recreate state.
+ *
+ * Each entry is tagged with the id of the TPC transaction it belongs to, so
+ * that the entries of several transactions which were in flight at once can
+ * be told apart when the log is replayed. tpclog_log tags entries with the
+ * default transaction id 0.
+ *
+ * Entries written before they carried a transaction id and a TTL hold only
+ * the TYPE, LENGTH and DATA of logentry_t. Current entries are marked by
+ * TPCLOG_ENTRY_MAGIC, and an entry is loaded in whichever format its marker
+ * and size match, so that a log left by an older version is replayed as
+ * entries of the default transaction with no TTL.
  */
 
 /* Filetype to use as an extension for the filenames of entries in the TPCLog. */
 #define TPCLOG_FILETYPE ".log"
 
+/* Marks a log entry written in the current format (see logentry_t). */
+#define TPCLOG_ENTRY_MAGIC 0x3147504cU
+
 /* A TPCLog. */
 typedef struct {
   char *dirname;             /* The name of the directory in which to store log entries. */
@@ -34,21 +49,34 @@ typedef struct {
 } tpclog_t;
 
 /* A single log entry.
+ * TXID is the id of the transaction the entry belongs to.
  * For messages of type COMMIT and ABORT, data is empty.
  * For messages of type DELREQ, data holds the relevant key.
  * For messages of type PUTREQ, data holds both the key and the value, in the
  * form:
  *   key_string \0 value_string \0
- *   (that is, two concatenated and null terminated strings) */
+ *   (that is, two concatenated and null terminated strings)
+ * For messages of type BATCHREQ, data holds one complete PUTREQ or DELREQ
+ * entry (header and data) after another, one for each operation in the
+ * batch, so that a whole batch is logged with a single write.
+ * TTL is the TTL a PUTREQ was sent with (see kvmessage.h), or 0. */
 typedef struct {
   msgtype_t type;          /* The type of message this log entry represents. */
   int length;              /* Stores the total length of DATA, including null terminators. */
+  unsigned int magic;      /* TPCLOG_ENTRY_MAGIC, which older log entries lack. */
+  unsigned long txid;      /* The transaction this log entry belongs to. */
+  unsigned long ttl;       /* The seconds until a PUTREQ's value expires, or 0. */
   char data[0];            /* Described above. */
 } logentry_t;
 
 int tpclog_init(tpclog_t *, char *dirname);
 
 int tpclog_log(tpclog_t *, msgtype_t type, char *key, char *value);
+int tpclog_log_txn(tpclog_t *, unsigned long txid, msgtype_t type, char *key,
+    char *value, unsigned long ttl);
+int tpclog_log_batch(tpclog_t *, unsigned long txid, kvmessage_t *ops,
+    unsigned int num_ops);
+logentry_t *tpclog_batch_next(logentry_t *batch, logentry_t *prev);
 
 int tpclog_load_entry(logentry_t **entry, char *filename);
 
@@ -3,11 +3,18 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <stdlib.h>
+#include <sched.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
 #include "kvconstants.h"
+#include "kvconn.h"
 #include "kvmessage.h"
 #include "socket_server.h"
 #include "time.h"
 #include "tpcmaster.h"
+#include "utlist.h"
 
 /* Initializes a tpcmaster. Will return 0 if successful, or a negative error
  * code if not. SLAVE_CAPACITY indicates the maximum number of slaves that
@@ -29,10 +36,62 @@ int tpcmaster_init(tpcmaster_t *master, unsigned int slave_capacity,
     master->redundancy = redundancy;
   }
   master->slaves_head = NULL;
+  master->ring = NULL;
+  master->ring_epoch = 0;
+  master->ring_readers[0] = master->ring_readers[1] = 0;
+  memset(master->get_hist, 0, sizeof(master->get_hist));
+  master->get_samples = 0;
+  master->groups = NULL;
+  /* Seed transaction ids from the clock so that ids are not reused by a
+   * restarted master while its slaves may still hold older transactions. */
+  master->next_txid = (unsigned long) time(NULL) << 20;
+  master->cache_version = 0;
+  master->write_quorum = 0;
+  master->read_quorum = 0;
+  master->hlc = 0;
+  master->heartbeat_running = false;
+  ret = pthread_mutex_init(&master->decision_lock, NULL);
+  if (ret < 0) return ret;
+  master->rebalancer_running = false;
+  master->joining = NULL;
+  master->joining_stale = false;
+  master->joining_written = NULL;
+  master->joining_seq = 0;
+  ret = pthread_rwlock_init(&master->migrate_lock, NULL);
+  if (ret < 0) return ret;
+  ret = pthread_mutex_init(&master->written_lock, NULL);
+  if (ret < 0) return ret;
+  ret = pthread_mutex_init(&master->group_lock, NULL);
+  if (ret < 0) return ret;
+  master->num_hot_keys = 0;
+  master->hot_requests = 0;
+  ret = pthread_mutex_init(&master->hot_lock, NULL);
+  if (ret < 0) return ret;
+  ret = kvflight_init(&master->flights);
+  if (ret < 0) return ret;
   master->handle = tpcmaster_handle;
   return 0;
 }
 
+/* Switches MASTER to quorum mode, in which a write succeeds once
+ * WRITE_QUORUM replicas have applied it and a read merges the answers of
+ * READ_QUORUM replicas, or back to 2PC if both are 0. Each quorum must be
+ * between 1 and MASTER's redundancy. Should be called before MASTER starts
+ * handling requests. Returns 0 if successful, else -1. */
+int tpcmaster_set_quorum(tpcmaster_t *master, unsigned int write_quorum,
+    unsigned int read_quorum) {
+  if (write_quorum == 0 && read_quorum == 0) {
+    master->write_quorum = master->read_quorum = 0;
+    return 0;
+  }
+  if (write_quorum == 0 || write_quorum > master->redundancy ||
+      read_quorum == 0 || read_quorum > master->redundancy)
+    return -1;
+  master->write_quorum = write_quorum;
+  master->read_quorum = read_quorum;
+  return 0;
+}
+
 /* Converts Strings to 64-bit longs. Borrowed from http://goo.gl/le1o0W,
  * adapted from the Java builtin String.hashcode().
  * DO NOT CHANGE THIS FUNCTION. */
@@ -45,6 +104,163 @@ int64_t hash_64_bit(char *s) {
   return h;
 }
 
+/* Returns the current time on a monotonic clock, in microseconds. */
+static unsigned long tpcmaster_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* Returns true if SLAVE is currently suspected to have failed. */
+static bool tpcmaster_slave_suspect(tpcslave_t *slave) {
+  return __atomic_load_n(&slave->suspect, __ATOMIC_RELAXED);
+}
+
+/* Records that SLAVE was heard from at time NOW (see tpcmaster_now_us),
+ * folding the time since it was last heard from into its moving mean and
+ * mean deviation of heartbeat intervals, and clears any suspicion of it. */
+static void tpcmaster_heartbeat_record(tpcslave_t *slave, unsigned long now) {
+  unsigned long last = __atomic_load_n(&slave->hb_last_us, __ATOMIC_RELAXED);
+  unsigned long mean = __atomic_load_n(&slave->hb_mean_us, __ATOMIC_RELAXED);
+  unsigned long dev = __atomic_load_n(&slave->hb_dev_us, __ATOMIC_RELAXED);
+  unsigned long interval, diff;
+  if (now > last) {
+    interval = now - last;
+    mean = mean - mean / 8 + interval / 8;
+    diff = (interval > mean) ? interval - mean : mean - interval;
+    dev = dev - dev / 4 + diff / 4;
+    __atomic_store_n(&slave->hb_mean_us, mean, __ATOMIC_RELAXED);
+    __atomic_store_n(&slave->hb_dev_us, dev, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&slave->hb_last_us, now, __ATOMIC_RELAXED);
+  __atomic_store_n(&slave->suspect, false, __ATOMIC_RELAXED);
+}
+
+/* Suspects SLAVE if, at time NOW, it has been silent for longer than its mean
+ * heartbeat interval plus TPCMASTER_SUSPECT_DEVS mean deviations, with half
+ * an interval of slack so that a perfectly regular slave is not suspected
+ * over scheduling noise. */
+static void tpcmaster_heartbeat_check(tpcslave_t *slave, unsigned long now) {
+  unsigned long last = __atomic_load_n(&slave->hb_last_us, __ATOMIC_RELAXED);
+  unsigned long mean = __atomic_load_n(&slave->hb_mean_us, __ATOMIC_RELAXED);
+  unsigned long dev = __atomic_load_n(&slave->hb_dev_us, __ATOMIC_RELAXED);
+  unsigned long limit = mean + TPCMASTER_SUSPECT_DEVS * dev +
+      TPCMASTER_HEARTBEAT_MS * 500;
+  __atomic_store_n(&slave->suspect, now > last && now - last > limit,
+      __ATOMIC_RELAXED);
+}
+
+/* Builds a new ring from MASTER's list of slaves, leaving out those still
+ * joining, and publishes it, freeing the ring it replaces once no reader can
+ * still be using it. Must be called with MASTER->slave_lock held for writing.
+ * The list is walked for at most SLAVE_COUNT slaves, so a circular list is
+ * handled as well. */
+static void tpcmaster_ring_rebuild(tpcmaster_t *master) {
+  tpcring_t *ring, *old;
+  tpcslave_t *slave = master->slaves_head;
+  unsigned int count = 0, seen = 0;
+  unsigned long parity;
+  ring = malloc(sizeof(tpcring_t) +
+      master->slave_count * sizeof(tpcring_entry_t));
+  if (ring == NULL)
+    return;
+  while (slave != NULL && seen++ < master->slave_count) {
+    if (!slave->joining) {
+      ring->entries[count].id = slave->id;
+      ring->entries[count].slave = slave;
+      count++;
+    }
+    slave = slave->next;
+    if (slave == master->slaves_head)
+      break;
+  }
+  ring->count = count;
+
+  old = __atomic_exchange_n(&master->ring, ring, __ATOMIC_SEQ_CST);
+  parity = __atomic_fetch_add(&master->ring_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+  while (__atomic_load_n(&master->ring_readers[parity], __ATOMIC_SEQ_CST) > 0)
+    sched_yield();
+  free(old);
+}
+
+/* Enters a read-side critical section on MASTER's ring and returns the
+ * current ring, building it first if no ring has been published yet (e.g.
+ * when the list of slaves was populated directly). The returned ring stays
+ * valid until tpcmaster_ring_release is called with the same PARITY. */
+static tpcring_t *tpcmaster_ring_acquire(tpcmaster_t *master,
+    unsigned long *parity) {
+  unsigned long epoch;
+  tpcring_t *ring;
+  for (;;) {
+    epoch = __atomic_load_n(&master->ring_epoch, __ATOMIC_SEQ_CST);
+    *parity = epoch & 1;
+    __atomic_add_fetch(&master->ring_readers[*parity], 1, __ATOMIC_SEQ_CST);
+    /* A rebuild which advanced the epoch before this reader was counted
+     * did not wait for it, and a later one would wait on the other parity,
+     * so the reader must start over. Once the epoch is seen unchanged, any
+     * rebuild replacing the ring loaded below waits for this reader. */
+    if (__atomic_load_n(&master->ring_epoch, __ATOMIC_SEQ_CST) != epoch) {
+      __atomic_sub_fetch(&master->ring_readers[*parity], 1, __ATOMIC_SEQ_CST);
+      continue;
+    }
+    ring = __atomic_load_n(&master->ring, __ATOMIC_SEQ_CST);
+    if (ring != NULL)
+      return ring;
+    __atomic_sub_fetch(&master->ring_readers[*parity], 1, __ATOMIC_SEQ_CST);
+    pthread_rwlock_wrlock(&master->slave_lock);
+    if (master->ring == NULL)
+      tpcmaster_ring_rebuild(master);
+    pthread_rwlock_unlock(&master->slave_lock);
+  }
+}
+
+/* Leaves the read-side critical section entered by tpcmaster_ring_acquire. */
+static void tpcmaster_ring_release(tpcmaster_t *master, unsigned long parity) {
+  __atomic_sub_fetch(&master->ring_readers[parity], 1, __ATOMIC_SEQ_CST);
+}
+
+/* Returns the number of slaves in RING whose ID is at most ID, if INCLUSIVE,
+ * or less than ID otherwise. */
+static unsigned int tpcring_rank(tpcring_t *ring, int64_t id, bool inclusive) {
+  unsigned int lo = 0, hi = ring->count, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (ring->entries[mid].id < id ||
+        (inclusive && ring->entries[mid].id == id))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Returns the first slave in RING whose ID is strictly greater than ID,
+ * wrapping around to the slave with the lowest ID if there is none. Returns
+ * NULL if RING is empty. */
+static tpcslave_t *tpcring_find(tpcring_t *ring, int64_t id) {
+  if (ring->count == 0)
+    return NULL;
+  return ring->entries[tpcring_rank(ring, id, true) % ring->count].slave;
+}
+
+/* Returns true if the slave with ID SLAVE_ID, whether or not it is in RING,
+ * is one of the REDUNDANCY replicas of a key hashing to KEYHASH in RING with
+ * that slave added: that is, if fewer than REDUNDANCY slaves of RING lie
+ * strictly between KEYHASH and SLAVE_ID going around the ring. */
+static bool tpcring_is_replica(tpcring_t *ring, int64_t slave_id,
+    int64_t keyhash, unsigned int redundancy) {
+  unsigned int between;
+  if (ring->count < redundancy)
+    return true;
+  if (keyhash < slave_id)
+    between = tpcring_rank(ring, slave_id, false) -
+        tpcring_rank(ring, keyhash, true);
+  else
+    between = ring->count - tpcring_rank(ring, keyhash, true) +
+        tpcring_rank(ring, slave_id, false);
+  return between < redundancy;
+}
+
 /* Handles an incoming kvmessage REQMSG, and populates the appropriate fields
  * of RESPMSG as a response. RESPMSG and REQMSG both must point to valid
  * kvmessage_t structs. Assigns an ID to the slave by hashing a string in the
@@ -78,6 +294,19 @@ void tpcmaster_register(tpcmaster_t *master, kvmessage_t *reqmsg,
     newslave->id = idhash;
     newslave->host = host;
     newslave->port = port;
+    newslave->inflight = 0;
+    newslave->latency_us = 0;
+    newslave->hedge_tokens = 0;
+    newslave->hb_last_us = tpcmaster_now_us();
+    newslave->hb_mean_us = TPCMASTER_HEARTBEAT_MS * 1000;
+    newslave->hb_dev_us = 0;
+    newslave->suspect = false;
+    newslave->undelivered = NULL;
+    /* Keys are moved to a new slave in the background when some other slave
+     * may already hold them (see tpcmaster_start_rebalancer). */
+    newslave->joining = master->rebalancer_running &&
+        master->write_quorum == 0 && master->ring != NULL &&
+        master->ring->count > 0;
     newslave->next = NULL;
     newslave->prev = NULL;
     int already_exists = 0;
@@ -88,14 +317,13 @@ void tpcmaster_register(tpcmaster_t *master, kvmessage_t *reqmsg,
         master->slaves_head = newslave;
       } else {
         tpcslave_t* current = master->slaves_head;
+        while (current->next != NULL && current->next->id <= idhash) {
+          current = current->next;
+        }
         if (current->id == idhash) {
+          /* A slave registers again when it restarts, so it is alive. */
           already_exists = 1;
-        }
-        while (current->next != NULL && current->id < idhash) {
-          current = current->next;
-          if (current->id == idhash) {
-            already_exists = 1;
-          }
+          tpcmaster_heartbeat_record(current, tpcmaster_now_us());
         }
         if (!already_exists) {
           if (current->next) {
@@ -112,6 +340,11 @@ void tpcmaster_register(tpcmaster_t *master, kvmessage_t *reqmsg,
     }
     if (!already_exists) {
       master->slave_count++;
+      if (!newslave->joining)
+        tpcmaster_ring_rebuild(master);
+    } else {
+      free(newslave);
+      free(host);
     }
   } else {
     error = -1;
@@ -133,51 +366,1071 @@ void tpcmaster_register(tpcmaster_t *master, kvmessage_t *reqmsg,
 /* Hashes KEY and finds the first slave that should contain it.
  * It should return the first slave whose ID is greater than the
  * KEY's hash, and the one with lowest ID if none matches the
- * requirement.
+ * requirement. Lock-free; binary searches the current ring.
  *
  * Checkpoint 2 only. */
 tpcslave_t *tpcmaster_get_primary(tpcmaster_t *master, char *key) {
   int64_t keyhash = hash_64_bit(key);
-  pthread_rwlock_rdlock(&master->slave_lock);
-  tpcslave_t* current = master->slaves_head;
-  while (current->next && current->id <= keyhash) {
-    current = current->next;
-  }
-  if (current->next) {
-  } else {
-    if (current->id <= keyhash) {
-      current = master->slaves_head;
-    }
-  }
-  pthread_rwlock_unlock(&master->slave_lock);
-  return current;
+  unsigned long parity;
+  tpcring_t *ring = tpcmaster_ring_acquire(master, &parity);
+  tpcslave_t *primary = tpcring_find(ring, keyhash);
+  tpcmaster_ring_release(master, parity);
+  return primary;
 }
 
 /* Returns the slave whose ID comes after PREDECESSOR's, sorted
- * in increasing order.
+ * in increasing order. Lock-free; binary searches the current ring.
  *
  * Checkpoint 2 only. */
 tpcslave_t *tpcmaster_get_successor(tpcmaster_t *master,
     tpcslave_t *predecessor) {
-  pthread_rwlock_rdlock(&master->slave_lock);
-  tpcslave_t* current;
-  if (predecessor->next) {
-    current = predecessor->next;
+  unsigned long parity;
+  tpcring_t *ring = tpcmaster_ring_acquire(master, &parity);
+  tpcslave_t *successor = tpcring_find(ring, predecessor->id);
+  tpcmaster_ring_release(master, parity);
+  return successor;
+}
+
+/* Fills REPLICAS with the (up to) REDUNDANCY distinct slaves responsible for
+ * KEY, starting with its primary and following the ring. The whole set is
+ * read from a single ring, so that a rebuild in the meantime cannot mix the
+ * old ring's replicas with the new one's. Returns the number of replicas
+ * found. */
+static unsigned int tpcmaster_get_replicas(tpcmaster_t *master, char *key,
+    tpcslave_t **replicas) {
+  unsigned int count = 0, start;
+  unsigned long parity;
+  tpcring_t *ring = tpcmaster_ring_acquire(master, &parity);
+
+  if (ring->count > 0) {
+    start = tpcring_rank(ring, hash_64_bit(key), true);
+    while (count < master->redundancy && count < ring->count) {
+      replicas[count] = ring->entries[(start + count) % ring->count].slave;
+      count++;
+    }
+  }
+  tpcmaster_ring_release(master, parity);
+  return count;
+}
+
+/* Folds a response time of ELAPSED microseconds into SLAVE's moving average. */
+static void tpcmaster_record_latency(tpcslave_t *slave, unsigned long elapsed) {
+  unsigned long avg = __atomic_load_n(&slave->latency_us, __ATOMIC_RELAXED);
+  avg = (avg == 0) ? elapsed : avg - avg / 8 + elapsed / 8;
+  __atomic_store_n(&slave->latency_us, avg, __ATOMIC_RELAXED);
+}
+
+/* Returns the load score of SLAVE as seen by this master: its outstanding
+ * requests (counting the one about to be sent) weighted by its recent
+ * response time. Lower is better; a suspect slave scores worst of all. */
+static unsigned long tpcmaster_slave_load(tpcslave_t *slave) {
+  unsigned long inflight = __atomic_load_n(&slave->inflight, __ATOMIC_RELAXED);
+  unsigned long latency = __atomic_load_n(&slave->latency_us, __ATOMIC_RELAXED);
+  if (tpcmaster_slave_suspect(slave))
+    return ULONG_MAX;
+  return (inflight + 1) * (latency + 1);
+}
+
+/* Credits SLAVE's hedge budget for one request sent to it. */
+static void tpcmaster_hedge_credit(tpcslave_t *slave) {
+  unsigned long tokens = __atomic_load_n(&slave->hedge_tokens, __ATOMIC_RELAXED);
+  do {
+    if (tokens >= TPCMASTER_HEDGE_RATIO * TPCMASTER_HEDGE_BURST)
+      return;
+  } while (!__atomic_compare_exchange_n(&slave->hedge_tokens, &tokens,
+      tokens + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Attempts to spend one hedged GET from SLAVE's budget. Returns true if
+ * SLAVE may be sent a hedged GET. */
+static bool tpcmaster_hedge_take(tpcslave_t *slave) {
+  unsigned long tokens = __atomic_load_n(&slave->hedge_tokens, __ATOMIC_RELAXED);
+  do {
+    if (tokens < TPCMASTER_HEDGE_RATIO)
+      return false;
+  } while (!__atomic_compare_exchange_n(&slave->hedge_tokens, &tokens,
+      tokens - TPCMASTER_HEDGE_RATIO, false, __ATOMIC_RELAXED,
+      __ATOMIC_RELAXED));
+  return true;
+}
+
+/* Records a GET response time of ELAPSED microseconds in MASTER's histogram. */
+static void tpcmaster_hist_record(tpcmaster_t *master, unsigned long elapsed) {
+  unsigned int bucket = 0, i;
+  unsigned long count;
+  while ((elapsed >> bucket) > 1 && bucket < TPCMASTER_HIST_BUCKETS - 1)
+    bucket++;
+  __atomic_add_fetch(&master->get_hist[bucket], 1, __ATOMIC_RELAXED);
+  if (__atomic_add_fetch(&master->get_samples, 1, __ATOMIC_RELAXED) %
+      TPCMASTER_HIST_WINDOW == 0) {
+    for (i = 0; i < TPCMASTER_HIST_BUCKETS; i++) {
+      count = __atomic_load_n(&master->get_hist[i], __ATOMIC_RELAXED);
+      __atomic_store_n(&master->get_hist[i], count / 2, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Returns an upper bound (in microseconds) on the PERCENTILE-th percentile of
+ * MASTER's recent GET response times, or 0 if too few have been recorded. */
+static unsigned long tpcmaster_hist_percentile(tpcmaster_t *master,
+    unsigned int percentile) {
+  unsigned long counts[TPCMASTER_HIST_BUCKETS], total = 0, seen = 0;
+  unsigned int i;
+  for (i = 0; i < TPCMASTER_HIST_BUCKETS; i++) {
+    counts[i] = __atomic_load_n(&master->get_hist[i], __ATOMIC_RELAXED);
+    total += counts[i];
+  }
+  if (total < TPCMASTER_HIST_MIN)
+    return 0;
+  for (i = 0; i < TPCMASTER_HIST_BUCKETS; i++) {
+    seen += counts[i];
+    if (seen * 100 >= total * percentile)
+      break;
+  }
+  return 1UL << (i + 1);
+}
+
+/* Connects to SLAVE and sends it REQMSG, counting the request against SLAVE's
+ * in-flight requests. Returns the connected socket, which must be passed to
+ * tpcmaster_slave_finish or tpcmaster_slave_abandon, or -1 if SLAVE could not
+ * be reached (in which case CALLBACK, if not NULL, is called with SLAVE). */
+static int tpcmaster_slave_start(tpcslave_t *slave, kvmessage_t *reqmsg,
+    callback_t callback) {
+  int sockfd = connect_to(slave->host, slave->port, TPCMASTER_TIMEOUT);
+  if (sockfd == -1) {
+    if (callback != NULL)
+      callback(slave);
+    return -1;
+  }
+  __atomic_add_fetch(&slave->inflight, 1, __ATOMIC_RELAXED);
+  tpcmaster_hedge_credit(slave);
+  kvmessage_send(reqmsg, sockfd);
+  return sockfd;
+}
+
+/* Reads SLAVE's response to a request sent on SOCKFD at time START (see
+ * tpcmaster_now_us) and closes SOCKFD. Returns the response, which should be
+ * freed using kvmessage_free, or NULL if SLAVE did not respond. */
+static kvmessage_t *tpcmaster_slave_finish(tpcslave_t *slave, int sockfd,
+    unsigned long start) {
+  kvmessage_t *respmsg = kvmessage_parse(sockfd);
+  if (respmsg != NULL)
+    tpcmaster_record_latency(slave, tpcmaster_now_us() - start);
+  __atomic_sub_fetch(&slave->inflight, 1, __ATOMIC_RELAXED);
+  close(sockfd);
+  return respmsg;
+}
+
+/* Gives up on the request outstanding to SLAVE on SOCKFD. */
+static void tpcmaster_slave_abandon(tpcslave_t *slave, int sockfd) {
+  __atomic_sub_fetch(&slave->inflight, 1, __ATOMIC_RELAXED);
+  close(sockfd);
+}
+
+/* Sends REQMSG to SLAVE and waits for its response, keeping SLAVE's in-flight
+ * count and latency average up to date. Returns the response, which should be
+ * freed using kvmessage_free, or NULL if SLAVE could not be reached or did not
+ * respond. If CALLBACK is not NULL, it is called with SLAVE when SLAVE cannot
+ * be reached. */
+static kvmessage_t *tpcmaster_send_slave(tpcslave_t *slave,
+    kvmessage_t *reqmsg, callback_t callback) {
+  unsigned long start = tpcmaster_now_us();
+  int sockfd = tpcmaster_slave_start(slave, reqmsg, callback);
+  if (sockfd == -1)
+    return NULL;
+  return tpcmaster_slave_finish(slave, sockfd, start);
+}
+
+/* Moves the suspect slaves among the NUM_REPLICAS slaves in REPLICAS to the
+ * back, keeping the relative order of both the healthy and suspect ones. */
+static void tpcmaster_demote_suspects(tpcslave_t **replicas,
+    unsigned int num_replicas) {
+  tpcslave_t *suspects[num_replicas];
+  unsigned int healthy = 0, num_suspects = 0, i;
+  for (i = 0; i < num_replicas; i++) {
+    if (tpcmaster_slave_suspect(replicas[i]))
+      suspects[num_suspects++] = replicas[i];
+    else
+      replicas[healthy++] = replicas[i];
+  }
+  memcpy(&replicas[healthy], suspects, num_suspects * sizeof(tpcslave_t *));
+}
+
+/* Orders the NUM_REPLICAS slaves in REPLICAS for a read of KEY, using the
+ * power of two choices: the replica KEY prefers and one other picked at
+ * random are compared, and the less loaded one is moved to the front. The
+ * preferred replica is fixed per key and wins ties, so an idle cluster keeps
+ * serving a key from the same replica. The remaining replicas stay in ring
+ * order as fallbacks, except that suspect replicas are tried last. */
+static void tpcmaster_order_reads(char *key, tpcslave_t **replicas,
+    unsigned int num_replicas) {
+  unsigned int preferred, other;
+  unsigned int seed = (unsigned int) tpcmaster_now_us();
+  tpcslave_t *chosen;
+  if (num_replicas < 2)
+    return;
+  preferred = (unsigned long) hash(key) % num_replicas;
+  other = (preferred + 1 + rand_r(&seed) % (num_replicas - 1)) % num_replicas;
+  if (tpcmaster_slave_load(replicas[other]) <
+      tpcmaster_slave_load(replicas[preferred]))
+    preferred = other;
+  chosen = replicas[preferred];
+  memmove(&replicas[1], &replicas[0], preferred * sizeof(tpcslave_t *));
+  replicas[0] = chosen;
+  tpcmaster_demote_suspects(replicas, num_replicas);
+}
+
+/* Sends the GET request REQMSG to the NUM_REPLICAS slaves in REPLICAS, in
+ * order, until one of them answers. If the replica currently being waited on
+ * has not answered within TPCMASTER_HEDGE_PERCENTILE of MASTER's recent GET
+ * response times, and the next replica is not suspect and has hedge budget
+ * left, the request is duplicated to that replica and the first answer is
+ * taken. Returns the
+ * response, which should be freed using kvmessage_free, or NULL if no replica
+ * answered. */
+static kvmessage_t *tpcmaster_hedged_get(tpcmaster_t *master,
+    kvmessage_t *reqmsg, tpcslave_t **replicas, unsigned int num_replicas) {
+  struct pollfd fds[2];
+  tpcslave_t *slaves[2];
+  unsigned long starts[2], delay;
+  unsigned int next = 0;
+  int nfds = 0, ready, timeout, i;
+  bool hedged = false;
+  kvmessage_t *respmsg = NULL;
+
+  delay = tpcmaster_hist_percentile(master, TPCMASTER_HEDGE_PERCENTILE);
+  while (respmsg == NULL) {
+    while (nfds == 0 && next < num_replicas) {
+      starts[0] = tpcmaster_now_us();
+      fds[0].fd = tpcmaster_slave_start(replicas[next], reqmsg, NULL);
+      fds[0].events = POLLIN;
+      slaves[0] = replicas[next++];
+      if (fds[0].fd != -1)
+        nfds = 1;
+    }
+    if (nfds == 0)
+      break;
+
+    if (!hedged && delay > 0 && nfds == 1 && next < num_replicas) {
+      timeout = (delay + 999) / 1000;
+    } else {
+      hedged = true;
+      timeout = TPCMASTER_TIMEOUT * 1000;
+    }
+    ready = poll(fds, nfds, timeout);
+    if (ready == 0 && !hedged) {
+      /* The hedging delay passed without an answer. */
+      hedged = true;
+      if (!tpcmaster_slave_suspect(replicas[next]) &&
+          tpcmaster_hedge_take(replicas[next])) {
+        starts[1] = tpcmaster_now_us();
+        fds[1].fd = tpcmaster_slave_start(replicas[next], reqmsg, NULL);
+        fds[1].events = POLLIN;
+        slaves[1] = replicas[next++];
+        if (fds[1].fd != -1)
+          nfds = 2;
+      }
+      continue;
+    }
+    if (ready <= 0) {
+      /* Every outstanding replica timed out; move on to the next one. */
+      for (i = 0; i < nfds; i++)
+        tpcmaster_slave_abandon(slaves[i], fds[i].fd);
+      nfds = 0;
+      continue;
+    }
+    for (i = 0; i < nfds; i++) {
+      if (fds[i].revents == 0)
+        continue;
+      respmsg = tpcmaster_slave_finish(slaves[i], fds[i].fd, starts[i]);
+      if (respmsg != NULL)
+        tpcmaster_hist_record(master, tpcmaster_now_us() - starts[i]);
+      nfds--;
+      fds[i] = fds[nfds];
+      slaves[i] = slaves[nfds];
+      starts[i] = starts[nfds];
+      break;
+    }
+  }
+  for (i = 0; i < nfds; i++)
+    tpcmaster_slave_abandon(slaves[i], fds[i].fd);
+  return respmsg;
+}
+
+/* Returns a new hybrid logical clock timestamp for MASTER, later than any it
+ * has issued or seen before. */
+static unsigned long tpcmaster_hlc_next(tpcmaster_t *master) {
+  struct timespec ts;
+  unsigned long physical, last, next;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  physical = (ts.tv_sec * 1000UL + ts.tv_nsec / 1000000) <<
+      TPCMASTER_HLC_LOGICAL_BITS;
+  last = __atomic_load_n(&master->hlc, __ATOMIC_RELAXED);
+  do {
+    next = (physical > last) ? physical : last + 1;
+  } while (!__atomic_compare_exchange_n(&master->hlc, &last, next, false,
+      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return next;
+}
+
+/* Advances MASTER's hybrid logical clock past VERSION, a timestamp read back
+ * from a slave, so that later writes are ordered after it even if it was
+ * issued by a master whose clock ran ahead. */
+static void tpcmaster_hlc_observe(tpcmaster_t *master, unsigned long version) {
+  unsigned long last = __atomic_load_n(&master->hlc, __ATOMIC_RELAXED);
+  while (version > last && !__atomic_compare_exchange_n(&master->hlc, &last,
+      version, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* Sends REQMSG to the NUM_REPLICAS slaves in REPLICAS, in order, keeping
+ * WIDTH of them either successfully answered or outstanding, and moving on
+ * to the next replica whenever one cannot be reached, does not answer within
+ * TPCMASTER_TIMEOUT or gives an answer which ACCEPT rejects. Stops once NEED
+ * accepted answers have arrived or every replica has been tried, abandoning
+ * any requests still outstanding. The accepted answers and the slaves which
+ * gave them are stored in RESPS and FROM, which must have room for
+ * NUM_REPLICAS entries; returns their number. The answers should be freed
+ * using kvmessage_free. CALLBACK is called with each slave which cannot be
+ * reached, if it is not NULL. */
+static unsigned int tpcmaster_gather(kvmessage_t *reqmsg,
+    tpcslave_t **replicas, unsigned int num_replicas, unsigned int width,
+    unsigned int need, bool (*accept)(kvmessage_t *), kvmessage_t **resps,
+    tpcslave_t **from, callback_t callback) {
+  struct pollfd fds[num_replicas];
+  tpcslave_t *slaves[num_replicas];
+  unsigned long starts[num_replicas];
+  unsigned int next = 0, nfds = 0, count = 0, i;
+  kvmessage_t *respmsg;
+
+  while (count < need) {
+    while (nfds + count < width && next < num_replicas) {
+      starts[nfds] = tpcmaster_now_us();
+      fds[nfds].fd = tpcmaster_slave_start(replicas[next], reqmsg, callback);
+      fds[nfds].events = POLLIN;
+      slaves[nfds] = replicas[next++];
+      if (fds[nfds].fd != -1)
+        nfds++;
+    }
+    if (nfds == 0)
+      break;
+    if (poll(fds, nfds, TPCMASTER_TIMEOUT * 1000) <= 0) {
+      /* Every outstanding replica timed out; move on to the next ones. */
+      for (i = 0; i < nfds; i++)
+        tpcmaster_slave_abandon(slaves[i], fds[i].fd);
+      nfds = 0;
+      continue;
+    }
+    for (i = 0; i < nfds; ) {
+      if (fds[i].revents == 0) {
+        i++;
+        continue;
+      }
+      respmsg = tpcmaster_slave_finish(slaves[i], fds[i].fd, starts[i]);
+      if (respmsg != NULL && accept(respmsg)) {
+        resps[count] = respmsg;
+        from[count++] = slaves[i];
+      } else if (respmsg != NULL) {
+        kvmessage_free(respmsg);
+      }
+      nfds--;
+      fds[i] = fds[nfds];
+      slaves[i] = slaves[nfds];
+      starts[i] = starts[nfds];
+    }
+  }
+  for (i = 0; i < nfds; i++)
+    tpcmaster_slave_abandon(slaves[i], fds[i].fd);
+  return count;
+}
+
+/* Returns true if RESPMSG is a replica's answer about the key of a quorum
+ * GET: its value, or that it holds none. */
+static bool tpcmaster_quorum_read(kvmessage_t *respmsg) {
+  return respmsg->type == GETRESP || (respmsg->message != NULL &&
+      strcmp(respmsg->message, ERRMSG_NO_KEY) == 0);
+}
+
+/* Returns true if RESPMSG acknowledges a quorum write. */
+static bool tpcmaster_quorum_ack(kvmessage_t *respmsg) {
+  return respmsg->message != NULL &&
+      strcmp(respmsg->message, MSG_SUCCESS) == 0;
+}
+
+/* Handles the GET request REQMSG in quorum mode, populating RESPMSG. Asks
+ * the replicas, preferring the less loaded ones (see tpcmaster_order_reads),
+ * until MASTER->read_quorum of them have answered about the key, and answers
+ * with the value of the highest version among those answers, where a deleted
+ * key counts as a value. An error answer does not count towards the quorum,
+ * so the read fails if fewer than that many replicas can answer. Replicas
+ * which answered with an older version are sent the freshest one without
+ * waiting for their reply. */
+static void tpcmaster_quorum_get(tpcmaster_t *master, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  tpcslave_t *replicas[master->redundancy], *from[master->redundancy];
+  kvmessage_t *resps[master->redundancy], msg, *best = NULL;
+  unsigned int num_replicas, count, i;
+  int sockfd;
+
+  num_replicas = tpcmaster_get_replicas(master, reqmsg->key, replicas);
+  tpcmaster_order_reads(reqmsg->key, replicas, num_replicas);
+  memset(&msg, 0, sizeof(kvmessage_t));
+  msg.type = GETREQ;
+  msg.key = reqmsg->key;
+  msg.version = tpcmaster_hlc_next(master);
+  count = tpcmaster_gather(&msg, replicas, num_replicas, master->read_quorum,
+      master->read_quorum, tpcmaster_quorum_read, resps, from, NULL);
+
+  for (i = 0; i < count; i++) {
+    if (best == NULL || resps[i]->version > best->version)
+      best = resps[i];
+  }
+  if (count < master->read_quorum || best == NULL) {
+    respmsg->message = ERRMSG_GENERIC_ERROR;
   } else {
-    current = master->slaves_head;
+    tpcmaster_hlc_observe(master, best->version);
+    if (best->type == GETRESP) {
+      respmsg->type = GETRESP;
+      respmsg->key = reqmsg->key;
+      respmsg->value = best->value;
+      best->value = NULL;
+    } else {
+      respmsg->message = ERRMSG_NO_KEY;
+    }
+    /* Read repair. A missing key with version 0 was never written. */
+    memset(&msg, 0, sizeof(kvmessage_t));
+    msg.type = (respmsg->type == GETRESP) ? PUTREQ : DELREQ;
+    msg.key = reqmsg->key;
+    msg.value = respmsg->value;
+    msg.version = best->version;
+    for (i = 0; i < count && best->version != 0; i++) {
+      if (resps[i]->version >= best->version)
+        continue;
+      sockfd = tpcmaster_slave_start(from[i], &msg, NULL);
+      if (sockfd != -1)
+        tpcmaster_slave_abandon(from[i], sockfd);
+    }
+  }
+  for (i = 0; i < count; i++)
+    kvmessage_free(resps[i]);
+}
+
+/* Handles the PUT or DEL request REQMSG, which has already been validated, in
+ * quorum mode, populating RESPMSG. The write is stamped with a new version
+ * and sent to every replica of its key at once, and succeeds as soon as
+ * MASTER->write_quorum of them have applied it; a replica answering with an
+ * error only fails the write once too few others are left to make up the
+ * quorum. CALLBACK is used as described for tpcmaster_handle_tpc. */
+static void tpcmaster_quorum_write(tpcmaster_t *master, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg, callback_t callback) {
+  tpcslave_t *replicas[master->redundancy], *from[master->redundancy];
+  kvmessage_t *resps[master->redundancy], msg;
+  unsigned int num_replicas, count, i;
+
+  memset(&msg, 0, sizeof(kvmessage_t));
+  msg.type = reqmsg->type;
+  msg.key = reqmsg->key;
+  msg.value = reqmsg->value;
+  msg.version = tpcmaster_hlc_next(master);
+  num_replicas = tpcmaster_get_replicas(master, reqmsg->key, replicas);
+  count = tpcmaster_gather(&msg, replicas, num_replicas, num_replicas,
+      master->write_quorum, tpcmaster_quorum_ack, resps, from, callback);
+  for (i = 0; i < count; i++)
+    kvmessage_free(resps[i]);
+  respmsg->message = (count >= master->write_quorum) ?
+      MSG_SUCCESS : ERRMSG_GENERIC_ERROR;
+}
+
+/* Pins KEY's entry in MASTER's cache if PINNED is true, else unpins it. */
+static void tpcmaster_pin_key(tpcmaster_t *master, char *key, bool pinned) {
+  pthread_rwlock_t *lock = kvcache_getlock(&master->cache, key);
+
+  pthread_rwlock_wrlock(lock);
+  kvcache_pin(&master->cache, key, pinned);
+  pthread_rwlock_unlock(lock);
+}
+
+/* Counts a request for KEY, which must be at most MAX_KEYLEN long, in
+ * MASTER's hot-key tracker. This is the space-saving algorithm: a key which
+ * is not tracked replaces the tracked key with the lowest count, inheriting
+ * that count as its possible error, so any key with more than
+ * 1/TPCMASTER_HOT_KEYS of the requests is always tracked. A key becomes hot
+ * once its count, less its error, reaches TPCMASTER_HOT_THRESHOLD; its cache
+ * entry is then pinned, and unpinned again once it cools down or is
+ * replaced. Returns true if KEY is hot. */
+static bool tpcmaster_track_key(tpcmaster_t *master, char *key) {
+  char changed[TPCMASTER_HOT_KEYS + 1][MAX_KEYLEN + 1];
+  bool pin[TPCMASTER_HOT_KEYS + 1];
+  unsigned int num_changed = 0, min = 0, i;
+  tpchotkey_t *entry = NULL, *curr;
+  bool hot;
+
+  pthread_mutex_lock(&master->hot_lock);
+  for (i = 0; i < master->num_hot_keys; i++) {
+    curr = &master->hot_keys[i];
+    if (strcmp(curr->key, key) == 0) {
+      entry = curr;
+      break;
+    }
+    if (curr->count < master->hot_keys[min].count)
+      min = i;
+  }
+  if (entry == NULL) {
+    if (master->num_hot_keys < TPCMASTER_HOT_KEYS) {
+      entry = &master->hot_keys[master->num_hot_keys++];
+      entry->count = 0;
+    } else {
+      entry = &master->hot_keys[min];
+      if (entry->hot) {
+        strcpy(changed[num_changed], entry->key);
+        pin[num_changed++] = false;
+      }
+    }
+    strcpy(entry->key, key);
+    entry->error = entry->count;
+    entry->hot = false;
+  }
+  entry->count++;
+  if (!entry->hot && entry->count - entry->error >= TPCMASTER_HOT_THRESHOLD) {
+    entry->hot = true;
+    strcpy(changed[num_changed], entry->key);
+    pin[num_changed++] = true;
+  }
+  if (++master->hot_requests >= TPCMASTER_HOT_WINDOW) {
+    master->hot_requests = 0;
+    for (i = 0; i < master->num_hot_keys; i++) {
+      curr = &master->hot_keys[i];
+      curr->count /= 2;
+      curr->error /= 2;
+      if (curr->hot &&
+          curr->count - curr->error < TPCMASTER_HOT_THRESHOLD / 2) {
+        curr->hot = false;
+        strcpy(changed[num_changed], curr->key);
+        pin[num_changed++] = false;
+      }
+    }
+  }
+  hot = entry->hot;
+  pthread_mutex_unlock(&master->hot_lock);
+
+  for (i = 0; i < num_changed; i++)
+    tpcmaster_pin_key(master, changed[i], pin[i]);
+  return hot;
+}
+
+/* Returns true if KEY is currently hot in MASTER's hot-key tracker. */
+static bool tpcmaster_key_hot(tpcmaster_t *master, char *key) {
+  unsigned int i;
+  bool hot = false;
+
+  pthread_mutex_lock(&master->hot_lock);
+  for (i = 0; i < master->num_hot_keys; i++) {
+    if (strcmp(master->hot_keys[i].key, key) == 0) {
+      hot = master->hot_keys[i].hot;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&master->hot_lock);
+  return hot;
+}
+
+/* Returns the milliseconds for which MASTER's cache may hold a value which
+ * its replicas say has TTL seconds left, rounded up. The cache errs on the
+ * early side, so that it never serves a value its replicas have expired. */
+static unsigned long tpcmaster_cache_ttl(unsigned long ttl) {
+  return (ttl > 1) ? (ttl - 1) * 1000 : 1;
+}
+
+/* Populates RESPMSG as the response to the GET request REQMSG, given the
+ * result RET of reading its key from the slaves: VALUE (which RESPMSG takes
+ * ownership of) and the TTL it has left if RET is 0, else ERRNOKEY or
+ * another negative error. */
+static void tpcmaster_get_result(kvmessage_t *reqmsg, kvmessage_t *respmsg,
+    int ret, char *value, unsigned long ttl) {
+  if (ret == 0) {
+    respmsg->type = GETRESP;
+    respmsg->key = reqmsg->key;
+    respmsg->value = value;
+    respmsg->ttl = ttl;
+  } else {
+    respmsg->message = (ret == ERRNOKEY) ?
+        ERRMSG_NO_KEY : ERRMSG_GENERIC_ERROR;
   }
-  pthread_rwlock_unlock(&master->slave_lock);
-  return current;
 }
 
 /* Handles an incoming GET request REQMSG, and populates the appropriate fields
  * of RESPMSG as a response. RESPMSG and REQMSG both must point to valid
- * kvmessage_t structs.
+ * kvmessage_t structs. The master's cache is checked first; on a miss, the
+ * replica chosen by tpcmaster_order_reads is asked (and hedged, see
+ * tpcmaster_hedged_get), falling back to the other replicas if it cannot be
+ * reached, and the value is filled into the cache unless a write to the
+ * same cache set committed while it was being read (see kvcacheset_fill).
+ * GETs which miss on the same key at once share a single read (see
+ * kvflight.h). In quorum mode, the read is handled by tpcmaster_quorum_get
+ * instead. On success, RESPMSG->value is malloc()d and should be free()d.
  *
  * Checkpoint 2 only. */
 void tpcmaster_handle_get(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg) {
-  respmsg->message = ERRMSG_NOT_IMPLEMENTED;
+  tpcslave_t *replicas[master->redundancy];
+  unsigned int num_replicas;
+  kvmessage_t *slavemsg;
+  pthread_rwlock_t *lock;
+  struct kvflightcall *call;
+  unsigned long token, ttl = 0;
+  char *value;
+  bool hot;
+  int ret;
+
+  respmsg->type = RESP;
+  lock = kvcache_getlock(&master->cache, reqmsg->key);
+  if (lock == NULL) {
+    respmsg->message = ERRMSG_KEY_LEN;
+    return;
+  }
+  hot = tpcmaster_track_key(master, reqmsg->key);
+  if (master->read_quorum > 0) {
+    tpcmaster_quorum_get(master, reqmsg, respmsg);
+    return;
+  }
+  pthread_rwlock_rdlock(lock);
+  ret = kvcache_get(&master->cache, reqmsg->key, &value);
+  if (ret == 0)
+    ttl = (kvcache_ttl(&master->cache, reqmsg->key) + 999) / 1000;
+  token = kvcache_fill_token(&master->cache, reqmsg->key);
+  pthread_rwlock_unlock(lock);
+  if (ret == 0 || ret == KVCACHESET_ABSENT) {
+    tpcmaster_get_result(reqmsg, respmsg, ret == 0 ? 0 : ERRNOKEY, value,
+        ttl);
+    return;
+  }
+
+  /* Only one of the GETs which miss on KEY at once asks its replicas; the
+   * others wait for its answer. */
+  call = kvflight_join(&master->flights, reqmsg->key, token, &ret, &value,
+      &ttl);
+  if (call == NULL) {
+    tpcmaster_get_result(reqmsg, respmsg, ret, value, ttl);
+    return;
+  }
+
+  num_replicas = tpcmaster_get_replicas(master, reqmsg->key, replicas);
+  tpcmaster_order_reads(reqmsg->key, replicas, num_replicas);
+  slavemsg = tpcmaster_hedged_get(master, reqmsg, replicas, num_replicas);
+
+  value = NULL;
+  if (slavemsg == NULL) {
+    ret = -1;
+  } else if (slavemsg->type == GETRESP && slavemsg->value != NULL) {
+    ttl = slavemsg->ttl;
+    pthread_rwlock_wrlock(lock);
+    if (kvcache_fill(&master->cache, reqmsg->key, slavemsg->value,
+        token) == 0) {
+      if (hot)
+        kvcache_pin(&master->cache, reqmsg->key, true);
+      if (ttl != 0)
+        kvcache_set_ttl(&master->cache, reqmsg->key,
+            tpcmaster_cache_ttl(ttl));
+    }
+    pthread_rwlock_unlock(lock);
+    ret = 0;
+    value = slavemsg->value;
+    slavemsg->value = NULL;
+  } else if (slavemsg->message != NULL &&
+      strcmp(slavemsg->message, ERRMSG_NO_KEY) == 0) {
+    pthread_rwlock_wrlock(lock);
+    kvcache_fill(&master->cache, reqmsg->key, NULL, token);
+    pthread_rwlock_unlock(lock);
+    ret = ERRNOKEY;
+  } else {
+    ret = -1;
+  }
+  if (slavemsg != NULL)
+    kvmessage_free(slavemsg);
+  kvflight_finish(&master->flights, call, ret, value, ttl);
+  tpcmaster_get_result(reqmsg, respmsg, ret, value, ttl);
+}
+
+/* Returns the error message a client should receive for a request which a
+ * slave voted to abort with VOTE. */
+static char *tpcmaster_abort_message(kvmessage_t *vote) {
+  if (vote == NULL || vote->type != VOTE_ABORT || vote->message == NULL)
+    return ERRMSG_GENERIC_ERROR;
+  if (strcmp(vote->message, ERRMSG_KEY_LEN) == 0)
+    return ERRMSG_KEY_LEN;
+  if (strcmp(vote->message, ERRMSG_VAL_LEN) == 0)
+    return ERRMSG_VAL_LEN;
+  if (strcmp(vote->message, ERRMSG_NO_KEY) == 0)
+    return ERRMSG_NO_KEY;
+  if (strcmp(vote->message, ERRMSG_KEY_LOCKED) == 0)
+    return ERRMSG_KEY_LOCKED;
+  if (strcmp(vote->message, ERRMSG_CAS_MISMATCH) == 0)
+    return ERRMSG_CAS_MISMATCH;
+  if (strcmp(vote->message, ERRMSG_NOT_INTEGER) == 0)
+    return ERRMSG_NOT_INTEGER;
+  return ERRMSG_GENERIC_ERROR;
+}
+
+/* Sends the phase-two message DECISION to SLAVE once, calling CALLBACK (if
+ * not NULL) with SLAVE if it cannot be reached. Returns true if SLAVE
+ * acknowledged it. */
+static bool tpcmaster_deliver_once(tpcslave_t *slave, kvmessage_t *decision,
+    callback_t callback) {
+  kvmessage_t *ack = tpcmaster_send_slave(slave, decision, callback);
+  bool acked = (ack != NULL && ack->type == ACK);
+  if (ack != NULL)
+    kvmessage_free(ack);
+  return acked;
+}
+
+/* Appends DECISION to SLAVE's list of undelivered decisions, kept by MASTER,
+ * to be delivered once SLAVE answers heartbeats again. */
+static void tpcmaster_defer_decision(tpcmaster_t *master, tpcslave_t *slave,
+    kvmessage_t *decision) {
+  tpcdecision_t *deferred = malloc(sizeof(tpcdecision_t));
+  if (deferred == NULL)
+    return;
+  deferred->type = decision->type;
+  deferred->txid = decision->txid;
+  pthread_mutex_lock(&master->decision_lock);
+  LL_APPEND(slave->undelivered, deferred);
+  pthread_mutex_unlock(&master->decision_lock);
+}
+
+/* Sends the phase-two message DECISION to SLAVE until SLAVE acknowledges it,
+ * calling CALLBACK (if not NULL) with SLAVE each time it cannot be reached.
+ * Once SLAVE is suspect, or has failed TPCMASTER_JOIN_ATTEMPTS times while
+ * joining, the caller stops waiting for it and the decision is left to
+ * tpcmaster_redeliver. Returns true if SLAVE acknowledged DECISION. */
+static bool tpcmaster_deliver(tpcmaster_t *master, tpcslave_t *slave,
+    kvmessage_t *decision, callback_t callback) {
+  unsigned int attempts = 0;
+  while (!tpcmaster_deliver_once(slave, decision, callback)) {
+    if (tpcmaster_slave_suspect(slave) ||
+        (slave->joining && ++attempts >= TPCMASTER_JOIN_ATTEMPTS)) {
+      tpcmaster_defer_decision(master, slave, decision);
+      return false;
+    }
+    usleep(TPCMASTER_RETRY_US);
+  }
+  return true;
+}
+
+/* Commits the NUM_OPS write requests in OPS on SLAVE alone, as one
+ * transaction. Returns true if SLAVE committed them, else false with
+ * *ABORTMSG (if not NULL) set to the reason. If SLAVE cannot be reached, it
+ * is not asked to abort, and a decision it does not acknowledge is left to
+ * tpcmaster_redeliver and counts as a failure, so that a dead slave does
+ * not block the caller. */
+static bool tpcmaster_slave_txn(tpcmaster_t *master, tpcslave_t *slave,
+    kvmessage_t *ops, unsigned int num_ops, char **abortmsg) {
+  kvmessage_t reqmsg, decision, *vote;
+  unsigned long start;
+  bool commit;
+  int sockfd;
+
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.txid = __atomic_add_fetch(&master->next_txid, 1, __ATOMIC_RELAXED);
+  if (num_ops == 1) {
+    reqmsg.type = ops->type;
+    reqmsg.key = ops->key;
+    reqmsg.value = ops->value;
+    reqmsg.ttl = ops->ttl;
+  } else {
+    reqmsg.type = BATCHREQ;
+    reqmsg.num_ops = num_ops;
+    reqmsg.ops = ops;
+  }
+  if (abortmsg != NULL)
+    *abortmsg = ERRMSG_GENERIC_ERROR;
+  start = tpcmaster_now_us();
+  if ((sockfd = tpcmaster_slave_start(slave, &reqmsg, NULL)) == -1)
+    return false;
+  vote = tpcmaster_slave_finish(slave, sockfd, start);
+  commit = (vote != NULL && vote->type == VOTE_COMMIT);
+  if (!commit && abortmsg != NULL)
+    *abortmsg = tpcmaster_abort_message(vote);
+  if (vote != NULL)
+    kvmessage_free(vote);
+
+  memset(&decision, 0, sizeof(kvmessage_t));
+  decision.type = commit ? COMMIT : ABORT;
+  decision.txid = reqmsg.txid;
+  return tpcmaster_deliver(master, slave, &decision, NULL) && commit;
+}
+
+/* Records that KEY is being forwarded to the slave joining MASTER, so that a
+ * batch copied to it which read KEY before now leaves KEY alone. Returns
+ * false if KEY could not be recorded. */
+static bool tpcmaster_note_written(tpcmaster_t *master, char *key) {
+  tpcwritten_t *written;
+  bool ret = true;
+  pthread_mutex_lock(&master->written_lock);
+  HASH_FIND_STR(master->joining_written, key, written);
+  if (written == NULL && (written = malloc(sizeof(tpcwritten_t))) != NULL) {
+    if ((written->key = strdup(key)) == NULL) {
+      free(written);
+      written = NULL;
+    } else {
+      HASH_ADD_KEYPTR(hh, master->joining_written, written->key,
+          strlen(written->key), written);
+    }
+  }
+  if (written != NULL)
+    written->seq = ++master->joining_seq;
+  else
+    ret = false;
+  pthread_mutex_unlock(&master->written_lock);
+  return ret;
+}
+
+/* Forgets the keys recorded by tpcmaster_note_written. */
+static void tpcmaster_clear_written(tpcmaster_t *master) {
+  tpcwritten_t *written, *tmp;
+  pthread_mutex_lock(&master->written_lock);
+  HASH_ITER(hh, master->joining_written, written, tmp) {
+    HASH_DEL(master->joining_written, written);
+    free(written->key);
+    free(written);
+  }
+  pthread_mutex_unlock(&master->written_lock);
+}
+
+/* Forwards the committed write requests in the list OPS to the slave
+ * currently joining MASTER, if it will be a replica of their keys, so that
+ * it does not miss writes to keys which have already been moved to it. A
+ * delete of a key it does not hold yet needs no forwarding. Forwards to the
+ * joining slave run concurrently, but never alongside a batch being copied to
+ * it, and each key is recorded first so that a batch read before the write
+ * skips it (see tpcmaster_migrate_batch). If any other write cannot be
+ * applied, the move is restarted (see tpcmaster_migrate). */
+static void tpcmaster_forward_joining(tpcmaster_t *master, tpcop_t *ops) {
+  tpcslave_t *joining = __atomic_load_n(&master->joining, __ATOMIC_SEQ_CST);
+  unsigned long parity;
+  kvmessage_t msg;
+  tpcring_t *ring;
+  char *abortmsg;
+  tpcop_t *op;
+  bool gains;
+
+  if (joining == NULL)
+    return;
+  LL_FOREACH(ops, op) {
+    ring = tpcmaster_ring_acquire(master, &parity);
+    gains = tpcring_is_replica(ring, joining->id, hash_64_bit(op->key),
+        master->redundancy);
+    tpcmaster_ring_release(master, parity);
+    if (!gains)
+      continue;
+    memset(&msg, 0, sizeof(kvmessage_t));
+    msg.type = op->type;
+    msg.key = op->key;
+    msg.value = op->value;
+    msg.ttl = op->ttl;
+    pthread_rwlock_rdlock(&master->migrate_lock);
+    if (!tpcmaster_note_written(master, op->key) ||
+        (!tpcmaster_slave_txn(master, joining, &msg, 1, &abortmsg) &&
+        !(op->type == DELREQ && strcmp(abortmsg, ERRMSG_NO_KEY) == 0)))
+      __atomic_store_n(&master->joining_stale, true, __ATOMIC_SEQ_CST);
+    pthread_rwlock_unlock(&master->migrate_lock);
+  }
+}
+
+/* Applies the write requests in the list OPS, committed at VERSION, to
+ * MASTER's cache: a PUT stores its value, along with its TTL, and a DEL
+ * invalidates the key. This is done at the commit point, so that the cache
+ * never serves a value older than a write which has committed, and repeated
+ * once the slaves have applied the writes, which drops any value a
+ * concurrent GET read from a slave in between and filled into the cache.
+ * Writes to the same key are serialized by their replica set's round, and
+ * the versions keep a late update from overwriting a newer one. */
+static void tpcmaster_cache_commit(tpcmaster_t *master, tpcop_t *ops,
+    unsigned long version) {
+  pthread_rwlock_t *lock;
+  tpcop_t *op;
+
+  LL_FOREACH(ops, op) {
+    lock = kvcache_getlock(&master->cache, op->key);
+    pthread_rwlock_wrlock(lock);
+    if (op->type == PUTREQ) {
+      if (kvcache_put_versioned(&master->cache, op->key, op->value,
+          version) == 0) {
+        if (tpcmaster_key_hot(master, op->key))
+          kvcache_pin(&master->cache, op->key, true);
+        if (op->ttl != 0)
+          kvcache_set_ttl(&master->cache, op->key,
+              tpcmaster_cache_ttl(op->ttl));
+      }
+    } else
+      kvcache_invalidate(&master->cache, op->key, version);
+    pthread_rwlock_unlock(lock);
+  }
+}
+
+/* Returns true if TYPE is a read-modify-write request: a CASREQ, INCRREQ or
+ * DECRREQ. */
+static bool tpcmaster_is_update(msgtype_t type) {
+  return type == CASREQ || type == INCRREQ || type == DECRREQ;
+}
+
+/* Runs a single 2PC round which commits the NUM_OPS write requests in the
+ * list OPS, all of which belong to the same replica set, as one transaction.
+ * A single request is sent as itself and several as one BATCHREQ, tagged with
+ * a fresh transaction id so that slaves can run it alongside rounds for
+ * other replica sets they belong to. A suspect replica is not asked to vote
+ * and counts as a vote to abort, so a write fails fast instead of waiting
+ * for a dead slave to time out. If the round commits, MASTER's cache is
+ * updated at the commit point, before any slave is told to commit, and again
+ * once they all have (see tpcmaster_cache_commit), and the writes are
+ * forwarded to a slave joining MASTER if it will own them. Returns true if it
+ * committed, else false with *ABORTMSG set to the reason. CALLBACK is used as
+ * described for tpcmaster_handle_tpc.
+ *
+ * An update always runs in a round of its own. Each replica votes with the
+ * value it computed, and the round only commits if they all agree, in which
+ * case the update becomes the PUTREQ of that value, held in malloc()d memory
+ * and carrying the TTL the replicas say it keeps, before MASTER's cache is
+ * updated. */
+static bool tpcmaster_run_round(tpcmaster_t *master, tpcop_t *ops,
+    unsigned int num_ops, char **abortmsg, callback_t callback) {
+  tpcslave_t *replicas[master->redundancy];
+  unsigned int num_replicas, i = 0;
+  kvmessage_t reqmsg, decision, batch[num_ops], *vote;
+  bool asked[master->redundancy];
+  unsigned long version = 0, ttl = 0;
+  char *computed = NULL;
+  bool commit = true;
+  tpcop_t *op;
+
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.txid = __atomic_add_fetch(&master->next_txid, 1, __ATOMIC_RELAXED);
+  if (num_ops == 1) {
+    reqmsg.type = ops->type;
+    reqmsg.key = ops->key;
+    reqmsg.value = ops->value;
+    reqmsg.expected = ops->expected;
+    reqmsg.ttl = ops->ttl;
+  } else {
+    memset(batch, 0, sizeof(batch));
+    LL_FOREACH(ops, op) {
+      batch[i].type = op->type;
+      batch[i].key = op->key;
+      batch[i].ttl = op->ttl;
+      batch[i++].value = op->value;
+    }
+    reqmsg.type = BATCHREQ;
+    reqmsg.num_ops = num_ops;
+    reqmsg.ops = batch;
+  }
+
+  *abortmsg = ERRMSG_GENERIC_ERROR;
+  num_replicas = tpcmaster_get_replicas(master, ops->key, replicas);
+  for (i = 0; i < num_replicas; i++) {
+    asked[i] = !tpcmaster_slave_suspect(replicas[i]);
+    vote = asked[i] ?
+        tpcmaster_send_slave(replicas[i], &reqmsg, callback) : NULL;
+    if (vote == NULL || vote->type != VOTE_COMMIT) {
+      if (commit)
+        *abortmsg = tpcmaster_abort_message(vote);
+      commit = false;
+    } else if (tpcmaster_is_update(ops->type)) {
+      /* Replicas which disagree on the value have diverged. */
+      if (vote->value == NULL ||
+          (computed != NULL && strcmp(computed, vote->value) != 0))
+        commit = false;
+      else if (computed == NULL)
+        computed = strdup(vote->value);
+      /* The replicas' clocks may differ, so the shortest TTL is kept. */
+      if (vote->ttl != 0 && (ttl == 0 || vote->ttl < ttl))
+        ttl = vote->ttl;
+    }
+    if (vote != NULL)
+      kvmessage_free(vote);
+  }
+
+  if (callback != NULL)
+    callback(NULL);
+
+  if (commit && tpcmaster_is_update(ops->type)) {
+    if (computed != NULL) {
+      ops->type = PUTREQ;
+      ops->value = computed;
+      ops->ttl = ttl;
+    } else {
+      commit = false;
+    }
+  } else {
+    free(computed);
+  }
+  if (commit) {
+    version = __atomic_add_fetch(&master->cache_version, 1, __ATOMIC_RELAXED);
+    tpcmaster_cache_commit(master, ops, version);
+  }
+
+  memset(&decision, 0, sizeof(kvmessage_t));
+  decision.type = commit ? COMMIT : ABORT;
+  decision.txid = reqmsg.txid;
+  for (i = 0; i < num_replicas; i++) {
+    if (asked[i])
+      tpcmaster_deliver(master, replicas[i], &decision, callback);
+  }
+
+  if (commit) {
+    tpcmaster_cache_commit(master, ops, version);
+    tpcmaster_forward_joining(master, ops);
+  }
+  return commit;
+}
+
+/* Commits the NUM_OPS write requests in the list OPS and sets the result of
+ * each. If a batch is aborted, its requests are retried in rounds of their
+ * own, so that one failing request does not fail the others. */
+static void tpcmaster_commit_batch(tpcmaster_t *master, tpcop_t *ops,
+    unsigned int num_ops, callback_t callback) {
+  tpcop_t *op, *next;
+  char *abortmsg;
+  if (tpcmaster_run_round(master, ops, num_ops, &abortmsg, callback)) {
+    LL_FOREACH(ops, op)
+      op->result = MSG_SUCCESS;
+  } else if (num_ops == 1) {
+    ops->result = abortmsg;
+  } else {
+    for (op = ops; op != NULL; op = next) {
+      next = op->next;
+      op->next = NULL;
+      op->result = tpcmaster_run_round(master, op, 1, &abortmsg, callback) ?
+          MSG_SUCCESS : abortmsg;
+      op->next = next;
+    }
+  }
+}
+
+/* Returns the group for the replica set starting at PRIMARY, creating it if
+ * necessary. Must be called with MASTER->group_lock held. */
+static tpcgroup_t *tpcmaster_get_group(tpcmaster_t *master,
+    tpcslave_t *primary) {
+  tpcgroup_t *group;
+  LL_FOREACH(master->groups, group) {
+    if (group->primary == primary)
+      return group;
+  }
+  group = calloc(1, sizeof(tpcgroup_t));
+  if (group == NULL)
+    return NULL;
+  group->primary = primary;
+  pthread_cond_init(&group->cond, NULL);
+  LL_PREPEND(master->groups, group);
+  return group;
+}
+
+/* Returns true if the list of requests OPS contains a write to KEY. */
+static bool tpcmaster_batch_has_key(tpcop_t *ops, char *key) {
+  tpcop_t *op;
+  LL_FOREACH(ops, op) {
+    if (strcmp(op->key, key) == 0)
+      return true;
+  }
+  return false;
 }
 
 /* Handles an incoming TPC request REQMSG, and populates the appropriate fields
@@ -185,6 +1438,18 @@ void tpcmaster_handle_get(tpcmaster_t *master, kvmessage_t *reqmsg,
  * kvmessage_t structs. Implements the TPC algorithm, polling all the slaves
  * for a vote first and sending a COMMIT or ABORT message in the second phase.
  * Must wait for an ACK from every slave after sending the second phase messages. 
+ *
+ * Requests are coalesced per replica set: the first request to find no round
+ * pending for its replica set leads the next round, which starts as soon as
+ * the current one (if any) finishes and includes every request for that
+ * replica set which joined in the meantime (up to TPCMASTER_BATCH_MAX, and at
+ * most one per key). Each request still receives its own result. In quorum
+ * mode, the write is handled by tpcmaster_quorum_write instead.
+ *
+ * A CASREQ, INCRREQ or DECRREQ is committed in a round of its own (see
+ * tpcmaster_run_round); an INCRREQ or DECRREQ which commits is answered with
+ * a GETRESP holding the new value. They are not supported in quorum mode,
+ * and neither is a PUTREQ with a TTL.
  * 
  * The CALLBACK field is used for testing purposes. You MUST include the following
  * calls to the CALLBACK function whenever CALLBACK is not null, or you will fail
@@ -198,34 +1463,685 @@ void tpcmaster_handle_get(tpcmaster_t *master, kvmessage_t *reqmsg,
  * Checkpoint 2 only. */
 void tpcmaster_handle_tpc(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg, callback_t callback) {
-  respmsg->message = ERRMSG_NOT_IMPLEMENTED;
+  tpcop_t op, *batch, *curr, *next;
+  tpcslave_t *primary;
+  tpcgroup_t *group;
+  unsigned int num_ops;
+  bool leader;
+
+  bool update = tpcmaster_is_update(reqmsg->type);
+
+  respmsg->type = RESP;
+  if ((reqmsg->type != PUTREQ && reqmsg->type != DELREQ && !update) ||
+      reqmsg->key == NULL || ((reqmsg->type == PUTREQ ||
+      reqmsg->type == CASREQ) && reqmsg->value == NULL)) {
+    respmsg->message = ERRMSG_INVALID_REQUEST;
+    return;
+  }
+  if (strlen(reqmsg->key) > MAX_KEYLEN) {
+    respmsg->message = ERRMSG_KEY_LEN;
+    return;
+  }
+  if ((reqmsg->type == PUTREQ || reqmsg->type == CASREQ) &&
+      strlen(reqmsg->value) > MAX_VALLEN) {
+    respmsg->message = ERRMSG_VAL_LEN;
+    return;
+  }
+  if (update && master->write_quorum > 0) {
+    /* Quorum writes are applied blindly, so cannot read what they replace. */
+    respmsg->message = ERRMSG_NOT_IMPLEMENTED;
+    return;
+  }
+  if (reqmsg->ttl != 0 && master->write_quorum > 0) {
+    /* Replicas would each count a TTL from when they applied it, so a
+     * version could no longer decide which value is current. */
+    respmsg->message = ERRMSG_NOT_IMPLEMENTED;
+    return;
+  }
+  tpcmaster_track_key(master, reqmsg->key);
+  primary = tpcmaster_get_primary(master, reqmsg->key);
+  if (primary == NULL) {
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+  if (master->write_quorum > 0) {
+    tpcmaster_quorum_write(master, reqmsg, respmsg, callback);
+    return;
+  }
+
+  memset(&op, 0, sizeof(tpcop_t));
+  op.type = reqmsg->type;
+  op.key = reqmsg->key;
+  op.value = (reqmsg->type != DELREQ) ? reqmsg->value : NULL;
+  op.expected = reqmsg->expected;
+  op.ttl = (reqmsg->type == PUTREQ) ? reqmsg->ttl : 0;
+
+  pthread_mutex_lock(&master->group_lock);
+  group = tpcmaster_get_group(master, primary);
+  if (group == NULL) {
+    pthread_mutex_unlock(&master->group_lock);
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+  /* An update waits for a round of its own. */
+  while (group->open != NULL && (update ||
+      tpcmaster_is_update(group->open->type) ||
+      group->num_open >= TPCMASTER_BATCH_MAX ||
+      tpcmaster_batch_has_key(group->open, op.key)))
+    pthread_cond_wait(&group->cond, &master->group_lock);
+  leader = (group->open == NULL);
+  LL_APPEND(group->open, &op);
+  group->num_open++;
+
+  if (leader) {
+    while (group->busy)
+      pthread_cond_wait(&group->cond, &master->group_lock);
+    batch = group->open;
+    num_ops = group->num_open;
+    group->open = NULL;
+    group->num_open = 0;
+    group->busy = true;
+    pthread_cond_broadcast(&group->cond);
+    pthread_mutex_unlock(&master->group_lock);
+
+    tpcmaster_commit_batch(master, batch, num_ops, callback);
+
+    pthread_mutex_lock(&master->group_lock);
+    group->busy = false;
+    for (curr = batch; curr != NULL; curr = next) {
+      next = curr->next;
+      curr->done = true;
+    }
+    pthread_cond_broadcast(&group->cond);
+  } else {
+    while (!op.done)
+      pthread_cond_wait(&group->cond, &master->group_lock);
+  }
+  pthread_mutex_unlock(&master->group_lock);
+  respmsg->message = op.result;
+  if (update && strcmp(op.result, MSG_SUCCESS) == 0 &&
+      reqmsg->type != CASREQ) {
+    respmsg->type = GETRESP;
+    respmsg->key = reqmsg->key;
+    respmsg->value = op.value;
+    respmsg->ttl = op.ttl;
+  } else if (update && strcmp(op.result, MSG_SUCCESS) == 0) {
+    free(op.value);
+  }
 }
 
 /* Handles an incoming kvmessage REQMSG, and populates the appropriate fields
  * of RESPMSG as a response. RESPMSG and REQMSG both must point to valid
  * kvmessage_t structs. Provides information about the slaves that are
- * currently alive.
+ * currently alive: one line per registered slave, marked "(joining)" if keys
+ * are still being moved to it or "(suspect)" if its heartbeats have stopped,
+ * followed, if any key is hot, by "Hot keys:" and one line per hot key with
+ * its estimated request count. RESPMSG->message should be freed unless it is
+ * ERRMSG_GENERIC_ERROR.
  *
  * Checkpoint 2 only. */
 void tpcmaster_info(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg) {
-  respmsg->message = ERRMSG_NOT_IMPLEMENTED;
+  char *info, *pos;
+  size_t size = 64 + TPCMASTER_HOT_KEYS * (MAX_KEYLEN + 32);
+  unsigned int i;
+  bool any_hot = false;
+  time_t ltime = time(NULL);
+  tpcslave_t *slave;
+
+  pthread_rwlock_rdlock(&master->slave_lock);
+  slave = master->slaves_head;
+  for (i = 0; slave != NULL && i < master->slave_count; i++) {
+    size += strlen(slave->host) + 40;
+    slave = slave->next;
+  }
+  info = malloc(size);
+  if (info == NULL) {
+    pthread_rwlock_unlock(&master->slave_lock);
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+  pos = info + sprintf(info, "%sSlaves:", asctime(localtime(&ltime)));
+  slave = master->slaves_head;
+  for (i = 0; slave != NULL && i < master->slave_count; i++) {
+    pos += sprintf(pos, "\n{%s, %u}%s", slave->host, slave->port,
+        slave->joining ? " (joining)" :
+        tpcmaster_slave_suspect(slave) ? " (suspect)" : "");
+    slave = slave->next;
+  }
+  pthread_rwlock_unlock(&master->slave_lock);
+  pthread_mutex_lock(&master->hot_lock);
+  for (i = 0; i < master->num_hot_keys; i++) {
+    if (!master->hot_keys[i].hot)
+      continue;
+    if (!any_hot)
+      pos += sprintf(pos, "\nHot keys:");
+    any_hot = true;
+    pos += sprintf(pos, "\n{%s, %lu}", master->hot_keys[i].key,
+        master->hot_keys[i].count - master->hot_keys[i].error);
+  }
+  pthread_mutex_unlock(&master->hot_lock);
+  respmsg->message = info;
 }
 
-/* Generic entrypoint for this MASTER. Takes in a socket on SOCKFD, which
- * should already be connected to an incoming request. Processes the request
- * and sends back a response message.  This should call out to the appropriate
- * internal handler. */
-void tpcmaster_handle(tpcmaster_t *master, int sockfd, callback_t callback) {
-  kvmessage_t *reqmsg, respmsg;
-  reqmsg = kvmessage_parse(sockfd);
+/* Carries the heartbeat on the non-blocking socket FD one step further once
+ * poll has reported REVENTS for it: sends the ping PING once the connection
+ * has been made, then reads the answer into CONN. Returns 1 while the
+ * heartbeat is still under way, in which case *EVENTS is set to what to wait
+ * for next, 0 once the answer has arrived, or -1 if the heartbeat failed. */
+static int tpcmaster_heartbeat_step(int fd, short *events, kvconn_t *conn,
+    kvmessage_t *ping) {
+  socklen_t len = sizeof(int);
+  kvmessage_t *pong;
+  int err;
+  long ret;
+
+  if (*events == POLLOUT) {
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0 ||
+        kvmessage_send(ping, fd) < 0)
+      return -1;
+    *events = POLLIN;
+    return 1;
+  }
+  ret = kvconn_receive(conn);
+  if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+    return -1;
+  if (!kvconn_pending(conn))
+    return 1;
+  if ((pong = kvconn_read(conn)) == NULL)
+    return -1;
+  kvmessage_free(pong);
+  return 0;
+}
+
+/* Delivers the decisions left on the list of each of the NUM_SLAVES slaves in
+ * SLAVES which is no longer suspect, oldest first, stopping at the first one
+ * a slave does not acknowledge so that it is retried after the next round. */
+static void tpcmaster_redeliver(tpcmaster_t *master, tpcslave_t **slaves,
+    unsigned int num_slaves) {
+  tpcdecision_t *deferred;
+  kvmessage_t decision;
+  unsigned int i;
+
+  memset(&decision, 0, sizeof(kvmessage_t));
+  for (i = 0; i < num_slaves; i++) {
+    while (!tpcmaster_slave_suspect(slaves[i])) {
+      pthread_mutex_lock(&master->decision_lock);
+      deferred = slaves[i]->undelivered;
+      pthread_mutex_unlock(&master->decision_lock);
+      if (deferred == NULL)
+        break;
+      decision.type = deferred->type;
+      decision.txid = deferred->txid;
+      if (!tpcmaster_deliver_once(slaves[i], &decision, NULL))
+        break;
+      /* Decisions are only ever appended by others, so DEFERRED is still
+       * the head of the list. */
+      pthread_mutex_lock(&master->decision_lock);
+      LL_DELETE(slaves[i]->undelivered, deferred);
+      pthread_mutex_unlock(&master->decision_lock);
+      free(deferred);
+    }
+  }
+}
+
+/* Sends one heartbeat (an INFO request) to each of MASTER's slaves at once,
+ * records the ones that answer within TPCMASTER_HEARTBEAT_MS, then updates
+ * which slaves are suspect, delivers the decisions left for slaves which are
+ * not (see tpcmaster_deliver), and waits out the rest of the interval. Every
+ * connection is non-blocking and polled against the same deadline, so a
+ * slave which cannot be reached, or answers only in part, delays nothing
+ * past it. Heartbeats are not counted as in-flight requests, so they do not
+ * skew the load scores used to balance reads. */
+static void tpcmaster_heartbeat_round(tpcmaster_t *master) {
+  unsigned long parity, now, deadline;
+  tpcring_t *ring = tpcmaster_ring_acquire(master, &parity);
+  unsigned int count = ring->count, nfds = 0, i;
+  tpcslave_t *members[count + 1], *slaves[count + 1];
+  struct pollfd fds[count + 1];
+  kvconn_t conns[count + 1];
+  kvmessage_t ping;
+  int ret;
+
+  /* Slaves are never freed, so the ring is only needed for the list of
+   * them, and is released before any network I/O so that rebuilding it
+   * never waits on a round. */
+  for (i = 0; i < count; i++)
+    members[i] = ring->entries[i].slave;
+  tpcmaster_ring_release(master, parity);
+
+  memset(&ping, 0, sizeof(kvmessage_t));
+  ping.type = INFO;
+  deadline = tpcmaster_now_us() + TPCMASTER_HEARTBEAT_MS * 1000;
+  for (i = 0; i < count; i++) {
+    fds[nfds].fd = connect_start(members[i]->host, members[i]->port);
+    if (fds[nfds].fd == -1)
+      continue;
+    fds[nfds].events = POLLOUT;
+    kvconn_init(&conns[nfds], fds[nfds].fd, NULL);
+    slaves[nfds++] = members[i];
+  }
+  while (nfds > 0 && (now = tpcmaster_now_us()) < deadline) {
+    if (poll(fds, nfds, (deadline - now + 999) / 1000) <= 0)
+      break;
+    for (i = 0; i < nfds; ) {
+      if (fds[i].revents == 0) {
+        i++;
+        continue;
+      }
+      ret = tpcmaster_heartbeat_step(fds[i].fd, &fds[i].events, &conns[i],
+          &ping);
+      if (ret > 0) {
+        i++;
+        continue;
+      }
+      if (ret == 0)
+        tpcmaster_heartbeat_record(slaves[i], tpcmaster_now_us());
+      kvconn_free(&conns[i]);
+      close(fds[i].fd);
+      nfds--;
+      fds[i] = fds[nfds];
+      slaves[i] = slaves[nfds];
+      conns[i] = conns[nfds];
+    }
+  }
+  for (i = 0; i < nfds; i++) {
+    kvconn_free(&conns[i]);
+    close(fds[i].fd);
+  }
+
+  now = tpcmaster_now_us();
+  for (i = 0; i < count; i++)
+    tpcmaster_heartbeat_check(members[i], now);
+  tpcmaster_redeliver(master, members, count);
+  now = tpcmaster_now_us();
+  if (now < deadline)
+    usleep(deadline - now);
+}
+
+/* Body of MASTER's heartbeat thread. */
+static void *tpcmaster_heartbeat_loop(void *aux) {
+  tpcmaster_t *master = aux;
+  while (__atomic_load_n(&master->heartbeat_running, __ATOMIC_RELAXED))
+    tpcmaster_heartbeat_round(master);
+  return NULL;
+}
+
+/* Starts a thread which sends heartbeats to MASTER's slaves every
+ * TPCMASTER_HEARTBEAT_MS milliseconds and marks the ones that stop answering
+ * as suspect. Returns 0 if successful, else a negative error code. */
+int tpcmaster_start_heartbeat(tpcmaster_t *master) {
+  if (master->heartbeat_running)
+    return 0;
+  master->heartbeat_running = true;
+  if (pthread_create(&master->heartbeat_thread, NULL,
+        tpcmaster_heartbeat_loop, master) != 0) {
+    master->heartbeat_running = false;
+    return -1;
+  }
+  return 0;
+}
+
+/* Stops MASTER's heartbeat thread, if it is running, and waits for it to
+ * exit. Suspicions already raised are kept. */
+void tpcmaster_stop_heartbeat(tpcmaster_t *master) {
+  if (!master->heartbeat_running)
+    return;
+  __atomic_store_n(&master->heartbeat_running, false, __ATOMIC_RELAXED);
+  pthread_join(master->heartbeat_thread, NULL);
+}
+
+/* Fills PRIMARIES with the first slaves of the replica sets which lose keys to
+ * SLAVE when it joins MASTER's ring: the slave that follows it and the ones
+ * before that slave, up to MASTER's redundancy. The first of them holds every
+ * key SLAVE will own. Returns the number of slaves found. */
+static unsigned int tpcmaster_losing_primaries(tpcmaster_t *master,
+    tpcslave_t *slave, tpcslave_t **primaries) {
+  unsigned long parity;
+  tpcring_t *ring = tpcmaster_ring_acquire(master, &parity);
+  unsigned int next, num = 0;
+  if (ring->count > 0) {
+    next = tpcring_rank(ring, slave->id, true) % ring->count;
+    while (num < master->redundancy && num < ring->count) {
+      primaries[num] = ring->entries[(next + ring->count - num) %
+          ring->count].slave;
+      num++;
+    }
+  }
+  tpcmaster_ring_release(master, parity);
+  return num;
+}
+
+/* Waits for the 2PC rounds of the NUM replica sets starting at PRIMARIES to
+ * finish and keeps new ones from starting until tpcmaster_release_groups is
+ * called; requests which arrive meanwhile wait in their batches. Returns
+ * false, holding nothing, if a replica set could not be tracked. */
+static bool tpcmaster_hold_groups(tpcmaster_t *master, tpcslave_t **primaries,
+    unsigned int num) {
+  tpcgroup_t *groups[num];
+  unsigned int i;
+  pthread_mutex_lock(&master->group_lock);
+  for (i = 0; i < num; i++) {
+    if ((groups[i] = tpcmaster_get_group(master, primaries[i])) == NULL)
+      break;
+    while (groups[i]->busy)
+      pthread_cond_wait(&groups[i]->cond, &master->group_lock);
+    groups[i]->busy = true;
+  }
+  if (i < num) {
+    while (i-- > 0) {
+      groups[i]->busy = false;
+      pthread_cond_broadcast(&groups[i]->cond);
+    }
+    pthread_mutex_unlock(&master->group_lock);
+    return false;
+  }
+  pthread_mutex_unlock(&master->group_lock);
+  return true;
+}
+
+/* Lets the 2PC rounds held by tpcmaster_hold_groups run again. */
+static void tpcmaster_release_groups(tpcmaster_t *master,
+    tpcslave_t **primaries, unsigned int num) {
+  tpcgroup_t *group;
+  unsigned int i;
+  pthread_mutex_lock(&master->group_lock);
+  for (i = 0; i < num; i++) {
+    group = tpcmaster_get_group(master, primaries[i]);
+    group->busy = false;
+    pthread_cond_broadcast(&group->cond);
+  }
+  pthread_mutex_unlock(&master->group_lock);
+}
+
+/* Asks SLAVE for the batch of its entries which starts at CURSOR (see
+ * kvmessage.h). Returns the response, which should be freed using
+ * kvmessage_free, or NULL if SLAVE could not be scanned. */
+static kvmessage_t *tpcmaster_scan_slave(tpcslave_t *slave,
+    unsigned long cursor) {
+  kvmessage_t reqmsg, *respmsg;
+  char limit[16];
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = SCANREQ;
+  reqmsg.version = cursor;
+  sprintf(limit, "%d", TPCMASTER_MIGRATE_BATCH);
+  reqmsg.value = limit;
+  respmsg = tpcmaster_send_slave(slave, &reqmsg, NULL);
+  if (respmsg != NULL && (respmsg->message == NULL ||
+        strcmp(respmsg->message, MSG_SUCCESS) != 0)) {
+    kvmessage_free(respmsg);
+    respmsg = NULL;
+  }
+  return respmsg;
+}
+
+/* Keeps the entries in the scan response RESPMSG which SLAVE_ID is (if OWNED)
+ * or is not (otherwise) a replica of in MASTER's ring, turning them into
+ * requests of type TYPE. If ROUTED is not NULL, nothing is kept unless the
+ * ring routes to ROUTED. Returns the number of entries kept, which are moved
+ * to the front of RESPMSG->ops. */
+static unsigned int tpcmaster_filter_scan(tpcmaster_t *master,
+    kvmessage_t *respmsg, int64_t slave_id, bool owned, msgtype_t type,
+    tpcslave_t *routed) {
+  unsigned long parity;
+  tpcring_t *ring = tpcmaster_ring_acquire(master, &parity);
+  unsigned int kept = 0, i;
+  kvmessage_t op;
+  if (routed != NULL && tpcring_rank(ring, routed->id, true) ==
+      tpcring_rank(ring, routed->id, false)) {
+    tpcmaster_ring_release(master, parity);
+    return 0;
+  }
+  for (i = 0; i < respmsg->num_ops; i++) {
+    op = respmsg->ops[i];
+    if (tpcring_is_replica(ring, slave_id, hash_64_bit(op.key),
+          master->redundancy) != owned)
+      continue;
+    op.type = type;
+    respmsg->ops[i] = respmsg->ops[kept];
+    respmsg->ops[kept++] = op;
+  }
+  tpcmaster_ring_release(master, parity);
+  return kept;
+}
+
+/* Drops the first NUM entries of the scan response RESPMSG whose keys were
+ * forwarded to the joining slave after MASTER's JOINING_SEQ was SEQ, since
+ * SLAVE already holds a newer value for them than the scan read. Returns the
+ * number of entries kept, which are moved to the front of RESPMSG->ops. */
+static unsigned int tpcmaster_skip_written(tpcmaster_t *master,
+    kvmessage_t *respmsg, unsigned int num, unsigned long seq) {
+  tpcwritten_t *written;
+  unsigned int kept = 0, i;
+  kvmessage_t op;
+  pthread_mutex_lock(&master->written_lock);
+  for (i = 0; i < num; i++) {
+    op = respmsg->ops[i];
+    HASH_FIND_STR(master->joining_written, op.key, written);
+    if (written != NULL && written->seq > seq)
+      continue;
+    respmsg->ops[i] = respmsg->ops[kept];
+    respmsg->ops[kept++] = op;
+  }
+  pthread_mutex_unlock(&master->written_lock);
+  return kept;
+}
+
+/* Copies the next batch of keys which the joining SLAVE will own from SOURCE,
+ * starting at *CURSOR, and advances *CURSOR. Client writes keep running
+ * meanwhile. A write commits on SOURCE before it is forwarded to SLAVE, so
+ * the scan reads at least the value of every write forwarded before it
+ * started; a key forwarded since is left out, and forwards wait while the
+ * batch is applied, so a copied value never lands on top of a newer one.
+ * Returns 1 once every key has been copied, 0 if there are more, or -1 if the
+ * batch could not be copied. */
+static int tpcmaster_migrate_batch(tpcmaster_t *master, tpcslave_t *slave,
+    tpcslave_t *source, unsigned long *cursor) {
+  kvmessage_t *respmsg;
+  unsigned long seq;
+  unsigned int num;
+  int ret = -1;
+  pthread_mutex_lock(&master->written_lock);
+  seq = master->joining_seq;
+  pthread_mutex_unlock(&master->written_lock);
+  if ((respmsg = tpcmaster_scan_slave(source, *cursor)) == NULL)
+    return -1;
+  num = tpcmaster_filter_scan(master, respmsg, slave->id, true, PUTREQ, NULL);
+  pthread_rwlock_wrlock(&master->migrate_lock);
+  num = tpcmaster_skip_written(master, respmsg, num, seq);
+  if (num == 0 || tpcmaster_slave_txn(master, slave, respmsg->ops, num,
+        NULL)) {
+    *cursor = respmsg->version;
+    ret = (*cursor == 0);
+  }
+  pthread_rwlock_unlock(&master->migrate_lock);
+  kvmessage_free(respmsg);
+  return ret;
+}
+
+/* Deletes from SLAVE, in batches, the keys it holds but is no longer a
+ * replica of now that JOINED is routed to. Ownership is checked for each
+ * batch under the ring published when JOINED was added, or a later one, just
+ * before the batch is deleted; rings only ever gain slaves and no round still
+ * uses an older one, so a key SLAVE is not a replica of then is never written
+ * to it again. Nothing is dropped if JOINED is not routed to. A batch which
+ * cannot be deleted is left in place. */
+static void tpcmaster_drop_unowned(tpcmaster_t *master, tpcslave_t *slave,
+    tpcslave_t *joined) {
+  unsigned long cursor = 0;
+  kvmessage_t *respmsg;
+  unsigned int num;
+  do {
+    if ((respmsg = tpcmaster_scan_slave(slave, cursor)) == NULL)
+      return;
+    num = tpcmaster_filter_scan(master, respmsg, slave->id, false, DELREQ,
+        joined);
+    if (num > 0)
+      tpcmaster_slave_txn(master, slave, respmsg->ops, num, NULL);
+    cursor = respmsg->version;
+    kvmessage_free(respmsg);
+    usleep(TPCMASTER_MIGRATE_PAUSE_US);
+  } while (cursor != 0 &&
+      __atomic_load_n(&master->rebalancer_running, __ATOMIC_RELAXED));
+}
+
+/* Moves the keys which SLAVE, which has registered but is not yet routed to,
+ * will own onto it, then adds it to MASTER's ring (see tpcmaster.h). Batches
+ * are copied from the slave which follows SLAVE on the ring while client
+ * writes go on, each of them forwarded to SLAVE by tpcmaster_forward_joining
+ * once committed, so that every write to a key is either copied or
+ * forwarded. If a forwarded write is lost, the copy starts over, once every
+ * decision SLAVE has not acknowledged has been delivered, so that none of its
+ * keys is still locked by a transaction left prepared. Once every batch has
+ * been copied, the replica sets losing keys to SLAVE are held only long
+ * enough to let their rounds, and so their forwards, finish and to add SLAVE
+ * to the ring, after which its successors drop the keys they no longer own.
+ * Gives up, leaving SLAVE joining, if the rebalancer is stopped. */
+static void tpcmaster_migrate(tpcmaster_t *master, tpcslave_t *slave) {
+  tpcslave_t *primaries[master->redundancy];
+  unsigned long cursor = 0, parity;
+  unsigned int num, i;
+  bool pending, copied = false;
+  tpcring_t *ring;
+  int ret;
+
+  __atomic_store_n(&master->joining_stale, false, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&master->joining, slave, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&master->rebalancer_running, __ATOMIC_RELAXED)) {
+    tpcmaster_redeliver(master, &slave, 1);
+    pthread_mutex_lock(&master->decision_lock);
+    pending = (slave->undelivered != NULL);
+    pthread_mutex_unlock(&master->decision_lock);
+    if (pending) {
+      usleep(TPCMASTER_RETRY_US);
+      continue;
+    }
+    if (__atomic_exchange_n(&master->joining_stale, false, __ATOMIC_SEQ_CST)) {
+      cursor = 0;
+      copied = false;
+    }
+    num = tpcmaster_losing_primaries(master, slave, primaries);
+    ret = (copied || num == 0) ? 1 :
+        tpcmaster_migrate_batch(master, slave, primaries[0], &cursor);
+    if (ret == 1) {
+      copied = true;
+      if (!tpcmaster_hold_groups(master, primaries, num)) {
+        usleep(TPCMASTER_RETRY_US);
+        continue;
+      }
+      if (__atomic_load_n(&master->joining_stale, __ATOMIC_SEQ_CST)) {
+        ret = -1;
+      } else {
+        pthread_rwlock_wrlock(&master->slave_lock);
+        slave->joining = false;
+        slave->hb_last_us = tpcmaster_now_us();
+        tpcmaster_ring_rebuild(master);
+        /* The ring is left as it was if it could not be rebuilt. */
+        if (master->ring == NULL ||
+            tpcring_rank(master->ring, slave->id, true) ==
+            tpcring_rank(master->ring, slave->id, false)) {
+          slave->joining = true;
+          ret = -1;
+        } else {
+          __atomic_store_n(&master->joining, NULL, __ATOMIC_SEQ_CST);
+        }
+        pthread_rwlock_unlock(&master->slave_lock);
+      }
+      tpcmaster_release_groups(master, primaries, num);
+      if (ret == 1)
+        break;
+    }
+    usleep((ret < 0) ? TPCMASTER_RETRY_US : TPCMASTER_MIGRATE_PAUSE_US);
+  }
+  tpcmaster_clear_written(master);
+  if (slave->joining) {
+    __atomic_store_n(&master->joining, NULL, __ATOMIC_SEQ_CST);
+    return;
+  }
+
+  ring = tpcmaster_ring_acquire(master, &parity);
+  i = tpcring_rank(ring, slave->id, true);
+  for (num = 0; num < master->redundancy && num + 1 < ring->count; num++)
+    primaries[num] = ring->entries[(i + num) % ring->count].slave;
+  tpcmaster_ring_release(master, parity);
+  for (i = 0; i < num; i++)
+    tpcmaster_drop_unowned(master, primaries[i], slave);
+}
+
+/* Returns the first slave in MASTER's list which is still joining, or NULL. */
+static tpcslave_t *tpcmaster_next_joining(tpcmaster_t *master) {
+  tpcslave_t *slave, *found = NULL;
+  unsigned int i;
+  pthread_rwlock_rdlock(&master->slave_lock);
+  slave = master->slaves_head;
+  for (i = 0; slave != NULL && i < master->slave_count; i++) {
+    if (slave->joining) {
+      found = slave;
+      break;
+    }
+    slave = slave->next;
+  }
+  pthread_rwlock_unlock(&master->slave_lock);
+  return found;
+}
+
+/* Body of MASTER's rebalancer thread. */
+static void *tpcmaster_rebalancer_loop(void *aux) {
+  tpcmaster_t *master = aux;
+  tpcslave_t *slave;
+  while (__atomic_load_n(&master->rebalancer_running, __ATOMIC_RELAXED)) {
+    if ((slave = tpcmaster_next_joining(master)) != NULL)
+      tpcmaster_migrate(master, slave);
+    else
+      usleep(TPCMASTER_RETRY_US);
+  }
+  return NULL;
+}
+
+/* Starts a thread which moves keys to slaves as they register, so that they
+ * are only routed to once they hold the keys they own (see tpcmaster.h).
+ * Only slaves which register after this call are moved. Returns 0 if
+ * successful, else a negative error code. */
+int tpcmaster_start_rebalancer(tpcmaster_t *master) {
+  if (master->rebalancer_running)
+    return 0;
+  master->rebalancer_running = true;
+  if (pthread_create(&master->rebalancer_thread, NULL,
+        tpcmaster_rebalancer_loop, master) != 0) {
+    master->rebalancer_running = false;
+    return -1;
+  }
+  return 0;
+}
+
+/* Stops MASTER's rebalancer thread, if it is running, and waits for it to
+ * exit. A slave whose keys were still being moved stays joining, and its move
+ * starts over if the rebalancer is started again. */
+void tpcmaster_stop_rebalancer(tpcmaster_t *master) {
+  if (!master->rebalancer_running)
+    return;
+  __atomic_store_n(&master->rebalancer_running, false, __ATOMIC_RELAXED);
+  pthread_join(master->rebalancer_thread, NULL);
+}
+
+/* The master and callback a connection to a master is served for. */
+typedef struct {
+  tpcmaster_t *master;
+  callback_t callback;
+} tpcmaster_conn_t;
+
+/* Handles REQMSG, a request read from CONN (or NULL if it could not be
+ * parsed), queueing the response on CONN. Takes ownership of REQMSG. Serves
+ * as the kvconn_handler_t of the tpcmaster_conn_t _CONN_INFO. */
+static void tpcmaster_answer(void *_conn_info, kvconn_t *conn,
+    kvmessage_t *reqmsg) {
+  tpcmaster_conn_t *conn_info = (tpcmaster_conn_t *) _conn_info;
+  tpcmaster_t *master = conn_info->master;
+  callback_t callback = conn_info->callback;
+  kvmessage_t respmsg;
   memset(&respmsg, 0, sizeof(kvmessage_t));
   respmsg.type = RESP;
-  if (reqmsg->key != NULL) {
-    respmsg.key = calloc(1, strlen(reqmsg->key));
-    strcpy(respmsg.key, reqmsg->key);
-  }
-  if (reqmsg->type == INFO) {
+  if (reqmsg != NULL && reqmsg->type == INFO) {
     tpcmaster_info(master, reqmsg, &respmsg);
   } else if (reqmsg == NULL || reqmsg->key == NULL) {
     respmsg.message = ERRMSG_INVALID_REQUEST;
@@ -236,10 +2152,26 @@ void tpcmaster_handle(tpcmaster_t *master, int sockfd, callback_t callback) {
   } else {
     tpcmaster_handle_tpc(master, reqmsg, &respmsg, callback);
   }
-  kvmessage_send(&respmsg, sockfd);
-  kvmessage_free(reqmsg);
-  if (respmsg.key != NULL)
-    free(respmsg.key);
+  kvconn_queue(conn, &respmsg);
+  if (respmsg.type == GETRESP)
+    free(respmsg.value);
+  if (reqmsg != NULL && reqmsg->type == INFO &&
+      strcmp(respmsg.message, ERRMSG_GENERIC_ERROR) != 0)
+    free(respmsg.message);
+  if (reqmsg != NULL)
+    kvmessage_free(reqmsg);
+}
+
+/* Generic entrypoint for this MASTER. Takes in a socket on SOCKFD, which
+ * should already be connected to an incoming request. Processes the request
+ * and sends back a response message.  This should call out to the appropriate
+ * internal handler. Any further requests the client pipelines on SOCKFD are
+ * served the same way, and SOCKFD is closed afterwards (see kvconn_serve). */
+void tpcmaster_handle(tpcmaster_t *master, int sockfd, callback_t callback) {
+  tpcmaster_conn_t conn_info;
+  conn_info.master = master;
+  conn_info.callback = callback;
+  kvconn_serve(sockfd, NULL, tpcmaster_answer, &conn_info);
 }
 
 /* Completely clears this TPCMaster's cache. For testing purposes. */
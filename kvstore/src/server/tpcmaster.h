@@ -2,7 +2,11 @@
 #define __KV_MASTER__
 
 #include <pthread.h>
+#include <stdbool.h>
 #include "kvcache.h"
+#include "kvflight.h"
+#include "kvmessage.h"
+#include "uthash.h"
 
 /* TPCMaster defines a master server which will communicate with multiple
  * slave servers.
@@ -12,13 +16,77 @@
  * it receives, the TPCMaster polls the slaves relevant to the key in question,
  * asking for a VOTE_COMMIT or a VOTE_ABORT. If a consesus to commit is
  * reached, the TPCMaster notifies the slaves to COMMIT, else it commands to
- * ABORT.
+ * ABORT. Writes which arrive for the same replica set while a round is
+ * running are coalesced into a single BATCHREQ round, which prepares, votes
+ * and commits all of them at once.
  *
  * The TPCMaster will need to listen for registration requests from KVServers
  * acting as its slaves, before it can handle any client request.
  *
  * The TPCMaster has an associated KVCache, which should be updated on PUT
  * and DEL requests, and accessed on GET requests before going to the slaves.
+ * A committed write updates or invalidates the cache at the commit point,
+ * tagged with an increasing commit version, so the cache is authoritative:
+ * it never serves a value older than a committed write, and a value a GET
+ * read from a slave is only filled into the cache if no write to its cache
+ * set committed while it was being read. A value written or read with a TTL
+ * (see kvmessage.h) is cached for a second less than its replicas report,
+ * so that the cache never outlives them.
+ *
+ * GET requests which miss the cache are spread across all REDUNDANCY replicas
+ * of the key: two of them are considered and the one with the lower load
+ * (outstanding requests weighted by recent response time, both tracked by the
+ * master itself) is asked first. If it has not answered within the 95th
+ * percentile of recent GET response times, the GET is hedged by sending a
+ * duplicate to the next replica and taking whichever answer arrives first.
+ * GETs which miss the cache on the same key at the same time share a single
+ * read, made by the first of them.
+ *
+ * A master can instead be switched into quorum mode with tpcmaster_set_quorum,
+ * given a write quorum W and a read quorum R out of the REDUNDANCY (N)
+ * replicas of each key. A write is stamped with a hybrid logical clock
+ * version and sent to all N replicas at once, and succeeds as soon as W of
+ * them have applied it; replicas keep whichever version of a key is newest.
+ * A read asks R replicas, returns the freshest of their answers, and sends
+ * that version to any replica which answered with an older one (read
+ * repair). Choosing W + R > N makes every read see the latest successful
+ * write. The master's cache is not used in quorum mode, since the replicas'
+ * versions decide which value is current.
+ *
+ * Once tpcmaster_start_heartbeat has been called, a background thread pings
+ * every slave each TPCMASTER_HEARTBEAT_MS and keeps a moving average of the
+ * interval between their answers and of its deviation. A slave which has
+ * been silent for longer than its mean interval plus TPCMASTER_SUSPECT_DEVS
+ * deviations (plus half an interval of slack) is marked suspect until it
+ * answers again. Reads try suspect replicas last and never hedge to them,
+ * and a write whose replica set includes a suspect slave is aborted at once
+ * instead of waiting for the slave to time out. A phase-two message which a
+ * slave has not acknowledged by the time it becomes suspect is kept on that
+ * slave's list of undelivered decisions instead, so that the round can
+ * finish, and is delivered by the heartbeat thread once the slave answers
+ * again. INFO reports which slaves are suspect.
+ *
+ * Once tpcmaster_start_rebalancer has been called, a slave which registers
+ * with a 2PC master that already routes to other slaves joins in the
+ * background instead of being routed to at once. The rebalancer thread
+ * copies the keys it will own from the slave that follows it on the ring, in
+ * throttled batches, while writes committed to those keys are also forwarded
+ * to it. A copied value never overwrites a write forwarded after it was
+ * read, so the copy runs alongside client traffic, and only the final step,
+ * which adds the slave to the ring, waits for the 2PC rounds of the replica
+ * sets losing keys and holds new ones back. Its successors then drop the keys
+ * they no longer own under the new ring. If the joining slave stops
+ * answering, writes stop waiting for it
+ * after TPCMASTER_JOIN_ATTEMPTS and the copy starts over once it answers
+ * again. INFO reports which slaves are still joining.
+ *
+ * Every request passes through a space-saving heavy-hitter tracker, which
+ * keeps approximate counts for the most requested keys in a bounded table.
+ * A key which takes a large enough share of recent requests is hot: its
+ * entry in the master's cache is pinned so that it is never evicted, and
+ * refilled or rewritten as pinned, until the key cools down. Reads of a hot
+ * key are thus served by the master rather than by the key's replicas. INFO
+ * lists the hot keys with their estimated request counts.
  *
  * For this project, you can assume that the TPCMaster will never fail. Thus,
  * you don't need to maintain a TPCLog for it.
@@ -28,15 +96,146 @@
 
 typedef void (*callback_t)(void*);
 
+/* The timeout (in seconds) used when contacting a slave. */
+#define TPCMASTER_TIMEOUT 2
+
+/* A GET which has not been answered within this percentile of recent GET
+ * response times is hedged by sending a duplicate to another replica. */
+#define TPCMASTER_HEDGE_PERCENTILE 95
+/* A slave earns one hedged GET for every TPCMASTER_HEDGE_RATIO requests sent
+ * to it, and may bank at most TPCMASTER_HEDGE_BURST of them, so hedging can
+ * add at most a bounded fraction of load to an already busy slave. */
+#define TPCMASTER_HEDGE_RATIO 10
+#define TPCMASTER_HEDGE_BURST 10
+
+/* GET response times are kept in power-of-two microsecond buckets. Bucket
+ * counts are halved every TPCMASTER_HIST_WINDOW samples, and no GET is hedged
+ * until TPCMASTER_HIST_MIN samples have been seen. */
+#define TPCMASTER_HIST_BUCKETS 32
+#define TPCMASTER_HIST_WINDOW 1024
+#define TPCMASTER_HIST_MIN 32
+
+/* The maximum number of write requests committed by a single 2PC round. */
+#define TPCMASTER_BATCH_MAX 16
+/* The delay (in microseconds) between attempts to deliver a phase-two
+ * message to a slave which could not be reached. */
+#define TPCMASTER_RETRY_US 100000
+
+/* Versions issued in quorum mode are hybrid logical clock timestamps: wall
+ * clock milliseconds shifted left by TPCMASTER_HLC_LOGICAL_BITS, plus a
+ * logical counter which orders writes issued within the same millisecond. */
+#define TPCMASTER_HLC_LOGICAL_BITS 16
+
+/* The interval (in milliseconds) between heartbeats sent to each slave. */
+#define TPCMASTER_HEARTBEAT_MS 100
+/* A slave is suspected once it has been silent for this many mean deviations
+ * beyond its mean heartbeat interval. */
+#define TPCMASTER_SUSPECT_DEVS 4
+
+/* Keys are moved to a joining slave in batches spanning at most
+ * TPCMASTER_MIGRATE_BATCH key hashes, at most one batch every
+ * TPCMASTER_MIGRATE_PAUSE_US microseconds. */
+#define TPCMASTER_MIGRATE_BATCH 32
+#define TPCMASTER_MIGRATE_PAUSE_US 10000
+/* A joining slave is not sent heartbeats, so a phase-two message it does not
+ * acknowledge within this many attempts is left on its list of undelivered
+ * decisions, and the keys copied to it so far are copied again. */
+#define TPCMASTER_JOIN_ATTEMPTS 3
+
+/* The hot-key tracker counts the TPCMASTER_HOT_KEYS most requested keys.
+ * Counts are halved every TPCMASTER_HOT_WINDOW requests; a key becomes hot
+ * once it is known to have received TPCMASTER_HOT_PERCENT percent of a
+ * window's requests, and cools down once that falls below half as many. */
+#define TPCMASTER_HOT_KEYS 16
+#define TPCMASTER_HOT_WINDOW 1024
+#define TPCMASTER_HOT_PERCENT 2
+#define TPCMASTER_HOT_THRESHOLD \
+  (TPCMASTER_HOT_WINDOW * TPCMASTER_HOT_PERCENT / 100)
+
+/* A key counted by a TPCMaster's hot-key tracker. */
+typedef struct {
+  char key[MAX_KEYLEN + 1];     /* The key being counted. */
+  unsigned long count;          /* Requests counted for KEY, halved every window. */
+  unsigned long error;          /* How much of COUNT may belong to the key KEY replaced. */
+  bool hot;                     /* Set while KEY is hot. */
+} tpchotkey_t;
+
+/* A phase-two message which could not be delivered to a slave before it
+ * became suspect. */
+typedef struct tpcdecision {
+  msgtype_t type;               /* COMMIT or ABORT. */
+  unsigned long txid;           /* The transaction this decision finishes. */
+  struct tpcdecision *next;     /* The next undelivered decision for the same slave. */
+} tpcdecision_t;
+
 /* A struct used to represent the slaves which this TPC Master is aware of. */
 typedef struct tpcslave {
   int64_t id;                   /* The unique ID for this slave. */
   char *host;                   /* The host where this slave can be reached. */
   unsigned int port;            /* The port where this slave can be reached. */
+  unsigned long inflight;       /* Requests this master currently has outstanding to this slave. */
+  unsigned long latency_us;     /* Moving average of this slave's response time, in microseconds. */
+  unsigned long hedge_tokens;   /* Budget for hedged GETs to this slave (see TPCMASTER_HEDGE_RATIO). */
+  unsigned long hb_last_us;     /* When this slave last answered a heartbeat (or registered). */
+  unsigned long hb_mean_us;     /* Moving average of the interval between heartbeat answers. */
+  unsigned long hb_dev_us;      /* Moving average of the deviation of that interval. */
+  bool suspect;                 /* True while this slave is suspected to have failed. */
+  bool joining;                 /* True until keys have been moved to this slave and it is routed to. */
+  tpcdecision_t *undelivered;   /* Decisions left for the heartbeat thread, oldest first. */
   struct tpcslave *next;        /* The next slave in the list of slaves. */
   struct tpcslave *prev;        /* The previous slave in the list of slaves. */
 } tpcslave_t;
 
+/* A single position on the routing ring. */
+typedef struct {
+  int64_t id;                   /* The ID of the slave at this position. */
+  tpcslave_t *slave;            /* The slave at this position. */
+} tpcring_entry_t;
+
+/* An immutable snapshot of the slaves this master is aware of, sorted by
+ * increasing ID. A new ring is built whenever a slave registers and is
+ * published with an atomic pointer swap, so routing can binary search the
+ * current ring without ever taking SLAVE_LOCK. A replaced ring is only freed
+ * once every reader which may still hold it has left its epoch. */
+typedef struct {
+  unsigned int count;           /* The number of slaves in this ring. */
+  tpcring_entry_t entries[0];   /* The slaves, sorted by increasing ID. */
+} tpcring_t;
+
+/* A key forwarded to the slave joining a master while its keys are copied. */
+typedef struct tpcwritten {
+  char *key;                    /* The key which was written. */
+  unsigned long seq;            /* The master's JOINING_SEQ once it was forwarded. */
+  UT_hash_handle hh;            /* Make this struct hashable by KEY. */
+} tpcwritten_t;
+
+/* A single write request waiting to be committed. A CASREQ, INCRREQ or
+ * DECRREQ becomes the PUTREQ of the value its replicas computed once its
+ * round commits. */
+typedef struct tpcop {
+  msgtype_t type;               /* PUTREQ, DELREQ, CASREQ, INCRREQ or DECRREQ. */
+  char *key;                    /* The key this request writes. */
+  char *value;                  /* The value this request writes (NULL for DELREQ). */
+  char *expected;               /* The value a CASREQ expects to replace. */
+  unsigned long ttl;            /* The seconds until a PUTREQ's value expires, or 0. */
+  char *result;                 /* The message to respond with, set once DONE. */
+  bool done;                    /* True once this request has been committed or aborted. */
+  struct tpcop *next;           /* The next request in the same batch. */
+} tpcop_t;
+
+/* The write requests for the replica set starting at PRIMARY. Only one 2PC
+ * round runs against a replica set at a time; requests which arrive while it
+ * runs are collected in OPEN and committed together by the next round, so a
+ * batch spans exactly the window of the round before it. */
+typedef struct tpcgroup {
+  tpcslave_t *primary;          /* The first slave of this replica set. */
+  tpcop_t *open;                /* The requests waiting for the next round. */
+  unsigned int num_open;        /* The number of requests in OPEN. */
+  bool busy;                    /* True while a round is running for this replica set. */
+  pthread_cond_t cond;          /* Signalled when a round starts or finishes. */
+  struct tpcgroup *next;        /* The next replica set in the list. */
+} tpcgroup_t;
+
 struct tpcmaster;
 
 typedef void (*tpchandle_t)(struct tpcmaster *, int sockfd, callback_t callback);
@@ -48,12 +247,48 @@ typedef struct tpcmaster {
   unsigned int redundancy;      /* The number of slaves a single value will be stored on. */
   tpcslave_t *slaves_head;      /* The head of the list of slaves. */
   pthread_rwlock_t slave_lock;  /* A lock used to protect the list of slaves. */
+  tpcring_t *ring;              /* The routing snapshot, read without locks. */
+  unsigned long ring_epoch;     /* Incremented each time the ring is replaced. */
+  unsigned long ring_readers[2];/* Readers inside each epoch parity. */
   kvcache_t cache;              /* The cache this master will use. */
+  kvflight_t flights;           /* Coalesces concurrent GETs of keys missing from CACHE. */
   tpchandle_t handle;           /* The function this master will use to handle requests. */
+  unsigned long get_hist[TPCMASTER_HIST_BUCKETS]; /* Recent GET response times. */
+  unsigned long get_samples;    /* The number of GET response times recorded. */
+  tpcgroup_t *groups;           /* The replica sets which have received writes. */
+  pthread_mutex_t group_lock;   /* A lock used to protect GROUPS and their batches. */
+  unsigned long next_txid;      /* The id of the last 2PC round started by this master. */
+  unsigned long cache_version;  /* The commit version of the last 2PC round to commit. */
+  unsigned int write_quorum;    /* Replicas which must apply a write in quorum mode, or 0 to use 2PC. */
+  unsigned int read_quorum;     /* Replicas whose answers a read merges in quorum mode. */
+  unsigned long hlc;            /* The latest hybrid logical clock timestamp seen or issued. */
+  bool heartbeat_running;       /* True while the heartbeat thread should keep running. */
+  pthread_t heartbeat_thread;   /* The thread sending heartbeats to slaves. */
+  pthread_mutex_t decision_lock;/* A lock used to protect the slaves' UNDELIVERED lists. */
+  bool rebalancer_running;      /* True while the rebalancer thread should keep running. */
+  pthread_t rebalancer_thread;  /* The thread moving keys to joining slaves. */
+  tpcslave_t *joining;          /* The slave keys are currently being moved to, or NULL. */
+  bool joining_stale;           /* Set if a write could not be forwarded to JOINING. */
+  pthread_rwlock_t migrate_lock;/* Held to read by forwards to JOINING, and to write by copies. */
+  tpcwritten_t *joining_written;/* The keys forwarded to JOINING, protected by WRITTEN_LOCK. */
+  unsigned long joining_seq;    /* The number of forwards to JOINING, protected by WRITTEN_LOCK. */
+  pthread_mutex_t written_lock; /* A lock used to protect JOINING_WRITTEN and JOINING_SEQ. */
+  tpchotkey_t hot_keys[TPCMASTER_HOT_KEYS]; /* The keys counted by the hot-key tracker. */
+  unsigned int num_hot_keys;    /* The number of entries of HOT_KEYS in use. */
+  unsigned long hot_requests;   /* Requests counted since HOT_KEYS were last halved. */
+  pthread_mutex_t hot_lock;     /* A lock used to protect the hot-key tracker. */
 } tpcmaster_t;
 
+int64_t hash_64_bit(char *s);
+
 int tpcmaster_init(tpcmaster_t *master, unsigned int slave_capacity,
     unsigned int redundancy, unsigned int num_sets, unsigned int elem_per_set);
+int tpcmaster_set_quorum(tpcmaster_t *master, unsigned int write_quorum,
+    unsigned int read_quorum);
+int tpcmaster_start_heartbeat(tpcmaster_t *master);
+void tpcmaster_stop_heartbeat(tpcmaster_t *master);
+int tpcmaster_start_rebalancer(tpcmaster_t *master);
+void tpcmaster_stop_rebalancer(tpcmaster_t *master);
 
 void tpcmaster_register(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg);
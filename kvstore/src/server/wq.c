@@ -1,15 +1,32 @@
 #include <stdlib.h>
+#include <time.h>
 #include "wq.h"
 #include "kvconstants.h"
 #include "utlist.h"
 
 /* Initializes a work queue WQ. Sets up any necessary synchronization constructs. */
 void wq_init(wq_t *wq) {
+  wq_init_bounded(wq, 0);
+}
+
+/* Initializes WQ as wq_init does, to hold at most MAX_SIZE items pushed by
+ * wq_try_push, or any number if MAX_SIZE is 0. */
+void wq_init_bounded(wq_t *wq, unsigned int max_size) {
   wq->head = NULL;
+  wq->size = 0;
+  wq->max_size = max_size;
   pthread_mutex_init(&wq->lock, NULL);
   pthread_cond_init(&wq->cond, NULL);
 }
 
+/* Returns the current time in microseconds, from a clock which only moves
+ * forward. */
+static unsigned long wq_now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+}
+
 /* Remove an item from the WQ. Currently, this immediately attempts
  * to remove the item at the head of the list, and will fail if there are
  * no items in the list.
@@ -18,6 +35,13 @@ void wq_init(wq_t *wq) {
  * contains at least one item, then remove that item from the list and
  * return it. */
 void *wq_pop(wq_t *wq) {
+  return wq_pop_aged(wq, NULL);
+}
+
+/* Removes an item from WQ as wq_pop does and, unless WAITED_MS is NULL,
+ * places the number of milliseconds it spent in WQ into WAITED_MS. */
+void *wq_pop_aged(wq_t *wq, unsigned long *waited_ms) {
+  wq_item_t *wq_item;
   void *job;
 
   pthread_mutex_lock(&wq->lock);
@@ -27,23 +51,54 @@ void *wq_pop(wq_t *wq) {
     pthread_cond_wait(&wq->cond, &wq->lock);
   }
 
-  job = wq->head->item;
-  DL_DELETE(wq->head,wq->head);
+  wq_item = wq->head;
+  DL_DELETE(wq->head, wq_item);
+  wq->size--;
 
   pthread_mutex_unlock(&wq->lock);
 
+  job = wq_item->item;
+  if (waited_ms != NULL)
+    *waited_ms = (wq_now_us() - wq_item->pushed_us) / 1000;
+  free(wq_item);
   return job;
 }
 
+/* Adds WQ_ITEM, holding ITEM, to WQ and wakes a thread waiting for it. Must
+ * be called with WQ's lock held. */
+static void wq_append(wq_t *wq, wq_item_t *wq_item, void *item) {
+  wq_item->item = item;
+  wq_item->pushed_us = wq_now_us();
+  DL_APPEND(wq->head, wq_item);
+  wq->size++;
+  pthread_cond_signal(&wq->cond);
+}
+
 /* Add ITEM to WQ. Currently, this just adds ITEM to the list.
  *
  * It is your task to perform any necessary operations to properly
- * perform synchronization. */
+ * perform synchronization. The item is added even if WQ is bounded and
+ * full. */
 void wq_push(wq_t *wq, void *item) {
+  wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
   pthread_mutex_lock(&wq->lock);
+  wq_append(wq, wq_item, item);
+  pthread_mutex_unlock(&wq->lock);
+}
+
+/* Adds ITEM to WQ unless WQ is bounded and already holds as many items as
+ * it may. Returns 0 if ITEM was added, else -1. */
+int wq_try_push(wq_t *wq, void *item) {
   wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
-  wq_item->item = item;
-  DL_APPEND(wq->head, wq_item);
-  pthread_cond_signal(&wq->cond);
+  if (wq_item == NULL)
+    return -1;
+  pthread_mutex_lock(&wq->lock);
+  if (wq->max_size > 0 && wq->size >= wq->max_size) {
+    pthread_mutex_unlock(&wq->lock);
+    free(wq_item);
+    return -1;
+  }
+  wq_append(wq, wq_item, item);
   pthread_mutex_unlock(&wq->lock);
+  return 0;
 }
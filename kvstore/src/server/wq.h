@@ -9,25 +9,36 @@
  * threads to be waiting for items to fill the work queue. For each item added to the queue,
  * exactly one thread should receive the item. When the queue is empty, there should be no
  * busy waiting.
+ *
+ * A queue may be bounded, in which case wq_try_push refuses items once it holds MAX_SIZE of
+ * them, so that a producer can shed load instead of letting the queue grow without limit.
+ * Each item records when it was pushed, and wq_pop_aged reports how long it waited, so that
+ * a consumer can drop items which have waited too long to still be of use.
  */
 
 typedef struct wq_item {
    void *item;             /* The item which is being stored. */
+   unsigned long pushed_us;/* When the item was pushed, in microseconds of CLOCK_MONOTONIC. */
    struct wq_item *next;   /* The next item in the queue. */
    struct wq_item *prev;   /* The previous item in the queue. */
 } wq_item_t;
 
 typedef struct wq {
   wq_item_t *head;         /* The head of the list of items. */
+  unsigned int size;       /* The number of items in the queue. */
+  unsigned int max_size;   /* The most items wq_try_push will queue, or 0 for no bound. */
   pthread_mutex_t lock;    /* Used to lock the work queue. */
   pthread_cond_t cond;     /* Used to signal threads of available tasks. */
 } wq_t;
 
 
 void wq_init(wq_t *wq);
+void wq_init_bounded(wq_t *wq, unsigned int max_size);
 
 void wq_push(wq_t *wq, void *item);
+int wq_try_push(wq_t *wq, void *item);
 
 void *wq_pop(wq_t *wq);
+void *wq_pop_aged(wq_t *wq, unsigned long *waited_ms);
 
 #endif
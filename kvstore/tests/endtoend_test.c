@@ -24,7 +24,7 @@ int endtoend_test_init(void) {
   socket_server.max_threads = 2;
   kvserver = &socket_server.kvserver;
   return kvserver_init(kvserver, ENDTOEND_SERVER_NAME, 2, 2, 2,
-      ENDTOEND_HOSTNAME, ENDTOEND_PORT, 0);
+      ENDTOEND_HOSTNAME, ENDTOEND_PORT, 0, NULL);
 }
 
 int endtoend_test_clean(void) {
@@ -61,12 +61,12 @@ void *endtoend_tpc_slave_runner(void *_slave_num) {
   slave = &socket_server->kvserver;
   if (slave_num == 1) {
     kvserver_init(slave, ENDTOEND_TPC_SLAVE_NAME_1, 2, 2, 1, ENDTOEND_TPC_HOSTNAME,
-        ENDTOEND_TPC_SLAVE_PORT_1, 1);
+        ENDTOEND_TPC_SLAVE_PORT_1, 1, NULL);
     old_slave_handle = slave->handle;
     slave->handle = &endtoend_tpc_handle_then_die;
   } else {
     kvserver_init(slave, ENDTOEND_TPC_SLAVE_NAME_2, 2, 2, 1, ENDTOEND_TPC_HOSTNAME,
-        ENDTOEND_TPC_SLAVE_PORT_2, 1);
+        ENDTOEND_TPC_SLAVE_PORT_2, 1, NULL);
   }
   /* Rebuild state from TPC Log in case the server is recovering from a (simulated) crash */
   kvserver_rebuild_state(slave);
@@ -248,6 +248,74 @@ void *endtoend_tpc_test_client_thread_failures(void *aux) {
   return 0;
 }
 
+/* Sends a GET of KEY to the TPCMaster, with its cache cleared so that a
+ * replica is asked. Returns true if the answer is VALUE. */
+bool endtoend_tpc_read_is(char *key, char *value) {
+  kvmessage_t reqmsg, *respmsg;
+  bool ret;
+  tpcmaster_clear_cache(master);
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = GETREQ;
+  reqmsg.key = key;
+  respmsg = endtoend_tpc_send_and_receive(&reqmsg);
+  ret = respmsg != NULL && respmsg->type == GETRESP &&
+      strcmp(respmsg->value, value) == 0;
+  kvmessage_free(respmsg);
+  return ret;
+}
+
+/* PUTs each of two values under one key, then reads it back repeatedly while
+ * making each replica in turn look loaded to the master, so that the reads
+ * are spread over both; every read must see the value last written. */
+void *endtoend_tpc_test_client_thread_spread(void *aux) {
+  char *values[] = {"value1", "value2"};
+  kvmessage_t reqmsg, *respmsg;
+  tpcslave_t *replicas[2];
+  unsigned long before;
+  int pass = 1, asked[2] = {0, 0}, i, j;
+
+  replicas[0] = master->slaves_head;
+  replicas[1] = master->slaves_head->next;
+  for (i = 0; i < 2; i++) {
+    memset(&reqmsg, 0, sizeof(kvmessage_t));
+    reqmsg.type = PUTREQ;
+    reqmsg.key = "key1";
+    reqmsg.value = values[i];
+    respmsg = endtoend_tpc_send_and_receive(&reqmsg);
+    if (respmsg->type != RESP || strcmp(respmsg->message, MSG_SUCCESS) != 0)
+      pass = 0;
+    kvmessage_free(respmsg);
+    for (j = 0; j < 4; j++) {
+      /* Each request sent to a slave credits it a hedge token. */
+      __atomic_add_fetch(&replicas[j % 2]->inflight, 1000000,
+          __ATOMIC_SEQ_CST);
+      before = replicas[(j + 1) % 2]->hedge_tokens;
+      if (!endtoend_tpc_read_is("key1", values[i]))
+        pass = 0;
+      if (replicas[(j + 1) % 2]->hedge_tokens != before)
+        asked[(j + 1) % 2]++;
+      __atomic_sub_fetch(&replicas[j % 2]->inflight, 1000000,
+          __ATOMIC_SEQ_CST);
+    }
+  }
+  if (asked[0] != 4 || asked[1] != 4)
+    pass = 0;
+
+  pthread_mutex_lock(&endtoend_tpc_lock);
+  synch = pass;
+  completed = 1;
+  pthread_cond_signal(&endtoend_tpc_cond);
+  pthread_mutex_unlock(&endtoend_tpc_lock);
+  return 0;
+}
+
+int endtoend_tpc_spread_test(void) {
+  requests_before_death = 0;
+  client_thread = &endtoend_tpc_test_client_thread_spread;
+  ASSERT_TRUE(endtoend_tpc_start_servers_wait_completion());
+  return 1;
+}
+
 int endtoend_tpc_failure_test(void) {
   requests_before_death = 2;
   client_thread = &endtoend_tpc_test_client_thread_failures;
@@ -263,6 +331,8 @@ int endtoend_tpc_failure_test(void) {
 test_info_t endtoend_tpc_tests[] = {
   {"End to end test with tpc where one server dies and restarts",
     endtoend_tpc_failure_test},
+  {"End to end test with tpc where reads spread over consistent replicas",
+    endtoend_tpc_spread_test},
   NULL_TEST_INFO
 };
 
@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvarena.h"
+#include "kvmessage.h"
+#include "tester.h"
+
+#define BLOCK_SIZE 256
+
+kvarena_t testarena;
+
+int kvarena_test_init(void) {
+  kvarena_init(&testarena, BLOCK_SIZE);
+  return 0;
+}
+
+int kvarena_test_clean(void) {
+  kvarena_free(&testarena);
+  return 0;
+}
+
+int kvarena_blocks(void) {
+  char *first, *second, *big;
+  unsigned int i;
+
+  /* Allocations are aligned and do not overlap. */
+  first = kvarena_strdup(&testarena, "first");
+  second = kvarena_calloc(&testarena, 3, 5);
+  ASSERT_PTR_NOT_NULL(first);
+  ASSERT_PTR_NOT_NULL(second);
+  ASSERT_EQUAL((uintptr_t) second % KVARENA_ALIGN, 0);
+  ASSERT_TRUE(second >= first + strlen("first") + 1);
+  for (i = 0; i < 15; i++)
+    ASSERT_EQUAL(second[i], 0);
+  ASSERT_STRING_EQUAL(first, "first");
+
+  /* An allocation larger than a block gets a block of its own, and the next
+   * reset leaves one block large enough for everything. */
+  big = kvarena_alloc(&testarena, BLOCK_SIZE * 2);
+  ASSERT_PTR_NOT_NULL(big);
+  memset(big, 'x', BLOCK_SIZE * 2);
+  ASSERT_STRING_EQUAL(first, "first");
+  ASSERT_PTR_NOT_NULL(testarena.head->next);
+  kvarena_reset(&testarena);
+  ASSERT_PTR_NULL(testarena.head->next);
+  ASSERT_TRUE(testarena.head->size >= BLOCK_SIZE * 3);
+  ASSERT_EQUAL(testarena.head->used, 0);
+  big = kvarena_alloc(&testarena, BLOCK_SIZE * 2);
+  ASSERT_PTR_NOT_NULL(big);
+  ASSERT_PTR_NULL(testarena.head->next);
+
+  /* A reset after a much larger request keeps no more than the cap. */
+  big = kvarena_alloc(&testarena, BLOCK_SIZE * 64);
+  ASSERT_PTR_NOT_NULL(big);
+  kvarena_reset(&testarena);
+  ASSERT_PTR_NULL(testarena.head->next);
+  ASSERT_EQUAL(testarena.head->size, BLOCK_SIZE * KVARENA_MAX_RETAIN);
+  kvarena_reset(&testarena);
+  ASSERT_EQUAL(testarena.head->size, BLOCK_SIZE * KVARENA_MAX_RETAIN);
+
+  /* A malloc()d string taken into the arena is copied there. */
+  first = kvarena_take(&testarena, strdup("taken"));
+  ASSERT_STRING_EQUAL(first, "taken");
+  return 1;
+}
+
+int kvarena_messages(void) {
+  kvmessage_t reqmsg, *msg;
+  unsigned int size;
+  char *frame, body[64];
+
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "key";
+  reqmsg.value = "value";
+  frame = kvmessage_encode(&reqmsg, &size);
+  ASSERT_PTR_NOT_NULL(frame);
+  /* kvmessage_decode needs the byte after the body to be writable. */
+  ASSERT_TRUE(size - 4 < sizeof(body));
+  memcpy(body, frame + 4, size - 4);
+  size -= 4;
+  free(frame);
+
+  /* A message decoded into an arena lives there, fields and all, and
+   * kvmessage_free leaves it to the arena. */
+  msg = kvmessage_decode(body, size, &testarena);
+  ASSERT_PTR_NOT_NULL(msg);
+  ASSERT_TRUE(msg->arena == &testarena);
+  ASSERT_TRUE((char *) msg >= testarena.head->data &&
+      (char *) msg < testarena.head->data + testarena.head->used);
+  ASSERT_TRUE(msg->value >= testarena.head->data &&
+      msg->value < testarena.head->data + testarena.head->used);
+  ASSERT_STRING_EQUAL(msg->key, "key");
+  ASSERT_STRING_EQUAL(msg->value, "value");
+  kvmessage_free(msg);
+  kvarena_reset(&testarena);
+  ASSERT_EQUAL(testarena.head->used, 0);
+
+  /* Without an arena, the message is malloc()d as before. */
+  msg = kvmessage_decode(body, size, NULL);
+  ASSERT_PTR_NOT_NULL(msg);
+  ASSERT_PTR_NULL(msg->arena);
+  ASSERT_STRING_EQUAL(msg->value, "value");
+  kvmessage_free(msg);
+  return 1;
+}
+
+test_info_t kvarena_tests[] = {
+  {"Allocations are bumped from blocks which a reset merges", kvarena_blocks},
+  {"Messages decoded into an arena are freed with it", kvarena_messages},
+  NULL_TEST_INFO
+};
+
+suite_info_t kvarena_suite = {"KVArena Tests", kvarena_test_init,
+  kvarena_test_clean, kvarena_tests};
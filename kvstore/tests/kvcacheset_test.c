@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <unistd.h>
 #include "tester.h"
 #include "kvcacheset.h"
 #include "kvconstants.h"
@@ -164,6 +165,123 @@ int kvcacheset_check_refbit_access(void) {
   return 1;
 }
 
+int kvcacheset_versioned_put(void) {
+  char *retval = NULL;
+  ASSERT_EQUAL(kvcacheset_put_versioned(&testset, "key", "new", 5), 0);
+  ASSERT_EQUAL(kvcacheset_put_versioned(&testset, "key", "old", 4), 1);
+  kvcacheset_get(&testset, "key", &retval);
+  ASSERT_STRING_EQUAL(retval, "new");
+  free(retval);
+  kvcacheset_invalidate(&testset, "key", 3);
+  ASSERT_EQUAL(kvcacheset_refbit(&testset, "key"), 1);
+  kvcacheset_invalidate(&testset, "key", 6);
+  ASSERT_EQUAL(kvcacheset_get(&testset, "key", &retval), ERRNOKEY);
+  /* Having seen version 6, the set must not resurrect KEY at version 5. */
+  ASSERT_EQUAL(kvcacheset_put_versioned(&testset, "key", "old", 5), 1);
+  ASSERT_EQUAL(kvcacheset_get(&testset, "key", &retval), ERRNOKEY);
+  return 1;
+}
+
+int kvcacheset_stale_fill(void) {
+  char *retval = NULL;
+  unsigned long token;
+  token = kvcacheset_fill_token(&testset);
+  kvcacheset_invalidate(&testset, "key", 1);
+  ASSERT_EQUAL(kvcacheset_fill(&testset, "key", "stale", token), 1);
+  ASSERT_EQUAL(kvcacheset_get(&testset, "key", &retval), ERRNOKEY);
+  token = kvcacheset_fill_token(&testset);
+  ASSERT_EQUAL(kvcacheset_fill(&testset, "key", "fresh", token), 0);
+  kvcacheset_get(&testset, "key", &retval);
+  ASSERT_STRING_EQUAL(retval, "fresh");
+  free(retval);
+  kvcacheset_invalidate(&testset, "key", 2);
+  ASSERT_EQUAL(kvcacheset_get(&testset, "key", &retval), ERRNOKEY);
+  return 1;
+}
+
+int kvcacheset_absent_keys(void) {
+  char *retval = NULL;
+  unsigned long token;
+  token = kvcacheset_fill_token(&testset);
+  ASSERT_EQUAL(kvcacheset_fill(&testset, "gone1", NULL, token), 0);
+  ASSERT_EQUAL(kvcacheset_get(&testset, "gone1", &retval),
+      KVCACHESET_ABSENT);
+  /* A set of 3 holds a single absent key, so the oldest makes way. */
+  token = kvcacheset_fill_token(&testset);
+  ASSERT_EQUAL(kvcacheset_fill(&testset, "gone2", NULL, token), 0);
+  ASSERT_EQUAL(kvcacheset_get(&testset, "gone1", &retval), ERRNOKEY);
+  ASSERT_EQUAL(kvcacheset_get(&testset, "gone2", &retval),
+      KVCACHESET_ABSENT);
+  ASSERT_EQUAL(kvcacheset_put(&testset, "gone2", "here"), 0);
+  kvcacheset_get(&testset, "gone2", &retval);
+  ASSERT_STRING_EQUAL(retval, "here");
+  free(retval);
+  token = kvcacheset_fill_token(&testset);
+  ASSERT_EQUAL(kvcacheset_fill(&testset, "gone3", NULL, token), 0);
+  usleep((KVCACHESET_ABSENT_TTL_MS + 50) * 1000);
+  ASSERT_EQUAL(kvcacheset_get(&testset, "gone3", &retval), ERRNOKEY);
+  token = kvcacheset_fill_token(&testset);
+  ASSERT_EQUAL(kvcacheset_fill(&testset, "gone3", "back", token), 0);
+  kvcacheset_get(&testset, "gone3", &retval);
+  ASSERT_STRING_EQUAL(retval, "back");
+  free(retval);
+  ASSERT_EQUAL(testset.num_absent, 0);
+  return 1;
+}
+int kvcacheset_value_ttl(void) {
+  char *retval = NULL;
+  unsigned long token;
+  ASSERT_EQUAL(kvcacheset_set_ttl(&testset, "short", 100), ERRNOKEY);
+  kvcacheset_put(&testset, "short", "val");
+  ASSERT_EQUAL(kvcacheset_ttl(&testset, "short"), 0);
+  ASSERT_EQUAL(kvcacheset_set_ttl(&testset, "short", 100), 0);
+  ASSERT_TRUE(kvcacheset_ttl(&testset, "short") > 0);
+  ASSERT_TRUE(kvcacheset_ttl(&testset, "short") <= 100);
+  usleep(150 * 1000);
+  ASSERT_EQUAL(kvcacheset_get(&testset, "short", &retval), ERRNOKEY);
+  ASSERT_EQUAL(kvcacheset_ttl(&testset, "short"), 0);
+  /* A fill replaces the expired value, and a write clears its TTL. */
+  token = kvcacheset_fill_token(&testset);
+  ASSERT_EQUAL(kvcacheset_fill(&testset, "short", "again", token), 0);
+  kvcacheset_get(&testset, "short", &retval);
+  ASSERT_STRING_EQUAL(retval, "again");
+  free(retval);
+  kvcacheset_set_ttl(&testset, "short", 100);
+  kvcacheset_put(&testset, "short", "kept");
+  ASSERT_EQUAL(kvcacheset_ttl(&testset, "short"), 0);
+  return 1;
+}
+
+int flushed;
+
+int kvcacheset_test_flush(char *key, char *value, void *aux) {
+  flushed++;
+  return *(int *) aux;
+}
+
+int kvcacheset_dirty_eviction(void) {
+  int flush_ret = -1;
+  flushed = 0;
+  kvcacheset_set_flush(&testset, kvcacheset_test_flush, &flush_ret);
+  kvcacheset_put_dirty(&testset, "key1", "val1");
+  kvcacheset_put(&testset, "key2", "val2");
+  kvcacheset_put(&testset, "key3", "val3");
+  ASSERT_EQUAL(testset.num_dirty, 1);
+  /* A dirty entry which cannot be written back is never evicted. */
+  kvcacheset_put(&testset, "key4", "val4");
+  ASSERT_EQUAL(kvcacheset_dirty(&testset, "key1"), 1);
+  ASSERT_EQUAL(kvcacheset_dirty(&testset, "key2"), -1);
+  ASSERT_EQUAL(flushed, 1);
+  /* Writes before a flush are coalesced into one. */
+  kvcacheset_put_dirty(&testset, "key1", "val2");
+  ASSERT_EQUAL(testset.num_dirty, 1);
+  flush_ret = 0;
+  ASSERT_EQUAL(kvcacheset_flush(&testset), 1);
+  ASSERT_EQUAL(kvcacheset_dirty(&testset, "key1"), 0);
+  ASSERT_EQUAL(kvcacheset_flush(&testset), 0);
+  ASSERT_EQUAL(flushed, 2);
+  return 1;
+}
 
 test_info_t kvcacheset_tests[] = {
   {"Simple PUT and GET of a single value", kvcacheset_simple_put_get_single},
@@ -178,6 +296,14 @@ test_info_t kvcacheset_tests[] = {
   {"Clearing the cache set", kvcacheset_clear_all},
   {"Ensure all refbits are initially unset", kvcacheset_check_initial_refbit},
   {"Ensure refbit is set after access", kvcacheset_check_refbit_access},
+  {"Versioned PUT keeps the newest commit", kvcacheset_versioned_put},
+  {"Fill racing an invalidation is dropped", kvcacheset_stale_fill},
+  {"Absent keys are cached briefly and replaced by writes",
+    kvcacheset_absent_keys},
+  {"Values with a TTL stop being returned once it passes",
+    kvcacheset_value_ttl},
+  {"Dirty entries are written back before eviction",
+    kvcacheset_dirty_eviction},
   NULL_TEST_INFO
 };
 
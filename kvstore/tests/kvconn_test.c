@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "kvconn.h"
+#include "tester.h"
+
+/* The two ends of the test connection. */
+int kvconn_test_fds[2];
+
+int kvconn_test_init(void) {
+  return socketpair(AF_UNIX, SOCK_STREAM, 0, kvconn_test_fds);
+}
+
+int kvconn_test_clean(void) {
+  close(kvconn_test_fds[0]);
+  close(kvconn_test_fds[1]);
+  return 0;
+}
+
+/* Writes the frame of a PUTREQ for "key" to the first end of the test
+ * connection a few bytes at a time, pausing between them. */
+void *kvconn_test_trickle_thread(void *aux) {
+  kvmessage_t reqmsg;
+  unsigned int size, i;
+  char *frame;
+
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "key";
+  reqmsg.value = "value";
+  frame = kvmessage_encode(&reqmsg, &size);
+  for (i = 0; i < size; i += 3) {
+    write(kvconn_test_fds[0], frame + i, (size - i < 3) ? size - i : 3);
+    usleep(1000);
+  }
+  free(frame);
+  return NULL;
+}
+
+/* Answers REQMSG with a GETRESP holding its key. */
+void kvconn_test_echo(void *aux, kvconn_t *conn, kvmessage_t *reqmsg) {
+  kvmessage_t respmsg;
+  memset(&respmsg, 0, sizeof(kvmessage_t));
+  respmsg.type = GETRESP;
+  respmsg.key = (reqmsg != NULL) ? reqmsg->key : NULL;
+  respmsg.value = "echo";
+  kvconn_queue(conn, &respmsg);
+  if (reqmsg != NULL)
+    kvmessage_free(reqmsg);
+}
+
+/* Serves the second end of the test connection with kvconn_test_echo. */
+void *kvconn_test_serve_thread(void *aux) {
+  kvconn_serve(kvconn_test_fds[1], NULL, kvconn_test_echo, NULL);
+  return NULL;
+}
+
+int kvconn_short_reads(void) {
+  pthread_t thread;
+  kvmessage_t *msg;
+  kvconn_t conn;
+
+  /* A header or body arriving in pieces is read whole, by kvmessage_parse
+   * and by a KVConn alike. */
+  pthread_create(&thread, NULL, kvconn_test_trickle_thread, NULL);
+  msg = kvmessage_parse(kvconn_test_fds[1]);
+  pthread_join(thread, NULL);
+  ASSERT_PTR_NOT_NULL(msg);
+  ASSERT_EQUAL(msg->type, PUTREQ);
+  ASSERT_STRING_EQUAL(msg->key, "key");
+  ASSERT_STRING_EQUAL(msg->value, "value");
+  kvmessage_free(msg);
+
+  kvconn_init(&conn, kvconn_test_fds[1], NULL);
+  pthread_create(&thread, NULL, kvconn_test_trickle_thread, NULL);
+  msg = kvconn_read(&conn);
+  pthread_join(thread, NULL);
+  ASSERT_PTR_NOT_NULL(msg);
+  ASSERT_STRING_EQUAL(msg->key, "key");
+  ASSERT_STRING_EQUAL(msg->value, "value");
+  ASSERT_FALSE(kvconn_pending(&conn));
+  kvmessage_free(msg);
+  kvconn_free(&conn);
+  return 1;
+}
+
+int kvconn_pipelined(void) {
+  char *frames[3], key[8], buf[256];
+  unsigned int sizes[3], total = 0, i;
+  kvmessage_t reqmsg, *respmsg;
+  pthread_t thread;
+
+  /* Three requests sent in a single write are answered in order. */
+  for (i = 0; i < 3; i++) {
+    sprintf(key, "key%u", i);
+    memset(&reqmsg, 0, sizeof(kvmessage_t));
+    reqmsg.type = GETREQ;
+    reqmsg.key = key;
+    frames[i] = kvmessage_encode(&reqmsg, &sizes[i]);
+    ASSERT_TRUE(total + sizes[i] <= sizeof(buf));
+    memcpy(buf + total, frames[i], sizes[i]);
+    total += sizes[i];
+    free(frames[i]);
+  }
+  pthread_create(&thread, NULL, kvconn_test_serve_thread, NULL);
+  ASSERT_EQUAL(write(kvconn_test_fds[0], buf, total), total);
+  for (i = 0; i < 3; i++) {
+    sprintf(key, "key%u", i);
+    respmsg = kvmessage_parse(kvconn_test_fds[0]);
+    ASSERT_PTR_NOT_NULL(respmsg);
+    ASSERT_EQUAL(respmsg->type, GETRESP);
+    ASSERT_STRING_EQUAL(respmsg->key, key);
+    kvmessage_free(respmsg);
+  }
+
+  /* The connection is closed once the client closes its end. */
+  shutdown(kvconn_test_fds[0], SHUT_WR);
+  pthread_join(thread, NULL);
+  ASSERT_EQUAL(read(kvconn_test_fds[0], buf, sizeof(buf)), 0);
+  return 1;
+}
+
+int kvconn_malformed_ops(void) {
+  char body[64];
+  kvmessage_t *msg;
+
+  /* A batch whose "ops" is not an array is read without operations. */
+  sprintf(body, "{\"type\": %d, \"ops\": 5}", BATCHREQ);
+  msg = kvmessage_decode(body, strlen(body), NULL);
+  ASSERT_PTR_NOT_NULL(msg);
+  ASSERT_EQUAL(msg->type, BATCHREQ);
+  ASSERT_EQUAL(msg->num_ops, 0);
+  ASSERT_PTR_NULL(msg->ops);
+  kvmessage_free(msg);
+  sprintf(body, "{\"type\": %d, \"ops\": {\"key\": \"k\"}}", BATCHREQ);
+  msg = kvmessage_decode(body, strlen(body), NULL);
+  ASSERT_PTR_NOT_NULL(msg);
+  ASSERT_PTR_NULL(msg->ops);
+  kvmessage_free(msg);
+  return 1;
+}
+
+test_info_t kvconn_tests[] = {
+  {"Messages arriving in pieces are read whole", kvconn_short_reads},
+  {"Pipelined requests are answered in order", kvconn_pipelined},
+  {"A batch with malformed operations is read without them",
+    kvconn_malformed_ops},
+  NULL_TEST_INFO
+};
+
+suite_info_t kvconn_suite = {"KVConn Tests", kvconn_test_init,
+  kvconn_test_clean, kvconn_tests};
@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "kvengine.h"
+#include "kvconstants.h"
+#include "tester.h"
+
+#define KVENGINE_DIRNAME "kvengine-test"
+
+kvengine_t testengine;
+const char *engine_names[] = {"file", "mmap", "memory"};
+
+/* Counts the entries visited by a scan into the int AUX. */
+void kvengine_count_visit(char *key, char *value, unsigned long expires,
+    void *aux) {
+  (*(int *) aux)++;
+}
+
+/* Appends the string AUX to VALUE, for kvengine_update, or fails if AUX is
+ * NULL. */
+int kvengine_append_update(char *value, void *aux, char **newvalue) {
+  if (aux == NULL)
+    return ERRINVLDMSG;
+  *newvalue = calloc(1, ((value != NULL) ? strlen(value) : 0) +
+      strlen(aux) + 1);
+  if (value != NULL)
+    strcpy(*newvalue, value);
+  strcat(*newvalue, aux);
+  return 0;
+}
+
+/* Runs the same sequence of operations against each engine, which should
+ * all give the same results. */
+int kvengine_conformance(void) {
+  kvstore_op_t ops[] = {{"batch1", "one"}, {"batch2", "two"},
+      {"batch1", NULL}, {"absent", NULL}};
+  unsigned long version, entries, memory, next, start, expires, left;
+  unsigned int i;
+  char *value;
+  int count, ret;
+
+  for (i = 0; i < sizeof(engine_names) / sizeof(engine_names[0]); i++) {
+    ASSERT_EQUAL(kvengine_init(&testengine, engine_names[i],
+        KVENGINE_DIRNAME), 0);
+    ASSERT_STRING_EQUAL(kvengine_name(&testengine), engine_names[i]);
+
+    ASSERT_EQUAL(kvengine_get(&testengine, "key", &value), ERRNOKEY);
+    ASSERT_EQUAL(kvengine_put(&testengine, "key", "value"), 0);
+    ASSERT_EQUAL(kvengine_put(&testengine, "key", "value2"), 0);
+    ASSERT_EQUAL(kvengine_get(&testengine, "key", &value), 0);
+    ASSERT_STRING_EQUAL(value, "value2");
+    free(value);
+    ASSERT_TRUE(kvengine_haskey(&testengine, "key"));
+    ASSERT_EQUAL(kvengine_del_check(&testengine, "key"), 0);
+    ASSERT_EQUAL(kvengine_del(&testengine, "key"), 0);
+    ASSERT_FALSE(kvengine_haskey(&testengine, "key"));
+    ASSERT_EQUAL(kvengine_del(&testengine, "key"), ERRNOKEY);
+    ASSERT_EQUAL(kvengine_del_check(&testengine, "key"), ERRNOKEY);
+    ASSERT_EQUAL(kvengine_put_check(&testengine, "key", "v"), 0);
+
+    /* A versioned delete leaves a tombstone which stale writes can't pass. */
+    ASSERT_EQUAL(kvengine_put_versioned(&testengine, "vkey", "v5", 5), 0);
+    ASSERT_EQUAL(kvengine_put_versioned(&testengine, "vkey", NULL, 7), 0);
+    ASSERT_EQUAL(kvengine_put_versioned(&testengine, "vkey", "v6", 6), 1);
+    ASSERT_EQUAL(kvengine_get(&testengine, "vkey", &value), ERRNOKEY);
+    ASSERT_EQUAL(kvengine_get_versioned(&testengine, "vkey", &value,
+        &version), 0);
+    ASSERT_PTR_NULL(value);
+    ASSERT_EQUAL(version, 7);
+
+    /* An update treats the tombstone as no value, and a failed one writes
+     * nothing. */
+    ASSERT_EQUAL(kvengine_update(&testengine, "vkey", kvengine_append_update,
+        "x", &value, NULL), 0);
+    ASSERT_STRING_EQUAL(value, "x");
+    free(value);
+    ASSERT_EQUAL(kvengine_update(&testengine, "vkey", kvengine_append_update,
+        "y", &value, NULL), 0);
+    ASSERT_STRING_EQUAL(value, "xy");
+    free(value);
+    ASSERT_EQUAL(kvengine_update(&testengine, "vkey", kvengine_append_update,
+        NULL, &value, NULL), ERRINVLDMSG);
+    ASSERT_EQUAL(kvengine_get(&testengine, "vkey", &value), 0);
+    ASSERT_STRING_EQUAL(value, "xy");
+    free(value);
+
+    /* An expired entry reads as absent until kvengine_expire removes it,
+     * which leaves live entries alone, and an update keeps the expiry. */
+    ASSERT_EQUAL(kvengine_put_expiring(&testengine, "tkey", "t", 1), 0);
+    ASSERT_EQUAL(kvengine_get(&testengine, "tkey", &value), ERRNOKEY);
+    ASSERT_EQUAL(kvengine_expire(&testengine, "vkey"), ERRNOKEY);
+    ASSERT_EQUAL(kvengine_expire(&testengine, "tkey"), 0);
+    ASSERT_EQUAL(kvengine_expire(&testengine, "tkey"), ERRNOKEY);
+    expires = time(NULL) + 60;
+    ASSERT_EQUAL(kvengine_put_expiring(&testengine, "tkey", "1", expires), 0);
+    ASSERT_EQUAL(kvengine_update(&testengine, "tkey", kvengine_append_update,
+        "2", &value, &left), 0);
+    ASSERT_EQUAL(left, expires);
+    free(value);
+    ASSERT_EQUAL(kvengine_get_expiring(&testengine, "tkey", &value, &left), 0);
+    ASSERT_STRING_EQUAL(value, "12");
+    ASSERT_EQUAL(left, expires);
+    free(value);
+    ASSERT_EQUAL(kvengine_del(&testengine, "tkey"), 0);
+
+    ASSERT_EQUAL(kvengine_batch(&testengine, ops, 4), 0);
+    ASSERT_FALSE(kvengine_haskey(&testengine, "batch1"));
+    ASSERT_EQUAL(kvengine_get(&testengine, "batch2", &value), 0);
+    ASSERT_STRING_EQUAL(value, "two");
+    free(value);
+
+    count = 0;
+    start = 0;
+    do {
+      ret = kvengine_scan(&testengine, start, 1, false, kvengine_count_visit,
+          &count, &next);
+      ASSERT_TRUE(ret >= 0);
+      start = next;
+    } while (next != 0);
+    ASSERT_EQUAL(count, 2);
+
+    ASSERT_EQUAL(kvengine_sync(&testengine), 0);
+    kvengine_stats(&testengine, &entries, &memory);
+    ASSERT_EQUAL(entries, 2);
+    ASSERT_TRUE(memory > 0);
+    ASSERT_EQUAL(kvengine_clean(&testengine), 0);
+    kvengine_close(&testengine);
+  }
+  return 1;
+}
+
+/* Only the named engines exist, and the memory engine keeps nothing on
+ * disk. */
+int kvengine_select(void) {
+  struct stat st;
+  ASSERT_EQUAL(kvengine_init(&testengine, "nonesuch", KVENGINE_DIRNAME), -1);
+  ASSERT_EQUAL(kvengine_init(&testengine, NULL, KVENGINE_DIRNAME), 0);
+  ASSERT_STRING_EQUAL(kvengine_name(&testengine), KVENGINE_DEFAULT);
+  kvengine_clean(&testengine);
+  kvengine_close(&testengine);
+
+  ASSERT_EQUAL(kvengine_init(&testengine, "memory", KVENGINE_DIRNAME), 0);
+  ASSERT_EQUAL(kvengine_put(&testengine, "key", "value"), 0);
+  ASSERT_EQUAL(stat(KVENGINE_DIRNAME, &st), -1);
+  kvengine_close(&testengine);
+  ASSERT_EQUAL(kvengine_init(&testengine, "memory", KVENGINE_DIRNAME), 0);
+  ASSERT_FALSE(kvengine_haskey(&testengine, "key"));
+  kvengine_close(&testengine);
+  return 1;
+}
+
+test_info_t kvengine_tests[] = {
+  {"Every storage engine gives the same results", kvengine_conformance},
+  {"Storage engines are chosen by name", kvengine_select},
+  NULL_TEST_INFO
+};
+
+suite_info_t kvengine_suite = {"KVEngine Tests", NULL, NULL,
+  kvengine_tests};
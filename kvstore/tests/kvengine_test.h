@@ -0,0 +1,3 @@
+#include "tester.h"
+
+suite_info_t kvengine_suite;
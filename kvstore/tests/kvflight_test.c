@@ -0,0 +1,92 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "kvflight.h"
+#include "kvconstants.h"
+#include "tester.h"
+
+#define NUM_WAITERS 8
+
+kvflight_t testflight;
+int waiter_rets[NUM_WAITERS];
+char *waiter_values[NUM_WAITERS];
+unsigned long waiter_ttls[NUM_WAITERS];
+bool waiter_led[NUM_WAITERS];
+
+int kvflight_test_init(void) {
+  kvflight_init(&testflight);
+  return 0;
+}
+
+void *kvflight_waiter(void *aux) {
+  int i = (intptr_t) aux;
+  struct kvflightcall *call;
+  call = kvflight_join(&testflight, "key", 1, &waiter_rets[i],
+      &waiter_values[i], &waiter_ttls[i]);
+  waiter_led[i] = (call != NULL);
+  if (call != NULL)
+    kvflight_finish(&testflight, call, ERRNOKEY, NULL, 0);
+  return NULL;
+}
+
+/* Returns the number of threads waiting for CALL. */
+unsigned int kvflight_waiters(struct kvflightcall *call) {
+  unsigned int waiters;
+  pthread_mutex_lock(&testflight.lock);
+  waiters = call->waiters;
+  pthread_mutex_unlock(&testflight.lock);
+  return waiters;
+}
+
+int kvflight_coalesce(void) {
+  pthread_t threads[NUM_WAITERS];
+  struct kvflightcall *call;
+  int i, ret, tries = 0;
+  call = kvflight_join(&testflight, "key", 1, &ret, NULL, NULL);
+  ASSERT_PTR_NOT_NULL(call);
+  for (i = 0; i < NUM_WAITERS; i++)
+    pthread_create(&threads[i], NULL, kvflight_waiter, (void *) (intptr_t) i);
+  while (kvflight_waiters(call) < NUM_WAITERS && tries++ < 1000)
+    usleep(1000);
+  ASSERT_EQUAL(kvflight_waiters(call), NUM_WAITERS);
+  kvflight_finish(&testflight, call, 0, "value", 30);
+  for (i = 0; i < NUM_WAITERS; i++) {
+    pthread_join(threads[i], NULL);
+    ASSERT_FALSE(waiter_led[i]);
+    ASSERT_EQUAL(waiter_rets[i], 0);
+    ASSERT_STRING_EQUAL(waiter_values[i], "value");
+    ASSERT_EQUAL(waiter_ttls[i], 30);
+    free(waiter_values[i]);
+  }
+  /* The finished load is not reused. */
+  call = kvflight_join(&testflight, "key", 1, &ret, NULL, NULL);
+  ASSERT_PTR_NOT_NULL(call);
+  kvflight_finish(&testflight, call, ERRNOKEY, NULL, 0);
+  return 1;
+}
+
+int kvflight_new_token(void) {
+  struct kvflightcall *old, *new;
+  int ret;
+  old = kvflight_join(&testflight, "key", 1, &ret, NULL, NULL);
+  ASSERT_PTR_NOT_NULL(old);
+  /* A miss after the cache set changed must not share the older load. */
+  new = kvflight_join(&testflight, "key", 2, &ret, NULL, NULL);
+  ASSERT_PTR_NOT_NULL(new);
+  ASSERT_TRUE(old != new);
+  kvflight_finish(&testflight, old, 0, "old", 0);
+  kvflight_finish(&testflight, new, 0, "new", 0);
+  ASSERT_PTR_NULL(testflight.calls);
+  return 1;
+}
+
+test_info_t kvflight_tests[] = {
+  {"Concurrent loads of a key share the first one's result",
+    kvflight_coalesce},
+  {"A load under a newer fill token is not shared", kvflight_new_token},
+  NULL_TEST_INFO
+};
+
+suite_info_t kvflight_suite = {"KVFlight Tests", kvflight_test_init, NULL,
+  kvflight_tests};
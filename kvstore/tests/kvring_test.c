@@ -0,0 +1,73 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "kvring.h"
+#include "tester.h"
+
+#define PRODUCERS 4
+#define PER_PRODUCER 20000
+
+kvring_t testring;
+
+int kvring_test_init(void) {
+  kvring_init(&testring);
+  return 0;
+}
+
+/* Pushes PER_PRODUCER items numbered from AUX onto the test ring, retrying
+ * while it is full. */
+void *kvring_test_producer(void *aux) {
+  intptr_t first = (intptr_t) aux, i;
+  for (i = 0; i < PER_PRODUCER; i++) {
+    while (kvring_push(&testring, (void *) (first + i)) < 0)
+      ;
+  }
+  return NULL;
+}
+
+int kvring_producers(void) {
+  pthread_t producers[PRODUCERS];
+  intptr_t item, next[PRODUCERS];
+  unsigned int i;
+
+  for (i = 0; i < PRODUCERS; i++) {
+    next[i] = 1 + i * PER_PRODUCER;
+    pthread_create(&producers[i], NULL, kvring_test_producer,
+        (void *) next[i]);
+  }
+  /* Every item arrives once, and each producer's in the order pushed. */
+  for (i = 0; i < PRODUCERS * PER_PRODUCER; i++) {
+    item = (intptr_t) kvring_pop(&testring);
+    ASSERT_TRUE(item >= 1 && item <= PRODUCERS * PER_PRODUCER);
+    ASSERT_EQUAL(item, next[(item - 1) / PER_PRODUCER]);
+    next[(item - 1) / PER_PRODUCER]++;
+  }
+  for (i = 0; i < PRODUCERS; i++)
+    pthread_join(producers[i], NULL);
+  return 1;
+}
+
+int kvring_full(void) {
+  intptr_t i;
+  for (i = 1; i <= KVRING_SIZE; i++)
+    ASSERT_EQUAL(kvring_push(&testring, (void *) i), 0);
+  ASSERT_EQUAL(kvring_push(&testring, (void *) i), -1);
+  /* Popping one frees a cell for the next lap. */
+  ASSERT_EQUAL((intptr_t) kvring_pop(&testring), 1);
+  ASSERT_EQUAL(kvring_push(&testring, (void *) i), 0);
+  for (i = 2; i <= KVRING_SIZE + 1; i++)
+    ASSERT_EQUAL((intptr_t) kvring_pop(&testring), i);
+  return 1;
+}
+
+test_info_t kvring_tests[] = {
+  {"Items from several producers each arrive once and in order",
+    kvring_producers},
+  {"A full ring refuses items until one is popped", kvring_full},
+  NULL_TEST_INFO
+};
+
+suite_info_t kvring_suite = {"KVRing Tests", kvring_test_init, NULL,
+  kvring_tests};
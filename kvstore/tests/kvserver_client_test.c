@@ -86,7 +86,7 @@ void *server_runner(void *callback){
   server.master = 0;
   server.max_threads = 3;
   kvserver_init(&server.kvserver, "slave", 4, 4, 2, KVSERVER_HOSTNAME,
-      KVSERVER_PORT, false);
+      KVSERVER_PORT, false, NULL);
   server.kvserver.handle = dummy_handle;
   server_run("slaveserver", KVSERVER_PORT, &server, (callback_t) callback);
   return NULL;
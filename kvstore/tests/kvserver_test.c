@@ -36,7 +36,7 @@ int kvserver_test_init(void) {
   memset(&reqmsg, 0, sizeof(kvmessage_t));
   memset(&respmsg, 0, sizeof(kvmessage_t));
   kvserver_init(&testserver, KVSERVER_DIRNAME, 4, 4, 1, KVSERVER_HOSTNAME,
-      KVSERVER_PORT, false);
+      KVSERVER_PORT, false, NULL);
   return 0;
 }
 
@@ -91,6 +91,16 @@ int kvserver_get_no_key(void) {
   kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
   ASSERT_EQUAL(respmsg.type, RESP);
   ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_NO_KEY);
+
+  /* The key is now cached as absent; a PUT must replace that. */
+  reqmsg.type = PUTREQ;
+  reqmsg.value = "NOW MYVALUE";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  reqmsg.type = GETREQ;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "NOW MYVALUE");
   return 1;
 }
 
@@ -199,7 +209,7 @@ int kvserver_use_cache(void) {
 
 int kvserver_get_fills_cache(void) {
   kvserver_init(&testserver, KVSERVER_DIRNAME, 1, 2, 1, KVSERVER_HOSTNAME,
-      KVSERVER_PORT, false);
+      KVSERVER_PORT, false, NULL);
   reqmsg.type = PUTREQ;
   reqmsg.key = "MYKEY1";
   reqmsg.value = "MYVALUE1";
@@ -240,6 +250,154 @@ int kvserver_get_fills_cache(void) {
   return 1;
 }
 
+int kvserver_write_back(void) {
+  kvserver_t recovered;
+  char *value;
+  ASSERT_EQUAL(kvserver_start_write_back(&testserver), 0);
+  ASSERT_EQUAL(kvserver_put(&testserver, "wbkey", "wbval1"), 0);
+  ASSERT_EQUAL(kvserver_put(&testserver, "wbkey", "wbval2"), 0);
+  ASSERT_EQUAL(kvserver_get(&testserver, "wbkey", &value), 0);
+  ASSERT_STRING_EQUAL(value, "wbval2");
+  free(value);
+  ASSERT_EQUAL(kvserver_put(&testserver, "gone", "soon"), 0);
+  ASSERT_EQUAL(kvserver_del(&testserver, "gone"), 0);
+  ASSERT_EQUAL(kvserver_put_ttl(&testserver, "ttlkey", "v", 60), ERRNOTIMPL);
+
+  /* A server started on the same directory, as after a crash, replays the
+   * write-ahead log into its store. */
+  kvserver_init(&recovered, KVSERVER_DIRNAME, 4, 4, 1, KVSERVER_HOSTNAME,
+      KVSERVER_PORT, false, NULL);
+  ASSERT_EQUAL(kvserver_start_write_back(&recovered), 0);
+  ASSERT_EQUAL(kvengine_get(&recovered.store, "wbkey", &value), 0);
+  ASSERT_STRING_EQUAL(value, "wbval2");
+  free(value);
+  ASSERT_EQUAL(kvengine_get(&recovered.store, "gone", &value), ERRNOKEY);
+  ASSERT_EQUAL(kvserver_stop_write_back(&recovered), 0);
+
+  ASSERT_EQUAL(kvserver_stop_write_back(&testserver), 0);
+  ASSERT_EQUAL(kvengine_get(&testserver.store, "wbkey", &value), 0);
+  ASSERT_STRING_EQUAL(value, "wbval2");
+  free(value);
+  return 1;
+}
+
+int kvserver_cas_incr(void) {
+  reqmsg.type = CASREQ;
+  reqmsg.key = "CASKEY";
+  reqmsg.value = "first";
+  reqmsg.expected = "nothing";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_CAS_MISMATCH);
+  reqmsg.expected = NULL;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_CAS_MISMATCH);
+  reqmsg.value = "second";
+  reqmsg.expected = "first";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  reqmsg.expected = NULL;
+
+  /* The new value is in the cache as well as the store. */
+  reqmsg.type = GETREQ;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.value, "second");
+  reqmsg.type = INCRREQ;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_NOT_INTEGER);
+
+  reqmsg.key = "COUNTER";
+  reqmsg.value = NULL;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "1");
+  reqmsg.value = "41";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.value, "42");
+  reqmsg.type = DECRREQ;
+  reqmsg.value = "50";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.value, "-8");
+  reqmsg.value = "9223372036854775807";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_NOT_INTEGER);
+
+  reqmsg.type = GETREQ;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.value, "-8");
+  return 1;
+}
+
+int kvserver_ttl(void) {
+  unsigned long ttl, version;
+  char *value;
+  int i;
+
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "TTLKEY";
+  reqmsg.value = "TTLVALUE";
+  reqmsg.ttl = 60;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  reqmsg.type = GETREQ;
+  reqmsg.ttl = 0;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_TRUE(respmsg.ttl > 58 && respmsg.ttl <= 60);
+
+  /* The store reports the same TTL once the cache has lost the value, and
+   * an update keeps it. */
+  kvcache_del(&testserver.cache, "TTLKEY");
+  ASSERT_EQUAL(kvserver_get_ttl(&testserver, "TTLKEY", &value, &ttl), 0);
+  ASSERT_STRING_EQUAL(value, "TTLVALUE");
+  ASSERT_TRUE(ttl > 58 && ttl <= 60);
+  free(value);
+  ASSERT_EQUAL(kvserver_put_ttl(&testserver, "COUNTER", "1", 60), 0);
+  reqmsg.type = INCRREQ;
+  reqmsg.key = "COUNTER";
+  reqmsg.value = NULL;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.value, "2");
+  ASSERT_EQUAL(kvserver_get_ttl(&testserver, "COUNTER", &value, &ttl), 0);
+  ASSERT_TRUE(ttl > 58 && ttl <= 60);
+  free(value);
+
+  /* An expired value reads as absent until it is expired. */
+  ASSERT_EQUAL(kvengine_put_expiring(&testserver.store, "OLDKEY", "v", 1), 0);
+  ASSERT_EQUAL(kvserver_get(&testserver, "OLDKEY", &value), ERRNOKEY);
+  ASSERT_EQUAL(kvserver_expire(&testserver, "TTLKEY"), ERRNOKEY);
+  ASSERT_EQUAL(kvserver_expire(&testserver, "OLDKEY"), 0);
+  ASSERT_EQUAL(kvserver_expire(&testserver, "OLDKEY"), ERRNOKEY);
+
+  /* Starting the reaper removes a key which expired while none was running,
+   * as across a restart, and the reaper removes a key soon after it
+   * expires. */
+  ASSERT_EQUAL(kvengine_put_expiring(&testserver.store, "OLDKEY", "v", 1), 0);
+  ASSERT_EQUAL(kvserver_start_expiry(&testserver), 0);
+  ASSERT_EQUAL(kvengine_get_versioned(&testserver.store, "OLDKEY", &value,
+      &version), ERRNOKEY);
+  ASSERT_EQUAL(kvwheel_count(&testserver.expiry), 2);
+  ASSERT_EQUAL(kvserver_put_ttl(&testserver, "SHORTKEY", "v", 1), 0);
+  ASSERT_EQUAL(kvserver_get_ttl(&testserver, "SHORTKEY", &value, &ttl), 0);
+  ASSERT_EQUAL(ttl, 1);
+  free(value);
+  /* Even a versioned read finds nothing once the entry has been removed. */
+  for (i = 0; i < 300; i++) {
+    if (kvengine_get_versioned(&testserver.store, "SHORTKEY", &value,
+        &version) == ERRNOKEY)
+      break;
+    free(value);
+    usleep(SLEEP_TIME * 1000);
+  }
+  ASSERT_TRUE(i < 300);
+  ASSERT_EQUAL(kvwheel_count(&testserver.expiry), 2);
+  ASSERT_EQUAL(kvserver_get(&testserver, "SHORTKEY", &value), ERRNOKEY);
+  kvserver_stop_expiry(&testserver);
+  ASSERT_EQUAL(kvwheel_count(&testserver.expiry), 0);
+  return 1;
+}
+
 /* Attempts to submit the current request message and then set SYNCH variable
  * to 1 to indicate that the request completed. */
 void *kvserver_concurrent_helper(void *aux) {
@@ -300,7 +458,7 @@ int kvserver_cache_concurrent_gets_rdlock(void) {
 int kvserver_cache_concurrent_get_cache_writes(void) {
   pthread_rwlock_t *cachelock;
   pthread_t thread;
-  kvserver_init(&testserver, KVSERVER_DIRNAME, 1, 2, 1, KVSERVER_HOSTNAME, KVSERVER_PORT, false);
+  kvserver_init(&testserver, KVSERVER_DIRNAME, 1, 2, 1, KVSERVER_HOSTNAME, KVSERVER_PORT, false, NULL);
   reqmsg.type = PUTREQ;
   reqmsg.key = "MYKEY1";
   reqmsg.value = "MYVALUE1";
@@ -344,6 +502,10 @@ test_info_t kvserver_tests[] = {
   {"GET requests fill the cache", kvserver_get_fills_cache},
   {"PUT on an oversized key or value", kvserver_put_oversized_fields},
   {"Simple DEL on a value", kvserver_del_simple},
+  {"CAS, INCR and DECR requests", kvserver_cas_incr},
+  {"PUTs with a TTL expire", kvserver_ttl},
+  {"PUTs in write-back mode are logged and written back later",
+    kvserver_write_back},
   {"PUT request cannot complete when a lock is held on cacheset",
     kvserver_cache_concurrent_puts},
   {"GET request can complete when a read lock is held on cacheset",
@@ -33,7 +33,7 @@ int kvserver_tpc_test_init(void) {
   memset(&reqmsg, 0, sizeof(kvmessage_t));
   memset(&respmsg, 0, sizeof(kvmessage_t));
   kvserver_init(&testserver, KVSERVER_TPC_DIRNAME, 4, 4, 1,
-      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true);
+      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true, NULL);
   return 0;
 }
 
@@ -254,14 +254,14 @@ int kvserver_tpc_rebuild_single_put(void) {
   /* Simulate a crash + rebuild. */
   memset(&testserver, 0, sizeof(kvserver_t));
   kvserver_init(&testserver, KVSERVER_TPC_DIRNAME, 4, 4, 1,
-      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true);
+      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true, NULL);
   kvserver_rebuild_state(&testserver);
 
   reqmsg.key = "MYKEY2";
   reqmsg.value = "MYVALUE2";
   kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
 
-  /* Check that server is in a TPC_READY state */
+  /* Check that the transaction is still prepared. */
   ASSERT_EQUAL(respmsg.type, RESP);
   ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_INVALID_REQUEST);
 
@@ -305,10 +305,10 @@ int kvserver_tpc_rebuild_del(void) {
   /* Simulate a crash + rebuild. */
   memset(&testserver, 0, sizeof(kvserver_t));
   kvserver_init(&testserver, KVSERVER_TPC_DIRNAME, 4, 4, 1,
-      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true);
+      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true, NULL);
   kvserver_rebuild_state(&testserver);
 
-  /* Check that server is in a TPC_READY state */
+  /* Check that the transaction is still prepared. */
   reqmsg.key = "MYKEY2";
   reqmsg.value = "MYVALUE2";
   kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
@@ -352,10 +352,10 @@ int kvserver_tpc_rebuild_abort(void) {
   /* Simulate a crash + rebuild. */
   memset(&testserver, 0, sizeof(kvserver_t));
   kvserver_init(&testserver, KVSERVER_TPC_DIRNAME, 4, 4, 1,
-      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true);
+      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true, NULL);
   kvserver_rebuild_state(&testserver);
 
-  /* Check that server is in a TPC_INIT state */
+  /* Check that no transaction is prepared. */
   reqmsg.type = PUTREQ;
   reqmsg.key = "MYKEY2";
   reqmsg.value = "MYVALUE2";
@@ -379,11 +379,11 @@ int kvserver_tpc_rebuild_put_commit(void) {
   /* Simulate a crash. */
   memset(&testserver, 0, sizeof(kvserver_t));
   kvserver_init(&testserver, KVSERVER_TPC_DIRNAME, 4, 4, 1,
-      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true);
+      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true, NULL);
 
   /* Forcefully remove from store (simulate crashing after log but before store
    * complete) */
-  kvstore_del(&testserver.store, "MYKEY1");
+  kvengine_del(&testserver.store, "MYKEY1");
 
   kvserver_rebuild_state(&testserver);
 
@@ -422,11 +422,11 @@ int kvserver_tpc_rebuild_multiple_commits(void) {
   /* Simulate a crash. */
   memset(&testserver, 0, sizeof(kvserver_t));
   kvserver_init(&testserver, KVSERVER_TPC_DIRNAME, 4, 4, 1,
-      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true);
+      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true, NULL);
 
   /* Forcefully remove from store (simulate crashing after log but before store
    * complete) */
-  kvstore_del(&testserver.store, "MYKEY1");
+  kvengine_del(&testserver.store, "MYKEY1");
 
   kvserver_rebuild_state(&testserver);
 
@@ -440,6 +440,268 @@ int kvserver_tpc_rebuild_multiple_commits(void) {
   return 1;
 }
 
+int kvserver_tpc_batch_commit(void) {
+  kvmessage_t ops[2];
+  memset(ops, 0, sizeof(ops));
+  ops[0].type = PUTREQ;
+  ops[0].key = "MYKEY1";
+  ops[0].value = "MYVALUE1";
+  ops[1].type = PUTREQ;
+  ops[1].key = "MYKEY2";
+  ops[1].value = "MYVALUE2";
+
+  reqmsg.type = BATCHREQ;
+  reqmsg.key = reqmsg.value = NULL;
+  reqmsg.num_ops = 2;
+  reqmsg.ops = ops;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+  reqmsg.num_ops = 0;
+  reqmsg.ops = NULL;
+
+  /* Simulate a crash + rebuild; the whole batch should still be pending. */
+  memset(&testserver, 0, sizeof(kvserver_t));
+  kvserver_init(&testserver, KVSERVER_TPC_DIRNAME, 4, 4, 1,
+      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true, NULL);
+  kvserver_rebuild_state(&testserver);
+
+  reqmsg.type = GETREQ;
+  reqmsg.key = "MYKEY2";
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_NO_KEY);
+
+  reqmsg.type = COMMIT;
+  reqmsg.key = NULL;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+
+  reqmsg.type = GETREQ;
+  reqmsg.key = "MYKEY1";
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "MYVALUE1");
+  reqmsg.key = "MYKEY2";
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "MYVALUE2");
+  return 1;
+}
+
+int kvserver_tpc_update(void) {
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "COUNTER";
+  reqmsg.value = "5";
+  reqmsg.ttl = 60;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+  reqmsg.ttl = 0;
+  reqmsg.type = COMMIT;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+
+  reqmsg.type = CASREQ;
+  reqmsg.value = "6";
+  reqmsg.expected = "4";
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_ABORT);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_CAS_MISMATCH);
+  reqmsg.expected = NULL;
+
+  /* The vote carries the computed value and the TTL it keeps, which are
+   * logged as a PUT. */
+  reqmsg.type = INCRREQ;
+  reqmsg.value = "2";
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+  ASSERT_STRING_EQUAL(respmsg.value, "7");
+  ASSERT_TRUE(respmsg.ttl > 58 && respmsg.ttl <= 60);
+  free(respmsg.value);
+  respmsg.value = NULL;
+
+  /* Simulate a crash + rebuild. */
+  memset(&testserver, 0, sizeof(kvserver_t));
+  kvserver_init(&testserver, KVSERVER_TPC_DIRNAME, 4, 4, 1,
+      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true, NULL);
+  kvserver_rebuild_state(&testserver);
+
+  reqmsg.type = COMMIT;
+  reqmsg.value = NULL;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+  reqmsg.type = GETREQ;
+  respmsg.ttl = 0;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "7");
+  ASSERT_TRUE(respmsg.ttl > 58 && respmsg.ttl <= 60);
+  return 1;
+}
+
+int kvserver_tpc_batch_invalid(void) {
+  kvmessage_t ops[2];
+  memset(ops, 0, sizeof(ops));
+  ops[0].type = PUTREQ;
+  ops[0].key = "MYKEY1";
+  ops[0].value = "MYVALUE1";
+  ops[1].type = DELREQ;
+  ops[1].key = "NOSUCHKEY";
+
+  reqmsg.type = BATCHREQ;
+  reqmsg.key = reqmsg.value = NULL;
+  reqmsg.num_ops = 2;
+  reqmsg.ops = ops;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_ABORT);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_NO_KEY);
+  reqmsg.num_ops = 0;
+  reqmsg.ops = NULL;
+
+  /* Make sure the server is ready to handle another request. */
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "MYKEY1";
+  reqmsg.value = "MYVALUE1";
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+  return 1;
+}
+
+int kvserver_tpc_concurrent_txns(void) {
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "MYKEY1";
+  reqmsg.value = "MYVALUE1";
+  reqmsg.txid = 1;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+
+  /* A second transaction on a different key may be prepared alongside. */
+  reqmsg.key = "MYKEY2";
+  reqmsg.value = "MYVALUE2";
+  reqmsg.txid = 2;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+
+  /* ...but not one which writes a key that is already locked. */
+  reqmsg.key = "MYKEY1";
+  reqmsg.value = "OTHERVALUE";
+  reqmsg.txid = 3;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_ABORT);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_KEY_LOCKED);
+
+  /* Simulate a crash + rebuild; both transactions should still be prepared. */
+  memset(&testserver, 0, sizeof(kvserver_t));
+  kvserver_init(&testserver, KVSERVER_TPC_DIRNAME, 4, 4, 1,
+      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true, NULL);
+  kvserver_rebuild_state(&testserver);
+
+  reqmsg.txid = 3;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_ABORT);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_KEY_LOCKED);
+
+  reqmsg.type = COMMIT;
+  reqmsg.key = reqmsg.value = NULL;
+  reqmsg.txid = 2;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+  reqmsg.type = ABORT;
+  reqmsg.txid = 1;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+
+  reqmsg.type = GETREQ;
+  reqmsg.key = "MYKEY2";
+  reqmsg.txid = 0;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "MYVALUE2");
+  reqmsg.key = "MYKEY1";
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_NO_KEY);
+
+  /* With the lock released, the key can be written again. */
+  reqmsg.type = PUTREQ;
+  reqmsg.value = "OTHERVALUE";
+  reqmsg.txid = 3;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+  return 1;
+}
+
+int kvserver_tpc_versioned(void) {
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "MYKEY1";
+  reqmsg.value = "MYVALUE1";
+  reqmsg.version = 20;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+
+  /* A stale write succeeds but does not change the value. */
+  reqmsg.value = "OLDVALUE";
+  reqmsg.version = 10;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+
+  reqmsg.type = GETREQ;
+  reqmsg.value = NULL;
+  reqmsg.version = 1;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "MYVALUE1");
+  ASSERT_EQUAL(respmsg.version, 20);
+
+  reqmsg.type = DELREQ;
+  reqmsg.version = 30;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+
+  reqmsg.type = GETREQ;
+  reqmsg.version = 1;
+  respmsg.version = 0;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_NO_KEY);
+  ASSERT_EQUAL(respmsg.version, 30);
+  return 1;
+}
+
+int kvserver_tpc_scan(void) {
+  unsigned int i;
+  int found = 0, batches = 0;
+  kvserver_put(&testserver, "SCANKEY1", "SCANVALUE1");
+  kvserver_put(&testserver, "SCANKEY2", "SCANVALUE2");
+
+  reqmsg.type = SCANREQ;
+  reqmsg.value = NULL;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_INVALID_REQUEST);
+
+  /* Scan one hash at a time until the slave reports the end. */
+  reqmsg.value = "1";
+  reqmsg.version = 0;
+  do {
+    memset(&respmsg, 0, sizeof(kvmessage_t));
+    kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+    ASSERT_EQUAL(respmsg.type, RESP);
+    ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+    for (i = 0; i < respmsg.num_ops; i++) {
+      ASSERT_EQUAL(respmsg.ops[i].type, PUTREQ);
+      if (strcmp(respmsg.ops[i].key, "SCANKEY1") == 0)
+        found += strcmp(respmsg.ops[i].value, "SCANVALUE1") == 0;
+      if (strcmp(respmsg.ops[i].key, "SCANKEY2") == 0)
+        found += strcmp(respmsg.ops[i].value, "SCANVALUE2") == 0;
+    }
+    reqmsg.version = respmsg.version;
+    batches++;
+  } while (respmsg.version != 0);
+  ASSERT_EQUAL(found, 2);
+  ASSERT_TRUE(batches >= 3);
+  return 1;
+}
+
 void dummy_registration_handle(kvserver_t *server, int sockfd, void *extra) {
   kvmessage_t *register_msg, respmsg;
   pthread_mutex_lock(&kvserver_tpc_lock);
@@ -531,6 +793,17 @@ test_info_t kvserver_tpc_tests[] = {
     "transaction is completed", kvserver_tpc_rebuild_put_commit},
   {"Rebuild from a TPCLog with transactions ending in multiple COMMITs",
     kvserver_tpc_rebuild_multiple_commits},
+  {"Valid BATCH request survives a rebuild and commits every operation",
+    kvserver_tpc_batch_commit},
+  {"BATCH request with one invalid operation votes to abort",
+    kvserver_tpc_batch_invalid},
+  {"CAS and INCR requests are prepared as the PUTs they compute",
+    kvserver_tpc_update},
+  {"Concurrent transactions lock their keys and survive a rebuild",
+    kvserver_tpc_concurrent_txns},
+  {"Versioned (quorum mode) requests keep the latest version",
+    kvserver_tpc_versioned},
+  {"SCANREQ lists the store in batches", kvserver_tpc_scan},
   {"KVServer registering with master", kvserver_tpc_registration},
   NULL_TEST_INFO
 };
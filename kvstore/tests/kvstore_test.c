@@ -1,7 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "kvstore.h"
+#include "kvmmap.h"
 #include "tester.h"
 
 #define KVSTORE_DIRNAME "kvstore-test"
@@ -221,6 +226,439 @@ int kvstore_multiple_put_get(void) {
   return 1;
 }
 
+int kvstore_versioned_put_get(void) {
+  char *retval;
+  unsigned long version;
+  int ret;
+  ret = kvstore_put_versioned(&teststore, "MYKEY", "NEWVALUE", 20);
+  ASSERT_EQUAL(ret, 0);
+  /* An older write which arrives late is ignored. */
+  ret = kvstore_put_versioned(&teststore, "MYKEY", "OLDVALUE", 10);
+  ASSERT_EQUAL(ret, 1);
+  ret = kvstore_get_versioned(&teststore, "MYKEY", &retval, &version);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_EQUAL(version, 20);
+  ASSERT_STRING_EQUAL(retval, "NEWVALUE");
+  free(retval);
+
+  /* A versioned delete leaves a tombstone which hides the key... */
+  ret = kvstore_put_versioned(&teststore, "MYKEY", NULL, 30);
+  ASSERT_EQUAL(ret, 0);
+  ret = kvstore_get(&teststore, "MYKEY", &retval);
+  ASSERT_EQUAL(ret, ERRNOKEY);
+  ASSERT_FALSE(kvstore_haskey(&teststore, "MYKEY"));
+  ret = kvstore_get_versioned(&teststore, "MYKEY", &retval, &version);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_PTR_NULL(retval);
+  ASSERT_EQUAL(version, 30);
+  /* ...and keeps an older write from bringing it back. */
+  ret = kvstore_put_versioned(&teststore, "MYKEY", "NEWVALUE", 20);
+  ASSERT_EQUAL(ret, 1);
+  ret = kvstore_get(&teststore, "MYKEY", &retval);
+  ASSERT_EQUAL(ret, ERRNOKEY);
+  return 1;
+}
+
+/* Counts the entries visited by kvstore_scan in the int AUX. */
+void kvstore_test_count_visit(char *key, char *value, unsigned long expires,
+    void *aux) {
+  (*(int *) aux)++;
+}
+
+int kvstore_scan_chains(void) {
+  kvstore_t store;
+  unsigned long next = 0;
+  int visited = 0, steps = 0, ret;
+  kvstore_init(&store, "kvstore-scan-test");
+  /* hash("abD") == hash("aae") == hash("ac#") */
+  kvstore_put(&store, "abD", "value1");
+  kvstore_put(&store, "aae", "value2");
+  kvstore_put(&store, "ac#", "value3");
+  kvstore_put(&store, "key", "value4");
+  kvstore_put_versioned(&store, "gone", NULL, 5);
+  /* Each step visits one whole hash chain, skipping the tombstone, and a
+   * last step finds nothing left. */
+  do {
+    ret = kvstore_scan(&store, next, 1, false, kvstore_test_count_visit,
+        &visited, &next);
+    steps++;
+  } while (ret > 0 && next != 0);
+  kvstore_clean(&store);
+  ASSERT_EQUAL(visited, 4);
+  ASSERT_EQUAL(steps, 4);
+  return 1;
+}
+
+/* Keys written concurrently by kvstore_test_writer; the first three share a
+ * hash chain. */
+static char *kvstore_test_keys[] = {"abD", "aae", "ac#", "key1", "key2",
+  "key3", "key4", "key5"};
+
+/* Repeatedly PUTs and DELs the key indexed by the int AUX. */
+void *kvstore_test_writer(void *aux) {
+  char *key = kvstore_test_keys[*(int *) aux];
+  int i;
+  for (i = 0; i < 50; i++) {
+    kvstore_put(&teststore, key, "temp");
+    kvstore_del(&teststore, key);
+    kvstore_put(&teststore, key, key);
+  }
+  return NULL;
+}
+
+int kvstore_concurrent_writes(void) {
+  pthread_t threads[8];
+  int ids[8], ret = 0, i;
+  char *retval;
+  for (i = 0; i < 8; i++) {
+    ids[i] = i;
+    pthread_create(&threads[i], NULL, kvstore_test_writer, &ids[i]);
+  }
+  for (i = 0; i < 8; i++)
+    pthread_join(threads[i], NULL);
+  /* Writers to the shared chain must not have broken it. */
+  for (i = 0; i < 8; i++) {
+    retval = NULL;
+    ret += kvstore_get(&teststore, kvstore_test_keys[i], &retval);
+    ASSERT_STRING_EQUAL(retval, kvstore_test_keys[i]);
+    free(retval);
+  }
+  ASSERT_EQUAL(ret, 0);
+  return 1;
+}
+
+int kvstore_fanout_layout(void) {
+  char filename[MAX_FILENAME];
+  unsigned long hashval = hash("key");
+  struct stat st;
+  int ret;
+  ret = kvstore_put(&teststore, "key", "value");
+  ASSERT_EQUAL(ret, 0);
+  sprintf(filename, "%s/%02lx/%02lx/%lu-0%s", KVSTORE_DIRNAME,
+      hashval & 0xff, (hashval >> 8) & 0xff, hashval, KVSTORE_FILETYPE);
+  ASSERT_EQUAL(stat(filename, &st), 0);
+  kvstore_clean(&teststore);
+  ASSERT_EQUAL(stat(KVSTORE_DIRNAME, &st), -1);
+  return 1;
+}
+
+/* Writes the entry file of KEY, holding VALUE, at position CHAINPOS of its
+ * hash chain in the flat store in DIRNAME, in the format written before
+ * entries carried a version and an expiry time. */
+static void kvstore_test_put_legacy(char *dirname, char *key,
+    unsigned int chainpos, char *value) {
+  char filename[MAX_FILENAME];
+  int length = strlen(key) + 1 + strlen(value) + 1;
+  FILE *file;
+  sprintf(filename, "%s/%lu-%u%s", dirname, hash(key), chainpos,
+      KVSTORE_FILETYPE);
+  file = fopen(filename, "w");
+  fwrite(&length, sizeof(int), 1, file);
+  fwrite(key, strlen(key) + 1, 1, file);
+  fwrite(value, strlen(value) + 1, 1, file);
+  fclose(file);
+}
+
+int kvstore_fanout_migration(void) {
+  /* hash("abD") == hash("aae") == hash("ac#") */
+  char *keys[] = {"abD", "aae", "ac#", "key1", "key2"}, *retval;
+  char filename[MAX_FILENAME];
+  unsigned long hashval = hash("key1"), next = 0;
+  kvstore_t store;
+  struct stat st;
+  int visited = 0, ret = 0, i;
+  /* A flat store written by an older version, whose entries lack the
+   * current header. */
+  mkdir("kvstore-flat-test", 0700);
+  kvstore_test_put_legacy("kvstore-flat-test", "abD", 0, "abD");
+  kvstore_test_put_legacy("kvstore-flat-test", "aae", 1, "aae");
+  kvstore_test_put_legacy("kvstore-flat-test", "ac#", 2, "ac#");
+  kvstore_test_put_legacy("kvstore-flat-test", "key1", 0, "key1");
+  kvstore_test_put_legacy("kvstore-flat-test", "key2", 0, "key2");
+  kvstore_init_fanout(&store, "kvstore-flat-test", 0);
+  ASSERT_FALSE(kvstore_migrating(&store));
+  ret += kvstore_get(&store, "ac#", &retval);
+  ASSERT_STRING_EQUAL(retval, "ac#");
+  free(retval);
+  /* Reopening the flat store with subdirectories serves it while it is
+   * moved, first by writes and then in batches. */
+  kvstore_init(&store, "kvstore-flat-test");
+  ASSERT_TRUE(kvstore_migrating(&store));
+  ret += kvstore_put(&store, "aae", "moved");
+  ret += kvstore_get(&store, "abD", &retval);
+  ASSERT_STRING_EQUAL(retval, "abD");
+  free(retval);
+  kvstore_scan(&store, 0, 10, false, kvstore_test_count_visit, &visited,
+      &next);
+  ASSERT_EQUAL(visited, 5);
+  while ((i = kvstore_migrate(&store, 1)) > 0)
+    continue;
+  ASSERT_EQUAL(i, 0);
+  ASSERT_FALSE(kvstore_migrating(&store));
+  /* Moved entries have been rewritten in the current format. */
+  sprintf(filename, "kvstore-flat-test/%02lx/%02lx/%lu-0%s", hashval & 0xff,
+      (hashval >> 8) & 0xff, hashval, KVSTORE_FILETYPE);
+  ASSERT_EQUAL(stat(filename, &st), 0);
+  ASSERT_EQUAL(st.st_size, sizeof(kventry_t) + 10);
+  ret += kvstore_get(&store, "aae", &retval);
+  ASSERT_STRING_EQUAL(retval, "moved");
+  free(retval);
+  for (i = 3; i < 5; i++) {
+    ret += kvstore_get(&store, keys[i], &retval);
+    ASSERT_STRING_EQUAL(retval, keys[i]);
+    free(retval);
+  }
+  ret += kvstore_del(&store, "ac#");
+  ASSERT_EQUAL(kvstore_get(&store, "ac#", &retval), ERRNOKEY);
+  kvstore_clean(&store);
+  ASSERT_EQUAL(ret, 0);
+  return 1;
+}
+
+int kvstore_index_snapshot(void) {
+  char filename[MAX_FILENAME], *retval;
+  kvstore_t restarted;
+  struct stat st;
+  FILE *file;
+  int ret;
+  /* hash("abD") == hash("aae") == hash("ac#") */
+  ret = kvstore_put(&teststore, "abD", "value1");
+  ret += kvstore_put(&teststore, "aae", "value2");
+  ret += kvstore_put(&teststore, "key", "value3");
+  ret += kvstore_snapshot(&teststore);
+  sprintf(filename, "%s/%s", KVSTORE_DIRNAME, KVSTORE_TAIL);
+  ASSERT_EQUAL(stat(filename, &st), 0);
+  ASSERT_EQUAL(st.st_size, 0);
+  /* Changes after the snapshot are only named in the tail. */
+  ret += kvstore_put(&teststore, "ac#", "value4");
+  ret += kvstore_del(&teststore, "abD");
+  ret += kvstore_del(&teststore, "key");
+  ASSERT_EQUAL(ret, 0);
+  kvstore_init(&restarted, KVSTORE_DIRNAME);
+  ret = kvstore_get(&restarted, "aae", &retval);
+  ASSERT_STRING_EQUAL(retval, "value2");
+  free(retval);
+  ret += kvstore_get(&restarted, "ac#", &retval);
+  ASSERT_STRING_EQUAL(retval, "value4");
+  free(retval);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_EQUAL(kvstore_get(&restarted, "abD", &retval), ERRNOKEY);
+  ASSERT_EQUAL(kvstore_get(&restarted, "key", &retval), ERRNOKEY);
+  /* A corrupt snapshot is rebuilt from the entries. */
+  sprintf(filename, "%s/%s", KVSTORE_DIRNAME, KVSTORE_SNAPSHOT);
+  file = fopen(filename, "r+");
+  fseek(file, -1, SEEK_END);
+  fputc(fgetc(file) ^ 0xff, file);
+  fclose(file);
+  kvstore_init(&restarted, KVSTORE_DIRNAME);
+  ret = kvstore_get(&restarted, "ac#", &retval);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(retval, "value4");
+  free(retval);
+  return 1;
+}
+
+int kvstore_index_tail_failure(void) {
+  char *retval;
+  int ret;
+  ret = kvstore_put(&teststore, "abD", "value1");
+  ASSERT_EQUAL(ret, 0);
+  /* With the tail unwritable, a write which would change a chain's length
+   * fails and leaves the chain alone, while an overwrite goes through. */
+  close(teststore.tailfd);
+  teststore.tailfd = open("/dev/null", O_RDONLY);
+  ASSERT_EQUAL(kvstore_put(&teststore, "aae", "value2"), ERRFILACCESS);
+  ASSERT_FALSE(kvstore_haskey(&teststore, "aae"));
+  ASSERT_EQUAL(kvstore_del(&teststore, "abD"), ERRFILACCESS);
+  ASSERT_EQUAL(kvstore_put(&teststore, "abD", "value3"), 0);
+  ret = kvstore_get(&teststore, "abD", &retval);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(retval, "value3");
+  free(retval);
+  return 1;
+}
+
+int kvstore_mmap_engine(void) {
+  char key[MAX_KEYLEN + 1], big[MAX_VALLEN + 1], *retval;
+  kvstore_t store, reopened;
+  unsigned long version, next = 0;
+  int visited = 0, ret, i;
+  memset(big, 'v', MAX_VALLEN);
+  big[MAX_VALLEN] = '\0';
+  kvstore_init_mmap(&store, "kvstore-mmap-test");
+  /* hash("abD") == hash("aae") == hash("ac#") */
+  ret = kvstore_put(&store, "abD", "value1");
+  ret += kvstore_put(&store, "aae", "value2");
+  ret += kvstore_put(&store, "ac#", big);
+  ret += kvstore_put(&store, "abD", "value3");
+  ret += kvstore_del(&store, "aae");
+  ASSERT_EQUAL(kvstore_del(&store, "aae"), ERRNOKEY);
+  ASSERT_FALSE(kvstore_haskey(&store, "aae"));
+  ret += kvstore_put_versioned(&store, "gone", NULL, 5);
+  ASSERT_EQUAL(kvstore_put_versioned(&store, "gone", "old", 4), 1);
+  ASSERT_EQUAL(kvstore_get(&store, "gone", &retval), ERRNOKEY);
+  ret += kvstore_get_versioned(&store, "gone", &retval, &version);
+  ASSERT_PTR_NULL(retval);
+  ASSERT_EQUAL(version, 5);
+  /* Enough small and large entries to grow the slots and the overflow. */
+  for (i = 0; i < 2 * KVMMAP_SLOTS; i++) {
+    sprintf(key, "key%d", i);
+    ret += kvstore_put(&store, key, (i % 16 == 0) ? big : key);
+  }
+  ASSERT_EQUAL(ret, 0);
+  /* The entries persist in the file. */
+  kvstore_init_mmap(&reopened, "kvstore-mmap-test");
+  ret = kvstore_get(&reopened, "abD", &retval);
+  ASSERT_STRING_EQUAL(retval, "value3");
+  free(retval);
+  ret += kvstore_get(&reopened, "ac#", &retval);
+  ASSERT_STRING_EQUAL(retval, big);
+  free(retval);
+  for (i = 0; i < 2 * KVMMAP_SLOTS; i++) {
+    sprintf(key, "key%d", i);
+    ret += kvstore_get(&reopened, key, &retval);
+    ASSERT_STRING_EQUAL(retval, (i % 16 == 0) ? big : key);
+    free(retval);
+  }
+  ASSERT_EQUAL(ret, 0);
+  do {
+    ret = kvstore_scan(&reopened, next, 100, false,
+        kvstore_test_count_visit, &visited, &next);
+  } while (ret > 0 && next != 0);
+  ASSERT_EQUAL(visited, 2 * KVMMAP_SLOTS + 2);
+  kvstore_clean(&reopened);
+  return 1;
+}
+
+int kvstore_mmap_overwrite(void) {
+  char filename[MAX_FILENAME], value[1001], *retval;
+  kvstore_t store;
+  struct stat st;
+  int ret = 0, i;
+  memset(value, 'v', 1000);
+  kvstore_init_mmap(&store, "kvstore-mmap-test");
+  /* Overwriting a key in place, or with data which no longer fits in place
+   * of its old data, must not grow the file. */
+  for (i = 0; i < 20000; i++) {
+    value[(i % 2 == 0) ? 600 : 1000] = '\0';
+    ret += kvstore_put(&store, "key", value);
+    value[(i % 2 == 0) ? 600 : 1000] = 'v';
+  }
+  ASSERT_EQUAL(ret, 0);
+  sprintf(filename, "kvstore-mmap-test/%s", KVSTORE_MMAP_FILE);
+  ASSERT_EQUAL(stat(filename, &st), 0);
+  ASSERT_EQUAL(st.st_size, sizeof(kvmmap_header_t) +
+      KVMMAP_SLOTS * sizeof(kvmmap_slot_t) + KVMMAP_OVERFLOW);
+  value[1000] = '\0';
+  ret = kvstore_get(&store, "key", &retval);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(retval, value);
+  free(retval);
+  kvstore_clean(&store);
+  return 1;
+}
+
+int kvstore_batch_atomic(void) {
+  char logname[MAX_FILENAME], big[MAX_KEYLEN + 2], *retval;
+  kvstore_batch_t batch;
+  kvstore_t reopened;
+  struct stat st;
+  FILE *file;
+  int ret;
+  ret = kvstore_put(&teststore, "abD", "old");
+  ret += kvstore_put(&teststore, "gone", "value");
+  /* hash("abD") == hash("aae") == hash("ac#") */
+  kvstore_batch_init(&batch);
+  ret += kvstore_batch_put(&batch, "abD", "new");
+  ret += kvstore_batch_put(&batch, "aae", "value2");
+  ret += kvstore_batch_del(&batch, "gone");
+  ret += kvstore_batch_del(&batch, "absent");
+  ret += kvstore_batch_put(&batch, "ac#", "value3");
+  ret += kvstore_batch_del(&batch, "aae");
+  ret += kvstore_write_batch(&teststore, &batch);
+  kvstore_batch_free(&batch);
+  ASSERT_EQUAL(ret, 0);
+  ret = kvstore_get(&teststore, "abD", &retval);
+  ASSERT_STRING_EQUAL(retval, "new");
+  free(retval);
+  ret += kvstore_get(&teststore, "ac#", &retval);
+  ASSERT_STRING_EQUAL(retval, "value3");
+  free(retval);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_FALSE(kvstore_haskey(&teststore, "aae"));
+  ASSERT_FALSE(kvstore_haskey(&teststore, "gone"));
+  sprintf(logname, "%s/%s.1", KVSTORE_DIRNAME, KVSTORE_BATCH_LOG);
+  ASSERT_EQUAL(stat(logname, &st), -1);
+
+  /* A batch with an invalid write makes none of its writes. */
+  memset(big, 'k', MAX_KEYLEN + 1);
+  big[MAX_KEYLEN + 1] = '\0';
+  kvstore_batch_put(&batch, "fresh", "value");
+  kvstore_batch_put(&batch, big, "value");
+  ASSERT_EQUAL(kvstore_write_batch(&teststore, &batch), ERRKEYLEN);
+  kvstore_batch_free(&batch);
+  ASSERT_FALSE(kvstore_haskey(&teststore, "fresh"));
+
+  /* A log torn by a crash was never committed, and is dropped. */
+  file = fopen(logname, "w");
+  fwrite("torn", 4, 1, file);
+  fclose(file);
+  ASSERT_EQUAL(kvstore_init(&reopened, KVSTORE_DIRNAME), 0);
+  ASSERT_EQUAL(stat(logname, &st), -1);
+  ASSERT_TRUE(kvstore_haskey(&reopened, "abD"));
+  kvstore_close(&reopened);
+  return 1;
+}
+
+/* Repeatedly writes a batch which PUTs the same tag, the key indexed by the
+ * int AUX, under the shared chain's keys "abD" and "aae" and its own key. */
+void *kvstore_test_batcher(void *aux) {
+  char *key = kvstore_test_keys[3 + *(int *) aux];
+  kvstore_batch_t batch;
+  int i;
+  for (i = 0; i < 20; i++) {
+    kvstore_batch_init(&batch);
+    kvstore_batch_put(&batch, "abD", key);
+    kvstore_batch_put(&batch, key, key);
+    kvstore_batch_put(&batch, "aae", key);
+    kvstore_write_batch(&teststore, &batch);
+    kvstore_batch_free(&batch);
+  }
+  return NULL;
+}
+
+int kvstore_batch_concurrent(void) {
+  char logname[MAX_FILENAME], *first, *second, *retval;
+  pthread_t threads[4];
+  int ids[4], ret = 0, i;
+  struct stat st;
+  for (i = 0; i < 4; i++) {
+    ids[i] = i;
+    pthread_create(&threads[i], NULL, kvstore_test_batcher, &ids[i]);
+  }
+  for (i = 0; i < 4; i++)
+    pthread_join(threads[i], NULL);
+  /* Batches syncing concurrently still apply whole, one after another. */
+  ret += kvstore_get(&teststore, "abD", &first);
+  ret += kvstore_get(&teststore, "aae", &second);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(first, second);
+  free(first);
+  free(second);
+  for (i = 0; i < 4; i++) {
+    ret += kvstore_get(&teststore, kvstore_test_keys[3 + i], &retval);
+    ASSERT_STRING_EQUAL(retval, kvstore_test_keys[3 + i]);
+    free(retval);
+  }
+  ASSERT_EQUAL(ret, 0);
+  /* Each batch removed its own log. */
+  for (i = 1; i <= 80; i++) {
+    sprintf(logname, "%s/%s.%d", KVSTORE_DIRNAME, KVSTORE_BATCH_LOG, i);
+    ASSERT_EQUAL(stat(logname, &st), -1);
+  }
+  return 1;
+}
+
 test_info_t kvstore_tests[] = {
   {"Simple PUT and GET of a single value", kvstore_single_put_get},
   {"Simple PUT and GET of multiple values", kvstore_multiple_put_get},
@@ -237,6 +675,25 @@ test_info_t kvstore_tests[] = {
   {"Simple DEL on a value", kvstore_del_simple},
   {"DEL on a key that does not exist", kvstore_del_no_key},
   {"DEL on keys which have hash conflicts", kvstore_del_hash_conflicts},
+  {"Versioned PUT, GET and DEL keep the latest version",
+    kvstore_versioned_put_get},
+  {"Scan visits whole hash chains in batches", kvstore_scan_chains},
+  {"Concurrent PUT and DEL on shared and separate hash chains",
+    kvstore_concurrent_writes},
+  {"Entries are stored in hashed subdirectories", kvstore_fanout_layout},
+  {"A flat store is migrated into subdirectories online",
+    kvstore_fanout_migration},
+  {"The index is restored from its snapshot and tail",
+    kvstore_index_snapshot},
+  {"A write fails if its chain cannot be noted in the index tail",
+    kvstore_index_tail_failure},
+  {"The memory-mapped engine stores, grows and persists entries",
+    kvstore_mmap_engine},
+  {"Overwriting entries of the memory-mapped engine reuses their space",
+    kvstore_mmap_overwrite},
+  {"A batch of writes is applied atomically", kvstore_batch_atomic},
+  {"Concurrent batches on a shared hash chain apply whole",
+    kvstore_batch_concurrent},
   NULL_TEST_INFO
 };
 
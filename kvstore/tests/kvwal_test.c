@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "kvwal.h"
+#include "tester.h"
+
+#define KVWAL_DIRNAME "kvwal-test"
+
+kvwal_t testwal;
+
+/* The records replayed from the test log, joined as "key=value;" or
+ * "key-;" for a DEL. */
+char replayed[1024];
+
+int kvwal_test_init(void) {
+  kvwal_init(&testwal, KVWAL_DIRNAME);
+  replayed[0] = '\0';
+  return 0;
+}
+
+int kvwal_test_clean(void) {
+  kvwal_close(&testwal);
+  return 0;
+}
+
+int kvwal_test_visit(char *key, char *value, void *aux) {
+  int *count = aux;
+  strcat(replayed, key);
+  if (value == NULL) {
+    strcat(replayed, "-;");
+  } else {
+    strcat(replayed, "=");
+    strcat(replayed, value);
+    strcat(replayed, ";");
+  }
+  (*count)++;
+  return 0;
+}
+
+/* Reopens the test log, as a server restarted on the same directory would. */
+void kvwal_test_reopen(void) {
+  kvwal_close(&testwal);
+  kvwal_init(&testwal, KVWAL_DIRNAME);
+}
+
+int kvwal_replay_order(void) {
+  int count = 0;
+  ASSERT_EQUAL(kvwal_append(&testwal, "a", "1", NULL), 0);
+  ASSERT_EQUAL(kvwal_append(&testwal, "b", "2", NULL), 0);
+  ASSERT_EQUAL(kvwal_append(&testwal, "a", NULL, NULL), 0);
+  ASSERT_EQUAL(kvwal_append(&testwal, "c", "", NULL), 0);
+  kvwal_test_reopen();
+  ASSERT_EQUAL(kvwal_replay(&testwal, kvwal_test_visit, &count), 0);
+  ASSERT_EQUAL(count, 4);
+  ASSERT_STRING_EQUAL(replayed, "a=1;b=2;a-;c=;");
+
+  /* An emptied log replays nothing, and takes new records. */
+  ASSERT_EQUAL(kvwal_truncate(&testwal), 0);
+  ASSERT_EQUAL(kvwal_append(&testwal, "d", "4", NULL), 0);
+  kvwal_test_reopen();
+  count = 0;
+  replayed[0] = '\0';
+  ASSERT_EQUAL(kvwal_replay(&testwal, kvwal_test_visit, &count), 0);
+  ASSERT_EQUAL(count, 1);
+  ASSERT_STRING_EQUAL(replayed, "d=4;");
+  return 1;
+}
+
+int kvwal_torn_tail(void) {
+  char filename[MAX_FILENAME];
+  struct stat st;
+  int count = 0, fd;
+
+  ASSERT_EQUAL(kvwal_append(&testwal, "key1", "value1", NULL), 0);
+  ASSERT_EQUAL(kvwal_append(&testwal, "key2", "value2", NULL), 0);
+  ASSERT_EQUAL(kvwal_append(&testwal, "key3", "value3", NULL), 0);
+  sprintf(filename, "%s/%s", KVWAL_DIRNAME, KVWAL_FILENAME);
+  ASSERT_EQUAL(stat(filename, &st), 0);
+
+  /* The last record is cut short by a crash, and the one before it has a
+   * byte flipped, so replay stops after the first. */
+  ASSERT_EQUAL(truncate(filename, st.st_size - 3), 0);
+  fd = open(filename, O_RDWR);
+  ASSERT_TRUE(fd >= 0);
+  ASSERT_EQUAL(pwrite(fd, "X", 1, 2 * sizeof(kvwal_record_t) + 10 + 2), 1);
+  close(fd);
+  kvwal_test_reopen();
+  ASSERT_EQUAL(kvwal_replay(&testwal, kvwal_test_visit, &count), 0);
+  ASSERT_EQUAL(count, 1);
+  ASSERT_STRING_EQUAL(replayed, "key1=value1;");
+  return 1;
+}
+
+/* Appends a record to the test log and waits until it is durable, returning
+ * its end position, or 0 on failure. */
+void *kvwal_test_writer(void *aux) {
+  unsigned long end;
+  char key[32];
+  sprintf(key, "key%ld", (long) aux);
+  if (kvwal_append(&testwal, key, "value", &end) < 0 ||
+      kvwal_sync(&testwal, end) < 0)
+    return NULL;
+  return (void *) end;
+}
+
+int kvwal_grouped_sync(void) {
+  pthread_t writers[8];
+  unsigned long end, last = 0;
+  void *ret;
+  long i;
+  int count = 0;
+
+  for (i = 0; i < 8; i++)
+    pthread_create(&writers[i], NULL, kvwal_test_writer, (void *) i);
+  for (i = 0; i < 8; i++) {
+    pthread_join(writers[i], &ret);
+    ASSERT_PTR_NOT_NULL(ret);
+    ASSERT_TRUE(testwal.durable >= (unsigned long) ret);
+    if ((unsigned long) ret > last)
+      last = (unsigned long) ret;
+  }
+  ASSERT_EQUAL(testwal.durable, last);
+  ASSERT_FALSE(testwal.syncing);
+  kvwal_test_reopen();
+  ASSERT_EQUAL(kvwal_replay(&testwal, kvwal_test_visit, &count), 0);
+  ASSERT_EQUAL(count, 8);
+
+  /* Truncating makes whatever was logged count as durable, so a writer
+   * waiting for its record does not sync again. */
+  ASSERT_EQUAL(kvwal_append(&testwal, "late", "value", &end), 0);
+  ASSERT_TRUE(testwal.durable < end);
+  ASSERT_EQUAL(kvwal_truncate(&testwal), 0);
+  ASSERT_EQUAL(testwal.durable, end);
+  ASSERT_EQUAL(kvwal_sync(&testwal, end), 0);
+  return 1;
+}
+
+test_info_t kvwal_tests[] = {
+  {"Records are replayed in order until the log is emptied",
+    kvwal_replay_order},
+  {"Replay stops at a torn or corrupt record", kvwal_torn_tail},
+  {"Concurrent writers share syncs and each wait for their own record",
+    kvwal_grouped_sync},
+  NULL_TEST_INFO
+};
+
+suite_info_t kvwal_suite = {"KVWal Tests", kvwal_test_init, kvwal_test_clean,
+  kvwal_tests};
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvwheel.h"
+#include "tester.h"
+
+#define START 1000
+
+kvwheel_t testwheel;
+
+int kvwheel_test_init(void) {
+  kvwheel_init(&testwheel, START);
+  return 0;
+}
+
+int kvwheel_test_clean(void) {
+  kvwheel_free(&testwheel);
+  return 0;
+}
+
+/* Advances the test wheel to tick NOW, returning the single key due by then
+ * (or NULL if none is), which should be free()d. */
+char *kvwheel_test_step(unsigned long now) {
+  char *keys[2];
+  unsigned int num = kvwheel_expire(&testwheel, now, 2, keys);
+  if (num == 2) {
+    free(keys[1]);
+    return NULL;
+  }
+  return (num == 1) ? keys[0] : NULL;
+}
+
+int kvwheel_levels(void) {
+  /* Offsets within each level, at their edges, and past the top one. */
+  unsigned long offsets[] = {0, 1, 63, 64, 65, 4095, 4096, 4097, 262143,
+    262144, 300000, 16777215, 16777216, 20000000};
+  unsigned int num = sizeof(offsets) / sizeof(offsets[0]), i;
+  unsigned long now = START;
+  char key[32], *due;
+
+  for (i = 0; i < num; i++) {
+    sprintf(key, "key%lu", offsets[i]);
+    ASSERT_EQUAL(kvwheel_add(&testwheel, key, START + offsets[i]), 0);
+  }
+  ASSERT_EQUAL(kvwheel_count(&testwheel), num);
+  /* Each key is due at its own tick, and not a tick sooner. */
+  for (i = 0; i < num; i++) {
+    if (START + offsets[i] > now) {
+      ASSERT_PTR_NULL(kvwheel_test_step(START + offsets[i] - 1));
+      now = START + offsets[i];
+    }
+    due = kvwheel_test_step(now);
+    ASSERT_PTR_NOT_NULL(due);
+    sprintf(key, "key%lu", offsets[i]);
+    ASSERT_STRING_EQUAL(due, key);
+    free(due);
+  }
+  ASSERT_EQUAL(kvwheel_count(&testwheel), 0);
+  return 1;
+}
+
+int kvwheel_batches(void) {
+  char *keys[4], key[32];
+  unsigned int i;
+
+  for (i = 0; i < 10; i++) {
+    sprintf(key, "key%u", i);
+    ASSERT_EQUAL(kvwheel_add(&testwheel, key, START + 5), 0);
+  }
+  /* A key which expired before it was added is due at once. */
+  ASSERT_EQUAL(kvwheel_add(&testwheel, "late", START - 5), 0);
+  ASSERT_EQUAL(kvwheel_expire(&testwheel, START, 4, keys), 1);
+  ASSERT_STRING_EQUAL(keys[0], "late");
+  free(keys[0]);
+  ASSERT_EQUAL(kvwheel_expire(&testwheel, START + 4, 4, keys), 0);
+  /* The due keys are handed out at most MAX at a time. */
+  ASSERT_EQUAL(kvwheel_expire(&testwheel, START + 5, 4, keys), 4);
+  for (i = 0; i < 4; i++)
+    free(keys[i]);
+  ASSERT_EQUAL(kvwheel_expire(&testwheel, START + 5, 4, keys), 4);
+  for (i = 0; i < 4; i++)
+    free(keys[i]);
+  ASSERT_EQUAL(kvwheel_expire(&testwheel, START + 6, 4, keys), 2);
+  for (i = 0; i < 2; i++)
+    free(keys[i]);
+  ASSERT_EQUAL(kvwheel_count(&testwheel), 0);
+  return 1;
+}
+
+test_info_t kvwheel_tests[] = {
+  {"Timers on every level expire at their own tick", kvwheel_levels},
+  {"Due timers are returned in batches", kvwheel_batches},
+  NULL_TEST_INFO
+};
+
+suite_info_t kvwheel_suite = {"KVWheel Tests", kvwheel_test_init,
+  kvwheel_test_clean, kvwheel_tests};
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include "socket_server.h"
@@ -97,8 +98,138 @@ int socket_server_multiple_test(void) {
   return 1;
 }
 
+/* Sends a request of type TYPE for KEY (and VALUE) to the test server and
+ * returns its response, which should be freed. */
+kvmessage_t *socket_server_request(msgtype_t type, char *key, char *value) {
+  kvmessage_t reqmsg, *respmsg;
+  int sockfd = connect_to(SOCKET_SERVER_HOST, SOCKET_SERVER_PORT, 3);
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = type;
+  reqmsg.key = key;
+  reqmsg.value = value;
+  kvmessage_send(&reqmsg, sockfd);
+  respmsg = kvmessage_parse(sockfd);
+  close(sockfd);
+  return respmsg;
+}
+
+int socket_server_sharded_test(void) {
+  pthread_t server_thread;
+  kvmessage_t *respmsg;
+  char key[16], *value;
+  int i, found, owners[2] = {0, 0};
+
+  testserver.master = 0;
+  testserver.max_threads = 2;
+  ASSERT_EQUAL(server_init_shards(&testserver, 2, "shard-test", 2, 2,
+      SOCKET_SERVER_HOST, SOCKET_SERVER_PORT, NULL), 0);
+  pthread_create(&server_thread, NULL, socket_server_run_thread, NULL);
+  pthread_mutex_lock(&socket_server_test_lock);
+  while (!server_running)
+    pthread_cond_wait(&socket_server_test_cond, &socket_server_test_lock);
+  pthread_mutex_unlock(&socket_server_test_lock);
+
+  for (i = 0; i < 16; i++) {
+    sprintf(key, "key%d", i);
+    respmsg = socket_server_request(PUTREQ, key, "value");
+    ASSERT_PTR_NOT_NULL(respmsg);
+    ASSERT_STRING_EQUAL(respmsg->message, MSG_SUCCESS);
+    kvmessage_free(respmsg);
+    respmsg = socket_server_request(GETREQ, key, NULL);
+    ASSERT_PTR_NOT_NULL(respmsg);
+    ASSERT_EQUAL(respmsg->type, GETRESP);
+    ASSERT_STRING_EQUAL(respmsg->value, "value");
+    kvmessage_free(respmsg);
+
+    /* Each key is stored by exactly one shard. */
+    found = 0;
+    for (int s = 0; s < 2; s++) {
+      if (kvengine_get(&testserver.shards[s].kvserver.store, key,
+          &value) == 0) {
+        found++;
+        owners[s]++;
+        free(value);
+      }
+    }
+    ASSERT_EQUAL(found, 1);
+  }
+  ASSERT_TRUE(owners[0] > 0 && owners[1] > 0);
+  server_stop(&testserver);
+  kvserver_clean(&testserver.shards[0].kvserver);
+  kvserver_clean(&testserver.shards[1].kvserver);
+  rmdir("shard-test");
+  return 1;
+}
+
+/* Holds the only request thread of the test server until COMPLETE is set. */
+void socket_server_blocking_handler(kvserver_t *server, int sockfd,
+    void *extra) {
+  pthread_mutex_lock(&socket_server_test_lock);
+  concurrent = 1;
+  pthread_cond_broadcast(&socket_server_test_cond);
+  while (!complete)
+    pthread_cond_wait(&socket_server_completion_cond,
+        &socket_server_test_lock);
+  pthread_mutex_unlock(&socket_server_test_lock);
+}
+
+/* Sends a GET to the test server, placing its response into AUX. */
+void *socket_server_queued_thread(void *aux) {
+  *(kvmessage_t **) aux = socket_server_request(GETREQ, "key", NULL);
+  return NULL;
+}
+
+int socket_server_overload_test(void) {
+  pthread_t server_thread, queued_thread;
+  kvmessage_t *respmsg, *queued;
+  int blocker;
+
+  testserver.master = 0;
+  testserver.max_threads = 1;
+  testserver.max_queue = 1;
+  testserver.queue_deadline_ms = 100;
+  testserver.kvserver.handle = &socket_server_blocking_handler;
+  pthread_create(&server_thread, NULL, socket_server_run_thread, NULL);
+  pthread_mutex_lock(&socket_server_test_lock);
+  while (!server_running)
+    pthread_cond_wait(&socket_server_test_cond, &socket_server_test_lock);
+  pthread_mutex_unlock(&socket_server_test_lock);
+
+  /* The first connection takes the only thread, and the second fills the
+   * queue. */
+  blocker = connect_to(SOCKET_SERVER_HOST, SOCKET_SERVER_PORT, 3);
+  pthread_mutex_lock(&socket_server_test_lock);
+  while (!concurrent)
+    pthread_cond_wait(&socket_server_test_cond, &socket_server_test_lock);
+  pthread_mutex_unlock(&socket_server_test_lock);
+  pthread_create(&queued_thread, NULL, socket_server_queued_thread, &queued);
+  usleep(200000);
+
+  /* A third is turned away at once. */
+  respmsg = socket_server_request(GETREQ, "key", NULL);
+  ASSERT_PTR_NOT_NULL(respmsg);
+  ASSERT_STRING_EQUAL(respmsg->message, ERRMSG_OVERLOADED);
+  kvmessage_free(respmsg);
+
+  /* The second has waited past the deadline, so is turned away unserved
+   * once the thread is free. */
+  pthread_mutex_lock(&socket_server_test_lock);
+  complete = 1;
+  pthread_cond_broadcast(&socket_server_completion_cond);
+  pthread_mutex_unlock(&socket_server_test_lock);
+  pthread_join(queued_thread, NULL);
+  ASSERT_PTR_NOT_NULL(queued);
+  ASSERT_STRING_EQUAL(queued->message, ERRMSG_OVERLOADED);
+  kvmessage_free(queued);
+  close(blocker);
+  server_stop(&testserver);
+  return 1;
+}
+
 test_info_t socket_server_tests[] = {
   {"Tests that multiple requests can be handled simultaneously", socket_server_multiple_test},
+  {"Tests that a sharded slave routes each key to one shard", socket_server_sharded_test},
+  {"Tests that a full or stale queue turns requests away", socket_server_overload_test},
   NULL_TEST_INFO
 };
 
@@ -8,10 +8,17 @@
 #include <string.h>
 #include "tester.h"
 #include "kvstore_test.h"
+#include "kvengine_test.h"
 #include "kvcacheset_test.h"
 #include "kvcache_test.h"
+#include "kvflight_test.h"
+#include "kvwheel_test.h"
+#include "kvwal_test.h"
+#include "kvarena_test.h"
+#include "kvconn_test.h"
 #include "kvserver_test.h"
 #include "wq_test.h"
+#include "kvring_test.h"
 #include "socket_server_test.h"
 #include "kvserver_tpc_test.h"
 #include "tpclog_test.h"
@@ -113,10 +120,17 @@ int main(int argc, const char *argv[]) {
 
   struct suite_desc suite_table[] = {
     {kvstore_suite, "kvstore"},
+    {kvengine_suite, "kvengine"},
     {kvcacheset_suite, "kvcacheset"},
     {kvcache_suite, "kvcache"},
+    {kvflight_suite, "kvflight"},
+    {kvwheel_suite, "kvwheel"},
+    {kvwal_suite, "kvwal"},
+    {kvarena_suite, "kvarena"},
+    {kvconn_suite, "kvconn"},
     {kvserver_suite, "kvserver"},
     {wq_suite, "wq"},
+    {kvring_suite, "kvring"},
     {socket_server_suite, "socket_server"},
     {kvserver_client_suite, "kvserver_client"},
     {kvserver_tpc_suite, "kvserver_tpc"},
@@ -140,12 +154,21 @@ int main(int argc, const char *argv[]) {
   };
 
   suite_info_t all_suites[] = {
+    kvstore_suite,
+    kvengine_suite,
     kvcacheset_suite,
     kvcache_suite,
+    kvflight_suite,
+    kvwheel_suite,
+    kvwal_suite,
+    kvarena_suite,
+    kvconn_suite,
     kvserver_suite,
     wq_suite,
+    kvring_suite,
     socket_server_suite,
     endtoend_suite,
+    tpclog_suite,
     kvserver_tpc_suite,
     tpcmaster_suite,
     endtoend_tpc_suite,
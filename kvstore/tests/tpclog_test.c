@@ -187,12 +187,102 @@ int tpclog_iterate_entries(void) {
   return 1;
 }
 
+int tpclog_log_load_batch(void) {
+  int ret;
+  logentry_t *entry, *op;
+  kvmessage_t ops[2];
+  memset(ops, 0, sizeof(ops));
+  ops[0].type = PUTREQ;
+  ops[0].key = "MYKEY";
+  ops[0].value = "MYVALUE";
+  ops[0].ttl = 60;
+  ops[1].type = DELREQ;
+  ops[1].key = "OLDKEY";
+  ret = tpclog_log_batch(&testlog, 7, ops, 2);
+  ASSERT_EQUAL(ret, 0);
+
+  tpclog_iterate_begin(&testlog);
+  entry = tpclog_iterate_next(&testlog);
+  ASSERT_PTR_NOT_NULL(entry);
+  ASSERT_EQUAL(entry->type, BATCHREQ);
+  ASSERT_EQUAL(entry->txid, 7);
+
+  op = tpclog_batch_next(entry, NULL);
+  ASSERT_PTR_NOT_NULL(op);
+  ASSERT_EQUAL(op->type, PUTREQ);
+  ASSERT_EQUAL(op->length, 14);
+  ASSERT_STRING_EQUAL(op->data, "MYKEY");
+  ASSERT_STRING_EQUAL(op->data + 6, "MYVALUE");
+  ASSERT_EQUAL(op->ttl, 60);
+
+  op = tpclog_batch_next(entry, op);
+  ASSERT_PTR_NOT_NULL(op);
+  ASSERT_EQUAL(op->type, DELREQ);
+  ASSERT_EQUAL(op->length, 7);
+  ASSERT_STRING_EQUAL(op->data, "OLDKEY");
+
+  ASSERT_PTR_NULL(tpclog_batch_next(entry, op));
+  free(entry);
+  ASSERT_FALSE(tpclog_iterate_has_next(&testlog));
+  return 1;
+}
+
+/* Writes the entry of type TYPE holding DATA, which is LENGTH bytes long, as
+ * entry ID of the log, in the format written before entries carried a
+ * transaction id and a TTL. */
+static void tpclog_test_log_legacy(unsigned long id, msgtype_t type,
+    char *data, int length) {
+  char filename[MAX_FILENAME];
+  FILE *file;
+  sprintf(filename, "%s/%lu%s", TPCLOG_DIRNAME, id, TPCLOG_FILETYPE);
+  file = fopen(filename, "w");
+  fwrite(&type, sizeof(msgtype_t), 1, file);
+  fwrite(&length, sizeof(int), 1, file);
+  fwrite(data, length, 1, file);
+  fclose(file);
+}
+
+int tpclog_load_legacy(void) {
+  tpclog_t log;
+  logentry_t *entry;
+  tpclog_test_log_legacy(0, PUTREQ, "MYKEY\0MYVALUE", 14);
+  tpclog_test_log_legacy(1, COMMIT, NULL, 0);
+  /* A log left by an older version is continued and replayed in order. */
+  tpclog_init(&log, TPCLOG_DIRNAME);
+  ASSERT_EQUAL(log.nextid, 2);
+  ASSERT_EQUAL(tpclog_log_txn(&log, 7, DELREQ, "MYKEY", NULL, 0), 0);
+  tpclog_iterate_begin(&log);
+  entry = tpclog_iterate_next(&log);
+  ASSERT_PTR_NOT_NULL(entry);
+  ASSERT_EQUAL(entry->type, PUTREQ);
+  ASSERT_EQUAL(entry->txid, 0);
+  ASSERT_EQUAL(entry->ttl, 0);
+  ASSERT_STRING_EQUAL(entry->data, "MYKEY");
+  ASSERT_STRING_EQUAL(entry->data + 6, "MYVALUE");
+  free(entry);
+  entry = tpclog_iterate_next(&log);
+  ASSERT_PTR_NOT_NULL(entry);
+  ASSERT_EQUAL(entry->type, COMMIT);
+  ASSERT_EQUAL(entry->length, 0);
+  free(entry);
+  entry = tpclog_iterate_next(&log);
+  ASSERT_PTR_NOT_NULL(entry);
+  ASSERT_EQUAL(entry->type, DELREQ);
+  ASSERT_EQUAL(entry->txid, 7);
+  free(entry);
+  ASSERT_PTR_NULL(tpclog_iterate_next(&log));
+  return 1;
+}
+
 test_info_t tpclog_tests[] = {
   {"Simple test of logging an entry and loading it back", tpclog_log_load},
   {"Simple test of logging multiple entries and loading them back",
     tpclog_log_load_multiple},
   {"Simple test of clearing out the log", tpclog_test_clear_log},
   {"Iterate through entries", tpclog_iterate_entries},
+  {"Log a batch as a single entry and walk its operations",
+    tpclog_log_load_batch},
+  {"Load entries written in the older format", tpclog_load_legacy},
   NULL_TEST_INFO
 };
 
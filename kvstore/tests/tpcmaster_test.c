@@ -17,6 +17,17 @@ kvserver_t testslaves[10];
 char buf[20];
 kvmessage_t reqmsg, respmsg;
 int done = 0; /* Used for synchronizing some of the concurrency tests. */
+unsigned long round_txid = 0; /* The transaction of the round in PUT_JOINING. */
+int quorum_requests = 0; /* The quorum requests the dummy slave has received. */
+/* In PUT_COALESCED: the key every batch containing it is voted down for, the
+ * BATCHREQs received and the operations of the last one, and whether the
+ * first vote has been stalled yet. */
+char coalesce_bad_key[16];
+int batch_requests = 0, batch_ops = 0, first_vote_stalled = 0;
+/* In GET_HEDGED: the GETs received for each key "hedgeN", and in all. The
+ * first for each key stalls for HEDGE_STALL_US. */
+int hedge_requests[64], get_requests = 0;
+#define HEDGE_STALL_US 200000
 
 typedef enum {
   GET_SIMPLE,
@@ -30,6 +41,15 @@ typedef enum {
   DEL_FAIL,
   INFO_SIMPLE,
   INFO_FAIL,
+  QUORUM_PUT,
+  QUORUM_GET,
+  QUORUM_PUT_ERROR,
+  QUORUM_GET_ERROR,
+  INCR_SIMPLE,
+  PUT_JOINING,
+  PUT_COALESCED,
+  GET_HEDGED,
+  GET_SPREAD,
 } test_t;
 
 test_t current_test;
@@ -48,6 +68,7 @@ void setup_slaves();
 void cleanup_slaves();
 int setup_listen_socket(int);
 int tpcmaster_run_test(void);
+void *tpcmaster_runner(void *callback);
 
 int tpcmaster_test_init(void) {
   struct timeval tv;
@@ -140,6 +161,36 @@ int tpcmaster_get_successor_for_slave(void) {
   return 1;
 }
 
+int tpcmaster_route_registered(void) {
+  char *keys[] = {"winteriscoming", "inagalaxyfarfaraway", "iamyourfather",
+    "thisisourtownscrub", "noooooooo"};
+  char *ports[] = {"1234", "2345", "3456", "4567"};
+  tpcslave_t *slave, *expected;
+  int i;
+  reqmsg.type = REGISTER;
+  reqmsg.key = "localhost";
+  for (i = 0; i < 4; i++) {
+    reqmsg.value = ports[i];
+    tpcmaster_register(&testmaster, &reqmsg, &respmsg);
+    ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  }
+  for (i = 0; i < 5; i++) {
+    expected = testmaster.slaves_head;
+    while (expected != NULL && expected->id <= hash_64_bit(keys[i]))
+      expected = expected->next;
+    if (expected == NULL)
+      expected = testmaster.slaves_head;
+    ASSERT_EQUAL(tpcmaster_get_primary(&testmaster, keys[i]), expected);
+  }
+  slave = testmaster.slaves_head;
+  for (i = 0; i < 4; i++) {
+    expected = slave->next ? slave->next : testmaster.slaves_head;
+    ASSERT_EQUAL(tpcmaster_get_successor(&testmaster, slave), expected);
+    slave = expected;
+  }
+  return 1;
+}
+
 int tpcmaster_get_cached(void) {
   int ret;
   pthread_rwlock_t *cachelock = kvcache_getlock(&testmaster.cache, "KEY");
@@ -171,6 +222,100 @@ void tpcmaster_dummy_handle(tpcmaster_t *master, int sockfd, callback_t callback
       else
         resp.type = ACK;
       break;
+    case PUT_JOINING:
+      /* Only the replicas of the round acknowledge their decision; the
+       * joining slave, sent a transaction of its own, dies after voting. */
+      if (req->type == PUTREQ) {
+        if (round_txid == 0)
+          round_txid = req->txid;
+        resp.type = VOTE_COMMIT;
+      } else if (req->txid == round_txid) {
+        resp.type = ACK;
+      } else {
+        free(req);
+        return;
+      }
+      break;
+    case PUT_COALESCED:
+      if (req->type == BATCHREQ) {
+        __atomic_add_fetch(&batch_requests, 1, __ATOMIC_SEQ_CST);
+        batch_ops = req->num_ops;
+        resp.type = VOTE_COMMIT;
+        for (int i = 0; i < req->num_ops; i++) {
+          if (strcmp(req->ops[i].key, coalesce_bad_key) == 0)
+            resp.type = VOTE_ABORT;
+        }
+      } else if (req->type == PUTREQ) {
+        /* The first round is held up, so that the writes arriving
+         * meanwhile queue up for the next one. */
+        if (__atomic_fetch_add(&first_vote_stalled, 1, __ATOMIC_SEQ_CST) == 0)
+          usleep(300000);
+        resp.type = (strcmp(req->key, coalesce_bad_key) == 0) ?
+            VOTE_ABORT : VOTE_COMMIT;
+      } else {
+        resp.type = ACK;
+      }
+      break;
+    case GET_HEDGED:
+      /* The replica asked first about a key stalls; any other answers at
+       * once, so a hedged GET is answered with its value. */
+      __atomic_add_fetch(&get_requests, 1, __ATOMIC_SEQ_CST);
+      resp.type = GETRESP;
+      resp.key = req->key;
+      if (__atomic_fetch_add(&hedge_requests[atoi(req->key + 5) % 64], 1,
+            __ATOMIC_SEQ_CST) == 0) {
+        usleep(HEDGE_STALL_US);
+        resp.value = "SLOW";
+      } else {
+        resp.value = "FAST";
+      }
+      break;
+    case GET_SPREAD:
+      resp.type = GETRESP;
+      resp.key = req->key;
+      resp.value = "VAL";
+      break;
+    case INCR_SIMPLE:
+      if (req->type == INCRREQ) {
+        resp.type = VOTE_COMMIT;
+        resp.value = "8";
+      } else {
+        resp.type = ACK;
+      }
+      break;
+    case QUORUM_PUT:
+      resp.type = RESP;
+      resp.message = (req->version != 0) ? MSG_SUCCESS : ERRMSG_INVALID_REQUEST;
+      break;
+    case QUORUM_PUT_ERROR: case QUORUM_GET_ERROR:
+      /* The first replica asked fails at once; the others answer, but only
+       * after it, so the master sees the error first. */
+      if (__atomic_fetch_add(&quorum_requests, 1, __ATOMIC_SEQ_CST) == 0) {
+        resp.type = RESP;
+        resp.message = ERRMSG_GENERIC_ERROR;
+      } else if (req->type == GETREQ) {
+        usleep(100000);
+        resp.type = GETRESP;
+        resp.key = "KEY";
+        resp.value = "VAL";
+        resp.version = 42;
+      } else {
+        usleep(100000);
+        resp.type = RESP;
+        resp.message = MSG_SUCCESS;
+      }
+      break;
+    case QUORUM_GET:
+      if (req->type == GETREQ && req->version != 0) {
+        resp.type = GETRESP;
+        resp.key = "KEY";
+        resp.value = "VAL";
+        resp.version = 42;
+      } else {
+        resp.type = RESP;
+        resp.message = MSG_SUCCESS;
+      }
+      break;
     default:
       return;
   }
@@ -182,11 +327,11 @@ void *tpcmaster_thread(void *aux) {
   reqmsg.key = "KEY";
   pthread_mutex_lock(&tpcmaster_lock);
   switch (current_test) {
-    case GET_SIMPLE:
+    case GET_SIMPLE: case QUORUM_GET: case QUORUM_GET_ERROR:
       reqmsg.type = GETREQ;
       tpcmaster_handle_get(&testmaster, &reqmsg, &respmsg);
       break;
-    case PUT_SIMPLE:
+    case PUT_SIMPLE: case QUORUM_PUT: case QUORUM_PUT_ERROR: case PUT_JOINING:
       reqmsg.type = PUTREQ;
       reqmsg.value = "VAL";
       tpcmaster_handle_tpc(&testmaster, &reqmsg, &respmsg, NULL);
@@ -195,6 +340,11 @@ void *tpcmaster_thread(void *aux) {
       reqmsg.type = DELREQ;
       tpcmaster_handle_tpc(&testmaster, &reqmsg, &respmsg, NULL);
       break;
+    case INCR_SIMPLE:
+      reqmsg.type = INCRREQ;
+      reqmsg.value = "1";
+      tpcmaster_handle_tpc(&testmaster, &reqmsg, &respmsg, NULL);
+      break;
     case INFO_SIMPLE:
       reqmsg.type = INFO;
       tpcmaster_info(&testmaster, &reqmsg, &respmsg);
@@ -223,6 +373,31 @@ int tpcmaster_put_simple(void) {
   return 1;
 }
 
+int tpcmaster_put_joining_dead(void) {
+  /* A slave joining as a replica of KEY, which stops answering once it has
+   * voted (see tpcmaster_dummy_handle). */
+  tpcslave_t *joiner = calloc(1, sizeof(tpcslave_t));
+  joiner->host = "localhost";
+  joiner->port = SLAVE_PORT;
+  joiner->id = hash_64_bit("KEY") + 1;
+  joiner->joining = true;
+  testmaster.joining = joiner;
+  current_test = PUT_JOINING;
+  tpcmaster_run_test();
+  /* The write commits, and its forward to the joining slave gives up after
+   * a few attempts, leaving the commit for later and restarting the copy. */
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  ASSERT_TRUE(testmaster.joining_stale);
+  ASSERT_PTR_NOT_NULL(joiner->undelivered);
+  ASSERT_EQUAL(joiner->undelivered->type, COMMIT);
+  ASSERT_TRUE(joiner->undelivered->txid != round_txid);
+  testmaster.joining = NULL;
+  testmaster.joining_stale = false;
+  free(joiner->undelivered);
+  free(joiner);
+  return 1;
+}
+
 int tpcmaster_del_simple(void) {
   current_test = DEL_SIMPLE;
   tpcmaster_run_test();
@@ -230,6 +405,19 @@ int tpcmaster_del_simple(void) {
   return 1;
 }
 
+int tpcmaster_incr_simple(void) {
+  char *value;
+  current_test = INCR_SIMPLE;
+  tpcmaster_run_test();
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "8");
+  /* The committed update is cached as the value the slaves computed. */
+  ASSERT_EQUAL(kvcache_get(&testmaster.cache, "KEY", &value), 0);
+  ASSERT_STRING_EQUAL(value, "8");
+  free(value);
+  return 1;
+}
+
 int tpcmaster_get_replica(void) {
   current_test = GET_REPLICA;
   tpcmaster_run_test();
@@ -259,6 +447,301 @@ int tpcmaster_put_fail(void) {
   return 1;
 }
 
+int tpcmaster_quorum_put(void) {
+  ASSERT_EQUAL(tpcmaster_set_quorum(&testmaster, 3, 1), -1);
+  ASSERT_EQUAL(tpcmaster_set_quorum(&testmaster, 2, 1), 0);
+  current_test = QUORUM_PUT;
+  tpcmaster_run_test();
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  return 1;
+}
+
+int tpcmaster_quorum_get(void) {
+  ASSERT_EQUAL(tpcmaster_set_quorum(&testmaster, 1, 2), 0);
+  current_test = QUORUM_GET;
+  tpcmaster_run_test();
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "VAL");
+  /* The master's clock has moved past the version it read. */
+  ASSERT_TRUE(testmaster.hlc >= 42);
+  return 1;
+}
+
+int tpcmaster_quorum_put_error(void) {
+  /* One replica's error does not fail a write the other can make up. */
+  ASSERT_EQUAL(tpcmaster_set_quorum(&testmaster, 1, 1), 0);
+  current_test = QUORUM_PUT_ERROR;
+  tpcmaster_run_test();
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  ASSERT_EQUAL(quorum_requests, 2);
+  return 1;
+}
+
+int tpcmaster_quorum_get_error(void) {
+  /* An error answer does not count towards the read quorum, so the master
+   * goes on to the other replica and reads the value from it. */
+  ASSERT_EQUAL(tpcmaster_set_quorum(&testmaster, 1, 1), 0);
+  current_test = QUORUM_GET_ERROR;
+  tpcmaster_run_test();
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "VAL");
+  ASSERT_EQUAL(quorum_requests, 2);
+  return 1;
+}
+
+/* A client's write in PUT_COALESCED. */
+struct coalesce_client {
+  char key[16];
+  kvmessage_t respmsg;
+};
+
+void *tpcmaster_coalesce_client(void *aux) {
+  struct coalesce_client *client = aux;
+  kvmessage_t req;
+  memset(&req, 0, sizeof(kvmessage_t));
+  req.type = PUTREQ;
+  req.key = client->key;
+  req.value = "VAL";
+  tpcmaster_handle_tpc(&testmaster, &req, &client->respmsg, NULL);
+  return NULL;
+}
+
+/* Signals the test once the dummy slave is listening. */
+void tpcmaster_test_listening(void *aux) {
+  pthread_mutex_lock(&tpcmaster_lock);
+  done = 1;
+  pthread_cond_signal(&tpcmaster_cond);
+  pthread_mutex_unlock(&tpcmaster_lock);
+}
+
+int tpcmaster_put_coalesced(void) {
+  struct coalesce_client clients[4];
+  pthread_t runner, threads[4];
+  tpcslave_t *primary;
+  unsigned int found = 0, i;
+
+  setup_slaves();
+  current_test = PUT_COALESCED;
+  /* Four keys of the same replica set, the last of which is refused. */
+  primary = tpcmaster_get_primary(&testmaster, "KEY");
+  for (i = 0; found < 4; i++) {
+    sprintf(clients[found].key, "key%u", i);
+    if (tpcmaster_get_primary(&testmaster, clients[found].key) == primary)
+      memset(&clients[found++].respmsg, 0, sizeof(kvmessage_t));
+  }
+  strcpy(coalesce_bad_key, clients[3].key);
+  pthread_create(&runner, NULL, &tpcmaster_runner, tpcmaster_test_listening);
+  pthread_mutex_lock(&tpcmaster_lock);
+  while (done == 0)
+    pthread_cond_wait(&tpcmaster_cond, &tpcmaster_lock);
+  pthread_mutex_unlock(&tpcmaster_lock);
+
+  /* The first write runs a round alone; the other three arrive while it is
+   * held up and are committed together in the next. */
+  pthread_create(&threads[0], NULL, tpcmaster_coalesce_client, &clients[0]);
+  usleep(100000);
+  for (i = 1; i < 4; i++)
+    pthread_create(&threads[i], NULL, tpcmaster_coalesce_client, &clients[i]);
+  for (i = 0; i < 4; i++)
+    pthread_join(threads[i], NULL);
+  server_stop(&socket_server);
+
+  /* One BATCHREQ of three operations reached each replica, and since it was
+   * voted down for one of them, each was retried alone and given its own
+   * result. */
+  ASSERT_EQUAL(batch_requests, 2);
+  ASSERT_EQUAL(batch_ops, 3);
+  for (i = 0; i < 3; i++)
+    ASSERT_STRING_EQUAL(clients[i].respmsg.message, MSG_SUCCESS);
+  ASSERT_STRING_EQUAL(clients[3].respmsg.message, ERRMSG_GENERIC_ERROR);
+  cleanup_slaves();
+  return 1;
+}
+
+/* Starts the dummy slave for GET_HEDGED, recording GET response times of
+ * about 2^BUCKET microseconds in the master's histogram, and stores into
+ * KEYS the names of NUM keys ("hedgeN") of the same replica set. */
+void tpcmaster_hedge_setup(unsigned int bucket, char keys[][16],
+    unsigned int num) {
+  pthread_t runner;
+  tpcslave_t *primary;
+  unsigned int found = 0, i;
+
+  setup_slaves();
+  current_test = GET_HEDGED;
+  memset(testmaster.get_hist, 0, sizeof(testmaster.get_hist));
+  testmaster.get_hist[bucket] = 100;
+  primary = tpcmaster_get_primary(&testmaster, "hedge0");
+  for (i = 0; found < num; i++) {
+    sprintf(keys[found], "hedge%u", i);
+    if (tpcmaster_get_primary(&testmaster, keys[found]) == primary)
+      found++;
+  }
+  pthread_create(&runner, NULL, &tpcmaster_runner, tpcmaster_test_listening);
+  pthread_mutex_lock(&tpcmaster_lock);
+  while (done == 0)
+    pthread_cond_wait(&tpcmaster_cond, &tpcmaster_lock);
+  pthread_mutex_unlock(&tpcmaster_lock);
+}
+
+/* Gives each of the test master's slaves enough budget for HEDGES hedged
+ * GETs, on top of what its own requests earn. */
+void tpcmaster_hedge_budget(unsigned long hedges) {
+  tpcslave_t *slave = testmaster.slaves_head;
+  int i;
+  for (i = 0; i < 4; i++, slave = slave->next)
+    slave->hedge_tokens = hedges * TPCMASTER_HEDGE_RATIO;
+}
+
+/* GETs KEY through the test master and sets *ELAPSED (unless NULL) to the
+ * microseconds it took. Returns 1 if the answer came from a hedge, 0 if it
+ * came from the stalled replica, or -1 if there was none. The stalled
+ * slave's thread is given time to finish before returning. */
+int tpcmaster_hedge_get(char *key, unsigned long *elapsed) {
+  kvmessage_t req, resp;
+  struct timeval start, end;
+  int hedged = -1;
+  memset(&req, 0, sizeof(kvmessage_t));
+  memset(&resp, 0, sizeof(kvmessage_t));
+  req.type = GETREQ;
+  req.key = key;
+  gettimeofday(&start, NULL);
+  tpcmaster_handle_get(&testmaster, &req, &resp);
+  gettimeofday(&end, NULL);
+  if (elapsed != NULL)
+    *elapsed = (end.tv_sec - start.tv_sec) * 1000000UL + end.tv_usec -
+        start.tv_usec;
+  if (resp.type == GETRESP && resp.value != NULL)
+    hedged = (strcmp(resp.value, "FAST") == 0);
+  free(resp.value);
+  usleep(HEDGE_STALL_US);
+  return hedged;
+}
+
+int tpcmaster_hedge_wins(void) {
+  unsigned long elapsed;
+  char keys[1][16];
+  /* Recent GETs took about a millisecond, so a replica which has not
+   * answered after a few is hedged, and the hedge answers first. */
+  tpcmaster_hedge_setup(10, keys, 1);
+  tpcmaster_hedge_budget(TPCMASTER_HEDGE_BURST);
+  ASSERT_EQUAL(tpcmaster_hedge_get(keys[0], &elapsed), 1);
+  server_stop(&socket_server);
+  ASSERT_EQUAL(get_requests, 2);
+  ASSERT_TRUE(elapsed < HEDGE_STALL_US / 2);
+  cleanup_slaves();
+  return 1;
+}
+
+int tpcmaster_hedge_delay(void) {
+  unsigned long elapsed;
+  char keys[2][16];
+  /* While recent GETs took about a second, a replica which takes a fifth of
+   * that is waited for rather than hedged. */
+  tpcmaster_hedge_setup(19, keys, 2);
+  tpcmaster_hedge_budget(TPCMASTER_HEDGE_BURST);
+  ASSERT_EQUAL(tpcmaster_hedge_get(keys[0], &elapsed), 0);
+  ASSERT_EQUAL(get_requests, 1);
+  ASSERT_TRUE(elapsed >= HEDGE_STALL_US);
+  /* Once they are recorded as taking a millisecond, it is hedged. */
+  memset(testmaster.get_hist, 0, sizeof(testmaster.get_hist));
+  testmaster.get_hist[10] = 100;
+  ASSERT_EQUAL(tpcmaster_hedge_get(keys[1], &elapsed), 1);
+  server_stop(&socket_server);
+  ASSERT_EQUAL(get_requests, 3);
+  ASSERT_TRUE(elapsed < HEDGE_STALL_US / 2);
+  cleanup_slaves();
+  return 1;
+}
+
+int tpcmaster_hedge_capped(void) {
+  unsigned int hedges = 0, i;
+  char keys[4][16];
+  int hedged;
+  /* Every GET is slow enough to hedge, but with no budget none is. */
+  tpcmaster_hedge_setup(10, keys, 4);
+  ASSERT_EQUAL(tpcmaster_hedge_get(keys[0], NULL), 0);
+  ASSERT_EQUAL(get_requests, 1);
+  /* With one hedge banked on each replica, hedges are capped by that
+   * budget and by what the requests sent meanwhile earn: with two replicas
+   * and two requests at most per GET, three GETs earn less than one more. */
+  tpcmaster_hedge_budget(1);
+  for (i = 1; i < 4; i++) {
+    hedged = tpcmaster_hedge_get(keys[i], NULL);
+    ASSERT_TRUE(hedged >= 0);
+    hedges += hedged;
+  }
+  server_stop(&socket_server);
+  ASSERT_TRUE(hedges >= 1);
+  ASSERT_TRUE(hedges <= 2);
+  ASSERT_EQUAL(get_requests, 4 + hedges);
+  cleanup_slaves();
+  return 1;
+}
+
+/* GETs the NUM keys KEYS through the test master, each of them once, and
+ * returns the number of those GETs sent to SLAVE, which is credited one
+ * hedge token for each request it is sent. */
+int tpcmaster_spread_gets(char keys[][16], unsigned int num,
+    tpcslave_t *slave) {
+  unsigned long before = slave->hedge_tokens;
+  kvmessage_t req, resp;
+  unsigned int i;
+  for (i = 0; i < num; i++) {
+    memset(&req, 0, sizeof(kvmessage_t));
+    memset(&resp, 0, sizeof(kvmessage_t));
+    req.type = GETREQ;
+    req.key = keys[i];
+    tpcmaster_handle_get(&testmaster, &req, &resp);
+    if (resp.type != GETRESP)
+      return -1;
+    free(resp.value);
+  }
+  return slave->hedge_tokens - before;
+}
+
+int tpcmaster_get_spread(void) {
+  tpcslave_t *primary, *successor;
+  unsigned int found = 0, i;
+  char keys[16][16];
+  pthread_t runner;
+
+  setup_slaves();
+  current_test = GET_SPREAD;
+  primary = tpcmaster_get_primary(&testmaster, "spread0");
+  successor = tpcmaster_get_successor(&testmaster, primary);
+  for (i = 0; found < 16; i++) {
+    sprintf(keys[found], "spread%u", i);
+    if (tpcmaster_get_primary(&testmaster, keys[found]) == primary)
+      found++;
+  }
+  pthread_create(&runner, NULL, &tpcmaster_runner, tpcmaster_test_listening);
+  pthread_mutex_lock(&tpcmaster_lock);
+  while (done == 0)
+    pthread_cond_wait(&tpcmaster_cond, &tpcmaster_lock);
+  pthread_mutex_unlock(&tpcmaster_lock);
+
+  /* While the primary has many requests outstanding, its successor serves
+   * every read of the keys they share, and then the other way around. */
+  primary->inflight += 1000000;
+  ASSERT_EQUAL(tpcmaster_spread_gets(keys, 4, successor), 4);
+  primary->inflight -= 1000000;
+  successor->inflight += 1000000;
+  ASSERT_EQUAL(tpcmaster_spread_gets(keys + 4, 4, primary), 4);
+  successor->inflight -= 1000000;
+  /* While both are idle, each key is read from the replica it prefers, so
+   * the keys are spread over both. */
+  for (i = 8, found = 0; i < 16; i++) {
+    primary->latency_us = successor->latency_us = 0;
+    found += tpcmaster_spread_gets(keys + i, 1, primary);
+  }
+  server_stop(&socket_server);
+  ASSERT_TRUE(found > 0);
+  ASSERT_TRUE(found < 8);
+  cleanup_slaves();
+  return 1;
+}
+
 int tpcmaster_info_check(void) {
   current_test = INFO_SIMPLE;
   tpcmaster_run_test();
@@ -278,6 +761,98 @@ int tpcmaster_info_check(void) {
   return 1;
 }
 
+int tpcmaster_suspect_slaves(void) {
+  tpcslave_t *primary, *successor;
+  char *info;
+  setup_slaves();
+  /* A write to a replica set of suspect slaves fails without contacting
+   * them, so no slave needs to be listening. */
+  primary = tpcmaster_get_primary(&testmaster, "winteriscoming");
+  successor = tpcmaster_get_successor(&testmaster, primary);
+  primary->suspect = true;
+  successor->suspect = true;
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "winteriscoming";
+  reqmsg.value = "VAL";
+  tpcmaster_handle_tpc(&testmaster, &reqmsg, &respmsg, NULL);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_GENERIC_ERROR);
+
+  primary->suspect = false;
+  tpcmaster_info(&testmaster, &reqmsg, &respmsg);
+  info = respmsg.message;
+  ASSERT_PTR_NOT_NULL(strstr(info, "}\n{localhost, 1234} (suspect)"));
+  ASSERT_PTR_NULL(strstr(strstr(info, "(suspect)") + 1, "(suspect)"));
+  free(info);
+  cleanup_slaves();
+  return 1;
+}
+
+/* Marks SLAVE suspect as soon as it cannot be reached. */
+static void tpcmaster_suspect_unreachable(void *slave) {
+  if (slave != NULL)
+    ((tpcslave_t *) slave)->suspect = true;
+}
+
+int tpcmaster_defer_decisions(void) {
+  tpcslave_t *primary, *successor;
+  setup_slaves();
+  /* Neither replica is listening, and each is suspected once it cannot be
+   * reached, so the round gives up delivering its ABORT to them instead of
+   * retrying forever. */
+  primary = tpcmaster_get_primary(&testmaster, "winteriscoming");
+  successor = tpcmaster_get_successor(&testmaster, primary);
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "winteriscoming";
+  reqmsg.value = "VAL";
+  tpcmaster_handle_tpc(&testmaster, &reqmsg, &respmsg,
+      tpcmaster_suspect_unreachable);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_GENERIC_ERROR);
+  ASSERT_PTR_NOT_NULL(primary->undelivered);
+  ASSERT_EQUAL(primary->undelivered->type, ABORT);
+  ASSERT_PTR_NULL(primary->undelivered->next);
+  ASSERT_PTR_NOT_NULL(successor->undelivered);
+  ASSERT_EQUAL(successor->undelivered->txid, primary->undelivered->txid);
+  free(primary->undelivered);
+  free(successor->undelivered);
+  cleanup_slaves();
+  return 1;
+}
+
+int tpcmaster_hot_key_pinned(void) {
+  pthread_rwlock_t *lock;
+  char key[16], *info;
+  int i;
+  lock = kvcache_getlock(&testmaster.cache, "hotkey");
+  pthread_rwlock_wrlock(lock);
+  kvcache_put(&testmaster.cache, "hotkey", "VAL");
+  pthread_rwlock_unlock(lock);
+  reqmsg.type = GETREQ;
+  reqmsg.key = "hotkey";
+  for (i = 0; i < TPCMASTER_HOT_THRESHOLD; i++) {
+    tpcmaster_handle_get(&testmaster, &reqmsg, &respmsg);
+    ASSERT_EQUAL(respmsg.type, GETRESP);
+    free(respmsg.value);
+  }
+  /* Flooding the cache must not evict the hot key's pinned entry. */
+  for (i = 0; i < 64; i++) {
+    sprintf(key, "cold%d", i);
+    lock = kvcache_getlock(&testmaster.cache, key);
+    pthread_rwlock_wrlock(lock);
+    kvcache_put(&testmaster.cache, key, "VAL");
+    pthread_rwlock_unlock(lock);
+  }
+  tpcmaster_handle_get(&testmaster, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "VAL");
+  free(respmsg.value);
+  tpcmaster_info(&testmaster, &reqmsg, &respmsg);
+  info = respmsg.message;
+  sprintf(key, "%d}", TPCMASTER_HOT_THRESHOLD + 1);
+  ASSERT_PTR_NOT_NULL(strstr(info, "\nHot keys:\n{hotkey, "));
+  ASSERT_PTR_NOT_NULL(strstr(info, key));
+  free(info);
+  return 1;
+}
 
 void tpcmaster_test_connect(void) {
   pthread_t thread;
@@ -308,19 +883,19 @@ int tpcmaster_run_test(void) {
 
 void setup_slaves() {
   int port = SLAVE_PORT;
-  tpcslave_t *first = malloc(sizeof(tpcslave_t));
+  tpcslave_t *first = calloc(1, sizeof(tpcslave_t));
   first->host = "localhost";
   first->port = port;
   first->id = -5397345852215556464;
-  tpcslave_t *second = malloc(sizeof(tpcslave_t));
+  tpcslave_t *second = calloc(1, sizeof(tpcslave_t));
   second->host = "localhost";
   second->port = port;
   second->id = -2561935789451811312;
-  tpcslave_t *third = malloc(sizeof(tpcslave_t));
+  tpcslave_t *third = calloc(1, sizeof(tpcslave_t));
   third->host = "localhost";
   third->port = port;
   third->id = 2561935789451811312;
-  tpcslave_t *fourth = malloc(sizeof(tpcslave_t));
+  tpcslave_t *fourth = calloc(1, sizeof(tpcslave_t));
   fourth->host = "localhost";
   fourth->port = port;
   fourth->id = 5397345852215556464;
@@ -339,11 +914,11 @@ void setup_slaves() {
 void cleanup_slaves() {
   int i = 0;
   tpcslave_t *curr = testmaster.slaves_head;
-  tpcslave_t *next = curr->next;
+  tpcslave_t *next;
   while (i < 4) {
+    next = curr->next;
     free(curr);
     curr = next;
-    next = curr->next;
     i++;
   }
 }
@@ -353,11 +928,32 @@ test_info_t tpcmaster_tests[] = {
   {"Register one too many slaves", tpcmaster_register_fail},
   {"Identify first replica for multiple keys", tpcmaster_get_slave_for_key},
   {"Identify successor for multiple slaves", tpcmaster_get_successor_for_slave},
+  {"Route keys after registering slaves", tpcmaster_route_registered},
   {"Master GET value from master cache", tpcmaster_get_cached},
   {"Master GET value from main slave", tpcmaster_get_simple},
   {"Master PUT value", tpcmaster_put_simple},
+  {"Master PUT value while a joining slave dies", tpcmaster_put_joining_dead},
+  {"Master coalesces concurrent writes into one batch",
+    tpcmaster_put_coalesced},
   {"Master DEL value", tpcmaster_del_simple},
+  {"Master INCR value", tpcmaster_incr_simple},
+  {"Master PUT value in quorum mode", tpcmaster_quorum_put},
+  {"Master GET value in quorum mode", tpcmaster_quorum_get},
+  {"Master quorum PUT survives one replica's error",
+    tpcmaster_quorum_put_error},
+  {"Master quorum GET does not count error answers",
+    tpcmaster_quorum_get_error},
+  {"Master spreads GETs over replicas by load", tpcmaster_get_spread},
+  {"Master hedges a GET to another replica, which wins",
+    tpcmaster_hedge_wins},
+  {"Master hedges only after the recorded 95th percentile",
+    tpcmaster_hedge_delay},
+  {"Master hedges no more than its token budget allows",
+    tpcmaster_hedge_capped},
   {"Get information, all slaves", tpcmaster_info_check},
+  {"Master skips and reports suspect slaves", tpcmaster_suspect_slaves},
+  {"Master defers decisions for suspect slaves", tpcmaster_defer_decisions},
+  {"Master pins and reports hot keys", tpcmaster_hot_key_pinned},
   NULL_TEST_INFO
 };
 
@@ -90,9 +90,28 @@ int wq_wait_single_test(void) {
   return 1;
 }
 
+int wq_bounded_test(void) {
+  unsigned long waited_ms;
+  wq_init_bounded(&testwq, 2);
+  ASSERT_EQUAL(wq_try_push(&testwq, (void *) 1), 0);
+  ASSERT_EQUAL(wq_try_push(&testwq, (void *) 2), 0);
+  ASSERT_EQUAL(wq_try_push(&testwq, (void *) 3), -1);
+  ASSERT_EQUAL((intptr_t) wq_pop(&testwq), 1);
+  ASSERT_EQUAL(wq_try_push(&testwq, (void *) 3), 0);
+  /* wq_push ignores the bound. */
+  wq_push(&testwq, (void *) 4);
+  usleep(20000);
+  ASSERT_EQUAL((intptr_t) wq_pop_aged(&testwq, &waited_ms), 2);
+  ASSERT_TRUE(waited_ms >= 20);
+  ASSERT_EQUAL((intptr_t) wq_pop(&testwq), 3);
+  ASSERT_EQUAL((intptr_t) wq_pop(&testwq), 4);
+  return 1;
+}
+
 test_info_t wq_tests[] = {
   {"Tests that a thread popping will wait until there is an item in the queue", wq_wait_single_test},
   {"Tests that multiple threads waiting will get one item each", wq_wait_multiple_test},
+  {"Tests that a bounded queue refuses items and reports their age", wq_bounded_test},
   NULL_TEST_INFO
 };
 